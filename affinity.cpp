@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <atomic>
+#include "locker.h"
+#include "affinity.h"
+#include "metrics.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+static std::vector< std::vector< int > > node_cpus;   // 每个节点上本进程可用的CPU
+static std::vector< int > cpu_node;                    // CPU编号 -> 节点
+static bool numa_enabled = false;
+
+// 解析 "0-3,8-11" 形式的CPU列表
+static void parse_cpulist( const char* text, std::vector< int >& out ) {
+    const char* p = text;
+    while ( *p ) {
+        char* end;
+        long a = strtol( p, &end, 10 );
+        if ( end == p ) {
+            break;
+        }
+        long b = a;
+        p = end;
+        if ( *p == '-' ) {
+            b = strtol( p + 1, &end, 10 );
+            p = end;
+        }
+        for ( long c = a; c <= b; ++c ) {
+            out.push_back( ( int )c );
+        }
+        if ( *p == ',' ) {
+            ++p;
+        } else {
+            break;
+        }
+    }
+}
+
+void affinity_init( bool numa ) {
+    numa_enabled = numa;
+    cpu_set_t allowed;
+    CPU_ZERO( &allowed );
+    sched_getaffinity( 0, sizeof( allowed ), &allowed );
+
+    node_cpus.clear();
+    for ( int node = 0; numa; ++node ) {
+        char path[ 96 ];
+        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", node );
+        FILE* fp = fopen( path, "r" );
+        if ( !fp ) {
+            break;
+        }
+        char line[ 1024 ] = "";
+        if ( !fgets( line, sizeof( line ), fp ) ) {
+            line[0] = '\0';
+        }
+        fclose( fp );
+        std::vector< int > all, usable;
+        parse_cpulist( line, all );
+        for ( size_t i = 0; i < all.size(); ++i ) {
+            if ( all[i] < CPU_SETSIZE && CPU_ISSET( all[i], &allowed ) ) {
+                usable.push_back( all[i] );
+            }
+        }
+        node_cpus.push_back( usable );
+    }
+    // 没有NUMA信息，或者没有开启numa：所有可用CPU当作一个节点
+    if ( node_cpus.empty() ) {
+        std::vector< int > usable;
+        for ( int c = 0; c < CPU_SETSIZE; ++c ) {
+            if ( CPU_ISSET( c, &allowed ) ) {
+                usable.push_back( c );
+            }
+        }
+        node_cpus.push_back( usable );
+        numa_enabled = false;
+    }
+    cpu_node.assign( CPU_SETSIZE, 0 );
+    for ( size_t n = 0; n < node_cpus.size(); ++n ) {
+        for ( size_t i = 0; i < node_cpus[n].size(); ++i ) {
+            cpu_node[ node_cpus[n][i] ] = ( int )n;
+        }
+    }
+}
+
+int numa_nodes() {
+    return node_cpus.empty() ? 1 : ( int )node_cpus.size();
+}
+
+const std::vector< int >& numa_node_cpus( int node ) {
+    return node_cpus[ node ];
+}
+
+int numa_node_of_cpu( int cpu ) {
+    return ( cpu >= 0 && cpu < ( int )cpu_node.size() ) ? cpu_node[ cpu ] : 0;
+}
+
+bool pin_thread_cpu( int cpu ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+}
+
+bool pin_thread_node( int node ) {
+    const std::vector< int >& cpus = node_cpus[ node ];
+    if ( cpus.empty() ) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for ( size_t i = 0; i < cpus.size(); ++i ) {
+        CPU_SET( cpus[i], &set );
+    }
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+}
+
+int socket_node( int fd ) {
+    if ( !numa_enabled || node_cpus.size() < 2 ) {
+        return 0;
+    }
+    int cpu = -1;
+    socklen_t len = sizeof( cpu );
+    if ( getsockopt( fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len ) == 0 && cpu >= 0 ) {
+        return numa_node_of_cpu( cpu );
+    }
+    static std::atomic< unsigned > next( 0 );
+    return ( int )( next.fetch_add( 1, std::memory_order_relaxed ) % node_cpus.size() );
+}
+
+// 每个节点一个空闲链表，按块大小从 mmap 的大块中切分；块只在节点之间转移，不归还给系统
+struct node_pool {
+    locker lock;
+    std::vector< char* > free_blocks;
+};
+
+static const size_t BLOCKS_PER_CHUNK = 64;
+static size_t pool_block_size = 0;
+static std::vector< node_pool* > pools;
+static std::atomic< unsigned long > pool_blocks( 0 );    // 已经切分出的块数
+
+void buffer_pool_init( size_t block_size ) {
+    if ( !pools.empty() ) {
+        return;
+    }
+    // 按缓存行对齐，相邻连接的缓冲区不共享缓存行
+    pool_block_size = ( block_size + 63 ) & ~( size_t )63;
+    for ( int n = 0; n < numa_nodes(); ++n ) {
+        pools.push_back( new node_pool );
+    }
+}
+
+static bool pool_refill( node_pool* pool, int node ) {
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t len = ( pool_block_size * BLOCKS_PER_CHUNK + page - 1 ) & ~( page - 1 );
+    void* p = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( p == MAP_FAILED ) {
+        return false;
+    }
+    if ( numa_enabled && node >= 0 ) {
+        // 还没有访问过的页，在缺页时按策略从指定节点分配
+        unsigned long mask[ 16 ];
+        memset( mask, 0, sizeof( mask ) );
+        mask[ node / ( 8 * sizeof( unsigned long ) ) ] |= 1UL << ( node % ( 8 * sizeof( unsigned long ) ) );
+        if ( syscall( SYS_mbind, p, len, MPOL_PREFERRED, mask, sizeof( mask ) * 8, 0 ) != 0 ) {
+            printf( "mbind to node %d failed: %s\n", node, strerror( errno ) );
+        }
+    }
+    for ( size_t i = 0; i + pool_block_size <= len; i += pool_block_size ) {
+        pool->free_blocks.push_back( ( char* )p + i );
+        ++pool_blocks;
+    }
+    return true;
+}
+
+char* buffer_get( int node ) {
+    node_pool* pool = pools[ node < 0 ? 0 : node ];
+    char* block = NULL;
+    pool->lock.lock();
+    if ( !pool->free_blocks.empty() || pool_refill( pool, node ) ) {
+        block = pool->free_blocks.back();
+        pool->free_blocks.pop_back();
+    }
+    pool->lock.unlock();
+    return block;
+}
+
+void buffer_put( char* block, int node ) {
+    node_pool* pool = pools[ node < 0 ? 0 : node ];
+    pool->lock.lock();
+    pool->free_blocks.push_back( block );
+    pool->lock.unlock();
+}
+
+void affinity_metrics( std::string& out ) {
+    char labels[ 32 ];
+    metrics_header( out, "webserver_numa_nodes", "gauge", "NUMA nodes used for thread pools and buffers." );
+    metrics_gauge( out, "webserver_numa_nodes", NULL, numa_nodes() );
+    metrics_header( out, "webserver_buffer_pool_blocks", "gauge", "Connection buffer blocks carved from the pools." );
+    metrics_gauge( out, "webserver_buffer_pool_blocks", NULL, pool_blocks.load() );
+    metrics_header( out, "webserver_buffer_pool_free", "gauge", "Free connection buffer blocks per node." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        pools[n]->lock.lock();
+        size_t free_blocks = pools[n]->free_blocks.size();
+        pools[n]->lock.unlock();
+        snprintf( labels, sizeof( labels ), "node=\"%d\"", ( int )n );
+        metrics_gauge( out, "webserver_buffer_pool_free", labels, free_blocks );
+    }
+}
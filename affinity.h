@@ -0,0 +1,40 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+    CPU亲和性和NUMA放置
+    拓扑从 /sys/devices/system/node 读取，只保留本进程允许运行的CPU；
+    没有NUMA信息的机器当作只有一个节点。内存策略直接用 mbind 系统调用，不依赖 libnuma。
+
+    cpu_affinity 开启时主线程和每个工作线程各绑定到一个CPU；
+    numa 开启时每个节点一个线程池，连接按收到它的CPU（SO_INCOMING_CPU）分配节点，
+    工作线程只在本节点的CPU上运行，连接的读写缓冲区从本节点的缓冲区池分配。
+*/
+
+// 读取拓扑，启动时调用一次
+void affinity_init( bool numa );
+int numa_nodes();
+const std::vector< int >& numa_node_cpus( int node );
+int numa_node_of_cpu( int cpu );
+
+// 把调用线程绑定到一个CPU或一个节点的全部CPU
+bool pin_thread_cpu( int cpu );
+bool pin_thread_node( int node );
+
+// 连接所属的节点：取最后处理这个连接的数据包的CPU所在的节点，取不到时轮流分配
+int socket_node( int fd );
+
+// 节点本地的缓冲区池，每块大小固定（读缓冲区 + 写缓冲区），node 为 -1 时不指定节点
+// buffer_pool_init 只有第一次调用生效，在主线程中调用
+void buffer_pool_init( size_t block_size );
+char* buffer_get( int node );
+void buffer_put( char* block, int node );
+
+// 节点数和各节点缓冲区池的空闲块数，注册到 metrics 中
+void affinity_metrics( std::string& out );
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "bundle.h"
+#include "metrics.h"
+
+static const char* base = NULL;         // 整个包的映射
+static size_t base_size = 0;
+static int base_fd = -1;
+static const bundle_header* header = NULL;
+static const bundle_entry* entries = NULL;
+static const char* strings = NULL;
+
+static std::atomic< uint64_t > bundle_hits( 0 );
+static std::atomic< uint64_t > bundle_misses( 0 );
+static std::atomic< uint64_t > bundle_not_modified( 0 );
+static std::atomic< uint64_t > bundle_gzip( 0 );
+
+// 字符串区中的偏移是否指向一个完整的字符串
+static bool string_ok( uint32_t off ) {
+    return off < header->strings_size && memchr( strings + off, '\0', header->strings_size - off ) != NULL;
+}
+
+static bool range_ok( uint64_t offset, uint64_t size ) {
+    return offset <= base_size && size <= base_size - offset;
+}
+
+bool bundle_open( const char* file, std::string& err ) {
+    int fd = open( file, O_RDONLY | O_CLOEXEC );
+    struct stat st;
+    if ( fd < 0 || fstat( fd, &st ) < 0 ) {
+        err = std::string( "cannot open bundle " ) + file + ": " + strerror( errno );
+        if ( fd >= 0 ) {
+            close( fd );
+        }
+        return false;
+    }
+    if ( ( size_t )st.st_size < sizeof( bundle_header ) ) {
+        err = std::string( "bundle " ) + file + " is too small";
+        close( fd );
+        return false;
+    }
+    void* p = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( p == MAP_FAILED ) {
+        err = std::string( "cannot mmap bundle " ) + file + ": " + strerror( errno );
+        close( fd );
+        return false;
+    }
+    base = ( const char* )p;
+    base_size = st.st_size;
+    header = ( const bundle_header* )base;
+    entries = ( const bundle_entry* )( base + sizeof( bundle_header ) );
+
+    // 启动时把所有偏移检查一遍，处理请求时直接使用
+    const char* problem = NULL;
+    if ( memcmp( header->magic, BUNDLE_MAGIC, 8 ) != 0 ) {
+        problem = "bad magic";
+    } else if ( header->version != BUNDLE_VERSION ) {
+        problem = "unsupported version";
+    } else if ( header->file_size != base_size ) {
+        problem = "truncated";
+    } else if ( !range_ok( sizeof( bundle_header ), ( uint64_t )header->count * sizeof( bundle_entry ) ) ||
+                !range_ok( header->strings_offset, header->strings_size ) ) {
+        problem = "index out of range";
+    } else {
+        strings = base + header->strings_offset;
+        for ( uint32_t i = 0; i < header->count && !problem; ++i ) {
+            const bundle_entry& e = entries[i];
+            if ( !string_ok( e.path ) || strlen( strings + e.path ) != e.path_len || !string_ok( e.type ) ||
+                 !string_ok( e.etag ) || ( e.gzip_size && !string_ok( e.gzip_etag ) ) ||
+                 !range_ok( e.offset, e.size ) || !range_ok( e.gzip_offset, e.gzip_size ) ) {
+                problem = "entry out of range";
+            } else if ( i > 0 ) {
+                const bundle_entry& prev = entries[ i - 1 ];
+                size_t n = prev.path_len < e.path_len ? prev.path_len : e.path_len;
+                int c = memcmp( strings + prev.path, strings + e.path, n );
+                if ( c > 0 || ( c == 0 && prev.path_len >= e.path_len ) ) {
+                    problem = "index not sorted";
+                }
+            }
+        }
+    }
+    if ( problem ) {
+        err = std::string( "bundle " ) + file + ": " + problem;
+        munmap( p, st.st_size );
+        close( fd );
+        base = NULL;
+        header = NULL;
+        return false;
+    }
+    base_fd = fd;
+    return true;
+}
+
+bool bundle_loaded() {
+    return base != NULL;
+}
+
+const bundle_entry* bundle_find( const char* path, size_t len ) {
+    size_t lo = 0, hi = header->count;
+    while ( lo < hi ) {
+        size_t mid = ( lo + hi ) / 2;
+        const bundle_entry& e = entries[ mid ];
+        size_t n = e.path_len < len ? e.path_len : len;
+        int c = memcmp( strings + e.path, path, n );
+        if ( c == 0 ) {
+            c = e.path_len < len ? -1 : ( e.path_len > len ? 1 : 0 );
+        }
+        if ( c == 0 ) {
+            bundle_hits.fetch_add( 1, std::memory_order_relaxed );
+            return &e;
+        }
+        if ( c < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    bundle_misses.fetch_add( 1, std::memory_order_relaxed );
+    return NULL;
+}
+
+const char* bundle_type( const bundle_entry* e ) {
+    return strings + e->type;
+}
+
+const char* bundle_etag( const bundle_entry* e, bool gzip ) {
+    return strings + ( gzip ? e->gzip_etag : e->etag );
+}
+
+const char* bundle_content( const bundle_entry* e, bool gzip ) {
+    return base + ( gzip ? e->gzip_offset : e->offset );
+}
+
+int bundle_fd() {
+    return base_fd;
+}
+
+bool bundle_etag_match( const char* value, const char* etag ) {
+    if ( !value ) {
+        return false;
+    }
+    size_t len = strlen( etag );
+    // If-None-Match: "a", W/"b", "c"  或  *
+    while ( *value ) {
+        value += strspn( value, " \t," );
+        if ( *value == '*' ) {
+            return true;
+        }
+        if ( strncmp( value, "W/", 2 ) == 0 ) {
+            value += 2;
+        }
+        size_t n = strcspn( value, " \t," );
+        if ( n == len && memcmp( value, etag, len ) == 0 ) {
+            return true;
+        }
+        value += n;
+    }
+    return false;
+}
+
+bool bundle_accept_gzip( const char* value ) {
+    if ( !value ) {
+        return false;
+    }
+    // Accept-Encoding: gzip, deflate, br;q=0.5
+    while ( *value ) {
+        value += strspn( value, " \t," );
+        size_t n = strcspn( value, " \t,;" );
+        bool gzip = n == 4 && strncasecmp( value, "gzip", 4 ) == 0;
+        value += n;
+        double q = 1;
+        const char* param = value + strspn( value, " \t" );
+        if ( *param == ';' ) {
+            param += 1 + strspn( param + 1, " \t" );
+            if ( strncasecmp( param, "q=", 2 ) == 0 ) {
+                q = atof( param + 2 );
+            }
+        }
+        if ( gzip ) {
+            return q > 0;
+        }
+        value += strcspn( value, "," );
+    }
+    return false;
+}
+
+void bundle_count( bool not_modified, bool gzip ) {
+    if ( not_modified ) {
+        bundle_not_modified.fetch_add( 1, std::memory_order_relaxed );
+    } else if ( gzip ) {
+        bundle_gzip.fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+void bundle_metrics( std::string& out ) {
+    if ( !base ) {
+        return;
+    }
+    metrics_header( out, "webserver_bundle_files", "gauge", "Files in the static asset bundle." );
+    metrics_gauge( out, "webserver_bundle_files", NULL, header->count );
+    metrics_header( out, "webserver_bundle_bytes", "gauge", "Size of the mapped asset bundle." );
+    metrics_gauge( out, "webserver_bundle_bytes", NULL, ( double )base_size );
+    metrics_header( out, "webserver_bundle_lookups_total", "counter", "Bundle lookups by result." );
+    metrics_counter( out, "webserver_bundle_lookups_total", "result=\"hit\"", bundle_hits.load() );
+    metrics_counter( out, "webserver_bundle_lookups_total", "result=\"miss\"", bundle_misses.load() );
+    metrics_header( out, "webserver_bundle_not_modified_total", "counter", "304 responses for a matching If-None-Match." );
+    metrics_counter( out, "webserver_bundle_not_modified_total", NULL, bundle_not_modified.load() );
+    metrics_header( out, "webserver_bundle_gzip_total", "counter", "Responses sent from the precompressed variant." );
+    metrics_counter( out, "webserver_bundle_gzip_total", NULL, bundle_gzip.load() );
+}
@@ -0,0 +1,75 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+    静态资源包：把网站根目录打成一个文件，启动时 mmap 一次，之后按路径二分查找，
+    处理请求时不再 stat/open/mmap。打包工具见 tools/packer，例如
+        tools/packer/packer resources site.bundle
+        ./server --bundle=site.bundle 10000
+    配置了 bundle 时只从包中取文件（不再访问 doc_root），包中没有的路径返回404。
+
+    文件格式（小端）：
+        bundle_header
+        bundle_entry[count]     按路径的字节序排好，用于二分查找
+        字符串区                 路径、Content-Type、ETag，都以'\0'结尾
+        内容区                   每个文件的内容（和gzip压缩后的内容）都从页边界开始，
+                                 可以直接 mincore，协程模式下可以直接 sendfile
+    ETag 和 Content-Type 在打包时算好；文本类文件压缩后明显变小时再存一份gzip的内容，
+    请求带 Accept-Encoding: gzip 时发送压缩的版本。
+*/
+
+#define BUNDLE_MAGIC "WSBUNDLE"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 4096
+
+struct bundle_header {
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t count;             // 文件数
+    uint64_t strings_offset;    // 字符串区的位置和大小
+    uint64_t strings_size;
+    uint64_t file_size;         // 整个包的大小，用来发现被截断的包
+};
+
+struct bundle_entry {
+    uint32_t path;              // 以下四项是字符串区中的偏移
+    uint32_t path_len;
+    uint32_t type;
+    uint32_t etag;              // 带引号的强校验值，例如 "\"5f3a9c0d12e4b7a1\""
+    uint32_t gzip_etag;         // gzip 版本的校验值，没有gzip版本时为0
+    uint32_t reserved;
+    uint64_t offset;            // 内容在包中的位置和长度
+    uint64_t size;
+    uint64_t gzip_offset;       // gzip 版本的位置和长度，没有时长度为0
+    uint64_t gzip_size;
+};
+
+// 打开并检查资源包，整个进程只调用一次；失败时返回false，原因放在 err 中
+bool bundle_open( const char* file, std::string& err );
+// 是否在使用资源包
+bool bundle_loaded();
+// 按路径查找，path 不需要以'\0'结尾；找不到时返回NULL
+const bundle_entry* bundle_find( const char* path, size_t len );
+
+// 下面几个函数取条目的字段
+const char* bundle_type( const bundle_entry* e );
+const char* bundle_etag( const bundle_entry* e, bool gzip );
+const char* bundle_content( const bundle_entry* e, bool gzip );
+// 资源包的文件描述符，配合 bundle_entry 中的偏移使用 sendfile
+int bundle_fd();
+
+// If-None-Match 的值中是否有和 etag 相同的校验值（或者是 "*"），弱校验值 W/"..." 也算相同
+bool bundle_etag_match( const char* if_none_match, const char* etag );
+// Accept-Encoding 的值是否接受 gzip（q=0 表示不接受）
+bool bundle_accept_gzip( const char* accept_encoding );
+
+// 记录一次响应：not_modified 为回复304，gzip 为发送了压缩的版本
+void bundle_count( bool not_modified, bool gzip );
+// 输出资源包的大小和命中情况，注册到 metrics 中
+void bundle_metrics( std::string& out );
+
+#endif
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "metrics.h"
+#include "sockopt.h"
+#include "coro.h"
+#include "proxy.h"
+#include "fastcgi.h"
+#include "ratelimit.h"
+#include "tls.h"
+#include "websocket.h"
+
+server_config server_conf = {
+    10000,                              // port
+    1024,                               // listen_backlog
+    8,                                  // threads
+    0,                                  // max_threads
+    1000,                               // pool_spawn_us
+    30000,                              // pool_idle_ms
+    10000,                              // max_requests
+    65536,                              // max_fd
+    10000,                              // max_events
+    30000,                              // drain_timeout_ms
+    2048,                               // read_buffer_size
+    1024,                               // write_buffer_size
+    30000,                              // proxy_timeout_ms
+    16,                                 // proxy_idle
+    2,                                  // proxy_max_fails
+    10000,                              // proxy_eject_ms
+    64,                                 // fastcgi_max_conns
+    0,                                  // microcache_mb
+    1024,                               // microcache_max_object_kb
+    0,                                  // rate_limit
+    100,                                // rate_limit_burst
+    0,                                  // conn_limit
+    1048576,                            // rate_limit_slots
+    128,                                // http2_max_streams
+    0,                                  // tls_port
+    20480,                              // tls_session_cache
+    300,                                // tls_session_timeout
+    256,                                // websocket_queue_kb
+    64,                                 // websocket_max_message_kb
+    "/home/wh/webserver/resources",     // doc_root
+    "",                                 // socket_options
+    "",                                 // bundle
+    "",                                 // proxy
+    "round_robin",                      // proxy_balance
+    "",                                 // fastcgi
+    "",                                 // fastcgi_root
+    "",                                 // rate_limit_prefixes
+    "",                                 // tls_cert
+    "",                                 // tls_key
+    "",                                 // tls_ticket_key
+    "",                                 // websocket
+    "local",                            // websocket_publish
+    false,                              // perf_counters
+    false,                              // cpu_affinity
+    false,                              // numa
+    true,                               // fair_sched
+    false,                              // coroutines
+    true,                               // http2
+};
+
+// 整数配置项及其取值范围
+struct config_int_field {
+    const char* name;
+    int server_config::*value;
+    int min;
+    int max;
+};
+
+static const config_int_field int_fields[] = {
+    { "port", &server_config::port, 1, 65535 },
+    { "listen_backlog", &server_config::listen_backlog, 1, 65535 },
+    { "threads", &server_config::threads, 1, 1024 },
+    { "max_threads", &server_config::max_threads, 0, 1024 },
+    { "pool_spawn_us", &server_config::pool_spawn_us, 0, 10000000 },
+    { "pool_idle_ms", &server_config::pool_idle_ms, 1, 86400000 },
+    { "max_requests", &server_config::max_requests, 1, 10000000 },
+    { "max_fd", &server_config::max_fd, 64, 16777216 },
+    { "max_events", &server_config::max_events, 1, 1000000 },
+    { "drain_timeout_ms", &server_config::drain_timeout_ms, 0, 86400000 },
+    // 读缓冲区要能放下一个完整的请求头，写缓冲区要能放下响应头和错误页面
+    { "read_buffer_size", &server_config::read_buffer_size, 512, 16777216 },
+    { "write_buffer_size", &server_config::write_buffer_size, 512, 16777216 },
+    { "proxy_timeout_ms", &server_config::proxy_timeout_ms, 1, 86400000 },
+    { "proxy_idle", &server_config::proxy_idle, 0, 4096 },
+    { "proxy_max_fails", &server_config::proxy_max_fails, 1, 1000 },
+    { "proxy_eject_ms", &server_config::proxy_eject_ms, 0, 3600000 },
+    { "fastcgi_max_conns", &server_config::fastcgi_max_conns, 0, 65536 },
+    { "microcache_mb", &server_config::microcache_mb, 0, 65536 },
+    { "microcache_max_object_kb", &server_config::microcache_max_object_kb, 1, 1048576 },
+    { "rate_limit", &server_config::rate_limit, 0, 1000000 },
+    { "rate_limit_burst", &server_config::rate_limit_burst, 1, 1000000 },
+    { "conn_limit", &server_config::conn_limit, 0, 1000000 },
+    { "rate_limit_slots", &server_config::rate_limit_slots, 1024, 67108864 },
+    { "http2_max_streams", &server_config::http2_max_streams, 1, 65536 },
+    { "tls_port", &server_config::tls_port, 0, 65535 },
+    { "tls_session_cache", &server_config::tls_session_cache, 0, 10000000 },
+    { "tls_session_timeout", &server_config::tls_session_timeout, 1, 604800 },
+    { "websocket_queue_kb", &server_config::websocket_queue_kb, 1, 1048576 },
+    { "websocket_max_message_kb", &server_config::websocket_max_message_kb, 1, 1048576 },
+};
+static const int INT_FIELD_COUNT = sizeof( int_fields ) / sizeof( int_fields[0] );
+
+// 开关配置项，取值 on/off、1/0、true/false
+struct config_bool_field {
+    const char* name;
+    bool server_config::*value;
+};
+
+static const config_bool_field bool_fields[] = {
+    { "perf_counters", &server_config::perf_counters },
+    { "cpu_affinity", &server_config::cpu_affinity },
+    { "numa", &server_config::numa },
+    { "fair_sched", &server_config::fair_sched },
+    { "coroutines", &server_config::coroutines },
+    { "http2", &server_config::http2 },
+};
+static const int BOOL_FIELD_COUNT = sizeof( bool_fields ) / sizeof( bool_fields[0] );
+
+static std::string trim( const std::string& s ) {
+    size_t b = s.find_first_not_of( " \t\r\n" );
+    if ( b == std::string::npos ) {
+        return "";
+    }
+    size_t e = s.find_last_not_of( " \t\r\n" );
+    return s.substr( b, e - b + 1 );
+}
+
+bool config_set( server_config& conf, const std::string& key, const std::string& value, std::string& err ) {
+    for ( int i = 0; i < INT_FIELD_COUNT; ++i ) {
+        if ( key != int_fields[i].name ) {
+            continue;
+        }
+        char* tail;
+        long v = strtol( value.c_str(), &tail, 10 );
+        if ( value.empty() || *tail != '\0' ) {
+            err = "'" + key + "' expects an integer, got '" + value + "'";
+            return false;
+        }
+        if ( v < int_fields[i].min || v > int_fields[i].max ) {
+            char buf[ 160 ];
+            snprintf( buf, sizeof( buf ), "'%s' must be between %d and %d, got %ld", key.c_str(), int_fields[i].min,
+                      int_fields[i].max, v );
+            err = buf;
+            return false;
+        }
+        conf.*( int_fields[i].value ) = ( int )v;
+        return true;
+    }
+    for ( int i = 0; i < BOOL_FIELD_COUNT; ++i ) {
+        if ( key != bool_fields[i].name ) {
+            continue;
+        }
+        if ( value == "1" || value == "on" || value == "true" ) {
+            conf.*( bool_fields[i].value ) = true;
+        } else if ( value == "0" || value == "off" || value == "false" ) {
+            conf.*( bool_fields[i].value ) = false;
+        } else {
+            err = "'" + key + "' expects on or off, got '" + value + "'";
+            return false;
+        }
+        return true;
+    }
+    if ( key == "doc_root" ) {
+        conf.doc_root = value;
+    } else if ( key == "socket_options" ) {
+        conf.socket_options = value;
+    } else if ( key == "bundle" ) {
+        conf.bundle = value;
+    } else if ( key == "proxy" ) {
+        conf.proxy = value;
+    } else if ( key == "proxy_balance" ) {
+        conf.proxy_balance = value;
+    } else if ( key == "fastcgi" ) {
+        conf.fastcgi = value;
+    } else if ( key == "fastcgi_root" ) {
+        conf.fastcgi_root = value;
+    } else if ( key == "rate_limit_prefixes" ) {
+        conf.rate_limit_prefixes = value;
+    } else if ( key == "tls_cert" ) {
+        conf.tls_cert = value;
+    } else if ( key == "tls_key" ) {
+        conf.tls_key = value;
+    } else if ( key == "tls_ticket_key" ) {
+        conf.tls_ticket_key = value;
+    } else if ( key == "websocket" ) {
+        conf.websocket = value;
+    } else if ( key == "websocket_publish" ) {
+        conf.websocket_publish = value;
+    } else {
+        err = "unknown setting '" + key + "'";
+        return false;
+    }
+    return true;
+}
+
+bool config_load( const char* file, server_config& conf, std::string& err ) {
+    FILE* fp = fopen( file, "r" );
+    if ( !fp ) {
+        err = std::string( "cannot open config file " ) + file;
+        return false;
+    }
+    char line[ 4096 ];
+    int lineno = 0;
+    while ( fgets( line, sizeof( line ), fp ) ) {
+        ++lineno;
+        std::string text = trim( line );
+        if ( text.empty() || text[0] == '#' ) {
+            continue;
+        }
+        size_t eq = text.find( '=' );
+        std::string e;
+        if ( eq == std::string::npos ) {
+            e = "expected 'key = value'";
+        } else if ( config_set( conf, trim( text.substr( 0, eq ) ), trim( text.substr( eq + 1 ) ), e ) ) {
+            continue;
+        }
+        char prefix[ 64 ];
+        snprintf( prefix, sizeof( prefix ), ":%d: ", lineno );
+        err = file + std::string( prefix ) + e;
+        fclose( fp );
+        return false;
+    }
+    fclose( fp );
+    return true;
+}
+
+bool config_parse_args( int argc, char* argv[], server_config& conf, std::string& err ) {
+    // 先读配置文件，命令行上的其他参数不论先后都覆盖配置文件
+    for ( int i = 1; i < argc; ++i ) {
+        if ( strcmp( argv[i], "-f" ) == 0 ) {
+            if ( i + 1 >= argc ) {
+                err = "-f requires a file name";
+                return false;
+            }
+            if ( !config_load( argv[ ++i ], conf, err ) ) {
+                return false;
+            }
+        }
+    }
+    for ( int i = 1; i < argc; ++i ) {
+        const char* arg = argv[i];
+        if ( strcmp( arg, "-f" ) == 0 ) {
+            ++i;
+        } else if ( strncmp( arg, "--", 2 ) == 0 ) {
+            const char* eq = strchr( arg, '=' );
+            if ( !eq ) {
+                err = std::string( "expected --key=value, got " ) + arg;
+                return false;
+            }
+            if ( !config_set( conf, std::string( arg + 2, eq - arg - 2 ), eq + 1, err ) ) {
+                return false;
+            }
+        } else if ( !config_set( conf, "port", arg, err ) ) {
+            // 兼容原来的用法： ./server 端口号
+            return false;
+        }
+    }
+    return true;
+}
+
+bool config_validate( const server_config& conf, std::string& err ) {
+    // 使用资源包时不访问 doc_root，包本身在启动时由 bundle_open 检查
+    struct stat st;
+    if ( conf.bundle.empty() &&
+         ( conf.doc_root.empty() || stat( conf.doc_root.c_str(), &st ) != 0 || !S_ISDIR( st.st_mode ) ) ) {
+        err = "doc_root '" + conf.doc_root + "' is not a directory";
+        return false;
+    }
+    // m_real_file 长度为 FILENAME_LEN(200)，根目录要给URL留出空间
+    if ( conf.doc_root.size() > 100 ) {
+        err = "doc_root is longer than 100 characters";
+        return false;
+    }
+    if ( conf.max_threads != 0 && conf.max_threads < conf.threads ) {
+        err = "max_threads must be 0 or at least threads";
+        return false;
+    }
+    if ( conf.max_events > conf.max_fd ) {
+        err = "max_events must not exceed max_fd";
+        return false;
+    }
+    if ( conf.coroutines && !coro_available() ) {
+        err = "coroutines = on needs a build with C++20 coroutines (-std=c++20)";
+        return false;
+    }
+    if ( conf.tls_port != 0 ) {
+        if ( !tls_available() ) {
+            err = "tls_port needs a build with OpenSSL (-DWEBSERVER_TLS -lssl -lcrypto)";
+            return false;
+        }
+        if ( conf.tls_port == conf.port ) {
+            err = "tls_port must differ from port";
+            return false;
+        }
+        if ( conf.tls_cert.empty() || conf.tls_key.empty() ) {
+            err = "tls_port needs tls_cert and tls_key";
+            return false;
+        }
+    }
+    socket_profile profile;
+    if ( !sockopt_parse( conf.socket_options.c_str(), profile, err ) ) {
+        err = "socket_options: " + err;
+        return false;
+    }
+    std::vector< proxy_route > routes;
+    if ( !proxy_parse( conf.proxy.c_str(), routes, err ) ) {
+        err = "proxy: " + err;
+        return false;
+    }
+    if ( !fastcgi_parse( conf.fastcgi.c_str(), conf.fastcgi_max_conns, routes, err ) ) {
+        err = "fastcgi: " + err;
+        return false;
+    }
+    if ( proxy_balance_parse( conf.proxy_balance.c_str() ) < 0 ) {
+        err = "proxy_balance: unknown policy '" + conf.proxy_balance + "'";
+        return false;
+    }
+    std::vector< ratelimit_prefix > prefixes;
+    if ( !ratelimit_parse( conf.rate_limit_prefixes.c_str(), prefixes, err ) ) {
+        err = "rate_limit_prefixes: " + err;
+        return false;
+    }
+    std::vector< std::string > ws_prefixes;
+    if ( !ws_parse( conf.websocket.c_str(), ws_prefixes, err ) ) {
+        err = "websocket: " + err;
+        return false;
+    }
+    if ( ws_publish_parse( conf.websocket_publish.c_str() ) < 0 ) {
+        err = "websocket_publish: expected local or all, got '" + conf.websocket_publish + "'";
+        return false;
+    }
+    return true;
+}
+
+// 标签值中的 \ " 和换行需要转义
+static std::string label_escape( const std::string& s ) {
+    std::string out;
+    for ( size_t i = 0; i < s.size(); ++i ) {
+        if ( s[i] == '\\' || s[i] == '"' ) {
+            out += '\\';
+            out += s[i];
+        } else if ( s[i] == '\n' ) {
+            out += "\\n";
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+void config_metrics( std::string& out ) {
+    char labels[ 64 ];
+    metrics_header( out, "webserver_config", "gauge", "Numeric settings the server was started with." );
+    for ( int i = 0; i < INT_FIELD_COUNT; ++i ) {
+        snprintf( labels, sizeof( labels ), "key=\"%s\"", int_fields[i].name );
+        metrics_gauge( out, "webserver_config", labels, server_conf.*( int_fields[i].value ) );
+    }
+    for ( int i = 0; i < BOOL_FIELD_COUNT; ++i ) {
+        snprintf( labels, sizeof( labels ), "key=\"%s\"", bool_fields[i].name );
+        metrics_gauge( out, "webserver_config", labels, server_conf.*( bool_fields[i].value ) ? 1 : 0 );
+    }
+    metrics_header( out, "webserver_config_info", "gauge", "String settings the server was started with." );
+    std::string info = "doc_root=\"" + label_escape( server_conf.doc_root ) + "\",socket_options=\"" +
+                       label_escape( sockopt_describe( sockopt_profile ) ) + "\",bundle=\"" +
+                       label_escape( server_conf.bundle ) + "\",proxy=\"" + label_escape( server_conf.proxy ) +
+                       "\",proxy_balance=\"" + label_escape( server_conf.proxy_balance ) + "\",fastcgi=\"" +
+                       label_escape( server_conf.fastcgi ) + "\",fastcgi_root=\"" + label_escape( server_conf.fastcgi_root ) +
+                       "\",rate_limit_prefixes=\"" + label_escape( server_conf.rate_limit_prefixes ) +
+                       "\",tls_cert=\"" + label_escape( server_conf.tls_cert ) + "\",tls_key=\"" +
+                       label_escape( server_conf.tls_key ) + "\",tls_ticket_key=\"" +
+                       label_escape( server_conf.tls_ticket_key ) + "\",websocket=\"" +
+                       label_escape( server_conf.websocket ) + "\",websocket_publish=\"" +
+                       label_escape( server_conf.websocket_publish ) + "\"";
+    metrics_gauge( out, "webserver_config_info", info.c_str(), 1 );
+}
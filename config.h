@@ -0,0 +1,77 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+
+/*
+    服务器的运行参数
+    先取默认值，再读配置文件（-f 指定），最后用命令行的 --键=值 覆盖，例如
+        ./server -f server.conf --threads=16 --doc_root=/srv/www 10000
+    配置文件每行一项 "键 = 值"，'#' 开头为注释。启动时检查取值范围，
+    检查通过的配置通过 METRICS_URL 输出。
+*/
+struct server_config {
+    int port;
+    int listen_backlog;         // 监听套接字的全连接队列长度（HTTP 和 HTTPS 端口）
+    int threads;                // 线程池中常驻的线程数
+    int max_threads;            // 线程数上限，大于 threads 时线程池按排队时间伸缩，0 表示不伸缩
+    int pool_spawn_us;          // 请求排队超过这个时间（微秒）时新建线程
+    int pool_idle_ms;           // 多出来的线程空闲这么久（毫秒）后退出
+    int max_requests;           // 线程池请求队列的上限
+    int max_fd;                 // 最大文件描述符，也是连接数组的大小
+    int max_events;             // 每次 epoll_wait 最多返回的事件数
+    int drain_timeout_ms;       // 收到 SIGTERM/SIGQUIT 后等待连接关闭的最长时间，见 upgrade.h
+    int read_buffer_size;       // 每个连接的读缓冲区大小，也是请求头的长度上限
+    int write_buffer_size;      // 每个连接的写缓冲区大小，存放响应头
+    int proxy_timeout_ms;       // 反向代理等待上游的超时，见 proxy.h
+    int proxy_idle;             // 每个线程、每个上游保留的空闲连接数，0 表示每个请求新建连接
+    int proxy_max_fails;        // 上游连续失败这么多次后暂时摘除
+    int proxy_eject_ms;         // 上游被摘除的时长（毫秒）
+    int fastcgi_max_conns;      // 每个 FastCGI 应用服务器同时进行的请求数上限，0 表示不限
+    int microcache_mb;          // 代理和 FastCGI 响应的微缓存大小（MB），0 表示不缓存，见 microcache.h
+    int microcache_max_object_kb; // 能缓存的最大响应（KB）
+    int rate_limit;             // 每个客户端IP每秒的请求数，0 表示不限，见 ratelimit.h
+    int rate_limit_burst;       // 允许的突发请求数
+    int conn_limit;             // 每个客户端IP同时打开的连接数，0 表示不限
+    int rate_limit_slots;       // 限速哈希表的槽数
+    int http2_max_streams;      // 每个 HTTP/2 连接同时进行的流数，见 http2.h
+    int tls_port;               // HTTPS 的端口，0 表示不开启，见 tls.h
+    int tls_session_cache;      // TLS 会话缓存的条目数，0 表示只用会话票据
+    int tls_session_timeout;    // TLS 会话和票据的有效期（秒）
+    int websocket_queue_kb;     // 每个 WebSocket 连接的发送队列上限（KB），超过时断开，见 websocket.h
+    int websocket_max_message_kb; // 客户端发来的一条消息的上限（KB）
+    std::string doc_root;       // 网站的根目录
+    std::string socket_options; // 套接字选项，格式见 sockopt.h
+    std::string bundle;         // 静态资源包，设置后代替 doc_root，见 bundle.h
+    std::string proxy;          // 反向代理的路由 "前缀=地址|地址,..."，见 proxy.h
+    std::string proxy_balance;  // 一个路由有多个上游时的负载均衡策略，见 proxy.h
+    std::string fastcgi;        // FastCGI 的路由 "前缀=地址|地址,..."，见 fastcgi.h
+    std::string fastcgi_root;   // SCRIPT_FILENAME 的前缀，空表示 doc_root
+    std::string rate_limit_prefixes; // 按URL前缀限速 "前缀=每秒请求数[:突发],..."，见 ratelimit.h
+    std::string tls_cert;       // 证书链（PEM）
+    std::string tls_key;        // 私钥（PEM）
+    std::string tls_ticket_key; // 会话票据的密钥文件（80字节），空表示启动时随机生成
+    std::string websocket;      // WebSocket 端点的URL前缀 "前缀,..."，空表示不开启，见 websocket.h
+    std::string websocket_publish; // 谁能向频道发布：local 或 all
+    bool perf_counters;         // 是否开启硬件性能计数器，见 perf_counter.h
+    bool cpu_affinity;          // 主线程和工作线程各绑定一个CPU，见 affinity.h
+    bool numa;                  // 每个NUMA节点一个线程池和缓冲区池
+    bool fair_sched;            // 线程池按请求代价分级、按客户端公平调度，见 fair_queue.h
+    bool coroutines;            // 用协程处理连接，threads 为反应堆线程数，见 coro.h
+    bool http2;                 // 接受 h2c（prior knowledge 和 Upgrade），见 http2.h
+};
+
+extern server_config server_conf;
+
+// 设置一项，键不存在或值的格式不对时返回false
+bool config_set( server_config& conf, const std::string& key, const std::string& value, std::string& err );
+// 读取配置文件
+bool config_load( const char* file, server_config& conf, std::string& err );
+// 解析命令行：-f 配置文件、--键=值、以及兼容原来用法的端口号
+bool config_parse_args( int argc, char* argv[], server_config& conf, std::string& err );
+// 检查取值范围和根目录
+bool config_validate( const server_config& conf, std::string& err );
+// 输出配置项，注册到 metrics 中
+void config_metrics( std::string& out );
+
+#endif
@@ -0,0 +1,1444 @@
+#include "coro.h"
+
+#ifndef WEBSERVER_CORO
+
+bool coro_available() {
+    return false;
+}
+
+int coro_serve( int, int, int, int, char** ) {
+    return -1;
+}
+
+#else
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "locker.h"
+#include "http_conn.h"
+#include "http_request.h"
+#include "metrics.h"
+#include "perf_counter.h"
+#include "profiler.h"
+#include "sockopt.h"
+#include "affinity.h"
+#include "config.h"
+#include "upgrade.h"
+#include "bundle.h"
+#include "proxy.h"
+#include "fastcgi.h"
+#include "microcache.h"
+#include "ratelimit.h"
+#include "http2.h"
+#include "tls.h"
+#include "websocket.h"
+
+extern int setnonblocking( int fd );
+extern const char* ok_200_title;
+extern const char* switching_101_title;
+extern const char* not_modified_304_title;
+extern const char* error_400_title;
+extern const char* error_400_form;
+extern const char* error_403_title;
+extern const char* error_403_form;
+extern const char* error_404_title;
+extern const char* error_404_form;
+extern const char* error_500_title;
+extern const char* error_500_form;
+extern const char* error_502_title;
+extern const char* error_502_form;
+extern const char* error_504_title;
+extern const char* error_504_form;
+extern const char* error_503_title;
+extern const char* error_503_form;
+extern const char* error_429_title;
+extern const char* error_429_form;
+
+static std::atomic< int > coro_connections( 0 );
+static std::atomic< uint64_t > coro_responses( 0 );
+static std::atomic< uint64_t > coro_io_waits( 0 );        // 操作未能立即完成、协程挂起的次数
+static std::atomic< uint64_t > coro_frame_mallocs( 0 );   // 内存池中没有空闲帧、向系统申请的次数
+static std::atomic< bool > coro_draining( false );       // 服务器正在退出，响应发完后关闭连接
+static thread_local coro_conn* conn_list = NULL;          // 本反应堆线程上的连接
+static thread_local bool idle_closed = false;             // 本线程已经关闭过空闲连接
+// 反应堆处理一批事件的过程中析构的连接。恢复一个协程可能结束另一个连接（例如代理结束时释放上游连接），
+// 这一批中后面的事件不能再访问它
+static thread_local bool in_batch = false;
+static thread_local std::vector< void* > batch_gone;
+
+bool coro_available() {
+    return true;
+}
+
+// 协程帧内存池
+static const size_t FRAME_CLASS = 64;
+static const size_t FRAME_CLASSES = 64;
+static thread_local std::vector< void* > frame_free[ FRAME_CLASSES ];
+
+void* coro_frame_alloc( size_t size ) {
+    size_t c = ( size + FRAME_CLASS - 1 ) / FRAME_CLASS;
+    if ( c < FRAME_CLASSES && !frame_free[c].empty() ) {
+        void* p = frame_free[c].back();
+        frame_free[c].pop_back();
+        return p;
+    }
+    coro_frame_mallocs.fetch_add( 1, std::memory_order_relaxed );
+    return ::operator new( c < FRAME_CLASSES ? c * FRAME_CLASS : size );
+}
+
+void coro_frame_free( void* p, size_t size ) {
+    size_t c = ( size + FRAME_CLASS - 1 ) / FRAME_CLASS;
+    if ( c < FRAME_CLASSES ) {
+        frame_free[c].push_back( p );
+    } else {
+        ::operator delete( p );
+    }
+}
+
+// 可等待的操作
+bool recv_op::attempt() {
+    ssize_t n = tls ? tls_read( tls, buf, len ) : ::recv( fd, buf, len, 0 );
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+        return false;
+    }
+    result = n < 0 ? -errno : n;
+    return true;
+}
+
+bool send_op::attempt() {
+    while ( done < len ) {
+        ssize_t n;
+        if ( tls ) {
+            struct iovec iv = { ( void* )( buf + done ), len - done };
+            n = tls_writev( tls, &iv, 1 );
+        } else {
+            n = ::send( fd, buf + done, len - done, flags | MSG_NOSIGNAL );
+        }
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return false;
+            }
+            result = -errno;
+            return true;
+        }
+        done += n;
+    }
+    result = done;
+    return true;
+}
+
+bool sendfile_op::attempt() {
+    while ( done < count ) {
+        off_t off = offset + done;
+        ssize_t n = tls ? tls_sendfile( tls, file_fd, off, count - done ) : ::sendfile( fd, file_fd, &off, count - done );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return false;
+            }
+            result = -errno;
+            return true;
+        }
+        if ( n == 0 ) {
+            // 文件在发送过程中被截断
+            result = -EIO;
+            return true;
+        }
+        done += n;
+    }
+    result = done;
+    return true;
+}
+
+bool handshake_op::attempt() {
+    int ret = tls_handshake( tls, events );
+    if ( ret == 0 ) {
+        return false;
+    }
+    result = ret > 0 ? 0 : -EPROTO;
+    return true;
+}
+
+bool connect_op::attempt() {
+    // 连接建立或者失败时套接字变为可写
+    pollfd pfd = { fd, POLLOUT, 0 };
+    if ( poll( &pfd, 1, 0 ) == 0 ) {
+        return false;
+    }
+    result = proxy_connected( fd );
+    return true;
+}
+
+bool splice_op::attempt() {
+    while ( done < len ) {
+        ssize_t n = ::splice( from, NULL, to, NULL, len - done, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return false;
+            }
+            result = -errno;
+            return true;
+        }
+        if ( in ) {
+            result = n;
+            return true;
+        }
+        done += n;
+    }
+    result = done;
+    return true;
+}
+
+coro_conn::coro_conn( int epollfd, int fd, bool client )
+    : m_fd( -1 ), m_epollfd( epollfd ), m_client( client ), m_tls( NULL ), m_op( NULL ), m_timeout( 0 ), m_deadline( 0 ), m_idle( false ),
+      m_prev( NULL ), m_next( conn_list ) {
+    if ( conn_list ) {
+        conn_list->m_prev = this;
+    }
+    conn_list = this;
+    if ( fd >= 0 ) {
+        attach( fd );
+    }
+    if ( m_client ) {
+        coro_connections++;
+    }
+}
+
+coro_conn::~coro_conn() {
+    if ( m_prev ) {
+        m_prev->m_next = m_next;
+    } else {
+        conn_list = m_next;
+    }
+    if ( m_next ) {
+        m_next->m_prev = m_prev;
+    }
+    if ( in_batch ) {
+        batch_gone.push_back( this );
+    }
+    // 先发送 close_notify；关闭后自动从 epoll 中移除
+    tls_free( m_tls );
+    if ( m_fd >= 0 ) {
+        close( m_fd );
+    }
+    if ( m_client ) {
+        coro_connections--;
+    }
+}
+
+void coro_conn::attach( int fd ) {
+    m_fd = fd;
+    setnonblocking( fd );
+    epoll_event event;
+    event.data.ptr = this;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl( m_epollfd, EPOLL_CTL_ADD, fd, &event );
+}
+
+int coro_conn::release() {
+    int fd = m_fd;
+    if ( fd >= 0 ) {
+        epoll_ctl( m_epollfd, EPOLL_CTL_DEL, fd, 0 );
+        m_fd = -1;
+    }
+    return fd;
+}
+
+io_awaitable< recv_op > coro_conn::recv( char* buf, size_t len ) {
+    io_awaitable< recv_op > a;
+    a.conn = this;
+    a.op.events = EPOLLIN;
+    a.op.fd = m_fd;
+    a.op.tls = m_tls;
+    a.op.buf = buf;
+    a.op.len = len;
+    return a;
+}
+
+io_awaitable< send_op > coro_conn::send( const char* buf, size_t len, int flags ) {
+    io_awaitable< send_op > a;
+    a.conn = this;
+    a.op.events = EPOLLOUT;
+    a.op.fd = m_fd;
+    a.op.tls = m_tls;
+    a.op.buf = buf;
+    a.op.len = len;
+    a.op.done = 0;
+    a.op.flags = flags;
+    return a;
+}
+
+io_awaitable< sendfile_op > coro_conn::sendfile( int file_fd, off_t offset, size_t count ) {
+    io_awaitable< sendfile_op > a;
+    a.conn = this;
+    a.op.events = EPOLLOUT;
+    a.op.fd = m_fd;
+    a.op.tls = m_tls;
+    a.op.file_fd = file_fd;
+    a.op.offset = offset;
+    a.op.count = count;
+    a.op.done = 0;
+    return a;
+}
+
+io_awaitable< handshake_op > coro_conn::handshake() {
+    io_awaitable< handshake_op > a;
+    a.conn = this;
+    a.op.events = EPOLLIN;
+    a.op.tls = m_tls;
+    return a;
+}
+
+io_awaitable< connect_op > coro_conn::connected() {
+    io_awaitable< connect_op > a;
+    a.conn = this;
+    a.op.events = EPOLLOUT;
+    a.op.fd = m_fd;
+    return a;
+}
+
+io_awaitable< splice_op > coro_conn::splice_in( int pipe_w, size_t len ) {
+    io_awaitable< splice_op > a;
+    a.conn = this;
+    a.op.events = EPOLLIN;
+    a.op.from = m_fd;
+    a.op.to = pipe_w;
+    a.op.len = len;
+    a.op.done = 0;
+    a.op.in = true;
+    return a;
+}
+
+io_awaitable< splice_op > coro_conn::splice_out( int pipe_r, size_t len ) {
+    io_awaitable< splice_op > a;
+    a.conn = this;
+    a.op.events = EPOLLOUT;
+    a.op.from = pipe_r;
+    a.op.to = m_fd;
+    a.op.len = len;
+    a.op.done = 0;
+    a.op.in = false;
+    return a;
+}
+
+void coro_conn::wait( io_op* op ) {
+    m_op = op;
+    m_deadline = m_timeout > 0 ? upgrade_clock_ms() + m_timeout : 0;
+    coro_io_waits.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void coro_conn::on_event( uint32_t events ) {
+    // 边缘触发：没有等待中的操作时忽略，下一次操作会先直接尝试
+    if ( !m_op || !( events & ( m_op->events | EPOLLERR | EPOLLHUP | EPOLLRDHUP ) ) ) {
+        return;
+    }
+    if ( !m_op->attempt() ) {
+        return;
+    }
+    io_op* op = m_op;
+    m_op = NULL;
+    // 恢复之后协程可能结束，this 随协程帧一起释放，之后不能再访问成员
+    op->waiter.resume();
+}
+
+void coro_conn::expire( uint64_t now ) {
+    // 恢复的协程可能释放链表中的其他连接，每恢复一个就从头再找
+    bool again = true;
+    while ( again ) {
+        again = false;
+        for ( coro_conn* c = conn_list; c; c = c->m_next ) {
+            if ( c->m_op && c->m_deadline && now >= c->m_deadline ) {
+                io_op* op = c->m_op;
+                c->m_op = NULL;
+                op->result = -ETIMEDOUT;
+                op->waiter.resume();
+                again = true;
+                break;
+            }
+        }
+    }
+}
+
+void coro_conn::shutdown_idle() {
+    idle_closed = true;
+    for ( coro_conn* c = conn_list; c; c = c->m_next ) {
+        if ( c->m_idle ) {
+            // 不在这里恢复协程：读方向关闭后 epoll 报告 EPOLLRDHUP，由 on_event 恢复
+            shutdown( c->m_fd, SHUT_RD );
+        }
+    }
+}
+
+// 以下是连接协程：读请求头、解析、发送响应，keep-alive 时循环
+
+// 和 http_conn::add_response 一样，把一行或几行响应头格式化到 head + len，放不下时返回false
+static bool add_line( char* head, size_t cap, int& len, const char* format, ... ) {
+    va_list args;
+    va_start( args, format );
+    int n = vsnprintf( head + len, cap - len, format, args );
+    va_end( args );
+    if ( n < 0 || ( size_t )n >= cap - len ) {
+        return false;
+    }
+    len += n;
+    return true;
+}
+
+// 解析 [buf, end) 中的请求行和头部：按行原地切分，逐行交给 http_request.h 的解析函数（与 http_conn 相同），
+// headers 中放各个请求头（代理时转发）
+static bool parse_request( char* buf, char* end, http_request& req, std::vector< const char* >& headers ) {
+    req.clear();
+    headers.clear();
+    bool first = true;
+    for ( char* line = buf; line < end; ) {
+        char* eol = ( char* )memmem( line, end - line, "\r\n", 2 );
+        if ( !eol ) {
+            return false;
+        }
+        *eol = '\0';
+        if ( first ) {
+            if ( !http_parse_request_line( line, req ) ) {
+                return false;
+            }
+            first = false;
+        } else {
+            if ( http_parse_header( line, req ) == HTTP_HEADER_BAD ) {
+                return false;
+            }
+            headers.push_back( line );
+        }
+        line = eol + 2;
+    }
+    return !first && http_headers_complete( req );
+}
+
+// 客户端的地址，转发时用来生成 X-Forwarded-For 和 REMOTE_ADDR；取不到时为全0
+static sockaddr_in peer_address( int fd ) {
+    sockaddr_in peer;
+    socklen_t peer_len = sizeof( peer );
+    if ( getpeername( fd, ( sockaddr* )&peer, &peer_len ) != 0 || peer.sin_family != AF_INET ) {
+        memset( &peer, 0, sizeof( peer ) );
+    }
+    return peer;
+}
+
+// 采样剖析（见 profiler.h）要阻塞到采样结束，不能占住反应堆线程：交给一个临时线程去做，
+// 协程等 socketpair 的读端可读（线程结束时关闭写端）。协程可能在排空时先被销毁，结果由两边共同持有
+struct profile_job {
+    std::string url;
+    std::string out;
+    PROFILE_RESULT result;
+    int done_fd;
+};
+
+static void* profile_thread( void* arg ) {
+    std::shared_ptr< profile_job >* job = ( std::shared_ptr< profile_job >* )arg;
+    ( *job )->result = profiler_run( ( *job )->url.c_str(), ( *job )->out );
+    close( ( *job )->done_fd );
+    delete job;
+    return NULL;
+}
+
+// 返回状态码，200 时 out 为折叠栈
+static co_task run_profile( coro_conn& client, const char* url, std::string& out ) {
+    int fds[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds ) < 0 ) {
+        co_return 500;
+    }
+    std::shared_ptr< profile_job > job( new profile_job );
+    job->url = url;
+    job->result = PROFILE_FAILED;
+    job->done_fd = fds[1];
+    std::shared_ptr< profile_job >* arg = new std::shared_ptr< profile_job >( job );
+    pthread_t tid;
+    if ( pthread_create( &tid, NULL, profile_thread, arg ) != 0 ) {
+        delete arg;
+        close( fds[0] );
+        close( fds[1] );
+        co_return 500;
+    }
+    pthread_detach( tid );
+    coro_conn waiter( client.epollfd(), fds[0], false );
+    char c;
+    co_await waiter.recv( &c, 1 );
+    if ( job->result == PROFILE_BAD ) {
+        co_return 400;
+    } else if ( job->result != PROFILE_OK ) {
+        co_return 500;
+    }
+    out.swap( job->out );
+    co_return 200;
+}
+
+// 反向代理
+
+// 搬运数据用的管道，结束时管道为空才放回
+struct proxy_pipe {
+    int fds[2];
+    bool ok;
+    proxy_pipe() { ok = proxy_pipe_take( fds ); }
+    ~proxy_pipe() {
+        if ( ok ) {
+            int left = 0;
+            ioctl( fds[0], FIONREAD, &left );
+            proxy_pipe_put( fds, left == 0 );
+        }
+    }
+};
+
+// 经过管道从 from 向 to 搬运 len 字节，len 为 UINT64_MAX 时直到 from 关闭；返回0或者 -errno
+static co_task splice_body( coro_conn& from, coro_conn& to, proxy_pipe& pipe, uint64_t len ) {
+    uint64_t moved = 0;
+    while ( moved < len ) {
+        size_t want = len - moved < 65536 ? len - moved : 65536;
+        ssize_t n = co_await from.splice_in( pipe.fds[1], want );
+        if ( n == 0 ) {
+            co_return len == UINT64_MAX ? 0 : -EPIPE;
+        }
+        if ( n < 0 ) {
+            co_return n;
+        }
+        ssize_t m = co_await to.splice_out( pipe.fds[0], n );
+        if ( m < 0 ) {
+            co_return m;
+        }
+        moved += n;
+    }
+    co_return 0;
+}
+
+// 与 splice_body 相同，但经过 buf 复制，转发的数据同时记入 copy（填充微缓存时）
+static co_task copy_body( coro_conn& from, coro_conn& to, char* buf, size_t cap, uint64_t len, microcache_capture* copy ) {
+    uint64_t moved = 0;
+    while ( moved < len ) {
+        ssize_t n = co_await from.recv( buf, len - moved < cap ? len - moved : cap );
+        if ( n == 0 ) {
+            co_return len == UINT64_MAX ? 0 : -EPIPE;
+        }
+        if ( n < 0 ) {
+            co_return n;
+        }
+        copy->add( buf, n );
+        ssize_t m = co_await to.send( buf, n, moved + n < len ? MSG_MORE : 0 );
+        if ( m < 0 ) {
+            co_return m;
+        }
+        moved += n;
+    }
+    co_return 0;
+}
+
+// 转发 chunked 消息体，pre 是已经读到的部分，其中属于消息体的字节数放在 pre_used；
+// 返回从 from 多读的字节数（消息体之后的数据），或者 -errno。copy 不为 NULL 时转发的数据同时记入 copy
+static co_task relay_chunked( coro_conn& from, coro_conn& to, const char* pre, size_t pre_len, char* buf, size_t cap,
+                              size_t& pre_used, microcache_capture* copy = NULL ) {
+    chunk_scanner scanner;
+    const char* data = pre;
+    size_t len = pre_len;
+    pre_used = 0;
+    while ( true ) {
+        size_t body = scanner.scan( data, len );
+        if ( scanner.failed() ) {
+            co_return -EPROTO;
+        }
+        if ( data == pre ) {
+            pre_used = body;
+        }
+        if ( body > 0 ) {
+            if ( copy ) {
+                copy->add( data, body );
+            }
+            ssize_t ret = co_await to.send( data, body, scanner.done() ? 0 : MSG_MORE );
+            if ( ret < 0 ) {
+                co_return ret;
+            }
+        }
+        if ( scanner.done() ) {
+            co_return data == pre ? 0 : len - body;
+        }
+        ssize_t n = co_await from.recv( buf, cap );
+        if ( n <= 0 ) {
+            co_return n == 0 ? -EPIPE : n;
+        }
+        data = buf;
+        len = n;
+    }
+}
+
+// 与 proxy_connect 相同：取一个到 upstreams[ index ] 的连接注册到 up 上，连不上时由 proxy_failover 换一个上游；
+// 返回0或者 -errno
+static co_task connect_upstream( coro_conn& up, int route, const char* url, int& index, uint64_t& start, bool& reused ) {
+    for ( int attempt = 0; ; ++attempt ) {
+        int fd = proxy_take( route, index );
+        reused = fd >= 0;
+        if ( reused ) {
+            up.attach( fd );
+            co_return 0;
+        }
+        ssize_t ret = -1;
+        fd = proxy_dial( route, index );
+        if ( fd >= 0 ) {
+            up.attach( fd );
+            ret = co_await up.connected();
+            if ( ret == 0 ) {
+                co_return 0;
+            }
+            close( up.release() );
+        } else {
+            ret = -errno;
+        }
+        if ( !proxy_failover( route, url, index, start, attempt ) ) {
+            co_return ret;
+        }
+    }
+}
+
+// 把请求转发给 proxy_routes[ req.route ]，响应直接发给客户端；每一步做什么由 proxy_exchange 决定，这里只等待 I/O。
+// pre 是读缓冲区中请求头之后的数据，其中属于请求体的字节数放在 used；buf 是代理用的缓冲区（PROXY_BUFFER_SIZE）。
+// 返回0表示响应已经转发（keep_alive 为之后是否保持连接），否则返回应该回复客户端的错误状态码。
+// capture 不为 NULL 时记下发给客户端的响应，用来填充微缓存
+static co_task proxy_request( coro_conn& client, const http_request& req, const std::vector< const char* >& headers,
+                              const char* pre, size_t pre_len, size_t& used, char* buf, bool& keep_alive,
+                              microcache_capture* capture ) {
+    used = 0;
+    proxy_pipe pipe;
+    if ( !pipe.ok ) {
+        // 请求体还留在连接上
+        keep_alive = keep_alive && !( req.chunked || req.content_length > 0 );
+        co_return 502;
+    }
+    proxy_exchange x( req.route, req, buf, keep_alive, capture );
+    int status = x.begin( headers, peer_address( client.fd() ), pre_len );
+    used = req.chunked ? 0 : x.pre_len;
+    // 上游连接在 proxy_take 之后才注册到本反应堆的 epoll，放回连接池前移除
+    coro_conn up( client.epollfd(), -1, false );
+    up.set_timeout( proxy_timeout_ms );
+    client.set_timeout( proxy_timeout_ms );
+    while ( status == 0 ) {
+        bool reused;
+        ssize_t ret = co_await connect_upstream( up, req.route, req.url, x.up, x.start, reused );
+        if ( ret < 0 ) {
+            status = x.connect_failed( ret );
+            break;
+        }
+        ret = co_await up.send( x.head.data(), x.head.size(), x.has_body ? MSG_MORE : 0 );
+        if ( ret >= 0 && req.chunked ) {
+            x.body_streamed = true;
+            ret = co_await relay_chunked( client, up, pre, x.pre_len, buf, PROXY_BUFFER_SIZE, used );
+            if ( ret > 0 ) {
+                // 请求体之后已经读走的数据（流水线中的下一个请求）没有保留
+                x.keep_alive = false;
+            }
+        } else if ( ret >= 0 && x.has_body ) {
+            if ( x.pre_len > 0 ) {
+                ret = co_await up.send( pre, x.pre_len );
+            }
+            if ( ret >= 0 && x.need_continue() ) {
+                ret = co_await client.send( PROXY_CONTINUE, sizeof( PROXY_CONTINUE ) - 1 );
+            }
+            if ( ret >= 0 && x.remaining > 0 ) {
+                x.body_streamed = true;
+                ret = co_await splice_body( client, up, pipe, x.remaining );
+            }
+        }
+        while ( ret >= 0 && ( ret = x.read_head() ) == 0 ) {
+            ret = co_await up.recv( buf + x.len, PROXY_BUFFER_SIZE - x.len );
+            if ( ret <= 0 ) {
+                ret = ret == 0 ? -EPIPE : ret;
+                break;
+            }
+            x.received( ret );
+        }
+        if ( ret > 0 ) {
+            break;
+        }
+        close( up.release() );
+        if ( !x.retry( ret, reused ) ) {
+            status = x.failed( ret );
+        }
+    }
+    if ( status != 0 ) {
+        keep_alive = x.keep_alive;
+        co_return status;
+    }
+
+    x.forward( coro_draining );
+    const proxy_response& r = x.r;
+    ssize_t ret = co_await client.send( x.head.data(), x.head.size(), r.body != PROXY_BODY_NONE ? MSG_MORE : 0 );
+    if ( ret >= 0 && r.body == PROXY_BODY_CHUNKED ) {
+        // 响应头之后的数据在 buf 中，relay_chunked 读上游时会覆盖 buf，先把它当作 pre 处理完
+        size_t pre_used;
+        ret = co_await relay_chunked( up, client, x.extra, x.extra_len, buf, PROXY_BUFFER_SIZE, pre_used, capture );
+        x.reusable = x.reusable && ret == 0 && pre_used == x.extra_len;
+    } else if ( ret >= 0 && r.body != PROXY_BODY_NONE ) {
+        // 响应头之后的数据先发出，之后可以覆盖 buf；填充微缓存时响应体要经过用户空间，不用 splice
+        uint64_t rest = r.body == PROXY_BODY_LENGTH ? r.content_length - x.first : UINT64_MAX;
+        if ( x.first > 0 ) {
+            ret = co_await client.send( x.extra, x.first, rest > 0 ? MSG_MORE : 0 );
+        }
+        if ( ret >= 0 && rest > 0 ) {
+            if ( capture ) {
+                ret = co_await copy_body( up, client, buf, PROXY_BUFFER_SIZE, rest, capture );
+            } else {
+                ret = co_await splice_body( up, client, pipe, rest );
+            }
+        }
+    }
+    if ( ret < 0 ) {
+        x.abort( ret );
+        close( up.release() );
+    } else {
+        x.finish( up.release() );
+    }
+    keep_alive = x.keep_alive;
+    co_return 0;
+}
+
+// 把请求交给 FastCGI 应用服务器（见 fastcgi.h），应用的输出转换成 HTTP 响应发给客户端；
+// 每一步由 fastcgi_exchange 决定，参数和返回值与 proxy_request 相同
+static co_task fastcgi_request( coro_conn& client, const http_request& req, const std::vector< const char* >& headers,
+                                const char* pre, size_t pre_len, size_t& used, char* buf, bool& keep_alive,
+                                microcache_capture* capture ) {
+    fastcgi_exchange x( req.route, req, buf, keep_alive, capture );
+    int status = x.begin( headers, peer_address( client.fd() ), client.fd(), pre, pre_len );
+    used = x.pre_len;
+    coro_conn up( client.epollfd(), -1, false );
+    up.set_timeout( proxy_timeout_ms );
+    client.set_timeout( proxy_timeout_ms );
+    std::string out;
+    while ( status == 0 ) {
+        bool reused;
+        ssize_t ret = co_await connect_upstream( up, req.route, req.url, x.up, x.start, reused );
+        if ( ret < 0 ) {
+            status = x.connect_failed( ret );
+            break;
+        }
+        ret = co_await up.send( x.head.data(), x.head.size(), x.remaining > 0 ? MSG_MORE : 0 );
+        if ( ret >= 0 && x.need_continue() ) {
+            ret = co_await client.send( PROXY_CONTINUE, sizeof( PROXY_CONTINUE ) - 1 );
+        }
+        while ( ret >= 0 && x.remaining > 0 ) {
+            x.body_streamed = true;
+            ret = co_await client.recv( buf + FASTCGI_HEADER_LEN, x.body_want() );
+            if ( ret > 0 ) {
+                ret = co_await up.send( buf, x.stdin_record( ret ), x.remaining > 0 ? MSG_MORE : 0 );
+            } else if ( ret == 0 ) {
+                ret = -EPIPE;
+            }
+        }
+        while ( ret >= 0 && !x.done() ) {
+            ret = co_await up.recv( buf, PROXY_BUFFER_SIZE );
+            if ( ret <= 0 ) {
+                ret = ret == 0 ? -EPIPE : ret;
+            } else if ( ( ret = x.feed( ret, out ) ) == 0 && !out.empty() ) {
+                ret = co_await client.send( out.data(), out.size() );
+                out.clear();
+            }
+        }
+        if ( ret >= 0 ) {
+            x.finish( up.release() );
+            break;
+        }
+        close( up.release() );
+        if ( !x.retry( ret, reused ) ) {
+            status = x.failed( ret );
+            break;
+        }
+    }
+    keep_alive = x.keep_alive;
+    co_return status;
+}
+
+static co_task upstream_request( coro_conn& client, const http_request& req, const std::vector< const char* >& headers,
+                                 const char* pre, size_t pre_len, size_t& used, char* buf, bool& keep_alive,
+                                 microcache_capture* capture ) {
+    // 转发直接在套接字上读写（splice），HTTPS 连接要两个方向都由内核加解密才行，见 tls.h
+    if ( client.tls() && !( tls_ktls_send( client.tls() ) && tls_ktls_recv( client.tls() ) ) ) {
+        used = 0;
+        keep_alive = false;
+        co_return 502;
+    }
+    if ( proxy_routes[ req.route ].fastcgi ) {
+        co_return co_await fastcgi_request( client, req, headers, pre, pre_len, used, buf, keep_alive, capture );
+    }
+    co_return co_await proxy_request( client, req, headers, pre, pre_len, used, buf, keep_alive, capture );
+}
+
+// 先查微缓存（见 microcache.h），参数和返回值与 proxy_request 相同。
+// 同一个键正在填充时挂起协程，等 socketpair 的读端可读，最多 proxy_timeout_ms
+static co_task cached_request( coro_conn& client, const http_request& req, const std::vector< const char* >& headers,
+                               const char* pre, size_t pre_len, size_t& used, char* buf, bool& keep_alive ) {
+    used = 0;
+    microcache_ticket t;
+    int result;
+    while ( ( result = microcache_lookup( req.method_name, req.url, headers, req.chunked || req.content_length > 0, t ) )
+            == MICROCACHE_WAIT ) {
+        coro_conn waiter( client.epollfd(), t.wait_fd, false );
+        waiter.set_timeout( proxy_timeout_ms );
+        char c;
+        if ( co_await waiter.recv( &c, 1 ) < 0 ) {
+            // 等待超时，自己去上游
+            result = MICROCACHE_BYPASS;
+            break;
+        }
+    }
+    if ( result == MICROCACHE_BYPASS ) {
+        co_return co_await upstream_request( client, req, headers, pre, pre_len, used, buf, keep_alive, NULL );
+    }
+    if ( result == MICROCACHE_FILL ) {
+        microcache_capture capture;
+        int status = co_await upstream_request( client, req, headers, pre, pre_len, used, buf, keep_alive, &capture );
+        if ( !microcache_finish( t, &capture, headers, status ) ) {
+            co_return status;
+        }
+    }
+    // 命中，或者刷新失败时回复过期的响应
+    std::string head;
+    keep_alive = keep_alive && !coro_draining;
+    microcache_reply_head( *t.obj, keep_alive, head );
+    bool body = req.method != http_request::HEAD && !t.obj->body.empty();
+    client.set_timeout( proxy_timeout_ms );
+    ssize_t ret = co_await client.send( head.data(), head.size(), body ? MSG_MORE : 0 );
+    if ( ret >= 0 && body ) {
+        ret = co_await client.send( t.obj->body.data(), t.obj->body.size() );
+    }
+    if ( ret < 0 ) {
+        keep_alive = false;
+    }
+    co_return 0;
+}
+
+// 计入了客户端连接数（见 ratelimit.h）的连接，协程结束或者排空时被销毁都要减去
+struct conn_quota {
+    conn_quota() : ip( 0 ), counted( false ) {}
+    ~conn_quota() {
+        if ( counted ) {
+            ratelimit_disconnect( ip );
+        }
+    }
+    uint32_t ip;
+    bool counted;
+};
+
+// 把 HTTP/2 会话生成的帧写到套接字（见 h2_session::flush），发送缓冲区满时等 EPOLLOUT
+struct h2_flush_op : io_op {
+    int fd;
+    h2_session* session;
+    bool attempt() {
+        int ret = session->flush( fd );
+        if ( ret == 0 ) {
+            return false;
+        }
+        result = ret < 0 ? -errno : 0;
+        return true;
+    }
+};
+
+// HTTP/2 的连接：收到的数据交给会话，会话生成的帧都发完之后再读，读缓冲区只用来中转。
+// buf 中已经有 have 字节（连接前言，或者升级的请求之后的数据）
+static co_task serve_h2( coro_conn& conn, h2_session& session, char* buf, size_t cap, size_t have ) {
+    if ( have > 0 ) {
+        session.feed( buf, have );
+    }
+    while ( true ) {
+        if ( coro_draining ) {
+            session.shutdown();
+        }
+        io_awaitable< h2_flush_op > flush;
+        flush.conn = &conn;
+        flush.op.events = EPOLLOUT;
+        flush.op.fd = conn.fd();
+        flush.op.session = &session;
+        if ( co_await flush < 0 || session.finished() ) {
+            break;
+        }
+        // 没有进行中的流时和 HTTP/1.1 的空闲连接一样，排空时被关闭
+        conn.set_idle( session.idle() );
+        ssize_t n = co_await conn.recv( buf, cap );
+        conn.set_idle( false );
+        if ( n <= 0 ) {
+            break;
+        }
+        session.feed( buf, n );
+    }
+    co_return 0;
+}
+
+// WebSocket 的连接（见 websocket.h）：读到 EAGAIN 为止，收到的帧交给 ws_conn，再发送它的队列。
+// 反应堆投递的广播在 ws_conn::push 中直接发送，发不完的等 EPOLLOUT 后在这里继续；连接结束时完成
+struct ws_io_op : io_op {
+    int fd;
+    tls_conn* tls;
+    ws_conn* ws;
+    char* buf;
+    size_t cap;
+    bool attempt() {
+        if ( coro_draining ) {
+            ws->close( 1001 );
+        }
+        while ( !ws->closing() ) {
+            ssize_t n = tls ? tls_read( tls, buf, cap ) : ::recv( fd, buf, cap, 0 );
+            if ( n > 0 ) {
+                ws->feed( buf, n );
+                continue;
+            }
+            if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+                break;
+            }
+            result = n < 0 ? -errno : 0;
+            return true;
+        }
+        int ret = ws->flush();
+        if ( ret < 0 ) {
+            result = -errno;
+            return true;
+        }
+        result = 0;
+        return ws->finished();
+    }
+};
+
+// buf 中已经有 have 字节（客户端不等101就发出的帧）
+static co_task serve_ws( coro_conn& conn, ws_conn& ws, char* buf, size_t cap, size_t have ) {
+    ws.attach( conn.fd(), conn.tls(), NULL, NULL );
+    if ( have > 0 ) {
+        ws.feed( buf, have );
+    }
+    // 订阅的连接和空闲连接一样，排空时被关闭读方向，醒来后发送 1001
+    conn.set_idle( true );
+    io_awaitable< ws_io_op > io;
+    io.conn = &conn;
+    io.op.events = EPOLLIN | EPOLLOUT;
+    io.op.fd = conn.fd();
+    io.op.tls = conn.tls();
+    io.op.ws = &ws;
+    io.op.buf = buf;
+    io.op.cap = cap;
+    co_await io;
+    conn.set_idle( false );
+    co_return 0;
+}
+
+// tls 为true时是 HTTPS 端口上的连接，先握手
+static conn_task serve( int epollfd, int fd, bool tls ) {
+    coro_conn conn( epollfd, fd );
+    conn_quota quota;
+    if ( ratelimit_enabled() ) {
+        sockaddr_in peer;
+        socklen_t peer_len = sizeof( peer );
+        if ( getpeername( fd, ( sockaddr* )&peer, &peer_len ) == 0 && peer.sin_family == AF_INET ) {
+            quota.ip = peer.sin_addr.s_addr;
+        }
+        if ( !ratelimit_connect( quota.ip, quota.counted ) ) {
+            co_return;
+        }
+    }
+    if ( tls ) {
+        conn.set_tls( tls_new( fd ) );
+        if ( !conn.tls() ) {
+            co_return;
+        }
+        // 握手中的连接和空闲连接一样，排空时被关闭
+        conn.set_idle( true );
+        ssize_t ret = co_await conn.handshake();
+        conn.set_idle( false );
+        if ( ret < 0 ) {
+            co_return;
+        }
+    }
+    char* block = buffer_get( 0 );
+    if ( !block ) {
+        co_return;
+    }
+    char* buf = block;
+    size_t cap = http_conn::m_read_buffer_size;
+    char* head = block + cap;
+    size_t head_cap = http_conn::m_write_buffer_size;
+    size_t have = 0;
+    http_request req;
+    std::vector< const char* > headers;
+    std::vector< char > proxy_buf;      // 第一次代理请求时分配，存放上游的响应头
+
+    while ( true ) {
+        // 读到完整的请求头
+        char* end = NULL;
+        bool closed = false;
+        while ( !( end = ( char* )memmem( buf, have, "\r\n\r\n", 4 ) ) && have < cap ) {
+            if ( have == 0 && idle_closed ) {
+                // 上一个响应是在开始排空之前决定 keep-alive 的，发完时空闲连接已经关闭过
+                closed = true;
+                break;
+            }
+            conn.set_idle( have == 0 );
+            ssize_t n = co_await conn.recv( buf + have, cap - have );
+            conn.set_idle( false );
+            if ( n <= 0 ) {
+                closed = true;
+                break;
+            }
+            have += n;
+        }
+        if ( closed ) {
+            break;
+        }
+        // HTTP/2 的连接前言 "PRI * HTTP/2.0\r\n\r\n..." 的前18字节也是一个完整的"请求头"
+        if ( http2_enabled && !tls && end && h2_preface( buf, have ) ) {
+            h2_session session( quota.ip );
+            co_await serve_h2( conn, session, buf, cap, have );
+            break;
+        }
+
+        int status = 0;
+        size_t consumed = have;
+        if ( !end ) {
+            // 请求头超过读缓冲区
+            status = 400;
+        } else {
+            perf_scope scope( PERF_STAGE_PARSE );
+            consumed = end + 4 - buf;
+            if ( !parse_request( buf, end + 2, req, headers ) ) {
+                status = 400;
+            }
+        }
+        // Upgrade: h2c，没有请求体的非代理请求才能升级；这个请求成为流1，由会话回复（也在会话中限速）
+        if ( status == 0 && http2_enabled && !tls && req.route < 0 && req.content_length == 0 && !req.chunked
+             && h2_upgrade_requested( headers ) ) {
+            h2_session session( quota.ip );
+            if ( session.upgrade( req.method_name, req.url, headers ) ) {
+                memmove( buf, buf + consumed, have - consumed );
+                co_await serve_h2( conn, session, buf, cap, have - consumed );
+                break;
+            }
+        }
+        // 超过限速时回复429并关闭连接，不读请求体，也不转发
+        int retry_after = 0;
+        if ( status == 0 && ratelimit_enabled() ) {
+            retry_after = ratelimit_request( quota.ip, req.url, strlen( req.url ) );
+            if ( retry_after > 0 ) {
+                status = 429;
+            }
+        }
+        // WebSocket 的端点只接受没有请求体的升级请求：回复101后连接订阅频道，一直留在这个反应堆上
+        if ( status == 0 && ws_enabled() && ws_match( req.url ) ) {
+            std::string key;
+            if ( req.method != http_request::GET || req.content_length != 0 || req.chunked ||
+                 !ws_upgrade_requested( headers, key ) ) {
+                status = 400;
+            } else {
+                uint32_t ip = quota.ip;
+                sockaddr_in peer;
+                socklen_t peer_len = sizeof( peer );
+                if ( !ratelimit_enabled() && getpeername( fd, ( sockaddr* )&peer, &peer_len ) == 0 && peer.sin_family == AF_INET ) {
+                    ip = peer.sin_addr.s_addr;
+                }
+                ws_conn ws( req.url, ip );
+                int len = snprintf( head, head_cap,
+                                    "HTTP/1.1 101 %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+                                    switching_101_title, ws_accept( key ).c_str() );
+                if ( co_await conn.send( head, len ) >= 0 ) {
+                    coro_responses.fetch_add( 1, std::memory_order_relaxed );
+                    memmove( buf, buf + consumed, have - consumed );
+                    co_await serve_ws( conn, ws, buf, cap, have - consumed );
+                }
+                break;
+            }
+        }
+        bool proxied = status == 0 && req.route >= 0;
+        // 跳过请求体，放在缓冲区之后的部分边读边丢；代理的请求体转发给上游
+        if ( status == 0 && req.content_length > 0 && !proxied ) {
+            size_t in_buf = have - consumed;
+            if ( ( size_t )req.content_length <= in_buf ) {
+                consumed += req.content_length;
+            } else {
+                size_t remaining = req.content_length - in_buf;
+                consumed = have;
+                while ( remaining > 0 && !closed ) {
+                    ssize_t n = co_await conn.recv( head, remaining < head_cap ? remaining : head_cap );
+                    if ( n <= 0 ) {
+                        closed = true;
+                    } else {
+                        remaining -= n;
+                    }
+                }
+            }
+        }
+        if ( closed ) {
+            break;
+        }
+        bool proxy_keep = true;
+        if ( proxied ) {
+            if ( proxy_buf.empty() ) {
+                proxy_buf.resize( PROXY_BUFFER_SIZE );
+            }
+            size_t used = 0;
+            proxy_keep = req.keep_alive && !coro_draining;
+            if ( microcache_enabled() ) {
+                status = co_await cached_request( conn, req, headers, buf + consumed, have - consumed, used,
+                                                  proxy_buf.data(), proxy_keep );
+            } else {
+                status = co_await upstream_request( conn, req, headers, buf + consumed, have - consumed, used,
+                                                    proxy_buf.data(), proxy_keep, NULL );
+            }
+            conn.set_timeout( 0 );
+            consumed += used;
+            if ( status == 0 ) {
+                coro_responses.fetch_add( 1, std::memory_order_relaxed );
+                if ( !proxy_keep ) {
+                    break;
+                }
+                memmove( buf, buf + consumed, have - consumed );
+                have -= consumed;
+                continue;
+            }
+        }
+
+        // 采样剖析在临时线程中进行，不占住反应堆
+        http_content c;
+        if ( status == 0 && profiler_match( req.url ) ) {
+            status = co_await run_profile( conn, req.url, c.dynamic );
+            c.type = "text/plain";
+            c.size = c.dynamic.size();
+        } else if ( status == 0 ) {
+            perf_scope scope( PERF_STAGE_REQUEST );
+            status = http_resolve( req.url, req.if_none_match, req.accept_gzip, c );
+        }
+
+        int file_fd = c.file_fd;
+        off_t offset = 0;
+        off_t size = c.size;
+        const char* body = c.dynamic.data();
+        bool keep_alive = status != 400 && status != 429 && req.keep_alive && !coro_draining && proxy_keep;
+        int len;
+        {
+            perf_scope scope( PERF_STAGE_RESPONSE );
+            const char* type = c.type;
+            if ( c.entry ) {
+                // 资源包中的文件从包的描述符 sendfile，包一直打开，不关闭
+                file_fd = bundle_fd();
+                offset = c.gzip ? c.entry->gzip_offset : c.entry->offset;
+            }
+            const char* title = ok_200_title;
+            if ( status == 304 ) {
+                title = not_modified_304_title;
+            } else if ( status != 200 ) {
+                if ( status == 502 || status == 504 ) {
+                    title = status == 502 ? error_502_title : error_504_title;
+                    body = status == 502 ? error_502_form : error_504_form;
+                } else if ( status == 503 ) {
+                    title = error_503_title;
+                    body = error_503_form;
+                } else if ( status == 429 ) {
+                    title = error_429_title;
+                    body = error_429_form;
+                } else if ( status == 500 ) {
+                    title = error_500_title;
+                    body = error_500_form;
+                } else {
+                    title = status == 403 ? error_403_title : ( status == 404 ? error_404_title : error_400_title );
+                    body = status == 403 ? error_403_form : ( status == 404 ? error_404_form : error_400_form );
+                }
+                size = strlen( body );
+                type = "text/html";
+            }
+            // 响应头直接写进 head，不拼接临时的字符串；304 没有响应体
+            len = 0;
+            bool fits = add_line( head, head_cap, len, "HTTP/1.1 %d %s\r\n", status, title );
+            if ( status != 304 ) {
+                fits = fits && add_line( head, head_cap, len, "Content-length: %ld\r\nContent-Type: %s\r\n", ( long )size, type );
+            }
+            if ( c.entry ) {
+                fits = fits && add_line( head, head_cap, len, "ETag: %s\r\n", bundle_etag( c.entry, c.gzip ) );
+                fits = fits && ( !c.gzip || add_line( head, head_cap, len, "Content-Encoding: gzip\r\n" ) );
+                fits = fits && ( c.entry->gzip_size == 0 || add_line( head, head_cap, len, "Vary: Accept-Encoding\r\n" ) );
+            }
+            if ( status == 503 || status == 429 ) {
+                fits = fits && add_line( head, head_cap, len, "Retry-After: %d\r\n", status == 503 ? 1 : retry_after );
+            }
+            fits = fits && add_line( head, head_cap, len, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close" );
+            if ( !fits ) {
+                len = -1;
+            }
+        }
+        if ( len < 0 ) {
+            // 写缓冲区放不下响应头
+            if ( c.file_fd >= 0 ) {
+                close( c.file_fd );
+            }
+            break;
+        }
+        // 响应头和正文凑成满的报文段再发出
+        ssize_t n = co_await conn.send( head, len, size > 0 ? MSG_MORE : 0 );
+        if ( n >= 0 && size > 0 ) {
+            if ( file_fd >= 0 ) {
+                n = co_await conn.sendfile( file_fd, offset, size );
+            } else {
+                n = co_await conn.send( body, size );
+            }
+        }
+        if ( c.file_fd >= 0 ) {
+            close( c.file_fd );
+        }
+        if ( n < 0 ) {
+            break;
+        }
+        coro_responses.fetch_add( 1, std::memory_order_relaxed );
+        if ( !keep_alive ) {
+            break;
+        }
+
+        // 流水线中的下一个请求移到缓冲区开头
+        memmove( buf, buf + consumed, have - consumed );
+        have -= consumed;
+    }
+    buffer_put( block, 0 );
+}
+
+// 反应堆：一个线程、一个 epoll，新连接由 accept 线程放进 m_inbox，再用 eventfd 唤醒
+class coro_reactor {
+public:
+    coro_reactor() : m_epollfd( -1 ), m_wakefd( -1 ), m_ws( NULL ) {}
+    bool start();
+    // tls 为true时连接来自 HTTPS 端口
+    void add( int fd, bool tls = false );
+    // 排空时调用，让反应堆关闭它上面的空闲连接
+    void drain() { add( -1 ); }
+
+private:
+    static void* loop( void* arg );
+    void run();
+
+    int m_epollfd;
+    int m_wakefd;
+    pthread_t m_thread;
+    locker m_lock;
+    std::vector< std::pair< int, bool > > m_inbox;
+    ws_reactor* m_ws;       // 这个反应堆上 WebSocket 的订阅表，其他反应堆发布的广播也用 m_wakefd 唤醒
+};
+
+bool coro_reactor::start() {
+    m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+    m_wakefd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( m_epollfd < 0 || m_wakefd < 0 ) {
+        return false;
+    }
+    epoll_event event;
+    event.data.ptr = NULL;
+    event.events = EPOLLIN;
+    epoll_ctl( m_epollfd, EPOLL_CTL_ADD, m_wakefd, &event );
+    if ( ws_enabled() ) {
+        m_ws = ws_reactor_new( m_wakefd );
+    }
+    if ( pthread_create( &m_thread, NULL, loop, this ) != 0 ) {
+        return false;
+    }
+    pthread_detach( m_thread );
+    return true;
+}
+
+void coro_reactor::add( int fd, bool tls ) {
+    m_lock.lock();
+    bool wake = m_inbox.empty();
+    m_inbox.push_back( std::make_pair( fd, tls ) );
+    m_lock.unlock();
+    if ( wake ) {
+        uint64_t one = 1;
+        ssize_t n = ::write( m_wakefd, &one, sizeof( one ) );
+        ( void )n;
+    }
+}
+
+void* coro_reactor::loop( void* arg ) {
+    upgrade_block_signals();
+    ( ( coro_reactor* )arg )->run();
+    return NULL;
+}
+
+void coro_reactor::run() {
+    epoll_event events[ 1024 ];
+    std::vector< std::pair< int, bool > > fresh;
+    // 只有代理的操作有超时，配置了代理时每秒检查一次
+    int tick = proxy_routes.empty() ? -1 : 1000;
+    uint64_t next_expire = 0;
+    ws_reactor_bind( m_ws );
+    while ( true ) {
+        int number = epoll_wait( m_epollfd, events, 1024, tick );
+        if ( number < 0 && errno != EINTR ) {
+            printf( "coroutine reactor epoll failure\n" );
+            break;
+        }
+        bool wake = false;
+        in_batch = true;
+        {
+            // 与线程池模式的主线程相同，按事件数计次；这里还包括被恢复的协程处理请求的时间
+            perf_scope dispatch_scope( PERF_STAGE_DISPATCH, number > 0 ? number : 0 );
+            for ( int i = 0; i < number; ++i ) {
+                void* ptr = events[i].data.ptr;
+                if ( !ptr ) {
+                    wake = true;
+                } else if ( batch_gone.empty() || std::find( batch_gone.begin(), batch_gone.end(), ptr ) == batch_gone.end() ) {
+                    ( ( coro_conn* )ptr )->on_event( events[i].events );
+                }
+            }
+        }
+        in_batch = false;
+        batch_gone.clear();
+        if ( tick > 0 ) {
+            uint64_t now = upgrade_clock_ms();
+            if ( now >= next_expire ) {
+                coro_conn::expire( now );
+                next_expire = now + tick;
+            }
+        }
+        // 新连接在处理完这一批事件之后再启动，这一批事件里不会出现新连接的帧
+        if ( wake ) {
+            uint64_t count;
+            ssize_t n = ::read( m_wakefd, &count, sizeof( count ) );
+            ( void )n;
+            m_lock.lock();
+            fresh.swap( m_inbox );
+            m_lock.unlock();
+            for ( size_t i = 0; i < fresh.size(); ++i ) {
+                if ( fresh[i].first < 0 ) {
+                    coro_conn::shutdown_idle();
+                } else {
+                    serve( m_epollfd, fresh[i].first, fresh[i].second );
+                }
+            }
+            fresh.clear();
+            if ( m_ws ) {
+                ws_reactor_wake( m_ws );
+            }
+        }
+    }
+}
+
+static void coro_metrics( std::string& out ) {
+    metrics_header( out, "webserver_coro_connections", "gauge", "Connections handled by coroutines." );
+    metrics_gauge( out, "webserver_coro_connections", NULL, coro_connections.load() );
+    metrics_header( out, "webserver_coro_responses_total", "counter", "Responses sent by coroutines." );
+    metrics_counter( out, "webserver_coro_responses_total", NULL, coro_responses.load() );
+    metrics_header( out, "webserver_coro_io_waits_total", "counter", "Times a coroutine suspended waiting for the socket." );
+    metrics_counter( out, "webserver_coro_io_waits_total", NULL, coro_io_waits.load() );
+    metrics_header( out, "webserver_coro_frame_mallocs_total", "counter", "Coroutine frames not served from the pool." );
+    metrics_counter( out, "webserver_coro_frame_mallocs_total", NULL, coro_frame_mallocs.load() );
+}
+
+// 排空：不再接收连接，等所有连接协程结束或超时
+static void coro_drain( std::vector< coro_reactor* >& all, int sigfd ) {
+    printf( "draining %d connections\n", coro_connections.load() );
+    coro_draining = true;
+    uint64_t deadline = upgrade_clock_ms() + server_conf.drain_timeout_ms;
+    uint64_t idle_deadline = upgrade_clock_ms() + UPGRADE_IDLE_GRACE_MS;
+    while ( coro_connections > 0 ) {
+        uint64_t now = upgrade_clock_ms();
+        if ( now >= deadline ) {
+            printf( "drain timeout, %d connections left\n", coro_connections.load() );
+            return;
+        }
+        if ( idle_deadline && now >= idle_deadline ) {
+            idle_deadline = 0;
+            for ( size_t i = 0; i < all.size(); ++i ) {
+                all[i]->drain();
+            }
+        }
+        pollfd pfd = { sigfd, POLLIN, 0 };
+        if ( poll( &pfd, 1, 100 ) > 0 ) {
+            upgrade_signal_take();
+        }
+    }
+    printf( "drained, exiting\n" );
+}
+
+// 接收 listenfd 上所有等待的连接，轮流分给各反应堆；出现无法恢复的错误时返回false
+static bool accept_all( int listenfd, bool tls, std::vector< coro_reactor* >& all, unsigned& next ) {
+    while ( true ) {
+        sockaddr_in addr;
+        socklen_t len = sizeof( addr );
+        int connfd = accept( listenfd, ( sockaddr* )&addr, &len );
+        if ( connfd < 0 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return true;
+            }
+            printf( "errno is : %d\n", errno );
+            if ( errno == EMFILE || errno == ENFILE ) {
+                usleep( 1000 );
+                return true;
+            }
+            return false;
+        }
+        sockopt_accept( connfd );
+        all[ next++ % all.size() ]->add( connfd, tls );
+    }
+}
+
+int coro_serve( int listenfd, int tls_listenfd, int reactors, int sigfd, char* argv[] ) {
+    buffer_pool_init( http_conn::m_read_buffer_size + http_conn::m_write_buffer_size );
+    metrics_register( coro_metrics );
+    std::vector< coro_reactor* > all;
+    for ( int i = 0; i < reactors; ++i ) {
+        coro_reactor* r = new coro_reactor;
+        if ( !r->start() ) {
+            printf( "cannot start coroutine reactor: %s\n", strerror( errno ) );
+            return -1;
+        }
+        all.push_back( r );
+    }
+    printf( "coroutine mode, %d reactors\n", reactors );
+    // 监听套接字设为非阻塞，同时等待新连接和自管道；升级期间新旧进程在同一个套接字上 accept
+    setnonblocking( listenfd );
+    if ( tls_listenfd >= 0 ) {
+        setnonblocking( tls_listenfd );
+    }
+    unsigned next = 0;
+    while ( true ) {
+        // 没有 HTTPS 时 fd 为-1，poll 忽略这一项
+        pollfd pfds[3] = { { sigfd, POLLIN, 0 }, { listenfd, POLLIN, 0 }, { tls_listenfd, POLLIN, 0 } };
+        if ( poll( pfds, 3, -1 ) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            printf( "poll failure\n" );
+            return -1;
+        }
+        if ( pfds[0].revents & POLLIN ) {
+            int ev = upgrade_signal_take();
+            if ( ev & UPGRADE_REEXEC ) {
+                upgrade_spawn( listenfd, tls_listenfd, argv );
+            }
+            if ( ev & UPGRADE_STOP ) {
+                coro_drain( all, sigfd );
+                return 0;
+            }
+        }
+        if ( ( pfds[1].revents & POLLIN ) && !accept_all( listenfd, false, all, next ) ) {
+            return -1;
+        }
+        if ( ( pfds[2].revents & POLLIN ) && !accept_all( tls_listenfd, true, all, next ) ) {
+            return -1;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+    协程方式处理连接，配置 coroutines = on 时代替 线程池 + 状态机 的处理方式
+    每个反应堆线程有自己的 epoll，连接在某个反应堆上作为一个协程运行，
+    请求的读取、解析、响应都按顺序写在一个函数里（coro.cpp 中的 serve），不需要手写状态机的恢复逻辑。
+    recv/send/sendfile 都是可等待的操作：先直接调用，EAGAIN 时挂起协程，
+    套接字可读/可写后由反应堆重试，完成后再恢复协程。
+    协程帧从线程本地的内存池分配，读写缓冲区从 affinity.h 的缓冲区池取，处理请求的过程中没有 malloc。
+    反向代理（proxy.h）的请求由子协程 proxy_request 处理，上游连接也是反应堆上的 coro_conn，
+    用完后从 epoll 中移除、放回本反应堆的连接池。
+    HTTPS 端口上的连接（见 tls.h）先等待握手完成，之后 recv/send/sendfile 经过连接的 TLS 状态。
+
+    和线程池模式共用请求的处理逻辑，这里只有等待 I/O 的部分：请求的解析和静态内容的查找见 http_request.h，
+    反向代理和 FastCGI 每一步做什么由 proxy_exchange / fastcgi_exchange 决定，微缓存的填充和回退同 http_conn。
+    采样剖析（PROFILE_URL）会阻塞到采样结束，放在一个临时线程中进行，协程等它的结果，反应堆照常运行。
+    perf_counters 的阶段：PARSE、REQUEST、RESPONSE 在 serve 中统计（不跨越 co_await），
+    DISPATCH 是反应堆处理一批事件，包括被恢复的协程的运行时间。
+
+    需要 C++20 协程，用 -std=c++20 编译时才启用，例如
+        g++ -std=c++20 -O2 *.cpp -pthread -o server
+    否则 coro_available() 返回false，配置 coroutines = on 会在启动时报错。
+*/
+
+// 是否编译了协程支持
+bool coro_available();
+// 启动 reactors 个反应堆线程，主线程接收连接，把连接轮流分给各反应堆；tls_listenfd 为 HTTPS 的监听套接字，没有时为-1。
+// sigfd 是 upgrade_signal_init 返回的自管道：SIGUSR2 时启动新程序，SIGTERM/SIGQUIT 时停止接收连接，
+// 等已有的连接处理完（最多 drain_timeout_ms）后返回0
+int coro_serve( int listenfd, int tls_listenfd, int reactors, int sigfd, char* argv[] );
+
+#if defined( __cpp_impl_coroutine ) && __cpp_impl_coroutine >= 201902L
+#define WEBSERVER_CORO 1
+#include <coroutine>
+#include <exception>
+
+// 协程帧的内存池：按 64 字节分档的线程本地空闲链表。连接协程在它所在的反应堆线程上结束，
+// 帧也在同一个线程上释放；超过 4KB 的帧直接用 operator new
+void* coro_frame_alloc( size_t size );
+void coro_frame_free( void* p, size_t size );
+
+// 连接协程的返回类型：创建后立即运行，结束时自动释放帧，没有人等待它的结果
+struct conn_task {
+    struct promise_type {
+        conn_task get_return_object() { return conn_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new( size_t size ) { return coro_frame_alloc( size ); }
+        static void operator delete( void* p, size_t size ) { coro_frame_free( p, size ); }
+    };
+};
+
+// 可以 co_await 的子协程，返回 int：创建时不运行，被等待时开始，结束后恢复等待它的协程
+struct co_task {
+    struct promise_type {
+        int value;
+        std::coroutine_handle<> continuation;
+        co_task get_return_object() { return co_task( std::coroutine_handle< promise_type >::from_promise( *this ) ); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend( std::coroutine_handle< promise_type > h ) noexcept {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value( int v ) { value = v; }
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new( size_t size ) { return coro_frame_alloc( size ); }
+        static void operator delete( void* p, size_t size ) { coro_frame_free( p, size ); }
+    };
+    explicit co_task( std::coroutine_handle< promise_type > h ) : m_handle( h ) {}
+    co_task( co_task&& other ) : m_handle( other.m_handle ) { other.m_handle = nullptr; }
+    ~co_task() {
+        if ( m_handle ) {
+            m_handle.destroy();
+        }
+    }
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> h ) {
+        m_handle.promise().continuation = h;
+        return m_handle;
+    }
+    int await_resume() { return m_handle.promise().value; }
+
+    std::coroutine_handle< promise_type > m_handle;
+};
+
+// 一次可能阻塞的IO：attempt() 完成（成功或出错）时返回true，结果放在 result，出错时为 -errno
+struct io_op {
+    std::coroutine_handle<> waiter;
+    uint32_t events;        // 等待的事件，EPOLLIN 或 EPOLLOUT
+    ssize_t result;
+    virtual bool attempt() = 0;
+    virtual ~io_op() {}
+};
+
+struct tls_conn;
+
+// 读一次，返回读到的字节数，0 表示对端关闭
+struct recv_op : io_op {
+    int fd;
+    tls_conn* tls;          // HTTPS 连接经过 TLS 读写，否则为NULL（send_op、sendfile_op 相同）
+    char* buf;
+    size_t len;
+    bool attempt();
+};
+
+// 发送全部数据，flags 传给 send（如 MSG_MORE）
+struct send_op : io_op {
+    int fd;
+    tls_conn* tls;
+    const char* buf;
+    size_t len;
+    size_t done;
+    int flags;
+    bool attempt();
+};
+
+// 用 sendfile 发送文件的 [offset, offset + count)
+struct sendfile_op : io_op {
+    int fd;
+    tls_conn* tls;
+    int file_fd;
+    off_t offset;
+    size_t count;
+    size_t done;
+    bool attempt();
+};
+
+// TLS 握手，结果为0或者 -EPROTO；等待的事件由 OpenSSL 决定，每次尝试后更新
+struct handshake_op : io_op {
+    tls_conn* tls;
+    bool attempt();
+};
+
+// 等待非阻塞 connect 完成，结果为0或者 -errno
+struct connect_op : io_op {
+    int fd;
+    bool attempt();
+};
+
+// 用 splice 在套接字和管道之间搬运：in 为套接字到管道，读一次，0 表示对端关闭；
+// 否则把管道中的 len 字节全部写到套接字
+struct splice_op : io_op {
+    int from;
+    int to;
+    size_t len;
+    size_t done;
+    bool in;
+    bool attempt();
+};
+
+class coro_conn;
+
+// co_await 的对象：先直接尝试，未完成时把操作挂到连接上等待 epoll 通知
+template<typename Op>
+struct io_awaitable {
+    coro_conn* conn;
+    Op op;
+    bool await_ready() { return op.attempt(); }
+    void await_suspend( std::coroutine_handle<> h );
+    ssize_t await_resume() { return op.result; }
+};
+
+// 反应堆上的一个连接：构造时以边缘触发（读写都关注）注册到反应堆的 epoll，析构时关闭套接字。
+// client 为false时是到上游的连接，不计入连接数，fd 可以是-1，之后用 attach 注册
+class coro_conn {
+public:
+    coro_conn( int epollfd, int fd, bool client = true );
+    ~coro_conn();
+    int fd() const { return m_fd; }
+    int epollfd() const { return m_epollfd; }
+    void attach( int fd );
+    // 从 epoll 中移除，交出套接字（例如放回上游连接池），之后析构时不再关闭
+    int release();
+
+    io_awaitable< recv_op > recv( char* buf, size_t len );
+    io_awaitable< send_op > send( const char* buf, size_t len, int flags = 0 );
+    io_awaitable< sendfile_op > sendfile( int file_fd, off_t offset, size_t count );
+    io_awaitable< connect_op > connected();
+    // 之后这个连接的 recv/send/sendfile 经过 tls，析构时释放它
+    void set_tls( tls_conn* tls ) { m_tls = tls; }
+    tls_conn* tls() const { return m_tls; }
+    io_awaitable< handshake_op > handshake();
+    // 从这个连接读入管道 / 把管道中的 len 字节写到这个连接
+    io_awaitable< splice_op > splice_in( int pipe_w, size_t len );
+    io_awaitable< splice_op > splice_out( int pipe_r, size_t len );
+    // 之后每次挂起最多等待 ms 毫秒，超时时操作的结果为 -ETIMEDOUT；0 表示不限
+    void set_timeout( int ms ) { m_timeout = ms; }
+    // 反应堆定期调用，恢复本线程上等待超时的协程
+    static void expire( uint64_t now );
+
+    // 反应堆收到这个连接的事件时调用：重试正在等待的操作，完成后恢复协程
+    void on_event( uint32_t events );
+    void wait( io_op* op );
+    // 正在等下一个请求、还没读到任何数据时为true
+    void set_idle( bool idle ) { m_idle = idle; }
+    // 服务器退出时在反应堆线程上调用：关闭本线程上空闲连接的读方向，协程读到0后结束
+    static void shutdown_idle();
+
+private:
+    int m_fd;
+    int m_epollfd;
+    bool m_client;
+    tls_conn* m_tls;
+    io_op* m_op;        // 正在等待的操作，同一时间最多一个
+    int m_timeout;
+    uint64_t m_deadline; // 正在等待的操作的超时时刻，0 表示不限
+    bool m_idle;
+    coro_conn* m_prev;  // 本线程上所有连接的双向链表
+    coro_conn* m_next;
+};
+
+template<typename Op>
+void io_awaitable< Op >::await_suspend( std::coroutine_handle<> h ) {
+    op.waiter = h;
+    conn->wait( &op );
+}
+
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+/*
+    线程池的请求队列：多级队列 + 按客户端的赤字轮询（DRR）
+    请求按预计代价分为 LEVELS 级，0 级最便宜（例如已在页缓存中的小文件），2 级最贵（大文件）。
+    各级之间也按代价做赤字轮询，每轮第 i 级的额度为 LEVEL_WEIGHT[i] * QUANTUM：
+    积压时大文件最多占用约 1/12 的处理量，小页面不会排在一批大文件后面，大文件也不会饿死。
+    每一级内按 key（客户端IP地址）分流，流之间按请求的代价（1 ~ QUANTUM）做赤字轮询，
+    同一个客户端发来再多请求也只占它自己的份额。
+    所有请求都在 0 级、key 相同时退化为先进先出。
+    本身不加锁，由线程池的 m_queuelocker 保护。
+*/
+template<typename T>
+class fair_queue {
+public:
+    static const int LEVELS = 3;
+    // 每一轮中流的额度，也是单个请求代价的上限
+    static const int QUANTUM = 16;
+
+    struct entry {
+        T* request;
+        uint64_t enqueued_ns;
+        int cost;
+    };
+
+    fair_queue() : m_current(0), m_size(0) {
+        for (int i = 0; i < LEVELS; ++i) {
+            m_levels[i].size = 0;
+            m_levels[i].credit = weight(i) * QUANTUM;
+        }
+    }
+    ~fair_queue();
+
+    void push(entry e, int level, unsigned key);
+    // 队列为空时返回false
+    bool pop(entry& e);
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_t size(int level) const { return m_levels[level].size; }
+
+private:
+    struct flow {
+        unsigned key;
+        int deficit;
+        std::deque<entry> q;
+    };
+    struct level_queue {
+        std::unordered_map<unsigned, flow*> flows;  // 有请求排队的流
+        std::list<flow*> active;                     // 轮询顺序，队首是当前的流
+        size_t size;
+        int credit;                                  // 本轮剩余的额度，可以为负，透支的部分下一轮扣除
+    };
+
+    static int weight(int level) {
+        static const int LEVEL_WEIGHT[LEVELS] = { 8, 3, 1 };
+        return LEVEL_WEIGHT[level];
+    }
+    void pop_level(level_queue& lv, entry& e);
+
+    level_queue m_levels[LEVELS];
+    std::vector<flow*> m_free;      // 已经清空的流，留着复用
+    int m_current;                  // 当前轮到的级别
+    size_t m_size;
+};
+
+template<typename T>
+fair_queue<T>::~fair_queue() {
+    for (int i = 0; i < LEVELS; ++i) {
+        for (typename std::list<flow*>::iterator it = m_levels[i].active.begin(); it != m_levels[i].active.end(); ++it) {
+            delete *it;
+        }
+    }
+    for (size_t i = 0; i < m_free.size(); ++i) {
+        delete m_free[i];
+    }
+}
+
+template<typename T>
+void fair_queue<T>::push(entry e, int level, unsigned key) {
+    if (level < 0) {
+        level = 0;
+    } else if (level >= LEVELS) {
+        level = LEVELS - 1;
+    }
+    if (e.cost < 1) {
+        e.cost = 1;
+    } else if (e.cost > QUANTUM) {
+        e.cost = QUANTUM;
+    }
+    level_queue& lv = m_levels[level];
+    flow*& f = lv.flows[key];
+    if (!f) {
+        if (m_free.empty()) {
+            f = new flow;
+        } else {
+            f = m_free.back();
+            m_free.pop_back();
+        }
+        f->key = key;
+        f->deficit = 0;
+        lv.active.push_back(f);
+    }
+    f->q.push_back(e);
+    lv.size++;
+    m_size++;
+}
+
+template<typename T>
+bool fair_queue<T>::pop(entry& e) {
+    if (m_size == 0) {
+        return false;
+    }
+    while (true) {
+        level_queue& lv = m_levels[m_current];
+        if (lv.size > 0 && lv.credit > 0) {
+            pop_level(lv, e);
+            lv.credit -= e.cost;
+            return true;
+        }
+        // 这一级空了或者额度用完，轮到下一级；空的级别不积累额度
+        m_current = (m_current + 1) % LEVELS;
+        level_queue& next = m_levels[m_current];
+        if (next.size == 0) {
+            next.credit = 0;
+        } else {
+            next.credit += weight(m_current) * QUANTUM;
+        }
+    }
+}
+
+template<typename T>
+void fair_queue<T>::pop_level(level_queue& lv, entry& e) {
+    while (true) {
+        flow* f = lv.active.front();
+        if (f->deficit >= f->q.front().cost) {
+            f->deficit -= f->q.front().cost;
+            e = f->q.front();
+            f->q.pop_front();
+            lv.size--;
+            m_size--;
+            if (f->q.empty()) {
+                // 流清空后不保留赤字，下次来请求时重新排到队尾
+                lv.active.pop_front();
+                lv.flows.erase(f->key);
+                m_free.push_back(f);
+            }
+            return;
+        }
+        // 额度不够，加一个 QUANTUM 后排到队尾，让下一个流先取
+        f->deficit += QUANTUM;
+        lv.active.splice(lv.active.end(), lv.active, lv.active.begin());
+    }
+}
+
+#endif
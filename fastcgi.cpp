@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include "fastcgi.h"
+#include "metrics.h"
+#include "microcache.h"
+
+std::string fastcgi_root;
+
+// 记录类型和常量，见 FastCGI 规范
+enum { FCGI_BEGIN_REQUEST = 1, FCGI_ABORT_REQUEST, FCGI_END_REQUEST, FCGI_PARAMS, FCGI_STDIN, FCGI_STDOUT, FCGI_STDERR };
+enum { FCGI_REQUEST_COMPLETE = 0, FCGI_CANT_MPX_CONN, FCGI_OVERLOADED, FCGI_UNKNOWN_ROLE };
+static const int FCGI_VERSION = 1;
+static const int FCGI_RESPONDER = 1;
+static const int FCGI_KEEP_CONN = 1;
+// 一个连接同一时间只有一个请求，请求ID总是1
+static const int REQUEST_ID = 1;
+
+static std::atomic< uint64_t > fastcgi_stats[ FASTCGI_STAT_COUNT ];
+
+bool fastcgi_parse( const char* spec, int max_conns, std::vector< proxy_route >& routes, std::string& err ) {
+    std::vector< proxy_route > added;
+    if ( !proxy_parse( spec, added, err ) ) {
+        return false;
+    }
+    // 上游的 id 接着已有的路由编号，连接池按 id 区分
+    int id = 0;
+    for ( size_t r = 0; r < routes.size(); ++r ) {
+        for ( size_t u = 0; u < routes[r].upstreams.size(); ++u ) {
+            if ( routes[r].upstreams[u].id >= id ) {
+                id = routes[r].upstreams[u].id + 1;
+            }
+        }
+    }
+    for ( size_t i = 0; i < added.size(); ++i ) {
+        for ( size_t r = 0; r < routes.size(); ++r ) {
+            if ( routes[r].prefix == added[i].prefix ) {
+                err = "prefix '" + added[i].prefix + "' is already a proxy route";
+                return false;
+            }
+        }
+        added[i].fastcgi = true;
+        added[i].max_in_flight = max_conns;
+        for ( size_t u = 0; u < added[i].upstreams.size(); ++u ) {
+            added[i].upstreams[u].id = id++;
+        }
+        routes.push_back( added[i] );
+    }
+    return true;
+}
+
+static void record_header( unsigned char* h, int type, size_t len ) {
+    h[0] = FCGI_VERSION;
+    h[1] = type;
+    h[2] = REQUEST_ID >> 8;
+    h[3] = REQUEST_ID & 0xff;
+    h[4] = len >> 8;
+    h[5] = len & 0xff;
+    h[6] = 0;       // 不加填充
+    h[7] = 0;
+}
+
+static void append_record( std::string& out, int type, const char* content, size_t len ) {
+    unsigned char h[ FASTCGI_HEADER_LEN ];
+    record_header( h, type, len );
+    out.append( ( const char* )h, sizeof( h ) );
+    out.append( content, len );
+}
+
+// 名字和值的长度小于128时用1个字节，否则用4个字节，最高位为1
+static void append_length( std::string& out, size_t len ) {
+    if ( len < 128 ) {
+        out += ( char )len;
+    } else {
+        out += ( char )( ( len >> 24 ) | 0x80 );
+        out += ( char )( len >> 16 );
+        out += ( char )( len >> 8 );
+        out += ( char )len;
+    }
+}
+
+static void add_param( std::string& params, const char* name, size_t name_len, const char* value, size_t value_len ) {
+    append_length( params, name_len );
+    append_length( params, value_len );
+    params.append( name, name_len );
+    params.append( value, value_len );
+}
+
+static void add_param( std::string& params, const char* name, const std::string& value ) {
+    add_param( params, name, strlen( name ), value.data(), value.size() );
+}
+
+// 路径中有 ".." 这一段时不能拼到 fastcgi_root 后面
+static bool has_dot_dot( const char* path, size_t len ) {
+    for ( size_t i = 0; i + 1 < len; ++i ) {
+        if ( path[i] == '.' && path[i + 1] == '.' && ( i == 0 || path[i - 1] == '/' ) && ( i + 2 == len || path[i + 2] == '/' ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool fastcgi_request_head( std::string& out, const char* method, const char* url, const std::vector< const char* >& headers,
+                           const sockaddr_in& client, int client_fd, long content_length, bool& expect_continue ) {
+    size_t path_len = strcspn( url, "?" );
+    if ( has_dot_dot( url, path_len ) ) {
+        return false;
+    }
+    std::string path( url, path_len );
+    std::string params;
+    params.reserve( 1024 );
+    add_param( params, "GATEWAY_INTERFACE", "CGI/1.1" );
+    add_param( params, "SERVER_SOFTWARE", "webserver" );
+    add_param( params, "SERVER_PROTOCOL", "HTTP/1.1" );
+    add_param( params, "REQUEST_METHOD", method );
+    add_param( params, "REQUEST_URI", url );
+    add_param( params, "DOCUMENT_URI", path );
+    add_param( params, "SCRIPT_NAME", path );
+    add_param( params, "SCRIPT_FILENAME", fastcgi_root + path );
+    add_param( params, "DOCUMENT_ROOT", fastcgi_root );
+    add_param( params, "QUERY_STRING", url[ path_len ] == '?' ? url + path_len + 1 : "" );
+    // php 以 cgi 方式编译时要求这个参数
+    add_param( params, "REDIRECT_STATUS", "200" );
+    char text[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &client.sin_addr, text, sizeof( text ) );
+    add_param( params, "REMOTE_ADDR", text );
+    add_param( params, "REMOTE_PORT", std::to_string( ntohs( client.sin_port ) ) );
+    sockaddr_in local;
+    socklen_t local_len = sizeof( local );
+    std::string server_name;
+    if ( getsockname( client_fd, ( sockaddr* )&local, &local_len ) == 0 && local.sin_family == AF_INET ) {
+        inet_ntop( AF_INET, &local.sin_addr, text, sizeof( text ) );
+        server_name = text;
+        add_param( params, "SERVER_ADDR", text );
+        add_param( params, "SERVER_PORT", std::to_string( ntohs( local.sin_port ) ) );
+    }
+    if ( content_length > 0 ) {
+        add_param( params, "CONTENT_LENGTH", std::to_string( content_length ) );
+    }
+
+    // 请求头：Content-Type 变成 CONTENT_TYPE，其他的变成 HTTP_大写名字（- 换成 _）
+    expect_continue = false;
+    std::string name;
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        const char* h = headers[i];
+        const char* colon = strchr( h, ':' );
+        if ( !colon || colon == h ) {
+            continue;
+        }
+        size_t len = colon - h;
+        const char* value = colon + 1 + strspn( colon + 1, " \t" );
+        if ( len == 14 && strncasecmp( h, "Content-Length", len ) == 0 ) {
+            continue;
+        } else if ( len == 5 && strncasecmp( h, "Proxy", len ) == 0 ) {
+            continue;
+        } else if ( len == 12 && strncasecmp( h, "Content-Type", len ) == 0 ) {
+            add_param( params, "CONTENT_TYPE", value );
+            continue;
+        } else if ( len == 6 && strncasecmp( h, "Expect", len ) == 0 ) {
+            expect_continue = strcasecmp( value, "100-continue" ) == 0;
+            continue;
+        } else if ( len == 4 && strncasecmp( h, "Host", len ) == 0 ) {
+            server_name.assign( value, strcspn( value, ":" ) );
+        }
+        name = "HTTP_";
+        for ( size_t j = 0; j < len; ++j ) {
+            name += h[j] == '-' ? '_' : ( char )toupper( ( unsigned char )h[j] );
+        }
+        add_param( params, name.data(), name.size(), value, strlen( value ) );
+    }
+    if ( !server_name.empty() ) {
+        add_param( params, "SERVER_NAME", server_name );
+    }
+
+    out.clear();
+    unsigned char begin[ 8 ] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+    append_record( out, FCGI_BEGIN_REQUEST, ( const char* )begin, sizeof( begin ) );
+    for ( size_t pos = 0; pos < params.size(); pos += FASTCGI_MAX_CONTENT ) {
+        size_t n = params.size() - pos < FASTCGI_MAX_CONTENT ? params.size() - pos : FASTCGI_MAX_CONTENT;
+        append_record( out, FCGI_PARAMS, params.data() + pos, n );
+    }
+    append_record( out, FCGI_PARAMS, NULL, 0 );
+    if ( content_length <= 0 ) {
+        append_record( out, FCGI_STDIN, NULL, 0 );
+    }
+    return true;
+}
+
+void fastcgi_stdin_header( char* hdr, size_t len ) {
+    record_header( ( unsigned char* )hdr, FCGI_STDIN, len );
+}
+
+fastcgi_response::fastcgi_response( bool head_request, bool keep_alive )
+    : m_head_request( head_request ), m_keep_alive( keep_alive ), m_started( false ), m_done( false ),
+      m_overloaded( false ), m_clean( true ), m_no_body( head_request ), m_chunked( false ), m_length( 0 ), m_sent( 0 ),
+      m_header_len( 0 ), m_content( 0 ), m_padding( 0 ), m_end_len( 0 ) {}
+
+int fastcgi_response::feed( const char* p, size_t n, std::string& out ) {
+    while ( true ) {
+        if ( m_header_len == FASTCGI_HEADER_LEN && m_content == 0 && m_padding == 0 ) {
+            // 一个记录结束
+            if ( end_record( out ) < 0 ) {
+                return -1;
+            }
+            m_header_len = 0;
+        }
+        if ( n == 0 ) {
+            return 0;
+        }
+        if ( m_done ) {
+            // FCGI_END_REQUEST 之后还有数据，这个连接不能再用
+            m_clean = false;
+            return 0;
+        }
+        size_t take;
+        if ( m_header_len < FASTCGI_HEADER_LEN ) {
+            take = FASTCGI_HEADER_LEN - m_header_len < n ? FASTCGI_HEADER_LEN - m_header_len : n;
+            memcpy( m_header + m_header_len, p, take );
+            m_header_len += take;
+            if ( m_header_len == FASTCGI_HEADER_LEN ) {
+                int id = m_header[2] << 8 | m_header[3];
+                // 请求ID为0的是管理记录，忽略
+                if ( m_header[0] != FCGI_VERSION || ( id != REQUEST_ID && id != 0 ) ) {
+                    return -1;
+                }
+                m_content = m_header[4] << 8 | m_header[5];
+                m_padding = m_header[6];
+                m_end_len = 0;
+                if ( id == REQUEST_ID && m_header[1] == FCGI_STDERR && m_content > 0 ) {
+                    fastcgi_count( FASTCGI_STDERR );
+                }
+            }
+        } else if ( m_content > 0 ) {
+            take = m_content < n ? m_content : n;
+            if ( content( p, take, out ) < 0 ) {
+                return -1;
+            }
+            m_content -= take;
+        } else {
+            take = m_padding < n ? m_padding : n;
+            m_padding -= take;
+        }
+        p += take;
+        n -= take;
+    }
+}
+
+// 当前记录的一段内容
+int fastcgi_response::content( const char* p, size_t n, std::string& out ) {
+    int id = m_header[2] << 8 | m_header[3];
+    if ( id != REQUEST_ID ) {
+        return 0;
+    }
+    switch ( m_header[1] ) {
+        case FCGI_STDOUT:
+            if ( m_started ) {
+                body( p, n, out );
+                return 0;
+            }
+            // CGI 响应头以空行结束，有的应用只用 \n
+            {
+                size_t from = m_head.size() > 3 ? m_head.size() - 3 : 0;
+                m_head.append( p, n );
+                size_t crlf = m_head.find( "\r\n\r\n", from );
+                size_t lf = m_head.find( "\n\n", from );
+                size_t end = crlf < lf ? crlf + 4 : ( lf != std::string::npos ? lf + 2 : std::string::npos );
+                if ( end != std::string::npos ) {
+                    return start( end, out );
+                }
+                return m_head.size() > PROXY_BUFFER_SIZE ? -1 : 0;
+            }
+        case FCGI_STDERR:
+            fwrite( p, 1, n, stderr );
+            return 0;
+        case FCGI_END_REQUEST:
+            if ( m_end_len + n <= sizeof( m_end ) ) {
+                memcpy( m_end + m_end_len, p, n );
+                m_end_len += n;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+int fastcgi_response::end_record( std::string& out ) {
+    int id = m_header[2] << 8 | m_header[3];
+    if ( id != REQUEST_ID || m_header[1] != FCGI_END_REQUEST ) {
+        return 0;
+    }
+    m_done = true;
+    if ( m_end_len < sizeof( m_end ) ) {
+        return -1;
+    }
+    if ( !m_started ) {
+        // 没有输出完整的响应头就结束了
+        int status = m_end[4];
+        m_overloaded = status == FCGI_OVERLOADED || status == FCGI_CANT_MPX_CONN;
+        return -1;
+    }
+    if ( m_chunked ) {
+        out += "0\r\n\r\n";
+    } else if ( !m_no_body && m_sent < m_length ) {
+        // 响应体比 Content-Length 短，客户端只能靠关闭连接知道出错了
+        m_keep_alive = false;
+    }
+    return 0;
+}
+
+static const char* status_title( int status ) {
+    switch ( status ) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+// m_head 的前 head_len 字节是 CGI 响应头，转换成 HTTP 响应头，之后的是响应体的开头
+int fastcgi_response::start( size_t head_len, std::string& out ) {
+    int status = 0;
+    std::string title;
+    bool location = false;
+    bool has_length = false;
+    std::string fields;
+    size_t pos = 0;
+    while ( pos < head_len ) {
+        size_t eol = m_head.find( '\n', pos );
+        size_t end = eol > pos && m_head[ eol - 1 ] == '\r' ? eol - 1 : eol;
+        const char* line = m_head.data() + pos;
+        size_t len = end - pos;
+        pos = eol + 1;
+        if ( len == 0 ) {
+            break;
+        }
+        const char* colon = ( const char* )memchr( line, ':', len );
+        if ( !colon || colon == line ) {
+            return -1;
+        }
+        size_t name_len = colon - line;
+        const char* value = colon + 1;
+        while ( value < line + len && ( *value == ' ' || *value == '\t' ) ) {
+            ++value;
+        }
+        size_t value_len = line + len - value;
+        if ( name_len == 6 && strncasecmp( line, "Status", 6 ) == 0 ) {
+            // Status: 404 Not Found
+            std::string v( value, value_len );
+            status = atoi( v.c_str() );
+            title = v.substr( strspn( v.c_str(), "0123456789 \t" ) );
+            continue;
+        }
+        if ( name_len == 17 && strncasecmp( line, "Transfer-Encoding", 17 ) == 0 ) {
+            continue;
+        }
+        if ( proxy_hop_by_hop( line, name_len ) ) {
+            continue;
+        }
+        if ( name_len == 14 && strncasecmp( line, "Content-Length", 14 ) == 0 ) {
+            has_length = true;
+            m_length = strtoull( std::string( value, value_len ).c_str(), NULL, 10 );
+        } else if ( name_len == 8 && strncasecmp( line, "Location", 8 ) == 0 ) {
+            location = true;
+        }
+        fields.append( line, len );
+        fields += "\r\n";
+    }
+    if ( status == 0 ) {
+        status = location ? 302 : 200;
+    }
+    if ( status < 200 || status > 999 ) {
+        return -1;
+    }
+    if ( title.empty() ) {
+        title = status_title( status );
+    }
+    m_no_body = m_head_request || status == 204 || status == 304;
+    m_chunked = !has_length && !m_no_body;
+    char line[ 64 ];
+    snprintf( line, sizeof( line ), "HTTP/1.1 %d ", status );
+    out += line;
+    out += title;
+    out += "\r\n";
+    out += fields;
+    if ( m_chunked ) {
+        out += "Transfer-Encoding: chunked\r\n";
+    }
+    out += m_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    m_started = true;
+    if ( m_head.size() > head_len ) {
+        body( m_head.data() + head_len, m_head.size() - head_len, out );
+    }
+    std::string().swap( m_head );
+    return 0;
+}
+
+void fastcgi_response::body( const char* p, size_t n, std::string& out ) {
+    if ( m_no_body || n == 0 ) {
+        return;
+    }
+    if ( m_chunked ) {
+        char size[ 24 ];
+        snprintf( size, sizeof( size ), "%zx\r\n", n );
+        out += size;
+        out.append( p, n );
+        out += "\r\n";
+        return;
+    }
+    // 超出 Content-Length 的部分丢掉
+    size_t take = m_length - m_sent < n ? m_length - m_sent : n;
+    out.append( p, take );
+    m_sent += take;
+}
+
+fastcgi_exchange::fastcgi_exchange( int route, const http_request& req, char* buf, bool keep_alive,
+                                    microcache_capture* capture )
+    : route( route ), req( req ), buf( buf ), capture( capture ), has_body( req.chunked || req.content_length > 0 ),
+      pre_len( 0 ), remaining( 0 ), expect_continue( false ), continue_sent( false ), body_streamed( false ),
+      keep_alive( keep_alive ), up( -1 ), start( 0 ), attempt( 0 ), answered( false ),
+      resp( req.method == http_request::HEAD, keep_alive ) {}
+
+int fastcgi_exchange::begin( const std::vector< const char* >& headers, const sockaddr_in& client, int client_fd,
+                             const char* pre, size_t pre_bytes ) {
+    // 应用需要事先知道 CONTENT_LENGTH，不接受 chunked 的请求体
+    if ( req.chunked || !fastcgi_request_head( head, req.method_name, req.url, headers, client, client_fd,
+                                               req.content_length, expect_continue ) ) {
+        keep_alive = keep_alive && !has_body;
+        return 400;
+    }
+    fastcgi_count( FASTCGI_REQUESTS );
+    pre_len = pre_bytes < ( size_t )req.content_length ? pre_bytes : req.content_length;
+    remaining = req.content_length - pre_len;
+    // 读缓冲区中的请求体分成 FCGI_STDIN 记录跟在请求头后面，一起发出；都在这里时再加上表示结束的空记录
+    // （没有请求体时 fastcgi_request_head 已经加上了）
+    for ( size_t off = 0; off < pre_len; ) {
+        size_t n = pre_len - off < FASTCGI_MAX_CONTENT ? pre_len - off : FASTCGI_MAX_CONTENT;
+        append_record( head, FCGI_STDIN, pre + off, n );
+        off += n;
+    }
+    if ( has_body && remaining == 0 ) {
+        append_record( head, FCGI_STDIN, NULL, 0 );
+    }
+    up = proxy_pick( route, req.url );
+    if ( up < 0 ) {
+        // 所有应用服务器都满了，不排队
+        fastcgi_count( FASTCGI_BUSY );
+        keep_alive = keep_alive && !has_body;
+        return 503;
+    }
+    start = proxy_begin( route, up );
+    return 0;
+}
+
+bool fastcgi_exchange::need_continue() {
+    if ( !expect_continue || continue_sent || remaining == 0 ) {
+        return false;
+    }
+    continue_sent = true;
+    return true;
+}
+
+int fastcgi_exchange::connect_failed( ssize_t err ) {
+    fastcgi_count( err == -ETIMEDOUT ? FASTCGI_ERR_TIMEOUT : FASTCGI_ERR_CONNECT );
+    keep_alive = keep_alive && !has_body;
+    return err == -ETIMEDOUT ? 504 : 502;
+}
+
+size_t fastcgi_exchange::body_want() const {
+    // 前后各留一个记录头的位置
+    size_t want = PROXY_BUFFER_SIZE - 2 * FASTCGI_HEADER_LEN;
+    return remaining < want ? remaining : want;
+}
+
+size_t fastcgi_exchange::stdin_record( size_t n ) {
+    body_streamed = true;
+    remaining -= n;
+    fastcgi_stdin_header( buf, n );
+    if ( remaining > 0 ) {
+        return FASTCGI_HEADER_LEN + n;
+    }
+    fastcgi_stdin_header( buf + FASTCGI_HEADER_LEN + n, 0 );
+    return 2 * FASTCGI_HEADER_LEN + n;
+}
+
+int fastcgi_exchange::feed( size_t n, std::string& out ) {
+    if ( !answered ) {
+        answered = true;
+        proxy_answered( route, up, start );
+    }
+    if ( resp.feed( buf, n, out ) < 0 ) {
+        return -EPROTO;
+    }
+    if ( capture && !out.empty() ) {
+        capture->add( out.data(), out.size() );
+    }
+    return 0;
+}
+
+bool fastcgi_exchange::retry( ssize_t err, bool reused ) {
+    // 复用的连接可能恰好被应用服务器关闭，还没有收到输出、请求体也还没有读走时换新连接
+    if ( resp.started() || !reused || attempt > 0 || answered || body_streamed || err == -ETIMEDOUT ) {
+        return false;
+    }
+    proxy_count( PROXY_RETRIES );
+    ++attempt;
+    return true;
+}
+
+int fastcgi_exchange::failed( ssize_t err ) {
+    proxy_end( route, up, err == -ETIMEDOUT ? PROXY_RESULT_DOWN : PROXY_RESULT_ERROR );
+    if ( resp.started() ) {
+        // 响应已经开始发送，只能关闭两边的连接
+        fastcgi_count( err == -ETIMEDOUT ? FASTCGI_ERR_TIMEOUT : FASTCGI_ERR_UPSTREAM );
+        keep_alive = false;
+        return 0;
+    }
+    keep_alive = keep_alive && !has_body;
+    if ( resp.overloaded() ) {
+        fastcgi_count( FASTCGI_OVERLOADED );
+        return 503;
+    }
+    fastcgi_count( err == -ETIMEDOUT ? FASTCGI_ERR_TIMEOUT : FASTCGI_ERR_UPSTREAM );
+    return err == -ETIMEDOUT ? 504 : 502;
+}
+
+void fastcgi_exchange::finish( int fd ) {
+    proxy_end( route, up, PROXY_RESULT_OK );
+    proxy_put( route, up, fd, resp.reusable() );
+    keep_alive = resp.keep_alive();
+    if ( capture ) {
+        capture->complete = true;
+    }
+}
+
+void fastcgi_count( int stat ) {
+    fastcgi_stats[ stat ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+void fastcgi_metrics( std::string& out ) {
+    bool any = false;
+    for ( size_t i = 0; i < proxy_routes.size(); ++i ) {
+        any = any || proxy_routes[i].fastcgi;
+    }
+    if ( !any ) {
+        return;
+    }
+    metrics_header( out, "webserver_fastcgi_requests_total", "counter", "Requests passed to a FastCGI application server." );
+    metrics_counter( out, "webserver_fastcgi_requests_total", NULL, fastcgi_stats[ FASTCGI_REQUESTS ].load() );
+    metrics_header( out, "webserver_fastcgi_rejected_total", "counter", "Requests answered with 503, by reason." );
+    metrics_counter( out, "webserver_fastcgi_rejected_total", "reason=\"busy\"", fastcgi_stats[ FASTCGI_BUSY ].load() );
+    metrics_counter( out, "webserver_fastcgi_rejected_total", "reason=\"overloaded\"", fastcgi_stats[ FASTCGI_OVERLOADED ].load() );
+    metrics_header( out, "webserver_fastcgi_stderr_records_total", "counter", "FCGI_STDERR records written to the server log." );
+    metrics_counter( out, "webserver_fastcgi_stderr_records_total", NULL, fastcgi_stats[ FASTCGI_STDERR ].load() );
+    metrics_header( out, "webserver_fastcgi_errors_total", "counter", "FastCGI requests that failed, by cause." );
+    metrics_counter( out, "webserver_fastcgi_errors_total", "cause=\"connect\"", fastcgi_stats[ FASTCGI_ERR_CONNECT ].load() );
+    metrics_counter( out, "webserver_fastcgi_errors_total", "cause=\"timeout\"", fastcgi_stats[ FASTCGI_ERR_TIMEOUT ].load() );
+    metrics_counter( out, "webserver_fastcgi_errors_total", "cause=\"upstream\"", fastcgi_stats[ FASTCGI_ERR_UPSTREAM ].load() );
+}
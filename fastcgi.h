@@ -0,0 +1,136 @@
+#ifndef FASTCGI_H
+#define FASTCGI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include "proxy.h"
+#include "http_request.h"
+
+/*
+    FastCGI：URL 以某个前缀开头的请求交给本机的应用服务器进程池（php-fpm 这一类）执行，例如
+        fastcgi = /app=unix:/run/php-fpm.sock,/v2=127.0.0.1:9000|127.0.0.1:9001
+    写法和 proxy 相同，路由也放在 proxy_routes 中，共用前缀匹配、负载均衡、被动健康检查和 keep-alive 连接池。
+
+    每个请求是一个带 FCGI_KEEP_CONN 的 FCGI_RESPONDER 请求，应用服务器处理完不关闭连接，连接放回连接池。
+    php-fpm 不支持在一个连接上同时进行多个请求（FCGI_MPXS_CONNS 为0），所以一个连接同一时间只承载一个请求，
+    并发的请求分散在连接池中的多个持久连接上。
+    SCRIPT_FILENAME 是 fastcgi_root（默认为 doc_root）加上URL的路径，请求头按 CGI 的规则变成 HTTP_* 参数，
+    不传 HTTP_PROXY（httpoxy）。请求体需要 Content-Length，不接受 chunked。
+
+    应用的输出（FCGI_STDOUT）边收边发给客户端：CGI 响应头中的 Status 变成状态行，有 Content-Length 时
+    响应体原样转发，否则用 chunked 发送。FCGI_STDERR 写到服务器的标准错误输出。
+
+    背压：每个应用服务器同时进行的请求数不超过 fastcgi_max_conns，都满了时直接回复503（带 Retry-After），
+    而不是让请求在应用服务器的 listen 队列里排队直到超时；应用服务器回复 FCGI_OVERLOADED 时同样回复503。
+    持久连接会一直占着 php-fpm 的一个工作进程，pm.max_children 应不少于 fastcgi_max_conns 加上空闲连接数（proxy_idle）。
+*/
+
+extern std::string fastcgi_root;    // SCRIPT_FILENAME 的前缀
+
+// 解析 "前缀=地址|地址,..."，追加到 routes（proxy_routes）后面，前缀不能和已有的路由重复；
+// max_conns 为每个应用服务器同时进行的请求数上限，0 表示不限
+bool fastcgi_parse( const char* spec, int max_conns, std::vector< proxy_route >& routes, std::string& err );
+
+// 记录头的长度，一个记录的内容最多 FASTCGI_MAX_CONTENT 字节
+static const size_t FASTCGI_HEADER_LEN = 8;
+static const size_t FASTCGI_MAX_CONTENT = 65535;
+
+// 生成 FCGI_BEGIN_REQUEST 和 FCGI_PARAMS 记录，content_length 为0时再加上表示请求体结束的空 FCGI_STDIN。
+// headers 是客户端的请求头（"Name: value"），client_fd 用来取 SERVER_ADDR/SERVER_PORT，
+// expect_continue 返回客户端是否在等待 100 Continue。路径中有 ".." 时返回false
+bool fastcgi_request_head( std::string& out, const char* method, const char* url, const std::vector< const char* >& headers,
+                           const sockaddr_in& client, int client_fd, long content_length, bool& expect_continue );
+// 在 hdr 处写 FCGI_STDIN 的记录头，内容是紧接着的 len 字节，len 为0表示请求体结束
+void fastcgi_stdin_header( char* hdr, size_t len );
+
+// 把应用服务器发来的记录流转换成发给客户端的 HTTP 响应
+class fastcgi_response {
+public:
+    fastcgi_response( bool head_request, bool keep_alive );
+    // 处理从应用服务器读到的 [p, p + n)，要发给客户端的数据追加到 out；
+    // 应用的输出不正确、或者还没有输出就结束了时返回-1
+    int feed( const char* p, size_t n, std::string& out );
+    bool started() const { return m_started; }          // 已经生成了响应头，之后出错只能关闭连接
+    bool done() const { return m_done; }                // 收到了 FCGI_END_REQUEST
+    bool overloaded() const { return m_overloaded; }    // 应用服务器拒绝了请求（FCGI_OVERLOADED 等）
+    bool keep_alive() const { return m_keep_alive; }    // 响应发完后客户端连接是否保持
+    bool reusable() const { return m_done && m_clean; } // 到应用服务器的连接能否放回连接池
+
+private:
+    int content( const char* p, size_t n, std::string& out );
+    int end_record( std::string& out );
+    int start( size_t head_len, std::string& out );
+    void body( const char* p, size_t n, std::string& out );
+
+    bool m_head_request;
+    bool m_keep_alive;
+    bool m_started;
+    bool m_done;
+    bool m_overloaded;
+    bool m_clean;
+    bool m_no_body;                 // HEAD、204、304 没有响应体
+    bool m_chunked;                 // 应用没有给出 Content-Length，用 chunked 发送
+    uint64_t m_length;              // 应用给出的 Content-Length
+    uint64_t m_sent;
+    std::string m_head;             // 还没有收完的 CGI 响应头
+    unsigned char m_header[ FASTCGI_HEADER_LEN ];  // 当前记录的记录头
+    size_t m_header_len;
+    size_t m_content;               // 当前记录还没有处理的内容
+    size_t m_padding;
+    unsigned char m_end[ 8 ];       // FCGI_END_REQUEST 的内容
+    size_t m_end_len;
+};
+
+// 一次 FastCGI 请求中不读写套接字的部分，和 proxy_exchange 一样由两种模式的驱动方共用，顺序是
+//     begin；连接应用服务器，失败时 connect_failed；发送 head（含读缓冲区中的请求体）；
+//     remaining 不为0时从客户端读 body_want 字节到 buf + FASTCGI_HEADER_LEN，发送 stdin_record 返回的长度；
+//     读应用的输出到 buf 交给 feed，发送 out，直到 done；出错时 retry 或 failed；成功时 finish
+struct fastcgi_exchange {
+    // 参数与 proxy_exchange 相同；keep_alive 要事先考虑服务器是否正在退出，生成响应头时就要用到
+    fastcgi_exchange( int route, const http_request& req, char* buf, bool keep_alive, microcache_capture* capture );
+    // 生成请求记录并选择应用服务器，pre 是读缓冲区中请求头之后已经读到的 pre_bytes 字节。
+    // 返回0，或者应该回复客户端的状态码：400（chunked 的请求体、路径中有 ".."），503（应用服务器都满了）
+    int begin( const std::vector< const char* >& headers, const sockaddr_in& client, int client_fd, const char* pre,
+               size_t pre_bytes );
+    bool need_continue();
+    int connect_failed( ssize_t err );
+    size_t body_want() const;
+    // 从客户端读到了 n 字节请求体，加上记录头（请求体结束时再加上空的 FCGI_STDIN），返回从 buf 开始要发送的长度
+    size_t stdin_record( size_t n );
+    // 处理从应用服务器读到 buf 中的 n 字节，要发给客户端的数据放在 out；输出不正确时返回 -EPROTO
+    int feed( size_t n, std::string& out );
+    bool done() const { return resp.done(); }
+    bool retry( ssize_t err, bool reused );
+    // 不再重试：还没有开始回复时返回502、503或504；已经开始回复时返回0，之后关闭客户端连接
+    int failed( ssize_t err );
+    void finish( int fd );
+
+    int route;
+    const http_request& req;
+    char* buf;
+    microcache_capture* capture;
+    std::string head;           // FCGI_BEGIN_REQUEST、FCGI_PARAMS 和读缓冲区中的请求体
+    bool has_body;
+    size_t pre_len;             // 读缓冲区中属于请求体的字节数
+    uint64_t remaining;         // 请求体中还要从客户端读的字节数
+    bool expect_continue;
+    bool continue_sent;
+    bool body_streamed;
+    bool keep_alive;
+    int up;
+    uint64_t start;
+    int attempt;
+    bool answered;
+    fastcgi_response resp;
+};
+
+// FastCGI 的统计
+enum FASTCGI_STAT { FASTCGI_REQUESTS = 0, FASTCGI_BUSY, FASTCGI_OVERLOADED, FASTCGI_STDERR, FASTCGI_ERR_CONNECT,
+                    FASTCGI_ERR_TIMEOUT, FASTCGI_ERR_UPSTREAM, FASTCGI_STAT_COUNT };
+void fastcgi_count( int stat );
+void fastcgi_metrics( std::string& out );
+
+#endif
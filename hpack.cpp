@@ -0,0 +1,424 @@
+#include <string.h>
+#include "hpack.h"
+
+// 解码器接受的动态表上限，就是默认的 SETTINGS_HEADER_TABLE_SIZE，我们不发送这个设置
+static const size_t TABLE_MAX = 4096;
+static const size_t ENTRY_OVERHEAD = 32;
+
+struct static_entry {
+    const char* name;
+    const char* value;
+};
+
+// RFC 7541 附录 A，下标从1开始
+static const static_entry static_table[] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+static const size_t STATIC_COUNT = sizeof( static_table ) / sizeof( static_table[0] );
+
+struct huffman_code {
+    uint32_t code;
+    int bits;
+};
+
+// RFC 7541 附录 B，下标为符号，256 是 EOS。码是规范的：按长度、再按符号的顺序递增
+static const huffman_code huffman_table[ 257 ] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+// 规范 Huffman 码的解码表：长度为 len 的码从 first[len] 开始连续分配，对应 symbols 中 offset[len] 开始的符号
+struct huffman_decode_table {
+    uint32_t first[ 31 ];
+    uint16_t count[ 31 ];
+    uint16_t offset[ 31 ];
+    uint16_t symbols[ 257 ];
+};
+
+static huffman_decode_table build_decode_table() {
+    huffman_decode_table t;
+    memset( &t, 0, sizeof( t ) );
+    for ( int s = 0; s < 257; ++s ) {
+        t.count[ huffman_table[s].bits ]++;
+    }
+    uint16_t next = 0;
+    for ( int len = 1; len <= 30; ++len ) {
+        t.offset[ len ] = next;
+        next += t.count[ len ];
+    }
+    uint16_t fill[ 31 ];
+    memcpy( fill, t.offset, sizeof( fill ) );
+    for ( int len = 1; len <= 30; ++len ) {
+        for ( int s = 0; s < 257; ++s ) {
+            if ( huffman_table[s].bits == len ) {
+                if ( fill[ len ] == t.offset[ len ] ) {
+                    t.first[ len ] = huffman_table[s].code;
+                }
+                t.symbols[ fill[ len ]++ ] = s;
+            }
+        }
+    }
+    return t;
+}
+
+size_t hpack_huffman_length( const std::string& s ) {
+    uint64_t bits = 0;
+    for ( size_t i = 0; i < s.size(); ++i ) {
+        bits += huffman_table[ ( unsigned char )s[i] ].bits;
+    }
+    return ( bits + 7 ) / 8;
+}
+
+void hpack_huffman_encode( const std::string& s, std::string& out ) {
+    uint64_t acc = 0;
+    int n = 0;
+    for ( size_t i = 0; i < s.size(); ++i ) {
+        const huffman_code& c = huffman_table[ ( unsigned char )s[i] ];
+        acc = ( acc << c.bits ) | c.code;
+        n += c.bits;
+        while ( n >= 8 ) {
+            n -= 8;
+            out += ( char )( acc >> n );
+        }
+        acc &= ( 1u << n ) - 1;
+    }
+    // 最后不满一个字节的部分用 EOS 的前缀（全1）填充
+    if ( n > 0 ) {
+        out += ( char )( ( acc << ( 8 - n ) ) | ( 0xff >> n ) );
+    }
+}
+
+bool hpack_huffman_decode( const unsigned char* p, size_t len, std::string& out ) {
+    static const huffman_decode_table t = build_decode_table();
+    uint32_t code = 0;
+    int bits = 0;
+    for ( size_t i = 0; i < len; ++i ) {
+        for ( int b = 7; b >= 0; --b ) {
+            code = ( code << 1 ) | ( ( p[i] >> b ) & 1 );
+            ++bits;
+            if ( code - t.first[ bits ] < t.count[ bits ] ) {
+                uint16_t sym = t.symbols[ t.offset[ bits ] + code - t.first[ bits ] ];
+                if ( sym == 256 ) {
+                    return false;
+                }
+                out += ( char )sym;
+                code = 0;
+                bits = 0;
+            } else if ( bits == 30 ) {
+                return false;
+            }
+        }
+    }
+    // 填充不超过7位，而且全是1
+    return bits <= 7 && code == ( 1u << bits ) - 1;
+}
+
+// 整数：前缀 prefix 位放得下时直接放，否则前缀全1，余下的每7位一个字节
+static void put_int( std::string& out, unsigned char flags, int prefix, uint64_t v ) {
+    uint64_t max = ( 1u << prefix ) - 1;
+    if ( v < max ) {
+        out += ( char )( flags | v );
+        return;
+    }
+    out += ( char )( flags | max );
+    v -= max;
+    while ( v >= 128 ) {
+        out += ( char )( ( v & 0x7f ) | 0x80 );
+        v >>= 7;
+    }
+    out += ( char )v;
+}
+
+static bool get_int( const unsigned char*& p, const unsigned char* end, int prefix, uint64_t& v ) {
+    if ( p >= end ) {
+        return false;
+    }
+    uint64_t max = ( 1u << prefix ) - 1;
+    v = *p++ & max;
+    if ( v < max ) {
+        return true;
+    }
+    for ( int shift = 0; p < end && shift <= 28; shift += 7 ) {
+        unsigned char b = *p++;
+        v += ( uint64_t )( b & 0x7f ) << shift;
+        if ( !( b & 0x80 ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void put_string( std::string& out, const std::string& s ) {
+    size_t h = hpack_huffman_length( s );
+    if ( h < s.size() ) {
+        put_int( out, 0x80, 7, h );
+        hpack_huffman_encode( s, out );
+    } else {
+        put_int( out, 0, 7, s.size() );
+        out += s;
+    }
+}
+
+static bool get_string( const unsigned char*& p, const unsigned char* end, std::string& out ) {
+    if ( p >= end ) {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if ( !get_int( p, end, 7, len ) || len > ( uint64_t )( end - p ) ) {
+        return false;
+    }
+    out.clear();
+    if ( huffman ) {
+        if ( !hpack_huffman_decode( p, len, out ) ) {
+            return false;
+        }
+    } else {
+        out.assign( ( const char* )p, len );
+    }
+    p += len;
+    return true;
+}
+
+void hpack_table::evict( size_t max ) {
+    while ( m_size > max && !m_entries.empty() ) {
+        m_size -= m_entries.back().name.size() + m_entries.back().value.size() + ENTRY_OVERHEAD;
+        m_entries.pop_back();
+    }
+}
+
+void hpack_table::add( const std::string& name, const std::string& value ) {
+    size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+    // 比整个表还大的条目：清空动态表，不插入
+    if ( size > m_max ) {
+        evict( 0 );
+        return;
+    }
+    evict( m_max - size );
+    hpack_header h;
+    h.name = name;
+    h.value = value;
+    m_entries.push_front( h );
+    m_size += size;
+}
+
+void hpack_table::resize( size_t max ) {
+    m_max = max;
+    evict( max );
+}
+
+const hpack_header* hpack_table::get( size_t index ) const {
+    return index >= 1 && index <= m_entries.size() ? &m_entries[ index - 1 ] : NULL;
+}
+
+size_t hpack_table::find( const std::string& name, const std::string& value, size_t& name_index ) const {
+    name_index = 0;
+    for ( size_t i = 0; i < STATIC_COUNT; ++i ) {
+        if ( name == static_table[i].name ) {
+            if ( value == static_table[i].value ) {
+                return i + 1;
+            }
+            if ( !name_index ) {
+                name_index = i + 1;
+            }
+        }
+    }
+    for ( size_t i = 0; i < m_entries.size(); ++i ) {
+        if ( m_entries[i].name == name ) {
+            if ( m_entries[i].value == value ) {
+                return STATIC_COUNT + i + 1;
+            }
+            if ( !name_index ) {
+                name_index = STATIC_COUNT + i + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static bool lookup( const hpack_table& table, uint64_t index, hpack_header& h ) {
+    if ( index >= 1 && index <= STATIC_COUNT ) {
+        h.name = static_table[ index - 1 ].name;
+        h.value = static_table[ index - 1 ].value;
+        return true;
+    }
+    const hpack_header* e = index > STATIC_COUNT ? table.get( index - STATIC_COUNT ) : NULL;
+    if ( !e ) {
+        return false;
+    }
+    h = *e;
+    return true;
+}
+
+bool hpack_decoder::decode( const unsigned char* p, size_t len, std::vector< hpack_header >& out, size_t max_list ) {
+    const unsigned char* end = p + len;
+    size_t total = 0;
+    while ( p < end ) {
+        unsigned char b = *p;
+        hpack_header h;
+        if ( b & 0x80 ) {
+            // 下标
+            uint64_t index;
+            if ( !get_int( p, end, 7, index ) || !lookup( m_table, index, h ) ) {
+                return false;
+            }
+        } else if ( ( b & 0xe0 ) == 0x20 ) {
+            // 动态表大小更新
+            uint64_t size;
+            if ( !get_int( p, end, 5, size ) || size > TABLE_MAX ) {
+                return false;
+            }
+            m_table.resize( size );
+            continue;
+        } else {
+            // 字面量：01 加入动态表，0000 不加入，0001 永不加入（转发时也不能加入，我们不转发）
+            bool index = b & 0x40;
+            uint64_t name_index;
+            if ( !get_int( p, end, index ? 6 : 4, name_index ) ) {
+                return false;
+            }
+            if ( name_index ) {
+                hpack_header n;
+                if ( !lookup( m_table, name_index, n ) ) {
+                    return false;
+                }
+                h.name = n.name;
+            } else if ( !get_string( p, end, h.name ) ) {
+                return false;
+            }
+            if ( !get_string( p, end, h.value ) ) {
+                return false;
+            }
+            if ( index ) {
+                m_table.add( h.name, h.value );
+            }
+        }
+        total += h.name.size() + h.value.size() + ENTRY_OVERHEAD;
+        if ( total > max_list ) {
+            return false;
+        }
+        out.push_back( h );
+    }
+    return true;
+}
+
+void hpack_encoder::set_max_size( size_t max ) {
+    if ( max > TABLE_MAX ) {
+        max = TABLE_MAX;
+    }
+    if ( max == m_table.max_size() ) {
+        return;
+    }
+    // 两个头部块之间对端可能先缩小再放大：要先发最小的值，对端才会和我们淘汰同样的条目
+    if ( !m_pending_resize || max < m_min_size ) {
+        m_min_size = max;
+    }
+    m_pending_resize = true;
+    m_table.resize( max );
+}
+
+void hpack_encoder::begin( std::string& out ) {
+    if ( !m_pending_resize ) {
+        return;
+    }
+    if ( m_min_size < m_table.max_size() ) {
+        put_int( out, 0x20, 5, m_min_size );
+    }
+    put_int( out, 0x20, 5, m_table.max_size() );
+    m_pending_resize = false;
+}
+
+void hpack_encoder::encode( const std::string& name, const std::string& value, bool index, std::string& out ) {
+    size_t name_index;
+    size_t i = m_table.find( name, value, name_index );
+    if ( i ) {
+        put_int( out, 0x80, 7, i );
+        return;
+    }
+    put_int( out, index ? 0x40 : 0, index ? 6 : 4, name_index );
+    if ( !name_index ) {
+        put_string( out, name );
+    }
+    put_string( out, value );
+    if ( index ) {
+        m_table.add( name, value );
+    }
+}
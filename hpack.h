@@ -0,0 +1,76 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+/*
+    HPACK（RFC 7541）：HTTP/2 的头部压缩，供 http2.h 使用
+    头部块由若干条表示组成：静态表或动态表中的下标、字面量（名字可以是下标），字面量可以用 Huffman 编码。
+    动态表的内容由编码的一方决定，两边按头部块的顺序做同样的插入和淘汰，所以头部块必须按发送的顺序编码、
+    按收到的顺序解码。
+    解码器的动态表上限是我们的 SETTINGS_HEADER_TABLE_SIZE（默认4096）；编码器的上限跟随对端的设置，
+    变小时在下一个头部块的开头发送动态表大小更新。
+    编码器把 content-length、etag 这类每个响应都不同的值用"不索引"的字面量发送，避免把动态表中有用的条目挤掉。
+*/
+
+struct hpack_header {
+    std::string name;       // 小写
+    std::string value;
+};
+
+// 动态表：新条目在前，每个条目的大小为名字和值的长度加32
+class hpack_table {
+public:
+    hpack_table() : m_size( 0 ), m_max( 4096 ) {}
+    void add( const std::string& name, const std::string& value );
+    void resize( size_t max );
+    size_t max_size() const { return m_max; }
+    // 下标从1开始（在静态表之后的部分减去61）
+    const hpack_header* get( size_t index ) const;
+    // 找完全相同的条目，没有时 name_index 为名字相同的条目（都没有时为0）；返回包括静态表在内的下标，0 表示没有
+    size_t find( const std::string& name, const std::string& value, size_t& name_index ) const;
+
+private:
+    void evict( size_t max );
+    std::deque< hpack_header > m_entries;
+    size_t m_size;
+    size_t m_max;
+};
+
+class hpack_decoder {
+public:
+    // 解码一个完整的头部块（HEADERS 加上所有 CONTINUATION），解码后的头部总大小超过 max_list 或格式不对时返回false，
+    // 之后连接必须以 COMPRESSION_ERROR 关闭
+    bool decode( const unsigned char* p, size_t len, std::vector< hpack_header >& out, size_t max_list );
+
+private:
+    hpack_table m_table;
+};
+
+class hpack_encoder {
+public:
+    hpack_encoder() : m_pending_resize( false ), m_min_size( 0 ) {}
+    // 对端的 SETTINGS_HEADER_TABLE_SIZE，我们最多用4096
+    void set_max_size( size_t max );
+    // 开始一个头部块
+    void begin( std::string& out );
+    // name 为小写；index 为false时不放进动态表
+    void encode( const std::string& name, const std::string& value, bool index, std::string& out );
+
+private:
+    hpack_table m_table;
+    bool m_pending_resize;      // 下一个头部块的开头要发送动态表大小更新
+    size_t m_min_size;          // 上一个头部块之后对端设置过的最小值
+};
+
+// Huffman 编码，字面量比原文短时使用
+size_t hpack_huffman_length( const std::string& s );
+void hpack_huffman_encode( const std::string& s, std::string& out );
+// 解码失败（非法的填充、出现 EOS）时返回false
+bool hpack_huffman_decode( const unsigned char* p, size_t len, std::string& out );
+
+#endif
@@ -0,0 +1,1063 @@
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include "http2.h"
+#include "http_request.h"
+#include "metrics.h"
+#include "bundle.h"
+#include "proxy.h"
+#include "ratelimit.h"
+
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_429_form;
+
+bool http2_enabled = true;
+int http2_max_streams = 128;
+
+// 帧类型
+enum {
+    H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE, H2_PING, H2_GOAWAY,
+    H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+// 标志
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+// 错误码
+enum {
+    H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM, H2_INADEQUATE_SECURITY, H2_HTTP_1_1_REQUIRED
+};
+
+#define H2_FRAME_MAX 16384              // 我们的 SETTINGS_MAX_FRAME_SIZE（默认值，不修改）
+#define H2_HEADER_LIST_MAX 65536        // 解码后的请求头总大小上限，也是头部块的上限
+#define H2_WINDOW_DEFAULT 65535
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_PRODUCE_LIMIT ( 512 * 1024 ) // 每次 produce 最多生成的字节数，发完再生成，内存占用有上限
+#define H2_IOV_MAX 128
+
+enum { STAT_PRIOR, STAT_UPGRADE, STAT_STREAMS, STAT_REFUSED, STAT_HTTP1, STAT_CLIENT_RESET, STAT_ERRORS, STAT_COUNT };
+static std::atomic< uint64_t > stats[ STAT_COUNT ];
+
+struct h2_stream {
+    uint32_t id;
+    bool remote_closed;         // 客户端发送了 END_STREAM
+    bool responded;             // 响应已经生成
+    bool headers_sent;
+    bool local_closed;          // 我们发送了 END_STREAM
+    int64_t window;             // 发送窗口
+    int status;
+    std::vector< hpack_header > response;       // :status 之外的响应头
+    const char* body;           // 响应体：资源包、mmap 的文件或者 dynamic
+    size_t body_len;
+    size_t sent;
+    void* map;
+    size_t map_len;
+    std::string dynamic;
+
+    h2_stream( uint32_t i, int64_t w )
+        : id( i ), remote_closed( false ), responded( false ), headers_sent( false ), local_closed( false ),
+          window( w ), status( 0 ), body( NULL ), body_len( 0 ), sent( 0 ), map( NULL ), map_len( 0 ) {}
+    ~h2_stream() {
+        if ( map ) {
+            munmap( map, map_len );
+        }
+    }
+};
+
+static uint32_t get32( const unsigned char* p ) {
+    return ( ( uint32_t )p[0] << 24 ) | ( ( uint32_t )p[1] << 16 ) | ( ( uint32_t )p[2] << 8 ) | p[3];
+}
+
+static void put32( unsigned char* p, uint32_t v ) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void erase_child( std::vector< uint32_t >& v, uint32_t id ) {
+    std::vector< uint32_t >::iterator it = std::find( v.begin(), v.end(), id );
+    if ( it != v.end() ) {
+        v.erase( it );
+    }
+}
+
+// HTTP2-Settings 的值：base64url，可以没有填充
+static bool base64url_decode( const char* s, size_t len, std::string& out ) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for ( size_t i = 0; i < len; ++i ) {
+        char c = s[i];
+        int v;
+        if ( c >= 'A' && c <= 'Z' ) {
+            v = c - 'A';
+        } else if ( c >= 'a' && c <= 'z' ) {
+            v = c - 'a' + 26;
+        } else if ( c >= '0' && c <= '9' ) {
+            v = c - '0' + 52;
+        } else if ( c == '-' ) {
+            v = 62;
+        } else if ( c == '_' ) {
+            v = 63;
+        } else if ( c == '=' ) {
+            break;
+        } else {
+            return false;
+        }
+        acc = ( acc << 6 ) | v;
+        bits += 6;
+        if ( bits >= 8 ) {
+            bits -= 8;
+            out += ( char )( acc >> bits );
+        }
+    }
+    return true;
+}
+
+bool h2_preface( const char* data, size_t len ) {
+    size_t n = len < sizeof( H2_PREFACE ) - 1 ? len : sizeof( H2_PREFACE ) - 1;
+    return memcmp( data, H2_PREFACE, n ) == 0;
+}
+
+// 在 "Name: value" 中取 value，line 以 \r 或 '\0' 结束
+static bool header_value( const char* line, const char* name, const char*& value, size_t& len ) {
+    size_t n = strlen( name );
+    if ( strncasecmp( line, name, n ) != 0 || line[n] != ':' ) {
+        return false;
+    }
+    value = line + n + 1;
+    value += strspn( value, " \t" );
+    len = strcspn( value, "\r\n" );
+    while ( len > 0 && ( value[ len - 1 ] == ' ' || value[ len - 1 ] == '\t' ) ) {
+        --len;
+    }
+    return true;
+}
+
+bool h2_upgrade_requested( const std::vector< const char* >& headers ) {
+    bool h2c = false;
+    bool settings = false;
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        const char* v;
+        size_t len;
+        if ( header_value( headers[i], "Upgrade", v, len ) ) {
+            h2c = len == 3 && strncasecmp( v, "h2c", 3 ) == 0;
+        } else if ( header_value( headers[i], "HTTP2-Settings", v, len ) ) {
+            settings = true;
+        }
+    }
+    return h2c && settings;
+}
+
+h2_session::h2_session( uint32_t ip )
+    : m_ip( ip ), m_preface( false ), m_settings( false ), m_greeted( false ), m_seg( 0 ), m_seg_off( 0 ),
+      m_block_stream( 0 ), m_block_end_stream( false ), m_block_parent( 0 ), m_block_weight( 16 ),
+      m_block_exclusive( false ), m_block_priority( false ), m_last_stream( 0 ), m_send_window( H2_WINDOW_DEFAULT ),
+      m_peer_window( H2_WINDOW_DEFAULT ), m_peer_frame( H2_FRAME_MAX ), m_recv_window( H2_WINDOW_DEFAULT ),
+      m_goaway( false ), m_peer_goaway( false ), m_dead( false ) {
+    node root;
+    root.parent = 0;
+    root.weight = 16;
+    root.cycle = 0;
+    m_nodes[ 0 ] = root;
+}
+
+h2_session::~h2_session() {
+    for ( std::unordered_map< uint32_t, h2_stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it ) {
+        delete it->second;
+    }
+    for ( size_t i = 0; i < m_retired.size(); ++i ) {
+        delete m_retired[i];
+    }
+}
+
+// 输出
+
+void h2_session::append( const void* p, size_t len ) {
+    size_t off = m_out.size();
+    m_out.append( ( const char* )p, len );
+    // 和上一段在 m_out 中相连时合并，少用 iovec
+    if ( !m_segs.empty() && !m_segs.back().ext && m_segs.back().off + m_segs.back().len == off ) {
+        m_segs.back().len += len;
+        return;
+    }
+    segment s = { NULL, off, len };
+    m_segs.push_back( s );
+}
+
+void h2_session::append_ext( const char* p, size_t len ) {
+    segment s = { p, 0, len };
+    m_segs.push_back( s );
+}
+
+void h2_session::frame( int type, int flags, uint32_t id, const void* payload, size_t len ) {
+    unsigned char h[9];
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32( h + 5, id );
+    append( h, 9 );
+    if ( len > 0 ) {
+        append( payload, len );
+    }
+}
+
+void h2_session::reset( uint32_t id, uint32_t code ) {
+    unsigned char p[4];
+    put32( p, code );
+    frame( H2_RST_STREAM, 0, id, p, 4 );
+}
+
+// 连接错误：发送 GOAWAY，之后不再处理收到的数据
+bool h2_session::fail( uint32_t code ) {
+    if ( !m_dead ) {
+        unsigned char p[8];
+        put32( p, m_last_stream );
+        put32( p + 4, code );
+        frame( H2_GOAWAY, 0, 0, p, 8 );
+        m_dead = true;
+        m_goaway = true;
+        stats[ STAT_ERRORS ].fetch_add( 1, std::memory_order_relaxed );
+    }
+    return false;
+}
+
+void h2_session::send_settings() {
+    unsigned char p[12];
+    p[0] = 0;
+    p[1] = 3;       // SETTINGS_MAX_CONCURRENT_STREAMS
+    put32( p + 2, http2_max_streams );
+    p[6] = 0;
+    p[7] = 6;       // SETTINGS_MAX_HEADER_LIST_SIZE
+    put32( p + 8, H2_HEADER_LIST_MAX );
+    frame( H2_SETTINGS, 0, 0, p, sizeof( p ) );
+    m_greeted = true;
+}
+
+void h2_session::shutdown() {
+    if ( m_goaway ) {
+        return;
+    }
+    unsigned char p[8];
+    put32( p, m_last_stream );
+    put32( p + 4, H2_NO_ERROR );
+    frame( H2_GOAWAY, 0, 0, p, 8 );
+    m_goaway = true;
+}
+
+bool h2_session::finished() const {
+    if ( m_seg < m_segs.size() ) {
+        return false;
+    }
+    return m_dead || ( ( m_goaway || m_peer_goaway ) && m_streams.empty() );
+}
+
+int h2_session::flush( int fd ) {
+    while ( true ) {
+        if ( m_seg == m_segs.size() ) {
+            // 之前的输出都发完了，可以释放已关闭的流，再生成下一批
+            m_segs.clear();
+            m_out.clear();
+            m_seg = 0;
+            m_seg_off = 0;
+            for ( size_t i = 0; i < m_retired.size(); ++i ) {
+                delete m_retired[i];
+            }
+            m_retired.clear();
+            if ( !m_dead ) {
+                produce();
+            }
+            if ( m_segs.empty() ) {
+                return 1;
+            }
+        }
+        struct iovec iov[ H2_IOV_MAX ];
+        int n = 0;
+        for ( size_t i = m_seg; i < m_segs.size() && n < H2_IOV_MAX; ++i, ++n ) {
+            const segment& g = m_segs[i];
+            const char* base = g.ext ? g.ext : m_out.data() + g.off;
+            size_t skip = i == m_seg ? m_seg_off : 0;
+            iov[n].iov_base = ( void* )( base + skip );
+            iov[n].iov_len = g.len - skip;
+        }
+        ssize_t w = writev( fd, iov, n );
+        if ( w < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        size_t left = w;
+        while ( left > 0 ) {
+            size_t rest = m_segs[ m_seg ].len - m_seg_off;
+            if ( left < rest ) {
+                m_seg_off += left;
+                break;
+            }
+            left -= rest;
+            ++m_seg;
+            m_seg_off = 0;
+        }
+    }
+}
+
+// 按优先级生成 HEADERS 和 DATA 帧，直到没有可发的流或者达到 H2_PRODUCE_LIMIT
+void h2_session::produce() {
+    size_t budget = H2_PRODUCE_LIMIT;
+    while ( budget > 0 ) {
+        h2_stream* s = pick( 0 );
+        if ( !s ) {
+            break;
+        }
+        if ( !s->headers_sent ) {
+            size_t before = m_out.size();
+            send_headers( s );
+            size_t n = m_out.size() - before;
+            budget = n < budget ? budget - n : 0;
+            continue;
+        }
+        size_t n = s->body_len - s->sent;
+        n = std::min( n, ( size_t )m_peer_frame );
+        n = std::min( n, budget );
+        n = std::min( n, ( size_t )s->window );
+        n = std::min( n, ( size_t )m_send_window );
+        bool last = s->sent + n == s->body_len;
+        unsigned char h[9];
+        h[0] = n >> 16;
+        h[1] = n >> 8;
+        h[2] = n;
+        h[3] = H2_DATA;
+        h[4] = last ? H2_END_STREAM : 0;
+        put32( h + 5, s->id );
+        append( h, 9 );
+        append_ext( s->body + s->sent, n );
+        s->sent += n;
+        s->window -= n;
+        m_send_window -= n;
+        budget -= n;
+        charge( s->id, n );
+        if ( last ) {
+            finish_stream( s );
+        }
+    }
+}
+
+bool h2_session::ready( const h2_stream* s ) const {
+    if ( !s->responded || s->local_closed ) {
+        return false;
+    }
+    return !s->headers_sent || ( s->window > 0 && m_send_window > 0 );
+}
+
+h2_stream* h2_session::stream( uint32_t id ) const {
+    std::unordered_map< uint32_t, h2_stream* >::const_iterator it = m_streams.find( id );
+    return it == m_streams.end() ? NULL : it->second;
+}
+
+// 在 id 的子树中选下一个发送的流：自己能发就发，否则按虚拟时间从小到大找子树
+h2_stream* h2_session::pick( uint32_t id ) {
+    if ( id != 0 ) {
+        h2_stream* s = stream( id );
+        if ( s && ready( s ) ) {
+            return s;
+        }
+    }
+    const node& n = m_nodes[ id ];
+    if ( n.children.empty() ) {
+        return NULL;
+    }
+    std::vector< std::pair< uint64_t, uint32_t > > order;
+    order.reserve( n.children.size() );
+    for ( size_t i = 0; i < n.children.size(); ++i ) {
+        order.push_back( std::make_pair( m_nodes[ n.children[i] ].cycle, n.children[i] ) );
+    }
+    std::sort( order.begin(), order.end() );
+    for ( size_t i = 0; i < order.size(); ++i ) {
+        h2_stream* s = pick( order[i].second );
+        if ( s ) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// 流发送了 n 个字节：它和所有祖先的虚拟时间按各自的权重增加
+void h2_session::charge( uint32_t id, size_t n ) {
+    while ( id != 0 ) {
+        node& x = m_nodes[ id ];
+        x.cycle += ( uint64_t )( n + 1 ) * 256 / x.weight;
+        id = x.parent;
+    }
+}
+
+// 依赖树
+
+void h2_session::tree_insert( uint32_t id, uint32_t parent, int weight, bool exclusive ) {
+    // 依赖不存在的节点时用默认优先级（RFC 7540 5.3.1）
+    if ( parent != 0 && m_nodes.find( parent ) == m_nodes.end() ) {
+        parent = 0;
+        weight = 16;
+        exclusive = false;
+    }
+    node n;
+    n.parent = parent;
+    n.weight = weight;
+    n.cycle = 0;
+    node& p = m_nodes[ parent ];
+    // 新节点从兄弟节点中最小的虚拟时间开始，不会因为来得晚而独占带宽
+    for ( size_t i = 0; i < p.children.size(); ++i ) {
+        uint64_t c = m_nodes[ p.children[i] ].cycle;
+        if ( i == 0 || c < n.cycle ) {
+            n.cycle = c;
+        }
+    }
+    if ( exclusive ) {
+        n.children.swap( p.children );
+        for ( size_t i = 0; i < n.children.size(); ++i ) {
+            m_nodes[ n.children[i] ].parent = id;
+        }
+    }
+    p.children.push_back( id );
+    m_nodes[ id ] = n;
+}
+
+void h2_session::tree_move( uint32_t id, uint32_t parent, int weight, bool exclusive ) {
+    if ( m_nodes.find( id ) == m_nodes.end() ) {
+        // 还没打开的流：客户端用来分组的占位节点，数量有上限
+        if ( m_nodes.size() <= ( size_t )http2_max_streams * 4 ) {
+            tree_insert( id, parent, weight, exclusive );
+        }
+        return;
+    }
+    if ( parent != 0 && m_nodes.find( parent ) == m_nodes.end() ) {
+        parent = 0;
+        weight = 16;
+        exclusive = false;
+    }
+    // 新的父节点在它的子树中时，先把父节点移到它原来的位置（RFC 7540 5.3.3）
+    for ( uint32_t a = parent; a != 0; a = m_nodes[ a ].parent ) {
+        if ( a == id ) {
+            node& p = m_nodes[ parent ];
+            erase_child( m_nodes[ p.parent ].children, parent );
+            p.parent = m_nodes[ id ].parent;
+            m_nodes[ p.parent ].children.push_back( parent );
+            break;
+        }
+    }
+    node& n = m_nodes[ id ];
+    erase_child( m_nodes[ n.parent ].children, id );
+    n.parent = parent;
+    n.weight = weight;
+    node& p = m_nodes[ parent ];
+    if ( exclusive ) {
+        for ( size_t i = 0; i < p.children.size(); ++i ) {
+            m_nodes[ p.children[i] ].parent = id;
+            n.children.push_back( p.children[i] );
+        }
+        p.children.clear();
+    }
+    p.children.push_back( id );
+}
+
+// 流关闭：子节点移到它的父节点下
+void h2_session::tree_remove( uint32_t id ) {
+    std::unordered_map< uint32_t, node >::iterator it = m_nodes.find( id );
+    if ( it == m_nodes.end() ) {
+        return;
+    }
+    uint32_t parent = it->second.parent;
+    node& p = m_nodes[ parent ];
+    erase_child( p.children, id );
+    for ( size_t i = 0; i < it->second.children.size(); ++i ) {
+        uint32_t c = it->second.children[i];
+        m_nodes[ c ].parent = parent;
+        p.children.push_back( c );
+    }
+    m_nodes.erase( it );
+}
+
+// 收到的帧
+
+bool h2_session::feed( const char* data, size_t len ) {
+    if ( m_dead ) {
+        return false;
+    }
+    // 没有上次剩下的半帧时直接在 data 上解析，只保存最后不完整的部分
+    const char* buf = data;
+    size_t size = len;
+    if ( !m_in.empty() ) {
+        m_in.append( data, len );
+        buf = m_in.data();
+        size = m_in.size();
+    }
+    size_t pos = 0;
+    if ( !m_preface ) {
+        size_t n = std::min( size, sizeof( H2_PREFACE ) - 1 );
+        if ( memcmp( buf, H2_PREFACE, n ) != 0 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        if ( n < sizeof( H2_PREFACE ) - 1 ) {
+            m_in.assign( buf, size );
+            return true;
+        }
+        m_preface = true;
+        pos = n;
+        if ( !m_greeted ) {
+            stats[ STAT_PRIOR ].fetch_add( 1, std::memory_order_relaxed );
+            send_settings();
+        }
+    }
+    bool ok = true;
+    while ( ok && size - pos >= 9 ) {
+        const unsigned char* h = ( const unsigned char* )buf + pos;
+        size_t flen = ( ( size_t )h[0] << 16 ) | ( h[1] << 8 ) | h[2];
+        if ( flen > H2_FRAME_MAX ) {
+            ok = fail( H2_FRAME_SIZE_ERROR );
+            break;
+        }
+        if ( size - pos - 9 < flen ) {
+            break;
+        }
+        pos += 9 + flen;
+        ok = handle_frame( h[3], h[4], get32( h + 5 ) & 0x7fffffff, h + 9, flen );
+    }
+    if ( !ok ) {
+        m_in.clear();
+        return false;
+    }
+    if ( buf == m_in.data() ) {
+        m_in.erase( 0, pos );
+    } else {
+        m_in.assign( buf + pos, size - pos );
+    }
+    return true;
+}
+
+bool h2_session::handle_frame( int type, int flags, uint32_t id, const unsigned char* p, size_t len ) {
+    // 头部块没有结束时只能是同一个流的 CONTINUATION
+    if ( m_block_stream != 0 && ( type != H2_CONTINUATION || id != m_block_stream ) ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    // 连接前言之后的第一帧必须是 SETTINGS
+    if ( !m_settings && type != H2_SETTINGS ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    switch ( type ) {
+    case H2_DATA:
+        return on_data( flags, id, p, len );
+    case H2_HEADERS:
+        return on_headers( flags, id, p, len );
+    case H2_PRIORITY: {
+        if ( id == 0 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        if ( len != 5 ) {
+            reset( id, H2_FRAME_SIZE_ERROR );
+            return true;
+        }
+        uint32_t dep = get32( p );
+        if ( ( dep & 0x7fffffff ) == id ) {
+            reset( id, H2_PROTOCOL_ERROR );
+            return true;
+        }
+        tree_move( id, dep & 0x7fffffff, p[4] + 1, dep >> 31 );
+        return true;
+    }
+    case H2_RST_STREAM: {
+        if ( id == 0 || id > m_last_stream ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        if ( len != 4 ) {
+            return fail( H2_FRAME_SIZE_ERROR );
+        }
+        h2_stream* s = stream( id );
+        if ( s ) {
+            stats[ STAT_CLIENT_RESET ].fetch_add( 1, std::memory_order_relaxed );
+            close_stream( s );
+        }
+        return true;
+    }
+    case H2_SETTINGS:
+        return on_settings( flags, id, p, len );
+    case H2_PUSH_PROMISE:
+        // 客户端不能推送
+        return fail( H2_PROTOCOL_ERROR );
+    case H2_PING:
+        if ( id != 0 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        if ( len != 8 ) {
+            return fail( H2_FRAME_SIZE_ERROR );
+        }
+        if ( !( flags & H2_ACK ) ) {
+            frame( H2_PING, H2_ACK, 0, p, 8 );
+        }
+        return true;
+    case H2_GOAWAY:
+        if ( id != 0 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        if ( len < 8 ) {
+            return fail( H2_FRAME_SIZE_ERROR );
+        }
+        m_peer_goaway = true;
+        return true;
+    case H2_WINDOW_UPDATE:
+        return on_window_update( id, p, len );
+    case H2_CONTINUATION:
+        if ( m_block_stream == 0 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        if ( m_block.size() + len > H2_HEADER_LIST_MAX ) {
+            return fail( H2_ENHANCE_YOUR_CALM );
+        }
+        m_block.append( ( const char* )p, len );
+        return ( flags & H2_END_HEADERS ) ? end_headers() : true;
+    default:
+        // 不认识的帧类型忽略
+        return true;
+    }
+}
+
+bool h2_session::on_data( int flags, uint32_t id, const unsigned char* p, size_t len ) {
+    if ( id == 0 ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    if ( ( flags & H2_PADDED ) && ( len == 0 || p[0] >= len ) ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    // 请求体不使用，读完就归还连接的窗口（填充也计入流量控制）
+    m_recv_window -= len;
+    if ( m_recv_window < 0 ) {
+        return fail( H2_FLOW_CONTROL_ERROR );
+    }
+    if ( m_recv_window <= H2_WINDOW_DEFAULT / 2 ) {
+        unsigned char inc[4];
+        put32( inc, H2_WINDOW_DEFAULT - m_recv_window );
+        frame( H2_WINDOW_UPDATE, 0, 0, inc, 4 );
+        m_recv_window = H2_WINDOW_DEFAULT;
+    }
+    h2_stream* s = stream( id );
+    if ( !s ) {
+        // 已经关闭（或者被我们重置）的流上的 DATA 忽略
+        return id > m_last_stream ? fail( H2_PROTOCOL_ERROR ) : true;
+    }
+    if ( s->remote_closed ) {
+        reset( id, H2_STREAM_CLOSED );
+        close_stream( s );
+        return true;
+    }
+    if ( flags & H2_END_STREAM ) {
+        s->remote_closed = true;
+    } else if ( len > 0 ) {
+        unsigned char inc[4];
+        put32( inc, len );
+        frame( H2_WINDOW_UPDATE, 0, id, inc, 4 );
+    }
+    return true;
+}
+
+bool h2_session::on_headers( int flags, uint32_t id, const unsigned char* p, size_t len ) {
+    if ( id == 0 || ( id & 1 ) == 0 ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    size_t pad = 0;
+    if ( flags & H2_PADDED ) {
+        if ( len < 1 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        pad = p[0];
+        ++p;
+        --len;
+    }
+    m_block_priority = ( flags & H2_PRIORITY_FLAG ) != 0;
+    if ( m_block_priority ) {
+        if ( len < 5 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        uint32_t dep = get32( p );
+        m_block_parent = dep & 0x7fffffff;
+        m_block_exclusive = dep >> 31;
+        m_block_weight = p[4] + 1;
+        p += 5;
+        len -= 5;
+    }
+    if ( pad > len ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    m_block_stream = id;
+    m_block_end_stream = ( flags & H2_END_STREAM ) != 0;
+    m_block.assign( ( const char* )p, len - pad );
+    return ( flags & H2_END_HEADERS ) ? end_headers() : true;
+}
+
+bool h2_session::end_headers() {
+    uint32_t id = m_block_stream;
+    m_block_stream = 0;
+    // 即使这个流不处理也要解码，保持动态表和客户端一致
+    std::vector< hpack_header > headers;
+    bool ok = m_decoder.decode( ( const unsigned char* )m_block.data(), m_block.size(), headers, H2_HEADER_LIST_MAX );
+    m_block.clear();
+    if ( !ok ) {
+        return fail( H2_COMPRESSION_ERROR );
+    }
+    h2_stream* s = stream( id );
+    if ( s ) {
+        // 已打开的流上只能是结束请求的 trailer，内容忽略
+        if ( s->remote_closed || !m_block_end_stream ) {
+            reset( id, s->remote_closed ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR );
+            close_stream( s );
+        } else {
+            s->remote_closed = true;
+        }
+        return true;
+    }
+    if ( id <= m_last_stream ) {
+        return fail( H2_STREAM_CLOSED );
+    }
+    m_last_stream = id;
+    if ( m_goaway ) {
+        // GOAWAY 之后的新流不处理
+        return true;
+    }
+    if ( m_block_priority && m_block_parent == id ) {
+        reset( id, H2_PROTOCOL_ERROR );
+        return true;
+    }
+    if ( m_streams.size() >= ( size_t )http2_max_streams ) {
+        stats[ STAT_REFUSED ].fetch_add( 1, std::memory_order_relaxed );
+        reset( id, H2_REFUSED_STREAM );
+        return true;
+    }
+    open_stream( id, m_block_end_stream, headers );
+    return true;
+}
+
+bool h2_session::on_settings( int flags, uint32_t id, const unsigned char* p, size_t len ) {
+    if ( id != 0 ) {
+        return fail( H2_PROTOCOL_ERROR );
+    }
+    if ( flags & H2_ACK ) {
+        return len == 0 ? true : fail( H2_FRAME_SIZE_ERROR );
+    }
+    if ( len % 6 != 0 ) {
+        return fail( H2_FRAME_SIZE_ERROR );
+    }
+    if ( !apply_settings( p, len ) ) {
+        return false;
+    }
+    m_settings = true;
+    frame( H2_SETTINGS, H2_ACK, 0, NULL, 0 );
+    return true;
+}
+
+bool h2_session::apply_settings( const unsigned char* p, size_t len ) {
+    for ( size_t i = 0; i + 6 <= len; i += 6 ) {
+        int key = ( p[i] << 8 ) | p[ i + 1 ];
+        uint32_t value = get32( p + i + 2 );
+        switch ( key ) {
+        case 1:         // SETTINGS_HEADER_TABLE_SIZE
+            m_encoder.set_max_size( value );
+            break;
+        case 2:         // SETTINGS_ENABLE_PUSH，我们不推送
+            if ( value > 1 ) {
+                return fail( H2_PROTOCOL_ERROR );
+            }
+            break;
+        case 4: {       // SETTINGS_INITIAL_WINDOW_SIZE，已打开的流的窗口按差值调整
+            if ( value > H2_WINDOW_MAX ) {
+                return fail( H2_FLOW_CONTROL_ERROR );
+            }
+            int64_t delta = ( int64_t )value - m_peer_window;
+            m_peer_window = value;
+            for ( std::unordered_map< uint32_t, h2_stream* >::iterator it = m_streams.begin(); it != m_streams.end();
+                  ++it ) {
+                it->second->window += delta;
+                if ( it->second->window > H2_WINDOW_MAX ) {
+                    return fail( H2_FLOW_CONTROL_ERROR );
+                }
+            }
+            break;
+        }
+        case 5:         // SETTINGS_MAX_FRAME_SIZE
+            if ( value < H2_FRAME_MAX || value > 0xffffff ) {
+                return fail( H2_PROTOCOL_ERROR );
+            }
+            m_peer_frame = value;
+            break;
+        default:        // SETTINGS_MAX_CONCURRENT_STREAMS 等只影响推送或者是建议，忽略
+            break;
+        }
+    }
+    return true;
+}
+
+bool h2_session::on_window_update( uint32_t id, const unsigned char* p, size_t len ) {
+    if ( len != 4 ) {
+        return fail( H2_FRAME_SIZE_ERROR );
+    }
+    uint32_t inc = get32( p ) & 0x7fffffff;
+    if ( id == 0 ) {
+        if ( inc == 0 ) {
+            return fail( H2_PROTOCOL_ERROR );
+        }
+        m_send_window += inc;
+        return m_send_window > H2_WINDOW_MAX ? fail( H2_FLOW_CONTROL_ERROR ) : true;
+    }
+    h2_stream* s = stream( id );
+    if ( !s ) {
+        return id > m_last_stream ? fail( H2_PROTOCOL_ERROR ) : true;
+    }
+    s->window += inc;
+    if ( inc == 0 || s->window > H2_WINDOW_MAX ) {
+        reset( id, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR );
+        close_stream( s );
+    }
+    return true;
+}
+
+// 流
+
+void h2_session::open_stream( uint32_t id, bool end_stream, const std::vector< hpack_header >& headers ) {
+    h2_stream* s = new h2_stream( id, m_peer_window );
+    s->remote_closed = end_stream;
+    m_streams[ id ] = s;
+    if ( m_block_priority ) {
+        tree_move( id, m_block_parent, m_block_weight, m_block_exclusive );
+    }
+    if ( m_nodes.find( id ) == m_nodes.end() ) {
+        tree_insert( id, 0, 16, false );
+    }
+    stats[ STAT_STREAMS ].fetch_add( 1, std::memory_order_relaxed );
+    respond( s, headers );
+}
+
+// 生成响应，内容和 HTTP/1.1 一样由 http_resolve 查找：指标、资源包、doc_root 中的文件
+void h2_session::respond( h2_stream* s, const std::vector< hpack_header >& headers ) {
+    const std::string* method = NULL;
+    const std::string* path = NULL;
+    const char* if_none_match = NULL;
+    bool accept_gzip = false;
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        const hpack_header& h = headers[i];
+        if ( h.name == ":method" ) {
+            method = &h.value;
+        } else if ( h.name == ":path" ) {
+            path = &h.value;
+        } else if ( h.name == "if-none-match" ) {
+            if_none_match = h.value.c_str();
+        } else if ( h.name == "accept-encoding" ) {
+            accept_gzip = bundle_accept_gzip( h.value.c_str() );
+        } else if ( h.name == "connection" ) {
+            // HTTP/2 中不能有连接相关的头部（RFC 7540 8.1.2.2）
+            method = NULL;
+            break;
+        }
+    }
+    if ( !method || !path || path->empty() ) {
+        reset( s->id, H2_PROTOCOL_ERROR );
+        close_stream( s );
+        return;
+    }
+    int status = 0;
+    int retry_after = 0;
+    if ( ratelimit_enabled() ) {
+        retry_after = ratelimit_request( m_ip, path->data(), path->size() );
+        if ( retry_after > 0 ) {
+            status = 429;
+        }
+    }
+    // 代理和 FastCGI 不经过 HTTP/2，让客户端用 HTTP/1.1 重试
+    if ( status == 0 && http_route( path->c_str() ) >= 0 ) {
+        stats[ STAT_HTTP1 ].fetch_add( 1, std::memory_order_relaxed );
+        reset( s->id, H2_HTTP_1_1_REQUIRED );
+        close_stream( s );
+        return;
+    }
+    bool head = *method == "HEAD";
+    if ( status == 0 && !head && *method != "GET" ) {
+        status = 400;
+    }
+    const char* type = "text/html";
+    if ( status == 0 ) {
+        http_content c;
+        status = http_resolve( path->c_str(), if_none_match, accept_gzip, c );
+        type = c.type;
+        if ( c.entry ) {
+            s->response.push_back( hpack_header{ "etag", bundle_etag( c.entry, c.gzip ) } );
+            if ( c.gzip ) {
+                s->response.push_back( hpack_header{ "content-encoding", "gzip" } );
+            }
+            if ( c.entry->gzip_size > 0 ) {
+                s->response.push_back( hpack_header{ "vary", "accept-encoding" } );
+            }
+            if ( status == 200 ) {
+                s->body = bundle_content( c.entry, c.gzip );
+                s->body_len = c.size;
+            }
+        } else if ( status == 200 && c.file_fd < 0 ) {
+            s->dynamic.swap( c.dynamic );
+            s->body = s->dynamic.data();
+            s->body_len = s->dynamic.size();
+        } else if ( status == 200 ) {
+            // doc_root 中的文件 mmap 后直接作为 DATA 的内容
+            if ( c.size > 0 ) {
+                void* map = mmap( 0, c.size, PROT_READ, MAP_PRIVATE, c.file_fd, 0 );
+                if ( map == MAP_FAILED ) {
+                    status = 404;
+                } else {
+                    s->map = map;
+                    s->map_len = c.size;
+                    s->body = ( const char* )map;
+                    s->body_len = c.size;
+                }
+            }
+            close( c.file_fd );
+        }
+    }
+    if ( status != 200 && status != 304 ) {
+        s->response.clear();
+        const char* form = status == 429 ? error_429_form
+                         : ( status == 403 ? error_403_form : ( status == 404 ? error_404_form : error_400_form ) );
+        s->body = form;
+        s->body_len = strlen( form );
+        type = "text/html";
+        if ( status == 429 ) {
+            s->response.push_back( hpack_header{ "retry-after", std::to_string( retry_after ) } );
+        }
+    }
+    if ( status != 304 ) {
+        s->response.push_back( hpack_header{ "content-type", type } );
+        s->response.push_back( hpack_header{ "content-length", std::to_string( s->body_len ) } );
+    }
+    // HEAD 和 304 没有响应体
+    if ( head || status == 304 ) {
+        s->body_len = 0;
+    }
+    s->status = status;
+    s->responded = true;
+}
+
+// 响应头在发送时才编码：动态表的变化要和帧的发送顺序一致
+void h2_session::send_headers( h2_stream* s ) {
+    std::string block;
+    m_encoder.begin( block );
+    m_encoder.encode( ":status", std::to_string( s->status ), true, block );
+    for ( size_t i = 0; i < s->response.size(); ++i ) {
+        const hpack_header& h = s->response[i];
+        // 每个响应都不同的值不放进动态表
+        bool index = h.name != "content-length" && h.name != "etag" && h.name != "retry-after";
+        m_encoder.encode( h.name, h.value, index, block );
+    }
+    bool end = s->body_len == 0;
+    size_t off = 0;
+    do {
+        size_t n = std::min( block.size() - off, ( size_t )m_peer_frame );
+        bool first = off == 0;
+        bool last = off + n == block.size();
+        int flags = ( last ? H2_END_HEADERS : 0 ) | ( first && end ? H2_END_STREAM : 0 );
+        frame( first ? H2_HEADERS : H2_CONTINUATION, flags, s->id, block.data() + off, n );
+        off += n;
+    } while ( off < block.size() );
+    s->headers_sent = true;
+    charge( s->id, block.size() );
+    if ( end ) {
+        finish_stream( s );
+    }
+}
+
+// 响应发完：客户端还在发送请求体时用 RST_STREAM(NO_ERROR) 让它停止（RFC 7540 8.1）
+void h2_session::finish_stream( h2_stream* s ) {
+    s->local_closed = true;
+    if ( !s->remote_closed ) {
+        reset( s->id, H2_NO_ERROR );
+    }
+    close_stream( s );
+}
+
+void h2_session::close_stream( h2_stream* s ) {
+    m_streams.erase( s->id );
+    tree_remove( s->id );
+    // 输出中可能还有这个流的响应体，发完后再释放
+    m_retired.push_back( s );
+}
+
+bool h2_session::upgrade( const char* method, const char* path, const std::vector< const char* >& headers ) {
+    std::vector< hpack_header > list;
+    list.push_back( hpack_header{ ":method", method } );
+    list.push_back( hpack_header{ ":path", path } );
+    list.push_back( hpack_header{ ":scheme", "http" } );
+    std::string settings;
+    bool have_settings = false;
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        const char* line = headers[i];
+        const char* colon = strchr( line, ':' );
+        if ( !colon ) {
+            continue;
+        }
+        std::string name( line, colon - line );
+        for ( size_t j = 0; j < name.size(); ++j ) {
+            name[j] = tolower( ( unsigned char )name[j] );
+        }
+        const char* v;
+        size_t len;
+        header_value( line, name.c_str(), v, len );
+        if ( name == "http2-settings" ) {
+            have_settings = base64url_decode( v, len, settings );
+        } else if ( name == "host" ) {
+            list.insert( list.begin() + 3, hpack_header{ ":authority", std::string( v, len ) } );
+        } else if ( name != "connection" && name != "upgrade" && name != "keep-alive" && name != "proxy-connection"
+                    && name != "transfer-encoding" && name != "te" ) {
+            list.push_back( hpack_header{ name, std::string( v, len ) } );
+        }
+    }
+    if ( !have_settings || settings.size() % 6 != 0 ) {
+        return false;
+    }
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    append( switching, sizeof( switching ) - 1 );
+    send_settings();
+    // HTTP2-Settings 相当于客户端的第一个 SETTINGS，由101隐式确认
+    if ( !apply_settings( ( const unsigned char* )settings.data(), settings.size() ) ) {
+        return true;        // GOAWAY 已经放进输出
+    }
+    stats[ STAT_UPGRADE ].fetch_add( 1, std::memory_order_relaxed );
+    // 升级的请求是流1，客户端已经发完（half-closed remote）
+    m_last_stream = 1;
+    m_block_priority = false;
+    open_stream( 1, true, list );
+    return true;
+}
+
+void http2_metrics( std::string& out ) {
+    if ( !http2_enabled ) {
+        return;
+    }
+    metrics_header( out, "webserver_http2_connections_total", "counter", "Connections switched to HTTP/2." );
+    metrics_counter( out, "webserver_http2_connections_total", "how=\"prior_knowledge\"", stats[ STAT_PRIOR ].load() );
+    metrics_counter( out, "webserver_http2_connections_total", "how=\"upgrade\"", stats[ STAT_UPGRADE ].load() );
+    metrics_header( out, "webserver_http2_streams_total", "counter", "HTTP/2 streams opened by clients." );
+    metrics_counter( out, "webserver_http2_streams_total", NULL, stats[ STAT_STREAMS ].load() );
+    metrics_header( out, "webserver_http2_streams_reset_total", "counter", "HTTP/2 streams reset before completion." );
+    metrics_counter( out, "webserver_http2_streams_reset_total", "reason=\"max_streams\"", stats[ STAT_REFUSED ].load() );
+    metrics_counter( out, "webserver_http2_streams_reset_total", "reason=\"http_1_1_required\"",
+                     stats[ STAT_HTTP1 ].load() );
+    metrics_counter( out, "webserver_http2_streams_reset_total", "reason=\"client\"",
+                     stats[ STAT_CLIENT_RESET ].load() );
+    metrics_header( out, "webserver_http2_connection_errors_total", "counter",
+                    "HTTP/2 connections closed with a GOAWAY carrying an error code." );
+    metrics_counter( out, "webserver_http2_connection_errors_total", NULL, stats[ STAT_ERRORS ].load() );
+}
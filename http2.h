@@ -0,0 +1,144 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "hpack.h"
+
+/*
+    HTTP/2（RFC 7540）的明文版本 h2c。浏览器用 HTTP/1.1 时对每个主机开6个连接，每个连接一套缓冲区、
+    一份反应堆上的状态；HTTP/2 的多个请求在一个连接上并发，共用一个会话和一套缓冲区。
+    两种开始方式：
+        客户端直接发送连接前言 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"（prior knowledge）
+        HTTP/1.1 请求带 Upgrade: h2c 和 HTTP2-Settings：回复 101，这个请求成为流1，之后客户端再发送连接前言
+    线程池模式在 http_conn::process 中、协程模式在 serve 中识别这两种情况，之后连接交给 h2_session。
+
+    h2_session 只处理协议，不做IO：feed 放入收到的数据，解析帧、解码头部（hpack.h），请求完整时立即生成响应；
+    flush 把输出写到非阻塞的套接字，写不完时返回0，由调用者等待可写后再调用。
+    响应和 HTTP/1.1 的路径相同：运行时指标、资源包（bundle.h）中的文件、doc_root 中的文件。
+    文件的内容不复制：资源包本身是 mmap 的，doc_root 中的文件 mmap 后直接引用；DATA 帧的帧头和内容交替放进
+    iovec，一次 writev 发出多个流的多个帧。
+    反向代理和 FastCGI 的路由不经过 HTTP/2，回复 RST_STREAM(HTTP_1_1_REQUIRED)，客户端改用 HTTP/1.1 重试。
+    每个流的请求也按 ratelimit.h 限速，超过时这个流回复429。
+
+    流量控制：每个流和整个连接各有一个发送窗口，由对端的 SETTINGS_INITIAL_WINDOW_SIZE 和 WINDOW_UPDATE 决定，
+    窗口用完的流等 WINDOW_UPDATE；收到的 DATA（请求体，我们不使用）读完就归还窗口。
+    优先级：按 RFC 7540 5.3 维护依赖树（HEADERS 中的优先级和 PRIORITY 帧），发送时从根向下选：
+    自己有数据可发的节点先发，否则在子节点中选虚拟时间（已发送字节数 / 权重）最小的子树，所以兄弟节点按权重分带宽。
+    同时进行的流超过 http2_max_streams 时新流回复 REFUSED_STREAM。
+*/
+
+// 连接前言（24字节）
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+extern bool http2_enabled;
+extern int http2_max_streams;
+
+// data 是否是连接前言的开头（len 不足24字节时只比较前 len 个字节）
+bool h2_preface( const char* data, size_t len );
+// HTTP/1.1 的请求头（每项一行 "Name: value"）中有 Upgrade: h2c 和 HTTP2-Settings
+bool h2_upgrade_requested( const std::vector< const char* >& headers );
+void http2_metrics( std::string& out );
+
+struct h2_stream;
+
+class h2_session {
+public:
+    // ip 为客户端地址，用于限速
+    explicit h2_session( uint32_t ip );
+    ~h2_session();
+
+    // 从 HTTP/1.1 升级：输出 101 和服务器的 SETTINGS，请求成为流1。headers 中必须有 HTTP2-Settings
+    bool upgrade( const char* method, const char* path, const std::vector< const char* >& headers );
+    // 放入收到的数据；连接出错时在输出中放入 GOAWAY 并返回false，发送之后应关闭连接
+    bool feed( const char* data, size_t len );
+    // 把输出写到非阻塞的 fd：全部写完返回1，发送缓冲区满返回0，出错返回-1
+    int flush( int fd );
+    // 服务器退出：发送 GOAWAY，不再接受新的流，已有的流处理完后 finished() 为true
+    void shutdown();
+    // 输出已经写完，连接可以关闭
+    bool finished() const;
+    // 没有进行中的流
+    bool idle() const { return m_streams.empty(); }
+
+private:
+    // 优先级依赖树的节点，0 是根；可以是还没打开的流（客户端用 PRIORITY 帧建立的分组）
+    struct node {
+        uint32_t parent;
+        int weight;
+        uint64_t cycle;                 // 虚拟时间，兄弟节点中小的先发送
+        std::vector< uint32_t > children;
+    };
+    // 待发送的一段：ext 为NULL时是 m_out 中从 off 开始的一段，否则是响应体中的一段
+    struct segment {
+        const char* ext;
+        size_t off;
+        size_t len;
+    };
+
+    bool handle_frame( int type, int flags, uint32_t id, const unsigned char* p, size_t len );
+    bool on_data( int flags, uint32_t id, const unsigned char* p, size_t len );
+    bool on_headers( int flags, uint32_t id, const unsigned char* p, size_t len );
+    bool on_settings( int flags, uint32_t id, const unsigned char* p, size_t len );
+    bool on_window_update( uint32_t id, const unsigned char* p, size_t len );
+    bool apply_settings( const unsigned char* p, size_t len );
+    void send_settings();
+    bool end_headers();
+    void open_stream( uint32_t id, bool end_stream, const std::vector< hpack_header >& headers );
+    void respond( h2_stream* s, const std::vector< hpack_header >& headers );
+    void send_headers( h2_stream* s );
+    void finish_stream( h2_stream* s );
+    void close_stream( h2_stream* s );
+    void produce();
+    bool ready( const h2_stream* s ) const;
+    h2_stream* pick( uint32_t id );
+    h2_stream* stream( uint32_t id ) const;
+
+    void tree_insert( uint32_t id, uint32_t parent, int weight, bool exclusive );
+    void tree_move( uint32_t id, uint32_t parent, int weight, bool exclusive );
+    void tree_remove( uint32_t id );
+    void charge( uint32_t id, size_t n );
+
+    void append( const void* p, size_t len );
+    void append_ext( const char* p, size_t len );
+    void frame( int type, int flags, uint32_t id, const void* payload, size_t len );
+    void reset( uint32_t id, uint32_t code );
+    bool fail( uint32_t code );
+
+    uint32_t m_ip;
+    std::string m_in;                   // 收到的还不够一帧的数据
+    bool m_preface;                     // 已经收到连接前言
+    bool m_settings;                    // 已经收到第一个 SETTINGS
+    bool m_greeted;                     // 已经发送了我们的 SETTINGS
+    std::string m_out;                  // 控制帧、帧头和 HEADERS
+    std::vector< segment > m_segs;
+    size_t m_seg;                       // 正在发送的段
+    size_t m_seg_off;                   // 这一段已经发送的字节数
+    std::unordered_map< uint32_t, h2_stream* > m_streams;
+    std::unordered_map< uint32_t, node > m_nodes;
+    std::vector< h2_stream* > m_retired;    // 已关闭的流，输出中可能还引用它们的响应体，写完后释放
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+    // 正在接收的头部块（HEADERS 之后可能有 CONTINUATION）
+    std::string m_block;
+    uint32_t m_block_stream;            // 0 表示没有
+    bool m_block_end_stream;
+    uint32_t m_block_parent;
+    int m_block_weight;
+    bool m_block_exclusive;
+    bool m_block_priority;
+
+    uint32_t m_last_stream;             // 收到的最大流编号
+    int64_t m_send_window;              // 连接的发送窗口
+    int64_t m_peer_window;              // 对端的 SETTINGS_INITIAL_WINDOW_SIZE，新流的发送窗口
+    uint32_t m_peer_frame;              // 对端的 SETTINGS_MAX_FRAME_SIZE
+    int64_t m_recv_window;              // 连接的接收窗口
+    bool m_goaway;                      // 发送过 GOAWAY，之后的新流忽略
+    bool m_peer_goaway;                 // 收到过 GOAWAY
+    bool m_dead;                        // 连接出错，发完 GOAWAY 后关闭
+};
+
+#endif
@@ -1,7 +1,19 @@
 #include "http_conn.h"
+#include "metrics.h"
+#include "perf_counter.h"
+#include "profiler.h"
+#include "sockopt.h"
+#include "affinity.h"
+#include "fastcgi.h"
+#include "ratelimit.h"
+#include <new>
+#include <poll.h>
+#include <vector>
 
 //  定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* switching_101_title = "Switching Protocols";
+const char* not_modified_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax.\n";
 const char* error_403_title = "Forbidden";
@@ -10,9 +22,15 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server could not be reached or sent an invalid response.\n";
+const char* error_504_title = "Gateway Timeout";
+const char* error_504_form = "The upstream server did not respond in time.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The application server is busy, please retry later.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You have sent too many requests, please retry later.\n";
 
-// 网站的根目录
-const char* doc_root = "/home/wh/webserver/resources";
 
 int setnonblocking( int fd ) {
     int old_option = fcntl( fd, F_GETFL); // 获取文件描述符的状态
@@ -20,6 +38,11 @@ int setnonblocking( int fd ) {
     fcntl( fd, F_SETFL, new_option); // 为文件描述符设置非阻塞状态
     return old_option;
 }
+// epoll_ctl 调用次数和完成的响应数，二者之比就是每个请求的 epoll_ctl 次数
+static std::atomic< uint64_t > epoll_ctl_calls( 0 );
+static std::atomic< uint64_t > responses_sent( 0 );
+static std::atomic< uint64_t > write_eagain( 0 );   // 一次没发完，转交主线程等待EPOLLOUT
+
 // 1. 当有新连接到达的时候，将连接加入到epoll内核表中，对epoll内核表的增删改操作
 void addfd( int epollfd, int fd, bool one_shot ) {
     // 为该客户请求创建一个epoll事件
@@ -32,6 +55,7 @@ void addfd( int epollfd, int fd, bool one_shot ) {
     }
     // 将新请求的文件描述符加入到epoll内核表中
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    epoll_ctl_calls.fetch_add( 1, std::memory_order_relaxed );
     // 设置非阻塞状态
     setnonblocking(fd);
 }
@@ -39,6 +63,7 @@ void addfd( int epollfd, int fd, bool one_shot ) {
 // 从epoll中移出监听的文件描述符
 void removefd( int epollfd, int fd) {
     epoll_ctl( epollfd, EPOLL_CTL_DEL, fd, 0 );
+    epoll_ctl_calls.fetch_add( 1, std::memory_order_relaxed );
     close(fd);
 }
 
@@ -48,38 +73,140 @@ void modfd(int epollfd, int fd, int ev) {
     event.data.fd = fd;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+    epoll_ctl_calls.fetch_add( 1, std::memory_order_relaxed );
+}
+
+// 每个URL最近一次的文件大小和是否在页缓存中，用来给下一次请求估计代价；
+// 按URL的哈希直接映射，冲突时覆盖。高32位是哈希，低31位是大小（KB），最高位表示冷文件
+static const int COST_CACHE_SIZE = 4096;
+static std::atomic< uint64_t > cost_cache[ COST_CACHE_SIZE ];
+static const uint64_t COST_COLD = 1u << 31;
+static const int SMALL_FILE_KB = 64;
+static const int LARGE_FILE_KB = 1024;
+
+static uint32_t url_hash( const char* url, size_t len ) {
+    uint32_t h = 2166136261u;
+    for ( size_t i = 0; i < len; ++i ) {
+        h = ( h ^ ( unsigned char )url[i] ) * 16777619u;
+    }
+    return h;
+}
+
+static void cost_record( const char* url, off_t size, bool cold ) {
+    uint32_t h = url_hash( url, strlen( url ) );
+    uint64_t kb = ( uint64_t )( size + 1023 ) / 1024;
+    if ( kb >= COST_COLD ) {
+        kb = COST_COLD - 1;
+    }
+    cost_cache[ h % COST_CACHE_SIZE ].store( ( ( uint64_t )h << 32 ) | kb | ( cold ? COST_COLD : 0 ),
+                                             std::memory_order_relaxed );
+}
+
+// 文件内容已经映射到 addr（页对齐），记录大小和开头部分是否在页缓存中
+static void cost_sample( const char* url, const char* addr, off_t size ) {
+    unsigned char resident[ 64 ];
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t pages = ( size + page - 1 ) / page;
+    if ( pages > sizeof( resident ) ) {
+        pages = sizeof( resident );
+    }
+    bool cold = mincore( ( void* )addr, pages * page, resident ) != 0;
+    for ( size_t i = 0; !cold && i < pages; ++i ) {
+        cold = !( resident[i] & 1 );
+    }
+    cost_record( url, size, cold );
 }
 
 // 2. 为每个客户端初始化一个连接，读取客户请求数据
 // 所有的客户数
-int http_conn::m_user_count = 0;
+std::atomic< int > http_conn::m_user_count( 0 );
 // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 int http_conn::m_epollfd = -1;
+// 下面三项在启动时由配置设置
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
+const char* http_conn::m_doc_root = "/home/wh/webserver/resources";
+std::atomic< bool > http_conn::m_closing( false );
 
 
-// 关闭连接
+// 关闭连接。连接的状态都清理完之后才关闭描述符，关闭之后同一个描述符随时可能被新的连接取得
 void http_conn::close_conn() {
     if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        int fd = m_sockfd;
         m_sockfd = -1;
+        // 先发送 close_notify 再关闭套接字
+        tls_free( m_tls );
+        m_tls = NULL;
         m_user_count--; // 关闭一个连接，将客户总数量-1
+        // 同一个IP的连接数按这个连接自己的地址减一
+        bool counted = m_conn_counted;
+        unsigned key = client_key();
+        m_conn_counted = false;
+        if ( counted ) {
+            ratelimit_disconnect( key );
+        }
+        delete m_h2;
+        m_h2 = NULL;
+        // 退订会修改反应堆的订阅表，只能在主线程（唯一的反应堆）中进行，工作线程只调用 close_later
+        delete m_ws;
+        m_ws = NULL;
+        removefd( m_epollfd, fd );
     }
 }
 
+void http_conn::close_later() {
+    shutdown( m_sockfd, SHUT_RD );
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+}
+
 // 初始化连接，外部调用初始化套接字地址 
-void http_conn::init(int sockfd, const sockaddr_in& addr) {
+void http_conn::init(int sockfd, const sockaddr_in& addr, int node, bool counted, bool tls) {
     m_sockfd = sockfd; // 监听套接字？
     m_address = addr; // 其中有套接字的port和ip地址
+    m_node = node;
+    m_conn_counted = counted;
+    m_tls = tls ? tls_new( sockfd ) : NULL;
+    m_handshaking = tls;
 
-    // 端口复用 存放选项值的缓冲区
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ));
+    // 按配置设置TCP选项（SO_REUSEADDR只对监听套接字有意义，这里不再设置）
+    sockopt_accept( m_sockfd );
     addfd( m_epollfd, sockfd, true);
     m_user_count++;
     // 对连接进行初始化
+    alloc_buffers();
     init();
 }
 
+// 读写缓冲区是缓冲区池中的一块，前面是读缓冲区，后面是写缓冲区
+void http_conn::alloc_buffers() {
+    static bool pool_ready = false;     // 只在主线程中调用
+    if ( !pool_ready ) {
+        buffer_pool_init( m_read_buffer_size + m_write_buffer_size );
+        pool_ready = true;
+    }
+    if ( m_read_buf && m_buf_node == m_node ) {
+        return;
+    }
+    if ( m_read_buf ) {
+        buffer_put( m_read_buf, m_buf_node );
+    }
+    m_read_buf = buffer_get( m_node );
+    if ( !m_read_buf ) {
+        throw std::bad_alloc();
+    }
+    m_write_buf = m_read_buf + m_read_buffer_size;
+    m_buf_node = m_node;
+}
+
+http_conn::~http_conn() {
+    delete m_h2;
+    delete m_ws;
+    tls_free( m_tls );
+    if ( m_read_buf ) {
+        buffer_put( m_read_buf, m_buf_node );
+    }
+}
+
 
 
 
@@ -87,18 +214,23 @@ void http_conn::init() {
     m_check_state = CHECK_STATE_REQUESTLINE; // 初始状态为检查请求行
     m_linger = false;                       // 默认不保持连接，即非长链接
 
-    m_method = GET;                         // 默认请求方式为GET
-    m_url = 0;
-    m_version = 0;
-    m_content_length = 0;
-    m_host = 0;
+    m_req.clear();                          // 请求的各项复位，方法默认为GET
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    bzero(m_read_buf, m_read_buffer_size);
+    bzero(m_write_buf, m_write_buffer_size);
+    m_dynamic.clear();
+    m_content_type = "text/html";
+    m_entry = NULL;
+    m_gzip = false;
+    m_headers_start = 0;
+    m_admitted = false;
+    m_retry_after = 0;
+    m_websocket = false;
 
 }   
 
@@ -106,14 +238,24 @@ void http_conn::init() {
 // 3. 解析请求
 // 循环读取客户数据，知道无数据可读或者对方关闭连接
 bool http_conn::read() {
-    if ( m_read_idx >= READ_BUFFER_SIZE ) {
+    if ( m_handshaking ) {
+        // 握手在工作线程的 process() 中进行
+        return true;
+    }
+    if ( m_read_idx >= m_read_buffer_size ) {
         return false;
     }
     int bytes_read = 0;
-    while (true) {
-        // 从m_read_buf + m_read_idx索引处开始保存数据，大小是READ_BUFFER_SIZE
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx,
-            READ_BUFFER_SIZE - m_read_idx, 0 );
+    // 缓冲区满时停止读取，剩下的数据留在套接字中（例如代理请求的请求体，由 do_proxy 直接转发），
+    // 否则 recv 的长度为0，返回的0会被当成对方关闭
+    while ( m_read_idx < m_read_buffer_size ) {
+        // 从m_read_buf + m_read_idx索引处开始保存数据，大小是m_read_buffer_size
+        if ( m_tls ) {
+            bytes_read = tls_read( m_tls, m_read_buf + m_read_idx, m_read_buffer_size - m_read_idx );
+        } else {
+            bytes_read = recv(m_sockfd, m_read_buf + m_read_idx,
+                m_read_buffer_size - m_read_idx, 0 );
+        }
             if (bytes_read == -1) {
                 if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
                     // 没有数据
@@ -158,75 +300,44 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 
 // 解析请求行，获取行的请求方法，请求资源，版本号
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
-    // GET /index.html HTTP/1.1
-    m_url = strpbrk(text, " \t"); // 判断第二个参数中的字符哪个最先出现在text中
-    if (! m_url) {
-        return BAD_REQUEST;
-    }
-    // GET\0/index.html HTTP/1.1
-    *m_url++ = '\0'; // 置为空字符，字符串结束
-    char* method = text;
-    if (strcasecmp(method, "GET") == 0) {
-        // 忽略大小写比较
-        m_method = GET;
-    } else {
-        return BAD_REQUEST;
-    }
-    // /index.html HTTP/1.1
-    // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
-    m_version = strpbrk(m_url, " \t");
-    if (! m_version) {
-        return BAD_REQUEST;
-    }
-    *m_version++ = '\0'; // /index.html\0HTTP/1.1\0\0
-    if (strcasecmp(m_version, "HTTP/1.1") != 0) {
-        // 只能处理http1.1版本的连接
+    if ( !http_parse_request_line( text, m_req ) ) {
         return BAD_REQUEST;
     }
-    /**
-     * http://192.168.110.129:10000/index.html
-    */
-   if (strncasecmp(m_url, "http://", 7) == 0) {
-        m_url += 7;
-        // 在参数 str 所指向的字符串中搜索第一次出现字符 c (一个无符号字符) 的位置。
-        m_url = strchr(m_url, '/');
-   }
-   if ( !m_url || m_url[0] != '/') {
-        return BAD_REQUEST;
-   }
-   m_check_state = CHECK_STATE_HEADER; // 检查状态变成检查头
-   return NO_REQUEST; // 继续解析
+    m_headers_start = m_checked_idx;
+    m_check_state = CHECK_STATE_HEADER; // 检查状态变成检查头
+    return NO_REQUEST; // 继续解析
 }
 
 // 解析HTTP头部信息
 http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
     // 遇到空行表示解析完毕
     if ( text[0] == '\0' ) {
+        m_linger = m_req.keep_alive;
+        if ( !http_headers_complete( m_req ) ) {
+            return BAD_REQUEST;
+        }
+        // WebSocket 的端点只接受没有请求体的升级请求，见 websocket.h
+        if ( ws_enabled() && ws_match( m_req.url ) ) {
+            m_websocket = m_req.method == http_request::GET && m_req.content_length == 0 && websocket_requested();
+            return m_websocket ? GET_REQUEST : BAD_REQUEST;
+        }
+        // 代理的请求体不放进读缓冲区，由 do_proxy 边读边转发
+        if ( m_req.route >= 0 ) {
+            return GET_REQUEST;
+        }
         // 如果http请求有消息头，则还需要读取m_content_length字节的消息体，
         // 状态机转换到 CHECK_STATE_CONTENT 状态
-        if ( m_content_length != 0 ) {
+        if ( m_req.content_length != 0 ) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
         // 否则说明我们已经得到一个完整的HTTP请求
         return GET_REQUEST; // get请求不需要解析请求体
-    } else if ( strncasecmp ( text, "Connection:", 11 ) == 0) {
-        // strncasecmp 需要指定比较的字符个数 strcasecmp不需要指定
-        // 处理 Connection 头部字段，Connetcion: keep-alive
-        text += 11;
-        text += strspn( text, " \t" ); // text指向下一个信息
-        if ( strcasecmp( text, "keep-alive" ) == 0) {
-            m_linger = true;
-        }
-    } else if ( strncasecmp( text, "Content-Length:", 15) == 0) {
-        text += 15;
-        text += strspn( text, " \t");
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5) == 0) {
-        text += 5;
-        text += strspn( text, " \t");
-        m_host = text;
-    } else {
+    }
+    int ret = http_parse_header( text, m_req );
+    if ( ret == HTTP_HEADER_BAD ) {
+        return BAD_REQUEST;
+    } else if ( ret == HTTP_HEADER_OTHER ) {
         printf( "oop! unkonw header %s\n", text );
     }
     return NO_REQUEST;
@@ -234,9 +345,9 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
 
 // 我们不真正解析HTTP请求的消息体，只是判断它是否被完整的读入
 http_conn::HTTP_CODE http_conn::parse_content( char* text) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx)) {
+    if ( m_read_idx >= ( m_req.content_length + m_checked_idx)) {
         // 若读缓冲区的读入字节的下一个位置 >= 正在分析的字符串在读缓冲区的位置+消息体长度，说明成功将消息体读入
-        text[ m_content_length ] = '\0';
+        text[ m_req.content_length ] = '\0';
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -267,14 +378,14 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 if ( ret == BAD_REQUEST ) {
                     return BAD_REQUEST;
                 } else if ( ret == GET_REQUEST ) {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
                 ret = parse_content( text );
                 if (ret == GET_REQUEST) {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 line_status = LINE_OPEN; // 置为open下次继续解析
                 break;
@@ -291,36 +402,294 @@ http_conn::HTTP_CODE http_conn::process_read() {
 
 
 
-// 当得到一个完整、正确的HTTP请求时，我们需要分析目标文件的属性，
+// 转发的结果（0 或者 proxy_exchange / fastcgi_exchange 给出的状态码）对应的处理结果
+static http_conn::HTTP_CODE upstream_code( int status ) {
+    switch ( status ) {
+        case 0: return http_conn::PROXY_DONE;
+        case 400: return http_conn::BAD_REQUEST;
+        case 503: return http_conn::SERVICE_UNAVAILABLE;
+        case 504: return http_conn::GATEWAY_TIMEOUT;
+        default: return http_conn::BAD_GATEWAY;
+    }
+}
+
+// 当得到一个完整、正确的HTTP请求时，我们需要分析目标文件的属性（见 http_resolve），
 // 如果目标文件存在，对所有用户可读，并且不是目录，
 // 则使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request() {
-    // "/webserver/resources"
-    strcpy( m_real_file, doc_root ); // 将docroot复制到readfile中
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 ); // 把根和url拼接起来
-    // 获取m_real_file文件的相关状态信息， -1失败， 0 成功
-    if ( stat( m_real_file, &m_file_stat) < 0) {
-        return NO_REQUEST;
+    // 采样剖析会阻塞当前工作线程直到采样结束
+    if ( profiler_match( m_req.url ) ) {
+        PROFILE_RESULT ret = profiler_run( m_req.url, m_dynamic );
+        if ( ret == PROFILE_BAD ) {
+            return BAD_REQUEST;
+        } else if ( ret != PROFILE_OK ) {
+            return INTERNAL_ERROR;
+        }
+        m_content_type = "text/plain";
+        return DYNAMIC_REQUEST;
+    }
+    if ( m_req.route >= 0 ) {
+        if ( microcache_enabled() ) {
+            return do_microcache();
+        }
+        return upstream_code( do_upstream( NULL ) );
     }
-    // 怎么实现文件状态读取的？？有点神奇，m_real_file只是一个数组，怎么获取它的状态的，哪里设置的
+    http_content c;
+    int status = http_resolve( m_req.url, m_req.if_none_match, m_req.accept_gzip, c );
+    m_content_type = c.type;
+    m_entry = c.entry;
+    m_gzip = c.gzip;
+    if ( status == 304 ) {
+        return NOT_MODIFIED;
+    } else if ( status != 200 ) {
+        return status == 403 ? FORBIDDEN_REQUEST : ( status == 404 ? NO_RESOURCE : BAD_REQUEST );
+    }
+    if ( m_entry ) {
+        if ( c.size > 0 ) {
+            // 包中的内容从页边界开始，可以直接 mincore
+            cost_sample( m_req.url, bundle_content( m_entry, m_gzip ), c.size );
+        }
+        return BUNDLE_REQUEST;
+    }
+    if ( c.file_fd < 0 ) {
+        m_dynamic.swap( c.dynamic );
+        return DYNAMIC_REQUEST;
+    }
+    m_file_stat.st_size = c.size;
+    // 创建内存映射
+    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, c.file_fd, 0 );
+    close( c.file_fd ); // 打开文件完成映射后需要关闭文件描述符
+    // 记录大小和开头部分是否在页缓存中，供 sched_level 估计下一次请求的代价
+    if ( m_file_stat.st_size > 0 && m_file_address != MAP_FAILED ) {
+        cost_sample( m_req.url, m_file_address, m_file_stat.st_size );
+    }
+    return FILE_REQUEST;
+}
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+int http_conn::do_upstream( microcache_capture* capture ) {
+    // 转发直接在套接字上读写（splice），HTTPS 连接要两个方向都由内核加解密才行，见 tls.h
+    if ( m_tls && !( tls_ktls_send( m_tls ) && tls_ktls_recv( m_tls ) ) ) {
+        m_linger = false;
+        return 502;
     }
+    return proxy_routes[ m_req.route ].fastcgi ? do_fastcgi( capture ) : do_proxy( capture );
+}
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode) ) {
-        return BAD_REQUEST;
+// 先查微缓存（见 microcache.h）。同一个键正在填充时在工作线程中等待它完成，最多 proxy_timeout_ms
+http_conn::HTTP_CODE http_conn::do_microcache() {
+    std::vector< const char* > headers;
+    for ( char* p = m_read_buf + m_headers_start; *p; p += strlen( p ) + 2 ) {
+        headers.push_back( p );
+    }
+    bool has_body = m_req.chunked || m_req.content_length > 0;
+    microcache_ticket t;
+    int result;
+    while ( ( result = microcache_lookup( m_req.method_name, m_req.url, headers, has_body, t ) ) == MICROCACHE_WAIT ) {
+        int ret = proxy_wait( t.wait_fd, POLLIN );
+        close( t.wait_fd );
+        if ( ret < 0 ) {
+            // 等待超时，自己去上游
+            result = MICROCACHE_BYPASS;
+            break;
+        }
+    }
+    if ( result == MICROCACHE_BYPASS ) {
+        return upstream_code( do_upstream( NULL ) );
+    }
+    if ( result == MICROCACHE_FILL ) {
+        microcache_capture capture;
+        int status = do_upstream( &capture );
+        if ( !microcache_finish( t, &capture, headers, status ) ) {
+            return upstream_code( status );
+        }
     }
+    m_cached = t.obj;
+    return CACHE_HIT;
+}
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close(fd); // 打开文件完成映射后需要关闭文件描述符
-    return FILE_REQUEST;
+// 把请求转发给上游，响应直接发给客户端。在工作线程中同步进行，等待套接字时用 poll，超时为 proxy_timeout_ms；
+// 每一步做什么由 proxy_exchange 决定
+int http_conn::do_proxy( microcache_capture* capture ) {
+    std::vector< const char* > headers;
+    for ( char* p = m_read_buf + m_headers_start; *p; p += strlen( p ) + 2 ) {
+        headers.push_back( p );
+    }
+    char* buf = proxy_buffer();
+    proxy_exchange x( m_req.route, m_req, buf, m_linger && !m_closing, capture );
+    const char* pre = m_read_buf + m_checked_idx;
+    int status = x.begin( headers, m_address, m_read_idx - m_checked_idx );
+    int upstream = -1;
+    while ( status == 0 ) {
+        bool reused;
+        upstream = proxy_connect( m_req.route, m_req.url, x.up, x.start, reused );
+        if ( upstream < 0 ) {
+            status = x.connect_failed( upstream );
+            break;
+        }
+        // 请求头和缓冲区中的请求体一起发出
+        ssize_t ret = proxy_send_all( upstream, x.head.data(), x.head.size(), x.pre_len > 0 || x.has_body ? MSG_MORE : 0 );
+        if ( ret >= 0 && m_req.chunked ) {
+            x.body_streamed = true;
+            ret = proxy_relay_chunked( m_sockfd, upstream, pre, x.pre_len );
+        } else if ( ret >= 0 && x.has_body ) {
+            if ( x.pre_len > 0 ) {
+                ret = proxy_send_all( upstream, pre, x.pre_len );
+            }
+            if ( ret >= 0 && x.need_continue() ) {
+                ret = proxy_send_all( m_sockfd, PROXY_CONTINUE, strlen( PROXY_CONTINUE ) );
+            }
+            if ( ret >= 0 && x.remaining > 0 ) {
+                x.body_streamed = true;
+                ret = proxy_splice( m_sockfd, upstream, x.remaining );
+            }
+        }
+        while ( ret >= 0 && ( ret = x.read_head() ) == 0 ) {
+            ret = proxy_recv( upstream, buf + x.len, PROXY_BUFFER_SIZE - x.len );
+            if ( ret <= 0 ) {
+                ret = ret == 0 ? -EPIPE : ret;
+                break;
+            }
+            x.received( ret );
+        }
+        if ( ret > 0 ) {
+            break;
+        }
+        close( upstream );
+        if ( !x.retry( ret, reused ) ) {
+            status = x.failed( ret );
+        }
+    }
+    if ( status != 0 ) {
+        m_linger = x.keep_alive;
+        return status;
+    }
+
+    x.forward( m_closing );
+    const proxy_response& r = x.r;
+    ssize_t ret = proxy_send_all( m_sockfd, x.head.data(), x.head.size(), r.body != PROXY_BODY_NONE ? MSG_MORE : 0 );
+    // 填充微缓存时响应体要经过用户空间，不用 splice
+    if ( ret >= 0 && r.body == PROXY_BODY_CHUNKED ) {
+        ret = proxy_relay_chunked( upstream, m_sockfd, x.extra, x.extra_len, capture );
+        x.reusable = x.reusable && ret == 0;
+    } else if ( ret >= 0 && r.body != PROXY_BODY_NONE ) {
+        uint64_t rest = r.body == PROXY_BODY_LENGTH ? r.content_length - x.first : UINT64_MAX;
+        ret = proxy_send_all( m_sockfd, x.extra, x.first, rest > 0 ? MSG_MORE : 0 );
+        if ( ret >= 0 && rest > 0 ) {
+            ret = capture ? proxy_copy( upstream, m_sockfd, rest, capture ) : proxy_splice( upstream, m_sockfd, rest );
+        }
+    }
+    if ( ret < 0 ) {
+        x.abort( ret );
+        close( upstream );
+    } else {
+        x.finish( upstream );
+    }
+    m_linger = x.keep_alive;
+    return 0;
+}
+
+// 把请求交给 FastCGI 应用服务器（见 fastcgi.h），应用的输出边收边转换成 HTTP 响应发给客户端。
+// 与 do_proxy 一样在工作线程中同步进行，每一步做什么由 fastcgi_exchange 决定
+int http_conn::do_fastcgi( microcache_capture* capture ) {
+    std::vector< const char* > headers;
+    for ( char* p = m_read_buf + m_headers_start; *p; p += strlen( p ) + 2 ) {
+        headers.push_back( p );
+    }
+    char* buf = proxy_buffer();
+    fastcgi_exchange x( m_req.route, m_req, buf, m_linger && !m_closing, capture );
+    int status = x.begin( headers, m_address, m_sockfd, m_read_buf + m_checked_idx, m_read_idx - m_checked_idx );
+    std::string out;
+    while ( status == 0 ) {
+        bool reused;
+        int upstream = proxy_connect( m_req.route, m_req.url, x.up, x.start, reused );
+        if ( upstream < 0 ) {
+            status = x.connect_failed( upstream );
+            break;
+        }
+        ssize_t ret = proxy_send_all( upstream, x.head.data(), x.head.size(), x.remaining > 0 ? MSG_MORE : 0 );
+        if ( ret >= 0 && x.need_continue() ) {
+            ret = proxy_send_all( m_sockfd, PROXY_CONTINUE, strlen( PROXY_CONTINUE ) );
+        }
+        // 其余的请求体从客户端读到 buf 中记录头之后的位置
+        while ( ret >= 0 && x.remaining > 0 ) {
+            x.body_streamed = true;
+            ret = proxy_recv( m_sockfd, buf + FASTCGI_HEADER_LEN, x.body_want() );
+            if ( ret > 0 ) {
+                ret = proxy_send_all( upstream, buf, x.stdin_record( ret ), x.remaining > 0 ? MSG_MORE : 0 );
+            } else if ( ret == 0 ) {
+                ret = -EPIPE;
+            }
+        }
+        // 读应用的输出，转换后发给客户端
+        while ( ret >= 0 && !x.done() ) {
+            ret = proxy_recv( upstream, buf, PROXY_BUFFER_SIZE );
+            if ( ret <= 0 ) {
+                ret = ret == 0 ? -EPIPE : ret;
+            } else if ( ( ret = x.feed( ret, out ) ) == 0 && !out.empty() ) {
+                ret = proxy_send_all( m_sockfd, out.data(), out.size() );
+                out.clear();
+            }
+        }
+        if ( ret >= 0 ) {
+            x.finish( upstream );
+            break;
+        }
+        close( upstream );
+        if ( !x.retry( ret, reused ) ) {
+            status = x.failed( ret );
+            break;
+        }
+    }
+    m_linger = x.keep_alive;
+    return status;
+}
+
+int http_conn::sched_level( int& cost ) const {
+    // 请求行 "GET /index.html HTTP/1.1"，只看URL，不改动读缓冲区
+    const char* begin = ( const char* )memchr( m_read_buf, ' ', m_read_idx );
+    const char* end = begin ? ( const char* )memchr( begin + 1, ' ', m_read_buf + m_read_idx - begin - 1 ) : NULL;
+    if ( end ) {
+        ++begin;
+        uint32_t h = url_hash( begin, end - begin );
+        uint64_t v = cost_cache[ h % COST_CACHE_SIZE ].load( std::memory_order_relaxed );
+        if ( v && ( uint32_t )( v >> 32 ) == h ) {
+            uint64_t kb = v & ( COST_COLD - 1 );
+            bool cold = v & COST_COLD;
+            if ( kb >= LARGE_FILE_KB ) {
+                uint64_t units = 1 + kb / 256;
+                cost = units > 16 ? 16 : ( int )units;
+                return 2;
+            }
+            cost = cold ? 4 : ( kb <= SMALL_FILE_KB ? 1 : 2 );
+            return ( cold || kb > SMALL_FILE_KB ) ? 1 : 0;
+        }
+    }
+    // 没有见过的URL（包括运行时指标等动态内容）当作中等代价
+    cost = 2;
+    return 1;
+}
+
+bool http_conn::admit() {
+    // HTTP/2 的连接上每个流单独检查（h2_session 中），连接前言不是请求
+    if ( m_h2 || m_admitted || !ratelimit_enabled() || ( http2_enabled && !m_tls && h2_preface( m_read_buf, m_read_idx ) ) ) {
+        return true;
+    }
+    // 和 sched_level 一样只看请求行中的URL；请求行还没读完时等下一次读到数据再检查
+    const char* begin = ( const char* )memchr( m_read_buf, ' ', m_read_idx );
+    const char* end = begin ? ( const char* )memchr( begin + 1, ' ', m_read_buf + m_read_idx - begin - 1 ) : NULL;
+    if ( !end ) {
+        return true;
+    }
+    m_admitted = true;
+    m_retry_after = ratelimit_request( client_key(), begin + 1, end - begin - 1 );
+    if ( m_retry_after == 0 ) {
+        return true;
+    }
+    // 在主线程中回复，不占线程池的队列；m_linger 还是 false，发完即关闭，发不完时由主线程等 EPOLLOUT
+    if ( !process_write( TOO_MANY_REQUESTS ) || !write() ) {
+        close_conn();
+    }
+    return false;
 }
 
 // 4.写响应数据
@@ -336,49 +705,90 @@ void http_conn::unmap() {
         munmap( m_file_address, m_file_stat.st_size ); // 释放由 mmap 函数分配的内存映射区域。
         m_file_address = 0;
     }
+    m_cached.reset();
 }
 
+// 发送响应。工作线程在process()中直接调用一次，发送缓冲区满时注册EPOLLOUT，
+// 之后由主线程在可写时继续调用
 bool http_conn::write() {
     int temp = 0;
-    int bytes_have_send = 0;             // 已经发送的字节
-    int bytes_to_send= m_write_idx;     // 将要发送的字节，m_write_idx写缓冲区待发送的字节数
 
-    if ( bytes_to_send == 0 ) {
+    if ( m_handshaking ) {
+        // 握手的数据一次没有发完（证书链较大时），可写后继续；握手失败时 handshake() 已经让主线程关闭连接
+        if ( handshake() ) {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+        }
+        return true;
+    }
+    if ( m_h2 ) {
+        if ( m_closing ) {
+            m_h2->shutdown();
+        }
+        return write_h2();
+    }
+    if ( m_ws ) {
+        return process_ws();
+    }
+
+    if ( m_bytes_to_send == 0 ) {
         // 将要发送的字节数为0，说明相应结束
-        modfd( m_epollfd, m_sockfd, EPOLLIN);
         init();
-        return true; // 初始化连接，此时连接断开了吗？应该是断开了
+        modfd( m_epollfd, m_sockfd, EPOLLIN);
+        return true;
+    }
+
+    if ( m_bytes_have_send == 0 ) {
+        // 塞住连接，响应头和正文凑成满的报文段再发出
+        sockopt_cork( m_sockfd, true );
     }
-    
     while (1)
     {
         // 分散写 将缓冲区的数据包一次发送
-        temp = writev(m_sockfd, m_iv, m_iv_count ); // 返回已发送的字符数
+        // HTTPS 连接经过 TLS 加密；kTLS 生效时也是直接 writev，由内核加密
+        temp = m_tls ? tls_writev( m_tls, m_iv, m_iv_count ) : writev(m_sockfd, m_iv, m_iv_count ); // 返回已发送的字符数
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件
             // 在此期间服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if (errno == EAGAIN ) {
+                write_eagain.fetch_add( 1, std::memory_order_relaxed );
                 modfd( m_epollfd, m_sockfd, EPOLLOUT );
                 return true;
             }
             unmap();
             return false;
         }
-        bytes_to_send -= temp; // 待发送的字符数
-        bytes_have_send += temp; // 已发送的字符数
-        if (bytes_to_send <= bytes_have_send ) {
+        m_bytes_to_send -= temp; // 待发送的字符数
+        m_bytes_have_send += temp; // 已发送的字符数
+        if ( m_bytes_to_send <= 0 ) {
             // 发送http相应成功，根据HTTP请求中的Connetcion字段决定是否立即断开连接
             unmap();
-            if (m_linger) {
-                // 如果是长连接则初始化连接
+            sockopt_cork( m_sockfd, false );
+            responses_sent.fetch_add( 1, std::memory_order_relaxed );
+            if ( m_websocket ) {
+                // 101 发完，注册 EPOLLOUT 让主线程马上接手，在那里订阅频道
+                upgrade_ws();
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            if ( m_linger && !m_closing ) {
+                // 如果是长连接则初始化连接，必须先初始化再重新注册，注册之后其他线程就可能处理这个连接
                 init();
-                // 修改文件描述符
                 modfd( m_epollfd, m_sockfd, EPOLLIN );
                 return true;
-            } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
             }
+            // 不再重新注册，由调用者关闭连接
+            return false;
+        }
+        // 只发送了一部分，跳过iovec中已发送的字节，下一次从未发送的位置开始
+        size_t sent = temp;
+        if ( sent >= m_iv[ 0 ].iov_len ) {
+            sent -= m_iv[ 0 ].iov_len;
+            m_iv[ 0 ].iov_len = 0;
+            m_iv[ 1 ].iov_base = ( char* )m_iv[ 1 ].iov_base + sent;
+            m_iv[ 1 ].iov_len -= sent;
+        } else {
+            m_iv[ 0 ].iov_base = ( char* )m_iv[ 0 ].iov_base + sent;
+            m_iv[ 0 ].iov_len -= sent;
         }
     }
     
@@ -387,15 +797,15 @@ bool http_conn::write() {
 // 向写缓冲中写入待发送的数据
 bool http_conn::add_response(const char* format, ...) {
     // ... 表示其后还可以有参数
-    if ( m_write_idx >= WRITE_BUFFER_SIZE) {
+    if ( m_write_idx >= m_write_buffer_size) {
         // 已经写满了,直接返回错误，写失败
         return false;
     }
     // va_list 声明接收可变参数列表的指针
     va_list arg_list; // arg_list为访问指针，初始化
     va_start( arg_list, format);
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list ); //将格式化的字符串输出到一个字符数组中
-    if ( len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx) ) {
+    int len = vsnprintf( m_write_buf + m_write_idx, m_write_buffer_size - 1 - m_write_idx, format, arg_list ); //将格式化的字符串输出到一个字符数组中
+    if ( len >= (m_write_buffer_size - 1 - m_write_idx) ) {
         return false;
     }
     m_write_idx += len;
@@ -421,10 +831,13 @@ bool http_conn::add_content_length(int content_len) {
 }
 
 bool http_conn::add_content_type() {
-    return add_response( "Content-Type: %s\r\n", "text/html");
+    return add_response( "Content-Type: %s\r\n", m_content_type);
 }
 
 bool http_conn::add_linger() {
+    if ( m_closing ) {
+        m_linger = false;
+    }
     return add_response( "Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close" );
 }
 
@@ -477,6 +890,102 @@ bool http_conn::process_write(HTTP_CODE ret) {
             m_iv[ 1 ].iov_base = m_file_address;
             m_iv[ 1 ].iov_len = m_file_stat.st_size;
             m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + ( int )m_file_stat.st_size;
+            return true;
+        case BUNDLE_REQUEST: {
+            // 资源包中的文件：类型和校验值在打包时算好，有 gzip 版本时告诉缓存按 Accept-Encoding 区分
+            uint64_t size = m_gzip ? m_entry->gzip_size : m_entry->size;
+            add_status_line( 200, ok_200_title );
+            add_content_length( size );
+            add_content_type();
+            add_response( "ETag: %s\r\n", bundle_etag( m_entry, m_gzip ) );
+            if ( m_gzip ) {
+                add_response( "Content-Encoding: gzip\r\n" );
+            }
+            if ( m_entry->gzip_size > 0 ) {
+                add_response( "Vary: Accept-Encoding\r\n" );
+            }
+            add_linger();
+            if ( !add_blank_line() ) {
+                return false;
+            }
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = m_write_idx;
+            m_iv[ 1 ].iov_base = ( void* )bundle_content( m_entry, m_gzip );
+            m_iv[ 1 ].iov_len = size;
+            m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + ( int )size;
+            return true;
+        }
+        case NOT_MODIFIED:
+            // 304 没有响应体
+            add_status_line( 304, not_modified_304_title );
+            add_response( "ETag: %s\r\n", bundle_etag( m_entry, m_gzip ) );
+            if ( m_entry->gzip_size > 0 ) {
+                add_response( "Vary: Accept-Encoding\r\n" );
+            }
+            add_linger();
+            if ( !add_blank_line() ) {
+                return false;
+            }
+            break;
+        case BAD_GATEWAY:
+            add_status_line( 502, error_502_title );
+            add_headers( strlen( error_502_form ) );
+            if ( ! add_content( error_502_form ) ) {
+                return false;
+            }
+            break;
+        case SERVICE_UNAVAILABLE:
+            add_status_line( 503, error_503_title );
+            add_response( "Retry-After: 1\r\n" );
+            add_headers( strlen( error_503_form ) );
+            if ( ! add_content( error_503_form ) ) {
+                return false;
+            }
+            break;
+        case TOO_MANY_REQUESTS:
+            add_status_line( 429, error_429_title );
+            add_response( "Retry-After: %d\r\n", m_retry_after );
+            add_headers( strlen( error_429_form ) );
+            if ( ! add_content( error_429_form ) ) {
+                return false;
+            }
+            break;
+        case WEBSOCKET_UPGRADE:
+            add_status_line( 101, switching_101_title );
+            add_response( "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n", m_ws_accept.c_str() );
+            if ( !add_blank_line() ) {
+                return false;
+            }
+            break;
+        case GATEWAY_TIMEOUT:
+            add_status_line( 504, error_504_title );
+            add_headers( strlen( error_504_form ) );
+            if ( ! add_content( error_504_form ) ) {
+                return false;
+            }
+            break;
+        case CACHE_HIT:
+            // 缓存的响应头和 Age、Connection 放在 m_dynamic 中，响应体直接从缓存发送
+            m_linger = m_linger && !m_closing;
+            microcache_reply_head( *m_cached, m_linger, m_dynamic );
+            m_iv[ 0 ].iov_base = ( void* )m_dynamic.data();
+            m_iv[ 0 ].iov_len = m_dynamic.size();
+            m_iv[ 1 ].iov_base = ( void* )m_cached->body.data();
+            m_iv[ 1 ].iov_len = m_req.method == http_request::HEAD ? 0 : m_cached->body.size();
+            m_iv_count = 2;
+            m_bytes_to_send = m_iv[ 0 ].iov_len + m_iv[ 1 ].iov_len;
+            return true;
+        case DYNAMIC_REQUEST:
+            add_status_line( 200, ok_200_title );
+            add_headers( m_dynamic.size() );
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = m_write_idx;
+            m_iv[ 1 ].iov_base = ( void* )m_dynamic.data();
+            m_iv[ 1 ].iov_len = m_dynamic.size();
+            m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + ( int )m_dynamic.size();
             return true;
         default:
             return false;
@@ -484,23 +993,255 @@ bool http_conn::process_write(HTTP_CODE ret) {
     m_iv[ 0 ].iov_base = m_write_buf;
     m_iv[ 0 ].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
     return true;
 }
 
 // 线程池的工作线程执行程序，处理HTTP请求的入口函数
 void http_conn::process() {
+    if ( m_handshaking ) {
+        if ( !handshake() ) {
+            return;
+        }
+        // 客户端通常紧跟着握手的最后一条消息发出请求
+        if ( !read() ) {
+            close_later();
+            return;
+        }
+        if ( m_read_idx == 0 ) {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return;
+        }
+    }
+    if ( m_h2 ) {
+        process_h2();
+        return;
+    }
+    // 以 HTTP/2 的连接前言开头（prior knowledge）：前言不完整时等下一次读到数据，完整后切换到 HTTP/2。
+    // HTTPS 连接上没有 h2c
+    if ( http2_enabled && !m_tls && m_checked_idx == 0 && h2_preface( m_read_buf, m_read_idx ) ) {
+        if ( m_read_idx < ( int )sizeof( H2_PREFACE ) - 1 ) {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return;
+        }
+        m_h2 = new h2_session( client_key() );
+        process_h2();
+        return;
+    }
     // 解析HTTP请求,将数据读入，返回读后状态
-    HTTP_CODE read_ret = process_read();
+    HTTP_CODE read_ret;
+    {
+        perf_scope scope( PERF_STAGE_PARSE );
+        read_ret = process_read();
+    }
+    if ( read_ret == NO_REQUEST && m_read_idx >= m_read_buffer_size ) {
+        // 读缓冲区满了请求还不完整
+        read_ret = BAD_REQUEST;
+    }
     if ( read_ret == NO_REQUEST ) {
         // 若请求未被读取完,则继续读取
         modfd( m_epollfd, m_sockfd, EPOLLIN);
         return;
     }
+    if ( read_ret == GET_REQUEST && m_websocket ) {
+        read_ret = WEBSOCKET_UPGRADE;
+    }
+    // 没有请求体的非代理请求才能升级，请求体之后的数据已经是 HTTP/2 的帧
+    if ( read_ret == GET_REQUEST && http2_enabled && !m_tls && m_req.route < 0 && m_req.content_length == 0 && upgrade_h2() ) {
+        return;
+    }
+    if ( read_ret == GET_REQUEST ) {
+        // 请求解析完毕，再去访问目标文件
+        perf_scope scope( PERF_STAGE_REQUEST );
+        read_ret = do_request();
+    }
+    if ( read_ret == PROXY_DONE ) {
+        // 响应已经由 do_proxy 发送完
+        responses_sent.fetch_add( 1, std::memory_order_relaxed );
+        if ( m_linger && !m_closing ) {
+            init();
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+        } else {
+            close_later();
+        }
+        return;
+    }
 
     // 生成响应
-    bool write_ret = process_write( read_ret );
+    bool write_ret;
+    {
+        perf_scope scope( PERF_STAGE_RESPONSE );
+        write_ret = process_write( read_ret );
+    }
     if ( !write_ret ) {
-        close_conn();
+        close_later();
+        return;
+    }
+    // 乐观写：发送缓冲区几乎总是有空间，直接在工作线程发送，省去
+    // modfd(EPOLLOUT) -> epoll_wait -> write() -> modfd(EPOLLIN) 这一轮往返，
+    // 只有发送不完时write()才注册EPOLLOUT
+    if ( !write() ) {
+        close_later();
+    }
+}
+
+bool http_conn::handshake() {
+    uint32_t events = 0;
+    int ret = m_tls ? tls_handshake( m_tls, events ) : -1;
+    if ( ret > 0 ) {
+        m_handshaking = false;
+        return true;
+    }
+    if ( ret == 0 ) {
+        modfd( m_epollfd, m_sockfd, events );
+    } else {
+        close_later();
+    }
+    return false;
+}
+
+bool http_conn::upgrade_h2() {
+    // 请求头在读缓冲区中以 "\0\0" 分隔，空行处结束
+    std::vector< const char* > headers;
+    for ( int i = m_headers_start; i < m_checked_idx && m_read_buf[i]; i += strlen( m_read_buf + i ) + 2 ) {
+        headers.push_back( m_read_buf + i );
+    }
+    if ( !h2_upgrade_requested( headers ) ) {
+        return false;
+    }
+    m_h2 = new h2_session( client_key() );
+    if ( !m_h2->upgrade( m_req.method_name, m_req.url, headers ) ) {
+        delete m_h2;
+        m_h2 = NULL;
+        return false;
+    }
+    // 请求之后已经读到的数据（客户端的连接前言）交给会话
+    int rest = m_read_idx - m_checked_idx;
+    memmove( m_read_buf, m_read_buf + m_checked_idx, rest );
+    m_read_idx = rest;
+    process_h2();
+    return true;
+}
+
+bool http_conn::websocket_requested() {
+    // 请求头在读缓冲区中以 "\0\0" 分隔，空行处结束
+    std::vector< const char* > headers;
+    for ( int i = m_headers_start; i < m_checked_idx && m_read_buf[i]; i += strlen( m_read_buf + i ) + 2 ) {
+        headers.push_back( m_read_buf + i );
+    }
+    std::string key;
+    if ( !ws_upgrade_requested( headers, key ) ) {
+        return false;
+    }
+    m_ws_accept = ws_accept( key );
+    return true;
+}
+
+void http_conn::upgrade_ws() {
+    m_ws = new ws_conn( m_req.url, client_key() );
+    // 请求之后已经读到的数据（客户端不等101就发出的帧）留给 process_ws
+    int rest = m_read_idx - m_checked_idx;
+    memmove( m_read_buf, m_read_buf + m_checked_idx, rest );
+    m_read_idx = rest;
+}
+
+// 投递的广播没能一次发完：同时等 EPOLLOUT，可写后主线程再调用 process_ws
+static void ws_wait_write( void* arg ) {
+    write_eagain.fetch_add( 1, std::memory_order_relaxed );
+    modfd( http_conn::m_epollfd, ( ( http_conn* )arg )->sockfd(), EPOLLIN | EPOLLOUT );
+}
+
+// 主线程是 WebSocket 连接的反应堆：第一次调用时订阅频道；读到 EAGAIN 为止，收到的帧交给 m_ws，
+// 完整的消息在这里发布，再发送队列中的帧
+bool http_conn::process_ws() {
+    if ( !m_ws->attached() ) {
+        m_ws->attach( m_sockfd, m_tls, ws_wait_write, this );
+    }
+    if ( m_closing ) {
+        m_ws->close( 1001 );
+    }
+    while ( !m_ws->closing() ) {
+        if ( m_read_idx > 0 ) {
+            m_ws->feed( m_read_buf, m_read_idx );
+            m_read_idx = 0;
+            continue;
+        }
+        int n = m_tls ? tls_read( m_tls, m_read_buf, m_read_buffer_size ) : recv( m_sockfd, m_read_buf, m_read_buffer_size, 0 );
+        if ( n > 0 ) {
+            m_read_idx = n;
+            continue;
+        }
+        if ( n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) {
+            return false;
+        }
+        break;
+    }
+    int ret = m_ws->flush();
+    if ( ret < 0 || m_ws->finished() ) {
+        return false;
+    }
+    if ( ret == 0 ) {
+        write_eagain.fetch_add( 1, std::memory_order_relaxed );
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+    modfd( m_epollfd, m_sockfd, ret == 0 ? EPOLLIN | EPOLLOUT : EPOLLIN );
+    return true;
+}
+
+// HTTP/2 的连接（在工作线程中）：边沿触发，这里读到 EAGAIN 为止，收到的数据都交给会话，再发送它生成的帧
+void http_conn::process_h2() {
+    bool ok = true;
+    while ( ok ) {
+        if ( m_read_idx > 0 ) {
+            ok = m_h2->feed( m_read_buf, m_read_idx );
+            m_read_idx = 0;
+        }
+        if ( !ok ) {
+            break;
+        }
+        int n = recv( m_sockfd, m_read_buf, m_read_buffer_size, 0 );
+        if ( n > 0 ) {
+            m_read_idx = n;
+            continue;
+        }
+        if ( n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) {
+            close_later();
+            return;
+        }
+        break;
+    }
+    if ( m_closing ) {
+        m_h2->shutdown();
+    }
+    if ( !write_h2() ) {
+        close_later();
+    }
+}
+
+// 发不完时等 EPOLLOUT，之后由主线程调用 write() 继续；发完时会话结束（GOAWAY）则关闭连接
+bool http_conn::write_h2() {
+    int ret = m_h2->flush( m_sockfd );
+    if ( ret < 0 ) {
+        return false;
+    }
+    if ( ret == 0 ) {
+        write_eagain.fetch_add( 1, std::memory_order_relaxed );
+        modfd( m_epollfd, m_sockfd, EPOLLOUT );
+        return true;
+    }
+    if ( m_h2->finished() ) {
+        return false;
+    }
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+    return true;
+}
+
+void http_conn::metrics( std::string& out ) {
+    metrics_header( out, "webserver_connections", "gauge", "Open client connections." );
+    metrics_gauge( out, "webserver_connections", NULL, m_user_count );
+    metrics_header( out, "webserver_responses_total", "counter", "Responses written completely." );
+    metrics_counter( out, "webserver_responses_total", NULL, responses_sent.load( std::memory_order_relaxed ) );
+    metrics_header( out, "webserver_epoll_ctl_total", "counter", "epoll_ctl calls (add, modify and delete)." );
+    metrics_counter( out, "webserver_epoll_ctl_total", NULL, epoll_ctl_calls.load( std::memory_order_relaxed ) );
+    metrics_header( out, "webserver_write_eagain_total", "counter", "Writes that filled the socket buffer and waited for EPOLLOUT." );
+    metrics_counter( out, "webserver_write_eagain_total", NULL, write_eagain.load( std::memory_order_relaxed ) );
 }
@@ -20,16 +20,20 @@
 #include <errno.h>
 #include "locker.h"
 #include <sys/uio.h>
+#include <string>
+#include <atomic>
+#include "bundle.h"
+#include "proxy.h"
+#include "microcache.h"
+#include "http2.h"
+#include "tls.h"
+#include "websocket.h"
+#include "http_request.h"
 
 class http_conn
 {
 public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;    // 读缓冲区的大小1
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
-
-    // HTTP请求方法，这里只支持get
-    enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
 
     /*
         解析客户端请求时，主状态机的状态
@@ -47,34 +51,80 @@ public:
         NO_REQUEST          :       表示服务器没有资源
         FORBIDDEN_REQUEST   :       表示客户对资源没有足够的权限进行访问
         FILE_REQUEST        :       文件请求，获取文件成功
+        DYNAMIC_REQUEST     :       响应体由服务器生成（如运行时指标），存放在m_dynamic中
+        BUNDLE_REQUEST      :       文件在资源包中（见 bundle.h），m_entry 指向它的条目
+        NOT_MODIFIED        :       资源包中的文件和 If-None-Match 中的校验值相同，回复304
+        PROXY_DONE          :       请求已经转发给上游，响应也已经发给客户端
+        BAD_GATEWAY         :       连不上上游，或者上游的响应不正确，回复502
+        GATEWAY_TIMEOUT     :       等待上游超时，回复504
+        SERVICE_UNAVAILABLE :       上游都满了（见 fastcgi.h 的背压），回复503
+        CACHE_HIT           :       代理或 FastCGI 的响应在微缓存中（见 microcache.h），m_cached 指向它
+        TOO_MANY_REQUESTS   :       客户端超过了限速（见 ratelimit.h），回复429后关闭连接
+        WEBSOCKET_UPGRADE   :       WebSocket 的升级请求（见 websocket.h），回复101后连接交给主线程
         INTERNAL_ERROR      :       表示服务器内部错误
         CLOSED_CONNECTION   :       表示客户端已经关闭连接
    */
-    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};
+    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, DYNAMIC_REQUEST, BUNDLE_REQUEST, NOT_MODIFIED, PROXY_DONE, BAD_GATEWAY, GATEWAY_TIMEOUT, SERVICE_UNAVAILABLE, CACHE_HIT, TOO_MANY_REQUESTS, WEBSOCKET_UPGRADE, INTERNAL_ERROR, CLOSED_CONNECTION};
 
     // 从状态机的三种可能状态，即行的读取状态，分别为
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS {LINE_OK = 0, LINE_BAD, LINE_OPEN};
+
+    // 微基准测试直接读写内部缓冲区，不经过socket（test_presure/microbench）
+    friend class http_conn_bench;
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_sockfd( -1 ), m_node( 0 ), m_read_buf( NULL ), m_write_buf( NULL ), m_buf_node( 0 ), m_h2( NULL ), m_tls( NULL ), m_ws( NULL ) {}
+    ~http_conn();
 public:
     // 每个工作线程可执行的操作
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接收的连接
-    void close_conn(); // 关闭连接
+    // 初始化新接收的连接，node为处理它的NUMA节点；counted 表示连接计入了客户端的连接数（见 ratelimit.h）；
+    // tls 为true时是 HTTPS 端口上的连接，先握手（见 tls.h）
+    void init(int sockfd, const sockaddr_in& addr, int node = 0, bool counted = false, bool tls = false);
+    int node() const { return m_node; }
+    int sockfd() const { return m_sockfd; } // 连接已关闭时为-1
+    void close_conn(); // 关闭连接，只在主线程中调用
     void process(); // 处理客户端请求
     bool read(); // 阻塞读
-    bool write(); // 阻塞写
+    bool write(); // 发送响应，发送不完时注册EPOLLOUT；返回false表示需要关闭连接
+    static void metrics( std::string& out ); // 输出连接相关的运行时指标
+    // 主线程在交给线程池之前调用：从读缓冲区中的请求行取出URL，按以前处理它的结果估计代价，
+    // 返回线程池的队列级别（见 fair_queue.h），cost 为相对代价
+    int sched_level( int& cost ) const;
+    unsigned client_key() const { return m_address.sin_addr.s_addr; } // 公平调度按客户端IP分流
+    // 主线程在交给线程池之前调用：请求行读完后按客户端IP和URL限速，超过时直接回复429，返回false
+    bool admit();
+    // 连接已经升级为 WebSocket：之后只由主线程调用 process_ws，读收到的帧、发送排队的广播；返回false表示需要关闭连接
+    bool websocket() const { return m_ws != NULL; }
+    bool process_ws();
 private:
+    void alloc_buffers(); // 从所属节点的缓冲区池取读写缓冲区，之后连接复用，节点变化时才更换
+    // 工作线程中结束连接：只关闭读方向并重新注册，主线程随后收到 EPOLLRDHUP 再调用 close_conn。
+    // 工作线程不能自己关闭描述符，否则主线程可能马上 accept 到同一个描述符，而这里还在修改连接的状态
+    void close_later();
     void init(); // 初始化连接
-    HTTP_CODE process_read(); //解析HTTP请求
+    HTTP_CODE process_read(); //解析HTTP请求，请求完整时返回GET_REQUEST，不访问文件系统
     bool process_write(HTTP_CODE ret); // 填充http响应报文
 
-    // 下面这一组函数被process_read调用以分析HTTP请求
+    // 下面这一组函数被process_read调用以分析HTTP请求，请求行和请求头的格式见 http_request.h
     HTTP_CODE parse_request_line(char* text);
     HTTP_CODE parse_headers(char* text);
     HTTP_CODE parse_content(char* text);
     HTTP_CODE do_request();
+    HTTP_CODE do_microcache();
+    // 转发给代理或 FastCGI 的上游，返回0表示响应已经转发，否则返回应该回复客户端的状态码；
+    // capture 不为 NULL 时记下发给客户端的响应，用来填充微缓存
+    int do_upstream( microcache_capture* capture );
+    int do_proxy( microcache_capture* capture );
+    int do_fastcgi( microcache_capture* capture );
+    // HTTP/2（见 http2.h）：连接交给 m_h2 之后读缓冲区只用来中转收到的数据
+    bool upgrade_h2();      // 请求带 Upgrade: h2c 时切换到 HTTP/2，这个请求成为流1
+    void process_h2();
+    bool write_h2();
+    // WebSocket（见 websocket.h）：parse_headers 在请求头结束时检查升级请求，101 发完后创建 m_ws
+    bool websocket_requested();
+    void upgrade_ws();
+    // TLS 握手：完成时返回true；要等待时重新注册事件、失败时交给主线程关闭连接（close_later），返回false
+    bool handshake();
     char* get_line() {return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
@@ -92,33 +142,50 @@ private:
 public:
     // 全局静态变量，只能在类内使用？
     static int m_epollfd; // 所有socket上的事件都被注册到同一个epoll内核事件，所以设置为静态的 
-    static int m_user_count; // 统计用户的数量
+    static std::atomic< int > m_user_count; // 统计用户的数量，工作线程和主线程都会修改
+    static int m_read_buffer_size;  // 读缓冲区的大小，由配置决定（server_config）
+    static int m_write_buffer_size; // 写缓冲区的大小
+    static const char* m_doc_root;  // 网站的根目录
+    static std::atomic< bool > m_closing; // 服务器正在退出：之后的响应都带 Connection: close，发完即关闭
 
 private:
     int m_sockfd; // 该HTTP连接的socket和对方的socket地址
     sockaddr_in m_address;
+    int m_node;                                 // 连接所属的NUMA节点，决定由哪个线程池处理
 
-    char m_read_buf[ READ_BUFFER_SIZE ];        // 读缓冲区
+    char* m_read_buf;                           // 读缓冲区，大小为m_read_buffer_size
     int m_read_idx;                             // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
     int m_checked_idx;                          // 当前正在分析的字符在读缓冲区中的位置
     int m_start_line;                           // 当前正在解析行的起始位置
 
     CHECK_STATE m_check_state;                  // 主状态机当前所处的状态
-    METHOD m_method;                            // 请求方法
-
-    char m_real_file[ FILENAME_LEN];            // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站的根目录
-    char* m_url;                                // 客户请求的目标文件的文件名
-    char* m_version;                            // http的版本号
-    char* m_host;                               // 主机名
-    int m_content_length;                       // http请求的消息总长度
-    bool m_linger;                              // http请求是否要保持连接
+    http_request m_req;                         // 请求行和请求头中解析出的内容，见 http_request.h
+    bool m_linger;                              // 响应之后是否保持连接，开始时取请求中的 Connection
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];      // 写缓冲区
+    char* m_write_buf;                          // 写缓冲区，大小为m_write_buffer_size
+    int m_buf_node;                             // 读写缓冲区所在的节点
     int m_write_idx;                            // 写缓冲区中待发送的字节数
     char* m_file_address;                       // 客户请求的目标文件被mmap到内存中的起始位置
     struct stat m_file_stat;                    // 目标文件的状态，通过它我们可以判断文件是否存在，是否为目录，是否可读，并获取文件大小等信息
     struct iovec m_iv[2];                       // 我们将采用writev来执行写操作，所以定义两个成员，其中m_iv_count表示被写内存块的数量。
     int m_iv_count;
+    int m_bytes_to_send;                        // 响应中还未发送的字节数
+    int m_bytes_have_send;                      // 响应中已经发送的字节数
+    std::string m_dynamic;                      // 服务器生成的响应体，DYNAMIC_REQUEST时由m_iv[1]指向
+    const char* m_content_type;                 // 响应的Content-Type
+    const bundle_entry* m_entry;                // BUNDLE_REQUEST 时请求的文件在资源包中的条目
+    bool m_gzip;                                // 发送 m_entry 的 gzip 版本
+    int m_headers_start;                        // 第一个请求头在读缓冲区中的位置，各行以 "\0\0" 分隔
+    std::shared_ptr< const microcache_object > m_cached;    // CACHE_HIT 时回复的响应，发送完后释放
+    bool m_admitted;                            // 这个请求已经检查过限速
+    int m_retry_after;                          // TOO_MANY_REQUESTS 时的 Retry-After（秒）
+    bool m_conn_counted;                        // 关闭时要从客户端的连接数中减去
+    h2_session* m_h2;                           // 连接已经切换到 HTTP/2，关闭连接时释放
+    tls_conn* m_tls;                            // HTTPS 连接的 TLS 状态，明文连接为NULL
+    bool m_handshaking;                         // TLS 握手还没有完成
+    bool m_websocket;                           // 这个请求是 WebSocket 的升级请求
+    std::string m_ws_accept;                    // 101 响应中 Sec-WebSocket-Accept 的值
+    ws_conn* m_ws;                              // 连接已经升级为 WebSocket，关闭连接时释放
 };
 
 #endif
\ No newline at end of file
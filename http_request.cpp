@@ -0,0 +1,179 @@
+#include "http_request.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "http_conn.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "proxy.h"
+
+void http_request::clear() {
+    method = GET;
+    method_name = "GET";
+    url = NULL;
+    host = NULL;
+    content_length = 0;
+    keep_alive = false;
+    chunked = false;
+    if_none_match = NULL;
+    accept_gzip = false;
+    route = -1;
+}
+
+// 解析请求行，获取行的请求方法，请求资源，版本号
+bool http_parse_request_line( char* text, http_request& req ) {
+    // GET /index.html HTTP/1.1
+    char* url = strpbrk( text, " \t" ); // 判断第二个参数中的字符哪个最先出现在text中
+    if ( !url ) {
+        return false;
+    }
+    // GET\0/index.html HTTP/1.1
+    *url++ = '\0'; // 置为空字符，字符串结束
+    static const char* const methods[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+    int i = 0;
+    while ( i < ( int )( sizeof( methods ) / sizeof( methods[0] ) ) && strcasecmp( text, methods[i] ) != 0 ) {
+        // 忽略大小写比较
+        ++i;
+    }
+    // TRACE 和 CONNECT 不转发
+    if ( i == http_request::TRACE || i == http_request::CONNECT || i == ( int )( sizeof( methods ) / sizeof( methods[0] ) ) ) {
+        return false;
+    }
+    req.method = ( http_request::METHOD )i;
+    req.method_name = methods[i];
+    // /index.html HTTP/1.1
+    url += strspn( url, " \t" );
+    char* version = strpbrk( url, " \t" );
+    if ( !version ) {
+        return false;
+    }
+    *version++ = '\0'; // /index.html\0HTTP/1.1
+    version += strspn( version, " \t" );
+    if ( strcasecmp( version, "HTTP/1.1" ) != 0 ) {
+        // 只能处理http1.1版本的连接
+        return false;
+    }
+    // http://192.168.110.129:10000/index.html
+    if ( strncasecmp( url, "http://", 7 ) == 0 ) {
+        // 在参数 str 所指向的字符串中搜索第一次出现字符 c (一个无符号字符) 的位置。
+        url = strchr( url + 7, '/' );
+    }
+    if ( !url || url[0] != '/' ) {
+        return false;
+    }
+    req.url = url;
+    // GET 以外的方法只用于反向代理
+    req.route = http_route( url );
+    return req.method == http_request::GET || req.route >= 0;
+}
+
+// 解析HTTP头部信息
+int http_parse_header( char* text, http_request& req ) {
+    if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
+        // strncasecmp 需要指定比较的字符个数 strcasecmp不需要指定
+        // 处理 Connection 头部字段，Connetcion: keep-alive
+        text += 11;
+        text += strspn( text, " \t" ); // text指向下一个信息
+        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
+            req.keep_alive = true;
+        }
+    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
+        text += 15;
+        text += strspn( text, " \t" );
+        req.content_length = atol( text );
+        if ( req.content_length < 0 ) {
+            return HTTP_HEADER_BAD;
+        }
+    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
+        text += 5;
+        text += strspn( text, " \t" );
+        req.host = text;
+    } else if ( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 ) {
+        // 只有代理的路径接受 chunked 请求体，原样转发
+        text += 18;
+        text += strspn( text, " \t" );
+        if ( strcasecmp( text, "chunked" ) != 0 || req.route < 0 ) {
+            return HTTP_HEADER_BAD;
+        }
+        req.chunked = true;
+    } else if ( strncasecmp( text, "If-None-Match:", 14 ) == 0 ) {
+        // 条件请求，资源包中的文件校验值相同时回复304
+        req.if_none_match = text + 14 + strspn( text + 14, " \t" );
+    } else if ( strncasecmp( text, "Accept-Encoding:", 16 ) == 0 ) {
+        req.accept_gzip = bundle_accept_gzip( text + 16 );
+    } else {
+        return HTTP_HEADER_OTHER;
+    }
+    return HTTP_HEADER_KNOWN;
+}
+
+bool http_headers_complete( const http_request& req ) {
+    // 同时带 chunked 和 Content-Length 的请求体长度有歧义（请求走私），不接受
+    return !( req.chunked && req.content_length > 0 );
+}
+
+int http_route( const char* url ) {
+    if ( proxy_routes.empty() || strcmp( url, METRICS_URL ) == 0 || profiler_match( url ) ) {
+        return -1;
+    }
+    return proxy_match( url );
+}
+
+// 从资源包中取文件：一次二分查找，不访问文件系统
+static int resolve_bundle( const char* url, const char* if_none_match, bool accept_gzip, http_content& c ) {
+    c.entry = bundle_find( url, strlen( url ) );
+    if ( !c.entry ) {
+        return 404;
+    }
+    c.gzip = accept_gzip && c.entry->gzip_size > 0;
+    if ( bundle_etag_match( if_none_match, bundle_etag( c.entry, c.gzip ) ) ) {
+        bundle_count( true, c.gzip );
+        return 304;
+    }
+    bundle_count( false, c.gzip );
+    c.type = bundle_type( c.entry );
+    c.size = c.gzip ? c.entry->gzip_size : c.entry->size;
+    return 200;
+}
+
+int http_resolve( const char* url, const char* if_none_match, bool accept_gzip, http_content& c ) {
+    // 运行时指标不对应文件
+    if ( strcmp( url, METRICS_URL ) == 0 ) {
+        metrics_render( c.dynamic );
+        c.type = "text/plain; version=0.0.4";
+        c.size = c.dynamic.size();
+        return 200;
+    }
+    // 配置了资源包时只从包中取文件
+    if ( bundle_loaded() ) {
+        return resolve_bundle( url, if_none_match, accept_gzip, c );
+    }
+    // 目标文件的完整路径是 doc_root + url
+    char path[ http_conn::FILENAME_LEN ];
+    int len = snprintf( path, sizeof( path ), "%s%s", http_conn::m_doc_root, url );
+    if ( len < 0 || len >= ( int )sizeof( path ) ) {
+        return 404;
+    }
+    struct stat st;
+    if ( stat( path, &st ) < 0 ) {
+        return 404;
+    }
+    // 判断访问权限
+    if ( !( st.st_mode & S_IROTH ) ) {
+        return 403;
+    }
+    // 判断是否是目录
+    if ( S_ISDIR( st.st_mode ) ) {
+        return 400;
+    }
+    c.file_fd = open( path, O_RDONLY );
+    if ( c.file_fd < 0 ) {
+        return 404;
+    }
+    c.size = st.st_size;
+    return 200;
+}
@@ -0,0 +1,70 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <string>
+#include "bundle.h"
+
+/*
+    HTTP/1.1 请求的解析和静态内容的查找，线程池模式（http_conn）和协程模式（coro.cpp）共用，
+    HTTP/2（http2.cpp）也用 http_resolve 找内容。这里不读写套接字：
+    http_conn 用状态机一行一行地喂给解析函数，协程读到完整的请求头之后再逐行调用。
+
+    只支持 HTTP/1.1。请求行和请求头在读缓冲区中原地切分，http_request 中的指针都指向读缓冲区。
+    GET 以外的方法只用于反向代理和 FastCGI 的路径（见 proxy.h），TRACE 和 CONNECT 不转发；
+    chunked 的请求体也只有这些路径接受，而且不能同时带 Content-Length。
+*/
+
+struct http_request {
+    // HTTP请求方法，文件只支持get，反向代理的路径还支持其他方法
+    enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH};
+
+    METHOD method;              // 请求方法
+    const char* method_name;    // 请求行中的方法，原样转发给上游
+    char* url;                  // 请求的路径（含查询参数）
+    char* host;                 // Host 头，没有时为NULL
+    long content_length;        // 请求体的长度
+    bool keep_alive;            // Connection: keep-alive
+    bool chunked;               // 请求体是 Transfer-Encoding: chunked
+    const char* if_none_match;  // If-None-Match 的值，没有时为NULL
+    bool accept_gzip;           // Accept-Encoding 中有 gzip
+    int route;                  // 匹配的反向代理或 FastCGI 路由（proxy_routes 的下标），没有时为-1
+
+    http_request() { clear(); }
+    void clear();
+};
+
+// 解析请求行（已经去掉了行尾的 \r\n），格式错误时返回false
+bool http_parse_request_line( char* text, http_request& req );
+
+// 解析一个请求头（已经去掉了行尾的 \r\n），返回 HTTP_HEADER
+enum HTTP_HEADER { HTTP_HEADER_BAD = 0, HTTP_HEADER_KNOWN, HTTP_HEADER_OTHER };
+int http_parse_header( char* text, http_request& req );
+
+// 请求头都解析完之后检查它们的组合，不能接受时返回false
+bool http_headers_complete( const http_request& req );
+
+// url 对应的反向代理或 FastCGI 路由，没有时返回-1；运行时指标和采样剖析的URL不转发
+int http_route( const char* url );
+
+// http_resolve 找到的内容，三种之一：
+//     entry 不为NULL    资源包中的文件（gzip 为true时发送压缩的版本），内容用 bundle_content 取
+//     file_fd 不为-1    doc_root 中的文件，已经打开，调用方负责关闭
+//     否则              服务器生成的内容（运行时指标），在 dynamic 中
+struct http_content {
+    http_content() : type( "text/html" ), entry( NULL ), gzip( false ), file_fd( -1 ), size( 0 ) {}
+    const char* type;           // Content-Type
+    std::string dynamic;
+    const bundle_entry* entry;
+    bool gzip;
+    int file_fd;
+    off_t size;                 // 响应体的长度
+};
+
+// 找到 url 对应的静态内容：运行时指标、资源包中的文件（配置了 bundle 时），或者 doc_root 中的文件。
+// 返回状态码：200；304（资源包中的文件和 If-None-Match 相同，entry 有效，用于生成 ETag）；
+// 404 没有这个文件；403 没有读权限；400 是目录
+int http_resolve( const char* url, const char* if_none_match, bool accept_gzip, http_content& c );
+
+#endif
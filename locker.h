@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <time.h>
 
 // 互斥量
 class locker {
@@ -100,6 +101,19 @@ public:
         return sem_wait(&m_sem) == 0;
     }
 
+    // 最多等待 ms 毫秒，超时或被信号中断返回false
+    bool timedwait(int ms) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += ms / 1000;
+        t.tv_nsec += (long)(ms % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000) {
+            t.tv_sec += 1;
+            t.tv_nsec -= 1000000000;
+        }
+        return sem_timedwait(&m_sem, &t) == 0;
+    }
+
     // 增加信号量
     bool post() {
         return sem_post(&m_sem) == 0;
@@ -8,12 +8,25 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
-
-#define MAX_FD 65536  //最大文件描述符的个数
-#define MAX_EVENT_NUMBER 10000 // 监听的最大事件数量
+#include "metrics.h"
+#include "perf_counter.h"
+#include "sockopt.h"
+#include "config.h"
+#include "affinity.h"
+#include "coro.h"
+#include "upgrade.h"
+#include "bundle.h"
+#include "proxy.h"
+#include "fastcgi.h"
+#include "microcache.h"
+#include "ratelimit.h"
+#include "http2.h"
+#include "tls.h"
+#include "websocket.h"
 
 // 添加文件描述符
 extern void addfd( int epollfd, int fd, bool one_shot);
@@ -29,36 +42,86 @@ void addsig(int sig, void(handler)(int)) {
     assert( sigaction( sig, &sa, NULL ) != -1);
     // 注册哪个信号，信号参数
 }
-// 在命令行中需要输入参数，因此main函数中设置argc、argv
-int main(int argc, char * argv[]) {
+// 工作线程的绑定方式，每个节点的线程池一份
+struct worker_placement {
+    int node;
+    int reactor_cpu;    // 主线程占用的CPU，-1表示没有绑定
+};
 
-    if (argc <= 1) {
-        // 至少传递一个端口号
-        // basename()获取基础的名字，程序名称
-        printf("按照如下格式运行： %s port_number\n",basename(argv[0]));
-        exit(-1);
+// 线程池的线程启动时调用：cpu_affinity 开启时按序号轮流绑定到本节点的一个CPU（尽量避开主线程），
+// 否则只在 numa 开启时限制在本节点的CPU上
+void pin_worker( int index, void* arg ) {
+    worker_placement* place = ( worker_placement* )arg;
+    // 升级和退出的信号只由主线程处理
+    upgrade_block_signals();
+    if ( server_conf.cpu_affinity ) {
+        std::vector< int > cpus = numa_node_cpus( place->node );
+        if ( cpus.size() > 1 ) {
+            for ( size_t i = 0; i < cpus.size(); ++i ) {
+                if ( cpus[i] == place->reactor_cpu ) {
+                    cpus.erase( cpus.begin() + i );
+                    break;
+                }
+            }
+        }
+        if ( !cpus.empty() ) {
+            pin_thread_cpu( cpus[ index % cpus.size() ] );
+        }
+    } else if ( server_conf.numa ) {
+        pin_thread_node( place->node );
     }
+}
 
-    // 获取端口号
-    int port = atoi(argv[1]);
-    addsig( SIGPIPE, SIG_IGN );
+// 每个节点一个线程池
+static std::vector< threadpool< http_conn >* > pools;
 
-    threadpool< http_conn >* pool = NULL;
-    try {
-        //printf("console:\n");
-        pool = new threadpool<http_conn>;
-    } catch( ... ) {
-        return 1;
+// 线程池的线程数和排队情况，注册到 metrics 中
+void pool_metrics( std::string& out ) {
+    char labels[ 32 ];
+    metrics_header( out, "webserver_pool_threads", "gauge", "Worker threads currently running." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        snprintf( labels, sizeof( labels ), "node=\"%d\"", ( int )n );
+        metrics_gauge( out, "webserver_pool_threads", labels, pools[n]->threads() );
     }
+    metrics_header( out, "webserver_pool_idle_threads", "gauge", "Worker threads waiting for a request." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        snprintf( labels, sizeof( labels ), "node=\"%d\"", ( int )n );
+        metrics_gauge( out, "webserver_pool_idle_threads", labels, pools[n]->idle() );
+    }
+    metrics_header( out, "webserver_pool_queued", "gauge", "Requests waiting in the pool queue." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        snprintf( labels, sizeof( labels ), "node=\"%d\"", ( int )n );
+        metrics_gauge( out, "webserver_pool_queued", labels, pools[n]->queued() );
+    }
+    metrics_header( out, "webserver_pool_queued_level", "gauge", "Requests waiting in the pool queue by cost level." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        for ( int level = 0; level < fair_queue< http_conn >::LEVELS; ++level ) {
+            snprintf( labels, sizeof( labels ), "node=\"%d\",level=\"%d\"", ( int )n, level );
+            metrics_gauge( out, "webserver_pool_queued_level", labels, pools[n]->queued( level ) );
+        }
+    }
+    metrics_header( out, "webserver_pool_spawned_total", "counter", "Worker threads started." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        snprintf( labels, sizeof( labels ), "node=\"%d\"", ( int )n );
+        metrics_counter( out, "webserver_pool_spawned_total", labels, pools[n]->spawned() );
+    }
+    metrics_header( out, "webserver_pool_retired_total", "counter", "Worker threads that exited after being idle." );
+    for ( size_t n = 0; n < pools.size(); ++n ) {
+        snprintf( labels, sizeof( labels ), "node=\"%d\"", ( int )n );
+        metrics_counter( out, "webserver_pool_retired_total", labels, pools[n]->retired() );
+    }
+}
 
-    // 申请一个http连接池，存储到达的所有连接
-    http_conn* users = new http_conn[ MAX_FD ];
-
+// 新建监听套接字，backlog 为全连接队列的长度；端口被占用等失败时打印原因并退出
+static int open_listener( int port, int backlog ) {
     // 创建监听文件描述符 被动套接字，由内核接收连接请求
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0);
+    int listenfd = socket( PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( listenfd < 0 ) {
+        printf( "socket: %s\n", strerror( errno ) );
+        exit(-1);
+    }
 
     // 创建监听套接字
-    int ret = 0;
     struct sockaddr_in address;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_family = AF_INET;
@@ -67,60 +130,316 @@ int main(int argc, char * argv[]) {
     // 端口复用
     int reuse = 1;
     setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    // 需要强制类型转换，sockaddr_in转换为sockaddr，绑定端口和ip
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) ); 
-    ret = listen( listenfd, 5); // 开始监听，设置半连接+全连接的最大连接数量,若是请求的连接大于队列最大数量，则会对这些连接返回RST
-    
+    sockopt_listen( listenfd );
+    // 需要强制类型转换，sockaddr_in转换为sockaddr，绑定端口和ip；
+    // bind 失败时不能继续 listen，否则内核会绑定一个随机端口
+    if ( bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 ) {
+        printf( "bind port %d: %s\n", port, strerror( errno ) );
+        exit(-1);
+    }
+    // 开始监听，若是请求的连接大于队列最大数量，新的SYN会被丢弃，客户端要等重传
+    if ( listen( listenfd, backlog ) < 0 ) {
+        printf( "listen port %d: %s\n", port, strerror( errno ) );
+        exit(-1);
+    }
+    return listenfd;
+}
+
+// 在命令行中需要输入参数，因此main函数中设置argc、argv
+int main(int argc, char * argv[]) {
+
+    // 读取配置：默认值 < 配置文件 < 命令行
+    // basename()获取基础的名字，程序名称
+    std::string err;
+    server_config& conf = server_conf;
+    if ( !config_parse_args( argc, argv, conf, err ) || !config_validate( conf, err ) ) {
+        printf( "%s\n", err.c_str() );
+        printf( "按照如下格式运行： %s [-f 配置文件] [--键=值]... [port_number]\n", basename( argv[0] ) );
+        exit(-1);
+    }
+    int port = conf.port;
+    http_conn::m_read_buffer_size = conf.read_buffer_size;
+    http_conn::m_write_buffer_size = conf.write_buffer_size;
+    http_conn::m_doc_root = conf.doc_root.c_str();
+    sockopt_parse( conf.socket_options.c_str(), sockopt_profile, err );
+    // 静态资源包只在启动时 mmap 一次；升级时新进程重新打开，换上新的包
+    if ( !conf.bundle.empty() ) {
+        if ( !bundle_open( conf.bundle.c_str(), err ) ) {
+            printf( "%s\n", err.c_str() );
+            exit(-1);
+        }
+        printf( "bundle: %s\n", conf.bundle.c_str() );
+    }
+    // 反向代理和 FastCGI 的上游地址在启动时解析一次
+    proxy_parse( conf.proxy.c_str(), proxy_routes, err );
+    fastcgi_parse( conf.fastcgi.c_str(), conf.fastcgi_max_conns, proxy_routes, err );
+    fastcgi_root = conf.fastcgi_root.empty() ? conf.doc_root : conf.fastcgi_root;
+    proxy_timeout_ms = conf.proxy_timeout_ms;
+    proxy_idle_max = conf.proxy_idle;
+    proxy_balance = proxy_balance_parse( conf.proxy_balance.c_str() );
+    proxy_max_fails = conf.proxy_max_fails;
+    proxy_eject_ms = conf.proxy_eject_ms;
+    microcache_init( ( size_t )conf.microcache_mb << 20, ( size_t )conf.microcache_max_object_kb << 10 );
+    std::vector< ratelimit_prefix > rate_prefixes;
+    ratelimit_parse( conf.rate_limit_prefixes.c_str(), rate_prefixes, err );
+    ratelimit_init( conf.rate_limit, conf.rate_limit_burst, conf.conn_limit, conf.rate_limit_slots, rate_prefixes );
+    http2_enabled = conf.http2;
+    http2_max_streams = conf.http2_max_streams;
+    std::vector< std::string > ws_prefixes;
+    ws_parse( conf.websocket.c_str(), ws_prefixes, err );
+    ws_init( ws_prefixes, ws_publish_parse( conf.websocket_publish.c_str() ), ( size_t )conf.websocket_queue_kb << 10,
+             ( size_t )conf.websocket_max_message_kb << 10 );
+    for ( size_t i = 0; i < ws_prefixes.size(); ++i ) {
+        printf( "websocket: %s\n", ws_prefixes[i].c_str() );
+    }
+    // 证书和私钥在启动时加载一次，升级时新进程重新加载，换上新的证书
+    if ( conf.tls_port != 0 &&
+         !tls_init( conf.tls_cert.c_str(), conf.tls_key.c_str(), conf.tls_ticket_key.c_str(), conf.tls_session_cache,
+                    conf.tls_session_timeout, err ) ) {
+        printf( "%s\n", err.c_str() );
+        exit(-1);
+    }
+    for ( size_t i = 0; i < proxy_routes.size(); ++i ) {
+        std::string names;
+        for ( size_t j = 0; j < proxy_routes[i].upstreams.size(); ++j ) {
+            names += ( j ? " | " : "" ) + proxy_routes[i].upstreams[j].name;
+        }
+        printf( "%s: %s -> %s\n", proxy_routes[i].fastcgi ? "fastcgi" : "proxy", proxy_routes[i].prefix.c_str(), names.c_str() );
+    }
+
+    // 文件描述符上限至少要能容纳 max_fd 个连接
+    rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur < ( rlim_t )conf.max_fd ) {
+        rl.rlim_cur = rl.rlim_max < ( rlim_t )conf.max_fd ? rl.rlim_max : ( rlim_t )conf.max_fd;
+        setrlimit( RLIMIT_NOFILE, &rl );
+        if ( rl.rlim_cur < ( rlim_t )conf.max_fd ) {
+            printf( "warning: RLIMIT_NOFILE hard limit %lu is below max_fd %d\n", ( unsigned long )rl.rlim_max, conf.max_fd );
+        }
+    }
+    addsig( SIGPIPE, SIG_IGN );
+
+    // 运行时指标，通过 METRICS_URL 访问
+    metrics_register( config_metrics );
+    metrics_register( http_conn::metrics );
+    metrics_register( affinity_metrics );
+    metrics_register( pool_metrics );
+    metrics_register( bundle_metrics );
+    metrics_register( proxy_metrics );
+    metrics_register( fastcgi_metrics );
+    metrics_register( microcache_metrics );
+    metrics_register( ratelimit_metrics );
+    metrics_register( http2_metrics );
+    metrics_register( tls_metrics );
+    metrics_register( websocket_metrics );
+    // 硬件性能计数器有额外的系统调用开销，配置 perf_counters = on 才开启
+    if ( conf.perf_counters && !perf_counter_enable() ) {
+        printf( "perf counters unavailable\n" );
+    }
+
+    // 读取CPU拓扑，主线程绑定到0号节点的第一个CPU
+    affinity_init( conf.numa );
+    int nodes = numa_nodes();
+    int reactor_cpu = -1;
+    if ( conf.cpu_affinity && !numa_node_cpus( 0 ).empty() ) {
+        reactor_cpu = numa_node_cpus( 0 )[0];
+        pin_thread_cpu( reactor_cpu );
+    }
+    printf( "numa nodes: %d, reactor cpu: %d\n", nodes, reactor_cpu );
+
+    // 升级时由旧进程启动，直接使用继承的监听套接字，不再 bind（见 upgrade.h）
+    int listenfd = upgrade_inherited_listener();
+    // 套接字选项配置，例如 --socket_options=nodelay,sndbuf=262144，格式见 sockopt.h
+    printf( "socket options: %s\n", sockopt_describe( sockopt_profile ).c_str() );
+    if ( listenfd >= 0 ) {
+        printf( "inherited listening socket %d\n", listenfd );
+        sockopt_listen( listenfd );
+    } else {
+        listenfd = open_listener( port, conf.listen_backlog );
+    }
+    // HTTPS 的监听套接字，升级时同样继承
+    int tls_listenfd = upgrade_inherited_listener( UPGRADE_TLS_LISTEN_ENV );
+    if ( conf.tls_port == 0 && tls_listenfd >= 0 ) {
+        close( tls_listenfd );
+        tls_listenfd = -1;
+    } else if ( conf.tls_port != 0 ) {
+        if ( tls_listenfd >= 0 ) {
+            printf( "inherited https listening socket %d\n", tls_listenfd );
+            sockopt_listen( tls_listenfd );
+        } else {
+            tls_listenfd = open_listener( conf.tls_port, conf.listen_backlog );
+        }
+        printf( "https port: %d\n", conf.tls_port );
+    }
+    // 升级和退出的信号通过自管道送到主循环
+    int sigfd = upgrade_signal_init();
+
     // listen中TCP为此维护两个队列
+    if ( conf.coroutines ) {
+        // 协程模型：不使用线程池和连接数组，见 coro.h
+        return coro_serve( listenfd, tls_listenfd, conf.threads, sigfd, argv ) == 0 ? 0 : 1;
+    }
+
+    // 每个节点一个线程池，线程数按节点平分，每个池至少一个线程
+    pools.assign( nodes, ( threadpool< http_conn >* )NULL );
+    std::vector< worker_placement > places( nodes );
+    try {
+        //printf("console:\n");
+        for ( int n = 0; n < nodes; ++n ) {
+            int threads = conf.threads / nodes + ( n < conf.threads % nodes ? 1 : 0 );
+            int max_threads = conf.max_threads / nodes + ( n < conf.max_threads % nodes ? 1 : 0 );
+            places[n].node = n;
+            places[n].reactor_cpu = reactor_cpu;
+            pools[n] = new threadpool<http_conn>( threads > 0 ? threads : 1, conf.max_requests, pin_worker, &places[n],
+                                                  max_threads, conf.pool_spawn_us, conf.pool_idle_ms );
+        }
+    } catch( ... ) {
+        return 1;
+    }
+
+    // 申请一个http连接池，存储到达的所有连接，下标就是连接的文件描述符
+    const int max_fd = conf.max_fd;
+    http_conn* users = new http_conn[ max_fd ];
+
     // 创建epoll对象，和事件数组，添加
-    epoll_event events[ MAX_EVENT_NUMBER]; // epoll连接池
+    epoll_event* events = new epoll_event[ conf.max_events ]; // epoll连接池
     int epollfd = epoll_create( 5 );
     // 添加到epoll对象中
     addfd( epollfd, listenfd, false);
+    if ( tls_listenfd >= 0 ) {
+        addfd( epollfd, tls_listenfd, false );
+    }
+    addfd( epollfd, sigfd, false );
     http_conn::m_epollfd = epollfd;
+    // WebSocket 连接都在主线程上收发，主线程是唯一的反应堆，发布也都在主线程，用不到收件箱和唤醒
+    if ( ws_enabled() ) {
+        ws_reactor_bind( ws_reactor_new( -1 ) );
+    }
+
+    // 收到 SIGTERM/SIGQUIT 后进入排空状态，等已有的连接处理完或到达 drain_deadline 后退出
+    bool draining = false;
+    uint64_t drain_deadline = 0;
+    uint64_t idle_deadline = 0;     // 到时关闭仍然空闲的长连接，0 表示已经关闭过
 
     while (true) {
 
+        if ( draining ) {
+            if ( http_conn::m_user_count <= 0 ) {
+                printf( "drained, exiting\n" );
+                break;
+            }
+            uint64_t now = upgrade_clock_ms();
+            if ( now >= drain_deadline ) {
+                printf( "drain timeout, %d connections left\n", ( int )http_conn::m_user_count );
+                break;
+            }
+            if ( idle_deadline && now >= idle_deadline ) {
+                // 关闭读方向后空闲的连接马上收到 EPOLLRDHUP 被关闭；
+                // 正在处理的连接发完这次响应后关闭；WebSocket 连接先发送 1001，发完后关闭
+                idle_deadline = 0;
+                for ( int fd = 0; fd < max_fd; ++fd ) {
+                    if ( users[fd].sockfd() < 0 ) {
+                        continue;
+                    }
+                    if ( users[fd].websocket() ) {
+                        if ( !users[fd].process_ws() ) {
+                            users[fd].close_conn();
+                        }
+                    } else {
+                        shutdown( fd, SHUT_RD );
+                    }
+                }
+            }
+        }
+
         // 返回epollfd内核时间表中触发的事件数量，触发事件保存在events中，-1表示阻塞时间没有限制
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        // 排空时每100毫秒醒来检查一次连接数
+        int number = epoll_wait( epollfd, events, conf.max_events, draining ? 100 : -1 );
 
         if ( ( number < 0) && ( errno != EINTR) ) {
             printf( "epoll failure\n" );
             break;
         }
 
+        perf_scope dispatch_scope( PERF_STAGE_DISPATCH, number > 0 ? number : 0 );
         for (int i = 0; i < number; i++) {
 
             // 获得每一个连接的fd
             int sockfd = events[i].data.fd;
             
-            if (  sockfd == listenfd ) {
+            if ( sockfd == sigfd ) {
+                int ev = upgrade_signal_take();
+                if ( ( ev & UPGRADE_REEXEC ) && !draining ) {
+                    upgrade_spawn( listenfd, tls_listenfd, argv );
+                }
+                if ( ( ev & UPGRADE_STOP ) && !draining ) {
+                    // 停止 accept，监听套接字留在进程中直到退出，新进程还在上面接收连接；
+                    // 之后的响应都带 Connection: close，见 upgrade.h
+                    printf( "draining %d connections\n", ( int )http_conn::m_user_count );
+                    draining = true;
+                    http_conn::m_closing = true;
+                    epoll_ctl( epollfd, EPOLL_CTL_DEL, listenfd, 0 );
+                    if ( tls_listenfd >= 0 ) {
+                        epoll_ctl( epollfd, EPOLL_CTL_DEL, tls_listenfd, 0 );
+                    }
+                    drain_deadline = upgrade_clock_ms() + conf.drain_timeout_ms;
+                    idle_deadline = upgrade_clock_ms() + UPGRADE_IDLE_GRACE_MS;
+                }
+            } else if (  sockfd == listenfd || sockfd == tls_listenfd ) {
                 // 若触发的文件描述符是监听描述符则说明有新的连接到达
                 struct sockaddr_in client_address;
                 socklen_t client_addrlength = sizeof( client_address );
                 // 监听描述符上有新的连接到达，新建客户端的文件描述符
-                int connfd = accept( listenfd, ( struct sockaddr* )& client_address, &client_addrlength);
+                int connfd = accept( sockfd, ( struct sockaddr* )& client_address, &client_addrlength);
 
                 if ( connfd < 0 ) {
-                    // -1则失败
-                    printf( "errno is : %d\n", errno );
+                    // -1则失败；升级期间新旧进程同时 accept，被对方取走时是 EAGAIN
+                    if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                        printf( "errno is : %d\n", errno );
+                    }
                     continue;
                 }
 
-                if ( http_conn::m_user_count >= MAX_FD ) {
-                    close(connfd); // 若当前连接数量 > 最大连接数则关闭连接
-                }   
-                users[connfd].init( connfd, client_address);
+                if ( connfd >= max_fd || http_conn::m_user_count >= max_fd ) {
+                    close(connfd); // 若当前连接数量 > 最大连接数则关闭连接，描述符超出连接数组的也不能接收
+                    continue;
+                }
+                // 同一个IP的连接超过 conn_limit 时直接关闭，见 ratelimit.h
+                bool counted;
+                if ( !ratelimit_connect( client_address.sin_addr.s_addr, counted ) ) {
+                    close( connfd );
+                    continue;
+                }
+                // numa 开启时连接交给收到它的CPU所在节点的线程池处理
+                // HTTPS 端口上的连接先在工作线程中握手，见 tls.h
+                users[connfd].init( connfd, client_address, socket_node( connfd ), counted, sockfd == tls_listenfd );
             
-            }  else if ( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR) ) {
+            }  else if ( ( events[i].events & ( EPOLLHUP | EPOLLERR ) ) ||
+                         ( ( events[i].events & EPOLLRDHUP ) && !( draining && ( events[i].events & EPOLLOUT ) ) ) ) {
+                // 排空时读方向被关闭过，等待发送的连接也会带上EPOLLRDHUP，要先把响应发完
                 
                 users[sockfd].close_conn();
 
+            } else if ( users[sockfd].websocket() ) {
+                // WebSocket 连接不进入线程池，收到的帧和要发送的广播都在这里处理，见 websocket.h
+                if ( !users[sockfd].process_ws() ) {
+                    users[sockfd].close_conn();
+                }
             } else if (events[i].events & EPOLLIN) {
                 
                 if (users[sockfd].read()) {
-                    // 通知读取sockfd上的数据
-                    pool->append(users + sockfd);
+                    // 超过限速的请求在这里回复429，不进入线程池的队列
+                    if ( !users[sockfd].admit() ) {
+                        continue;
+                    }
+                    // 通知读取sockfd上的数据；公平调度时按预计代价分级、按客户端分流
+                    threadpool< http_conn >* pool = pools[ users[sockfd].node() ];
+                    if ( conf.fair_sched ) {
+                        int cost;
+                        int level = users[sockfd].sched_level( cost );
+                        pool->append( users + sockfd, level, users[sockfd].client_key(), cost );
+                    } else {
+                        pool->append( users + sockfd );
+                    }
                 } else {
                     users[sockfd].close_conn();
                 }
@@ -135,7 +454,13 @@ int main(int argc, char * argv[]) {
 
     close( epollfd );
     close( listenfd );
+    if ( tls_listenfd >= 0 ) {
+        close( tls_listenfd );
+    }
     delete [] users;
-    delete pool;
+    delete [] events;
+    for ( int n = 0; n < nodes; ++n ) {
+        delete pools[n];
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <vector>
+#include "locker.h"
+#include "metrics.h"
+
+static locker metrics_lock;
+static std::vector< metrics_fn > metrics_fns;
+
+void metrics_register( metrics_fn fn ) {
+    metrics_lock.lock();
+    metrics_fns.push_back( fn );
+    metrics_lock.unlock();
+}
+
+void metrics_render( std::string& out ) {
+    metrics_lock.lock();
+    std::vector< metrics_fn > fns = metrics_fns;
+    metrics_lock.unlock();
+    for ( size_t i = 0; i < fns.size(); ++i ) {
+        fns[i]( out );
+    }
+}
+
+void metrics_header( std::string& out, const char* name, const char* type, const char* help ) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+static void metrics_name( std::string& out, const char* name, const char* labels ) {
+    out += name;
+    if ( labels ) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+}
+
+void metrics_counter( std::string& out, const char* name, const char* labels, uint64_t value ) {
+    char buf[ 32 ];
+    snprintf( buf, sizeof( buf ), "%llu\n", ( unsigned long long )value );
+    metrics_name( out, name, labels );
+    out += buf;
+}
+
+void metrics_gauge( std::string& out, const char* name, const char* labels, double value ) {
+    // 17 位有效数字能精确表示任何 double，整数（配置项、槽数）原样输出，不会变成 1.04858e+06
+    char buf[ 64 ];
+    snprintf( buf, sizeof( buf ), "%.17g\n", value );
+    metrics_name( out, name, labels );
+    out += buf;
+}
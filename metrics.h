@@ -0,0 +1,23 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+// 运行时指标的访问地址，do_request 遇到这个路径时不访问文件系统，直接生成指标文本
+#define METRICS_URL "/__metrics"
+
+// 各模块注册一个输出函数，访问 METRICS_URL 时依次调用，拼接成 Prometheus 文本格式
+typedef void ( *metrics_fn )( std::string& out );
+
+// 在启动阶段（开始服务之前）注册
+void metrics_register( metrics_fn fn );
+// 生成全部指标，可在任意线程中调用
+void metrics_render( std::string& out );
+
+// 下面几个函数供输出函数使用，labels 形如 stage="parse"，没有标签时传 NULL
+void metrics_header( std::string& out, const char* name, const char* type, const char* help );
+void metrics_counter( std::string& out, const char* name, const char* labels, uint64_t value );
+void metrics_gauge( std::string& out, const char* name, const char* labels, double value );
+
+#endif
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include "microcache.h"
+#include "locker.h"
+#include "metrics.h"
+
+static const int SHARDS = 16;
+// 每个条目除了键和响应之外的大致开销
+static const size_t ENTRY_OVERHEAD = 128;
+// 上游的响应不能缓存（或填充失败）后，这段时间内同一个键的请求直接转发，不合并
+static const uint64_t PASS_MS = 2000;
+
+enum { STAT_HIT = 0, STAT_STALE, STAT_MISS, STAT_WAIT, STAT_BYPASS, STAT_STORE, STAT_UNCACHEABLE, STAT_EVICT, STAT_COUNT };
+
+struct cache_entry {
+    cache_entry() : fetching( false ), pass_until( 0 ), linked( false ), size( 0 ) {}
+    std::shared_ptr< const microcache_object > obj;
+    std::vector< std::string > vary;        // 只在主键上：响应的 Vary 列出的请求头（小写），obj 在各个变体的键上
+    bool fetching;                          // 有请求正在填充
+    uint64_t pass_until;                    // 上次填充没有得到可缓存的响应，这之前不合并请求（毫秒）
+    std::vector< int > waiters;             // 等待的请求的 socketpair 写端
+    bool linked;                            // 在 LRU 链表中
+    std::list< std::string >::iterator lru;
+    size_t size;
+};
+
+struct cache_shard {
+    cache_shard() : bytes( 0 ) {}
+    locker lock;
+    std::unordered_map< std::string, cache_entry > map;
+    std::list< std::string > lru;           // 最近用过的在前
+    size_t bytes;
+};
+
+static cache_shard shards[ SHARDS ];
+static size_t shard_limit = 0;
+static size_t max_object_size = 0;
+static std::atomic< uint64_t > cache_stats[ STAT_COUNT ];
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static cache_shard& shard_of( const std::string& primary ) {
+    uint32_t h = 2166136261u;
+    for ( size_t i = 0; i < primary.size(); ++i ) {
+        h = ( h ^ ( unsigned char )primary[i] ) * 16777619u;
+    }
+    return shards[ ( h ^ ( h >> 16 ) ) % SHARDS ];
+}
+
+// 在请求头中找 name 的值，没有时返回NULL
+static const char* find_header( const std::vector< const char* >& headers, const char* name ) {
+    size_t len = strlen( name );
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        if ( strncasecmp( headers[i], name, len ) == 0 && headers[i][ len ] == ':' ) {
+            const char* v = headers[i] + len + 1;
+            return v + strspn( v, " \t" );
+        }
+    }
+    return NULL;
+}
+
+// 逗号分隔的列表中有没有 token（不区分大小写）
+static bool has_token( const char* list, const char* token ) {
+    size_t len = strlen( token );
+    for ( const char* p = list; p && *p; ) {
+        p += strspn( p, " \t," );
+        if ( strncasecmp( p, token, len ) == 0 && strchr( " \t,;=", p[ len ] ) ) {
+            return true;
+        }
+        p = strchr( p, ',' );
+    }
+    return false;
+}
+
+static bool request_cacheable( const std::vector< const char* >& headers ) {
+    const char* cc = find_header( headers, "Cache-Control" );
+    const char* pragma = find_header( headers, "Pragma" );
+    return !find_header( headers, "Authorization" ) && !has_token( cc, "no-cache" ) && !has_token( cc, "no-store" )
+           && !has_token( pragma, "no-cache" );
+}
+
+// 主键加上 Vary 中各个请求头的值
+static std::string variant_key( const std::string& primary, const std::vector< std::string >& vary,
+                                const std::vector< const char* >& headers ) {
+    std::string key = primary;
+    for ( size_t i = 0; i < vary.size(); ++i ) {
+        const char* v = find_header( headers, vary[i].c_str() );
+        key += '\n';
+        key += vary[i];
+        key += ':';
+        key += v ? v : "";
+    }
+    return key;
+}
+
+static void link( cache_shard& s, cache_entry& e, const std::string& key, size_t size ) {
+    if ( e.linked ) {
+        s.bytes -= e.size;
+        s.lru.erase( e.lru );
+    }
+    s.lru.push_front( key );
+    e.lru = s.lru.begin();
+    e.linked = true;
+    e.size = size;
+    s.bytes += size;
+}
+
+static void touch( cache_shard& s, cache_entry& e ) {
+    if ( e.linked ) {
+        s.lru.splice( s.lru.begin(), s.lru, e.lru );
+    }
+}
+
+// 超出大小时从最久没用过的开始丢弃，正在填充的条目只丢掉响应
+static void evict( cache_shard& s ) {
+    while ( s.bytes > shard_limit && !s.lru.empty() ) {
+        std::unordered_map< std::string, cache_entry >::iterator it = s.map.find( s.lru.back() );
+        s.lru.pop_back();
+        cache_stats[ STAT_EVICT ].fetch_add( 1, std::memory_order_relaxed );
+        if ( it == s.map.end() ) {
+            continue;
+        }
+        s.bytes -= it->second.size;
+        it->second.linked = false;
+        it->second.obj.reset();
+        it->second.vary.clear();
+        if ( !it->second.fetching ) {
+            s.map.erase( it );
+        }
+    }
+}
+
+// 关闭等待者的写端，它们的读端变为可读
+static void wake( cache_entry& e ) {
+    for ( size_t i = 0; i < e.waiters.size(); ++i ) {
+        close( e.waiters[i] );
+    }
+    e.waiters.clear();
+}
+
+void microcache_capture::add( const char* p, size_t n ) {
+    if ( overflow ) {
+        return;
+    }
+    if ( data.size() + n > max_object_size ) {
+        overflow = true;
+        std::string().swap( data );
+        return;
+    }
+    data.append( p, n );
+}
+
+void microcache_init( size_t max_bytes, size_t max_object ) {
+    shard_limit = max_bytes / SHARDS;
+    // 一个响应不能超过一个分片的大小，否则存入后马上被丢弃
+    max_object_size = max_object < shard_limit ? max_object : shard_limit;
+}
+
+bool microcache_enabled() {
+    return shard_limit > 0;
+}
+
+int microcache_lookup( const char* method, const char* url, const std::vector< const char* >& headers, bool has_body,
+                       microcache_ticket& t ) {
+    t.key.clear();
+    t.obj.reset();
+    t.wait_fd = -1;
+    bool head = strcmp( method, "HEAD" ) == 0;
+    if ( ( !head && strcmp( method, "GET" ) != 0 ) || has_body || !request_cacheable( headers ) ) {
+        cache_stats[ STAT_BYPASS ].fetch_add( 1, std::memory_order_relaxed );
+        return MICROCACHE_BYPASS;
+    }
+    const char* host = find_header( headers, "Host" );
+    std::string primary = host ? host : "";
+    primary += url;
+    cache_shard& s = shard_of( primary );
+    uint64_t now = now_ms();
+    int result;
+    int stat;
+    s.lock.lock();
+    std::string key = primary;
+    std::unordered_map< std::string, cache_entry >::iterator it = s.map.find( key );
+    if ( it != s.map.end() && !it->second.vary.empty() ) {
+        touch( s, it->second );
+        key = variant_key( primary, it->second.vary, headers );
+        it = s.map.find( key );
+    }
+    cache_entry* e = it != s.map.end() ? &it->second : NULL;
+    bool usable_stale = e && e->obj && now < e->obj->stale_until;
+    if ( e && e->obj && now < e->obj->fresh_until ) {
+        touch( s, *e );
+        t.obj = e->obj;
+        result = MICROCACHE_HIT;
+        stat = STAT_HIT;
+    } else if ( e && e->fetching && usable_stale ) {
+        // 正在刷新，先用过期的响应
+        touch( s, *e );
+        t.obj = e->obj;
+        result = MICROCACHE_HIT;
+        stat = STAT_STALE;
+    } else if ( e && e->fetching ) {
+        int fds[2];
+        if ( socketpair( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds ) == 0 ) {
+            e->waiters.push_back( fds[1] );
+            t.wait_fd = fds[0];
+            result = MICROCACHE_WAIT;
+            stat = STAT_WAIT;
+        } else {
+            result = MICROCACHE_BYPASS;
+            stat = STAT_BYPASS;
+        }
+    } else if ( head || ( e && !usable_stale && now < e->pass_until ) ) {
+        // 刚填充过但响应不能缓存：被唤醒的和新来的请求都各自去上游，不再一个接一个地填充
+        result = MICROCACHE_BYPASS;
+        stat = STAT_BYPASS;
+    } else {
+        if ( !e ) {
+            e = &s.map[ key ];
+        }
+        e->fetching = true;
+        if ( usable_stale ) {
+            t.obj = e->obj;
+        }
+        t.key = key;
+        result = MICROCACHE_FILL;
+        stat = STAT_MISS;
+    }
+    s.lock.unlock();
+    cache_stats[ stat ].fetch_add( 1, std::memory_order_relaxed );
+    return result;
+}
+
+// 从发给客户端的响应生成缓存的响应，不能缓存时返回NULL；vary 返回响应的 Vary 中的请求头
+static microcache_object* build_object( const std::string& data, std::vector< std::string >& vary ) {
+    size_t end = data.find( "\r\n\r\n" );
+    if ( end == std::string::npos || data.compare( 0, 9, "HTTP/1.1 " ) != 0 ) {
+        return NULL;
+    }
+    int status = atoi( data.c_str() + 9 );
+    if ( status != 200 && status != 203 && status != 204 && status != 300 && status != 301 && status != 308
+         && status != 404 && status != 410 ) {
+        return NULL;
+    }
+    long max_age = -1;
+    long s_maxage = -1;
+    long swr = 0;
+    int age = 0;
+    bool has_length = false;
+    std::unique_ptr< microcache_object > obj( new microcache_object() );
+    size_t line_end = data.find( "\r\n" );
+    obj->head.assign( data, 0, line_end + 2 );
+    for ( size_t pos = line_end + 2; pos < end + 2; pos = line_end + 2 ) {
+        line_end = data.find( "\r\n", pos );
+        std::string line = data.substr( pos, line_end - pos );
+        size_t colon = line.find( ':' );
+        if ( colon == std::string::npos ) {
+            return NULL;
+        }
+        std::string name = line.substr( 0, colon );
+        const char* value = line.c_str() + colon + 1;
+        value += strspn( value, " \t" );
+        if ( strcasecmp( name.c_str(), "Cache-Control" ) == 0 ) {
+            if ( has_token( value, "no-store" ) || has_token( value, "no-cache" ) || has_token( value, "private" ) ) {
+                return NULL;
+            }
+            for ( const char* p = value; p && *p; p = strchr( p, ',' ) ) {
+                p += strspn( p, " \t," );
+                if ( strncasecmp( p, "s-maxage=", 9 ) == 0 ) {
+                    s_maxage = atol( p + 9 );
+                } else if ( strncasecmp( p, "max-age=", 8 ) == 0 ) {
+                    max_age = atol( p + 8 );
+                } else if ( strncasecmp( p, "stale-while-revalidate=", 23 ) == 0 ) {
+                    swr = atol( p + 23 );
+                }
+            }
+        } else if ( strcasecmp( name.c_str(), "Set-Cookie" ) == 0 ) {
+            return NULL;
+        } else if ( strcasecmp( name.c_str(), "Vary" ) == 0 ) {
+            for ( const char* p = value; *p; ) {
+                p += strspn( p, " \t," );
+                size_t n = strcspn( p, " \t," );
+                if ( n == 1 && *p == '*' ) {
+                    return NULL;
+                }
+                if ( n > 0 ) {
+                    std::string v( p, n );
+                    for ( size_t i = 0; i < n; ++i ) {
+                        v[i] = tolower( ( unsigned char )v[i] );
+                    }
+                    vary.push_back( v );
+                }
+                p += n;
+            }
+            continue;
+        } else if ( strcasecmp( name.c_str(), "Age" ) == 0 ) {
+            age = atoi( value );
+            continue;
+        } else if ( strcasecmp( name.c_str(), "Connection" ) == 0 || strcasecmp( name.c_str(), "Keep-Alive" ) == 0 ) {
+            continue;
+        } else if ( strcasecmp( name.c_str(), "Content-Length" ) == 0
+                    || strcasecmp( name.c_str(), "Transfer-Encoding" ) == 0 ) {
+            has_length = true;
+        }
+        obj->head += line;
+        obj->head += "\r\n";
+    }
+    if ( !vary.empty() ) {
+        // Vary 保留在响应头中，下游的缓存也需要它
+        obj->head += "Vary: ";
+        for ( size_t i = 0; i < vary.size(); ++i ) {
+            obj->head += ( i ? ", " : "" ) + vary[i];
+        }
+        obj->head += "\r\n";
+    }
+    long ttl = ( s_maxage >= 0 ? s_maxage : max_age ) - age;
+    if ( ttl <= 0 ) {
+        return NULL;
+    }
+    obj->body.assign( data, end + 4, std::string::npos );
+    if ( !has_length && status != 204 ) {
+        // 上游以关闭连接结束的响应体，缓存后长度已知
+        char buf[ 48 ];
+        snprintf( buf, sizeof( buf ), "Content-Length: %zu\r\n", obj->body.size() );
+        obj->head += buf;
+    }
+    obj->stored_ms = now_ms();
+    obj->fresh_until = obj->stored_ms + ttl * 1000;
+    obj->stale_until = obj->fresh_until + ( swr > 0 ? swr : 0 ) * 1000;
+    obj->age = age;
+    return obj.release();
+}
+
+void microcache_fill( microcache_ticket& t, const microcache_capture* capture, const std::vector< const char* >& headers ) {
+    if ( t.key.empty() ) {
+        return;
+    }
+    std::shared_ptr< const microcache_object > obj;
+    std::vector< std::string > vary;
+    if ( capture && capture->complete && !capture->overflow ) {
+        obj.reset( build_object( capture->data, vary ) );
+    }
+    cache_stats[ obj ? STAT_STORE : STAT_UNCACHEABLE ].fetch_add( 1, std::memory_order_relaxed );
+    std::string primary = t.key.substr( 0, t.key.find( '\n' ) );
+    cache_shard& s = shard_of( primary );
+    s.lock.lock();
+    std::unordered_map< std::string, cache_entry >::iterator it = s.map.find( t.key );
+    if ( it != s.map.end() ) {
+        it->second.fetching = false;
+        wake( it->second );
+        if ( !obj ) {
+            // 留下标记，等待的请求醒来后不再排队；标记也在 LRU 中，可以被丢弃
+            it->second.pass_until = now_ms() + PASS_MS;
+            if ( !it->second.linked ) {
+                link( s, it->second, t.key, t.key.size() * 2 + ENTRY_OVERHEAD );
+                evict( s );
+            }
+        }
+    }
+    if ( obj ) {
+        std::string key = primary;
+        cache_entry& p = s.map[ primary ];
+        if ( !vary.empty() ) {
+            // 主键上只记下 Vary，响应按请求头的值分别存放
+            p.obj.reset();
+            p.vary = vary;
+            link( s, p, primary, primary.size() * 2 + ENTRY_OVERHEAD );
+            key = variant_key( primary, vary, headers );
+        } else {
+            p.vary.clear();
+        }
+        cache_entry& e = s.map[ key ];
+        e.obj = obj;
+        e.pass_until = 0;
+        link( s, e, key, key.size() * 2 + obj->head.size() + obj->body.size() + ENTRY_OVERHEAD );
+        evict( s );
+    }
+    s.lock.unlock();
+    t.key.clear();
+}
+
+bool microcache_finish( microcache_ticket& t, const microcache_capture* capture, const std::vector< const char* >& headers,
+                        int status ) {
+    microcache_fill( t, capture, headers );
+    return t.obj && ( status == 502 || status == 503 || status == 504 );
+}
+
+void microcache_reply_head( const microcache_object& obj, bool keep_alive, std::string& out ) {
+    char buf[ 64 ];
+    uint64_t now = now_ms();
+    snprintf( buf, sizeof( buf ), "Age: %d\r\nConnection: %s\r\n\r\n",
+              obj.age + ( int )( ( now - obj.stored_ms ) / 1000 ), keep_alive ? "keep-alive" : "close" );
+    out = obj.head;
+    out += buf;
+}
+
+void microcache_metrics( std::string& out ) {
+    if ( !microcache_enabled() ) {
+        return;
+    }
+    static const char* const results[] = { "hit", "stale", "miss", "wait", "bypass" };
+    metrics_header( out, "webserver_microcache_lookups_total", "counter",
+                    "Micro-cache lookups: hit, stale (served while refreshing), miss (fetched), wait (collapsed), bypass." );
+    for ( int i = STAT_HIT; i <= STAT_BYPASS; ++i ) {
+        std::string labels = std::string( "result=\"" ) + results[i] + "\"";
+        metrics_counter( out, "webserver_microcache_lookups_total", labels.c_str(), cache_stats[i].load() );
+    }
+    metrics_header( out, "webserver_microcache_fills_total", "counter", "Upstream responses fetched for the cache, by outcome." );
+    metrics_counter( out, "webserver_microcache_fills_total", "outcome=\"stored\"", cache_stats[ STAT_STORE ].load() );
+    metrics_counter( out, "webserver_microcache_fills_total", "outcome=\"uncacheable\"", cache_stats[ STAT_UNCACHEABLE ].load() );
+    metrics_header( out, "webserver_microcache_evictions_total", "counter", "Entries dropped to stay within microcache_mb." );
+    metrics_counter( out, "webserver_microcache_evictions_total", NULL, cache_stats[ STAT_EVICT ].load() );
+    size_t bytes = 0;
+    size_t entries = 0;
+    for ( int i = 0; i < SHARDS; ++i ) {
+        shards[i].lock.lock();
+        bytes += shards[i].bytes;
+        entries += shards[i].lru.size();
+        shards[i].lock.unlock();
+    }
+    metrics_header( out, "webserver_microcache_bytes", "gauge", "Memory used by cached responses." );
+    metrics_gauge( out, "webserver_microcache_bytes", NULL, bytes );
+    metrics_header( out, "webserver_microcache_entries", "gauge", "Cached responses and Vary records." );
+    metrics_gauge( out, "webserver_microcache_entries", NULL, entries );
+}
@@ -0,0 +1,80 @@
+#ifndef MICROCACHE_H
+#define MICROCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+/*
+    微缓存：反向代理和 FastCGI 的响应在内存中缓存几秒。流量突增时同一个URL的请求由缓存回复，上游只处理一次。
+    只缓存上游明确允许的响应：Cache-Control 中有 s-maxage 或 max-age（s-maxage 优先，减去上游给出的 Age），
+    没有 no-store、no-cache、private，没有 Set-Cookie，Vary 不是 "*"，状态码为 200、203、204、300、301、308、404、410，
+    大小不超过 microcache_max_object_kb。
+    键是 Host 加上URL，只有 GET 会填充缓存，HEAD 命中时只回复响应头；响应有 Vary 时键再加上请求中这些头部的值。
+    请求有请求体、带 Authorization、Cache-Control: no-cache/no-store 或 Pragma: no-cache 时不查缓存。
+
+    合并请求：一个键没有可用的缓存时，第一个请求去上游取（填充），同时到达的同一个键的请求等它完成后从缓存回复；
+    响应不能缓存（或填充失败）时，等待的请求各自去上游，之后 2 秒内这个键的请求也不合并，直接转发。
+    最多等 proxy_timeout_ms，超时后自己去上游。
+    等待用一对 socketpair：填充结束时关闭写端，线程池模式用 poll 等读端可读，协程模式挂起协程。
+
+    stale-while-revalidate=N：过期后的 N 秒内，一个请求去上游刷新，同时到达的请求直接拿到过期的响应，不等待；
+    刷新失败（502、503、504）时这个请求也回复过期的响应。
+
+    缓存按键的哈希分成若干分片，每片一把锁、一条 LRU 链表，总大小不超过 microcache_mb。
+    缓存的响应头去掉 Connection 和 Age，没有长度的响应体加上 Content-Length；回复时再加上 Age 和 Connection。
+*/
+
+// 缓存的一个响应，存入后不再修改，回复期间由 shared_ptr 保持
+struct microcache_object {
+    std::string head;           // 状态行和响应头，每行以 \r\n 结尾，不含空行
+    std::string body;           // 响应体，原样保存（可能是 chunked）
+    uint64_t stored_ms;
+    uint64_t fresh_until;       // 毫秒，之前直接回复
+    uint64_t stale_until;       // 之前可以在刷新期间回复
+    int age;                    // 存入时的 Age（秒）
+};
+
+// 填充时记下发给客户端的响应，超过 microcache_max_object_kb 时放弃
+struct microcache_capture {
+    microcache_capture() : overflow( false ), complete( false ) {}
+    void add( const char* p, size_t n );
+
+    std::string data;
+    bool overflow;
+    bool complete;              // 响应完整地发给了客户端
+};
+
+enum MICROCACHE_RESULT {
+    MICROCACHE_BYPASS = 0,      // 不使用缓存，直接转发
+    MICROCACHE_HIT,             // 用 obj 回复
+    MICROCACHE_FILL,            // 去上游取，用 microcache_capture 记下响应，之后必须调用 microcache_fill
+    MICROCACHE_WAIT             // 等 wait_fd 可读后关闭它，再查一次
+};
+
+struct microcache_ticket {
+    microcache_ticket() : wait_fd( -1 ) {}
+    std::string key;                                    // FILL 时填充的键
+    std::shared_ptr< const microcache_object > obj;     // HIT 时回复的响应；FILL 时为还能用的过期响应，可能为空
+    int wait_fd;
+};
+
+// 启动时调用，max_bytes 为0时不缓存
+void microcache_init( size_t max_bytes, size_t max_object );
+bool microcache_enabled();
+// 查缓存。headers 是请求头，每项是一行 "Name: value"；返回 MICROCACHE_RESULT
+int microcache_lookup( const char* method, const char* url, const std::vector< const char* >& headers, bool has_body,
+                       microcache_ticket& t );
+// 填充结束：capture 为 NULL、响应不完整或不能缓存时唤醒等待的请求，并让它们和之后一段时间的请求直接转发
+void microcache_fill( microcache_ticket& t, const microcache_capture* capture, const std::vector< const char* >& headers );
+// 去上游取的请求结束时调用（status 为0表示响应已经转发，否则为要回复的错误），内部调用 microcache_fill。
+// 刷新失败（502、503、504）而 t 中还有 stale-while-revalidate 时间内的过期响应时返回true，用 t.obj 回复
+bool microcache_finish( microcache_ticket& t, const microcache_capture* capture, const std::vector< const char* >& headers,
+                        int status );
+// 用缓存回复时的响应头：obj 的响应头加上 Age、Connection 和空行
+void microcache_reply_head( const microcache_object& obj, bool keep_alive, std::string& out );
+void microcache_metrics( std::string& out );
+
+#endif
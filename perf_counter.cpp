@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <atomic>
+#include "locker.h"
+#include "metrics.h"
+#include "perf_counter.h"
+
+enum PERF_EVENT { EV_TASK_CLOCK = 0, EV_CYCLES, EV_INSTRUCTIONS, EV_CACHE_MISSES, EV_BRANCH_MISSES, EV_COUNT };
+
+struct perf_event_def {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const perf_event_def event_defs[ EV_COUNT ] = {
+    { "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static const char* stage_names[ PERF_STAGE_COUNT ] = { "parse", "request", "response", "dispatch" };
+
+// 每个线程一组计数器，累加值由本线程写、指标线程读，所以用原子变量
+struct perf_thread {
+    int leader;                             // 组长的fd，-1表示这个线程打不开计数器
+    int fds[ EV_COUNT ];
+    int slot[ EV_COUNT ];                   // 事件在组读取结果中的位置，-1表示未打开
+    int nr;
+    uint64_t begin[ PERF_STAGE_COUNT ][ EV_COUNT + 2 ];   // 阶段开始时的读数，最后两项是 enabled/running 时间
+    std::atomic< uint64_t > calls[ PERF_STAGE_COUNT ];
+    std::atomic< uint64_t > sums[ PERF_STAGE_COUNT ][ EV_COUNT ];
+    perf_thread* next;
+};
+
+bool perf_counter_on = false;
+static bool event_available[ EV_COUNT ];    // 启动时探测出的可用事件
+static locker perf_lock;
+static perf_thread* perf_threads = NULL;    // 所有线程的计数器，只增不删
+static __thread perf_thread* t_perf = NULL;
+
+static int perf_open( const perf_event_def& def, int group_fd ) {
+    perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = def.type;
+    attr.config = def.config;
+    attr.exclude_kernel = 1;                // 大多数机器的 perf_event_paranoid 不允许普通用户统计内核态
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group_fd == -1 ? 1 : 0;
+    // pid = 0, cpu = -1：只统计调用线程，跟随它在任意CPU上运行
+    return syscall( SYS_perf_event_open, &attr, 0, -1, group_fd, 0 );
+}
+
+static perf_thread* perf_thread_open() {
+    perf_thread* t = new perf_thread;
+    memset( t->begin, 0, sizeof( t->begin ) );
+    for ( int s = 0; s < PERF_STAGE_COUNT; ++s ) {
+        t->calls[s].store( 0, std::memory_order_relaxed );
+        for ( int e = 0; e < EV_COUNT; ++e ) {
+            t->sums[s][e].store( 0, std::memory_order_relaxed );
+        }
+    }
+    t->leader = -1;
+    t->nr = 0;
+    for ( int e = 0; e < EV_COUNT; ++e ) {
+        t->fds[e] = -1;
+        t->slot[e] = -1;
+        if ( !event_available[e] ) {
+            continue;
+        }
+        int fd = perf_open( event_defs[e], t->leader );
+        if ( fd < 0 ) {
+            continue;
+        }
+        if ( t->leader == -1 ) {
+            t->leader = fd;
+        }
+        t->fds[e] = fd;
+        t->slot[e] = t->nr++;
+    }
+    if ( t->leader != -1 ) {
+        ioctl( t->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+        ioctl( t->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+    }
+    perf_lock.lock();
+    t->next = perf_threads;
+    perf_threads = t;
+    perf_lock.unlock();
+    return t;
+}
+
+// 读取整组计数器：nr, time_enabled, time_running, value[nr]
+static bool perf_read( perf_thread* t, uint64_t* values, uint64_t* times ) {
+    uint64_t buf[ 3 + EV_COUNT ];
+    ssize_t n = read( t->leader, buf, sizeof( buf ) );
+    if ( n < ( ssize_t )( 3 * sizeof( uint64_t ) ) || buf[0] != ( uint64_t )t->nr ) {
+        return false;
+    }
+    times[0] = buf[1];
+    times[1] = buf[2];
+    for ( int e = 0; e < EV_COUNT; ++e ) {
+        values[e] = t->slot[e] >= 0 ? buf[ 3 + t->slot[e] ] : 0;
+    }
+    return true;
+}
+
+void perf_stage_begin( PERF_STAGE stage ) {
+    if ( !t_perf ) {
+        t_perf = perf_thread_open();
+    }
+    if ( t_perf->leader == -1 ) {
+        return;
+    }
+    uint64_t* b = t_perf->begin[ stage ];
+    if ( !perf_read( t_perf, b, b + EV_COUNT ) ) {
+        b[ EV_COUNT ] = UINT64_MAX;     // 标记本次读数无效
+    }
+}
+
+void perf_stage_end( PERF_STAGE stage, unsigned calls ) {
+    perf_thread* t = t_perf;
+    if ( !t || t->leader == -1 ) {
+        return;
+    }
+    uint64_t* b = t->begin[ stage ];
+    uint64_t values[ EV_COUNT ], times[2];
+    if ( b[ EV_COUNT ] == UINT64_MAX || !perf_read( t, values, times ) ) {
+        return;
+    }
+    // 计数器多于硬件寄存器时内核会分时复用，按 enabled/running 比例放大
+    uint64_t enabled = times[0] - b[ EV_COUNT ];
+    uint64_t running = times[1] - b[ EV_COUNT + 1 ];
+    double scale = ( running > 0 && running < enabled ) ? ( double )enabled / running : 1.0;
+    for ( int e = 0; e < EV_COUNT; ++e ) {
+        if ( t->slot[e] < 0 ) {
+            continue;
+        }
+        uint64_t delta = ( uint64_t )( ( values[e] - b[e] ) * scale );
+        t->sums[ stage ][e].store( t->sums[ stage ][e].load( std::memory_order_relaxed ) + delta,
+                                   std::memory_order_relaxed );
+    }
+    t->calls[ stage ].store( t->calls[ stage ].load( std::memory_order_relaxed ) + calls,
+                             std::memory_order_relaxed );
+}
+
+// 输出各阶段的累计值、IPC 和每次调用的事件数
+static void perf_counter_metrics( std::string& out ) {
+    uint64_t calls[ PERF_STAGE_COUNT ] = { 0 };
+    uint64_t sums[ PERF_STAGE_COUNT ][ EV_COUNT ];
+    memset( sums, 0, sizeof( sums ) );
+    int threads = 0, unavailable = 0;
+    perf_lock.lock();
+    for ( perf_thread* t = perf_threads; t; t = t->next ) {
+        ++threads;
+        if ( t->leader == -1 ) {
+            ++unavailable;
+        }
+        for ( int s = 0; s < PERF_STAGE_COUNT; ++s ) {
+            calls[s] += t->calls[s].load( std::memory_order_relaxed );
+            for ( int e = 0; e < EV_COUNT; ++e ) {
+                sums[s][e] += t->sums[s][e].load( std::memory_order_relaxed );
+            }
+        }
+    }
+    perf_lock.unlock();
+
+    char labels[ 96 ];
+    metrics_header( out, "webserver_perf_threads", "gauge", "Threads that opened perf counters, and those that could not." );
+    metrics_gauge( out, "webserver_perf_threads", "state=\"open\"", threads - unavailable );
+    metrics_gauge( out, "webserver_perf_threads", "state=\"unavailable\"", unavailable );
+    metrics_header( out, "webserver_perf_stage_calls_total", "counter", "Measured invocations per stage." );
+    for ( int s = 0; s < PERF_STAGE_COUNT; ++s ) {
+        snprintf( labels, sizeof( labels ), "stage=\"%s\"", stage_names[s] );
+        metrics_counter( out, "webserver_perf_stage_calls_total", labels, calls[s] );
+    }
+    metrics_header( out, "webserver_perf_stage_events_total", "counter", "perf events counted inside each stage (user space)." );
+    for ( int s = 0; s < PERF_STAGE_COUNT; ++s ) {
+        for ( int e = 0; e < EV_COUNT; ++e ) {
+            if ( event_available[e] ) {
+                snprintf( labels, sizeof( labels ), "stage=\"%s\",event=\"%s\"", stage_names[s], event_defs[e].name );
+                metrics_counter( out, "webserver_perf_stage_events_total", labels, sums[s][e] );
+            }
+        }
+    }
+    metrics_header( out, "webserver_perf_stage_events_per_call", "gauge", "Average perf events per stage invocation." );
+    for ( int s = 0; s < PERF_STAGE_COUNT; ++s ) {
+        for ( int e = 0; e < EV_COUNT; ++e ) {
+            if ( event_available[e] && calls[s] > 0 ) {
+                snprintf( labels, sizeof( labels ), "stage=\"%s\",event=\"%s\"", stage_names[s], event_defs[e].name );
+                metrics_gauge( out, "webserver_perf_stage_events_per_call", labels, ( double )sums[s][e] / calls[s] );
+            }
+        }
+    }
+    if ( event_available[ EV_CYCLES ] && event_available[ EV_INSTRUCTIONS ] ) {
+        metrics_header( out, "webserver_perf_stage_ipc", "gauge", "Instructions per cycle inside each stage." );
+        for ( int s = 0; s < PERF_STAGE_COUNT; ++s ) {
+            if ( sums[s][ EV_CYCLES ] > 0 ) {
+                snprintf( labels, sizeof( labels ), "stage=\"%s\"", stage_names[s] );
+                metrics_gauge( out, "webserver_perf_stage_ipc", labels,
+                               ( double )sums[s][ EV_INSTRUCTIONS ] / sums[s][ EV_CYCLES ] );
+            }
+        }
+    }
+}
+
+bool perf_counter_enable() {
+    // 先在当前线程探测哪些事件可用，工作线程之后只打开这些事件
+    int available = 0;
+    for ( int e = 0; e < EV_COUNT; ++e ) {
+        int fd = perf_open( event_defs[e], -1 );
+        if ( fd >= 0 ) {
+            event_available[e] = true;
+            ++available;
+            close( fd );
+        } else {
+            printf( "perf counter %s unavailable: %s\n", event_defs[e].name, strerror( errno ) );
+        }
+    }
+    if ( available == 0 ) {
+        return false;
+    }
+    metrics_register( perf_counter_metrics );
+    perf_counter_on = true;
+    return true;
+}
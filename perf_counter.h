@@ -0,0 +1,51 @@
+#ifndef PERF_COUNTER_H
+#define PERF_COUNTER_H
+
+#include <string>
+
+/*
+    热路径上的硬件性能计数器（perf_event_open）
+    每个线程第一次进入被测阶段时打开自己的计数器组：
+    task-clock、cycles、instructions、cache-misses、branch-misses，
+    打不开的事件（比如虚拟机里没有PMU）跳过，只统计能打开的。
+    阶段前后各读一次计数器组，差值累加到该阶段，通过 METRICS_URL 输出 IPC 和每次请求的缺失数。
+    每次读取是一次系统调用，所以默认关闭，需要显式调用 perf_counter_enable()。
+*/
+enum PERF_STAGE {
+    PERF_STAGE_PARSE = 0,   // process_read（协程模式：解析读到的请求头）
+    PERF_STAGE_REQUEST,     // do_request（协程模式：查找静态内容）
+    PERF_STAGE_RESPONSE,    // process_write（协程模式：生成响应头）
+    PERF_STAGE_DISPATCH,    // 主线程（协程模式：反应堆）处理一批epoll事件，按事件数计次
+    PERF_STAGE_COUNT
+};
+
+extern bool perf_counter_on;
+
+// 打开计数，并把输出函数注册到指标中；一个事件都打不开时返回false
+bool perf_counter_enable();
+void perf_stage_begin( PERF_STAGE stage );
+void perf_stage_end( PERF_STAGE stage, unsigned calls );
+
+// 在作用域内统计一个阶段，未开启时只有一次分支判断
+class perf_scope {
+public:
+    explicit perf_scope( PERF_STAGE stage, unsigned calls = 1 )
+        : m_stage( stage ), m_calls( calls ), m_active( perf_counter_on ) {
+        if ( m_active ) {
+            perf_stage_begin( m_stage );
+        }
+    }
+    ~perf_scope() {
+        if ( m_active ) {
+            perf_stage_end( m_stage, m_calls );
+        }
+    }
+    void set_calls( unsigned calls ) { m_calls = calls; }
+
+private:
+    PERF_STAGE m_stage;
+    unsigned m_calls;
+    bool m_active;
+};
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+#include "profiler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static const int MAX_DEPTH = 48;            // 每个样本最多回溯的帧数
+static const size_t MAX_SAMPLES = 65536;    // 一次剖析最多保留的样本数，超出的丢弃并计数
+static const int MAX_SECONDS = 60;
+static const int MAX_HZ = 1000;
+
+// 一个样本：pc[0]是被中断的指令地址，之后是各级返回地址
+struct prof_sample {
+    std::atomic< int > ready;
+    int depth;
+    uintptr_t pc[ MAX_DEPTH ];
+};
+
+static std::atomic< bool > prof_busy( false );      // 同一时间只允许一次剖析
+static std::atomic< bool > prof_active( false );    // 信号处理函数是否记录样本
+static std::atomic< int > prof_inflight( 0 );       // 正在执行的信号处理函数个数
+static std::atomic< size_t > prof_next( 0 );        // 下一个空闲样本的下标
+static std::atomic< size_t > prof_dropped( 0 );
+static prof_sample* prof_samples = NULL;
+
+// 读取可能无效的栈地址：process_vm_readv 遇到未映射的地址返回错误而不是触发SIGSEGV，
+// 并且是异步信号安全的
+static bool safe_read( uintptr_t addr, void* out, size_t len ) {
+    iovec local, remote;
+    local.iov_base = out;
+    local.iov_len = len;
+    remote.iov_base = ( void* )addr;
+    remote.iov_len = len;
+    return process_vm_readv( getpid(), &local, 1, &remote, 1, 0 ) == ( ssize_t )len;
+}
+
+static bool context_regs( void* uc, uintptr_t& pc, uintptr_t& fp, uintptr_t& sp ) {
+    ucontext_t* ctx = ( ucontext_t* )uc;
+#if defined(__x86_64__)
+    pc = ctx->uc_mcontext.gregs[ REG_RIP ];
+    fp = ctx->uc_mcontext.gregs[ REG_RBP ];
+    sp = ctx->uc_mcontext.gregs[ REG_RSP ];
+    return true;
+#elif defined(__aarch64__)
+    pc = ctx->uc_mcontext.pc;
+    fp = ctx->uc_mcontext.regs[ 29 ];
+    sp = ctx->uc_mcontext.sp;
+    return true;
+#else
+    ( void )ctx;
+    pc = fp = sp = 0;
+    return false;
+#endif
+}
+
+// SIGPROF 处理函数：只做原子操作和系统调用，不分配内存、不加锁
+static void prof_handler( int, siginfo_t*, void* uc ) {
+    int saved_errno = errno;
+    prof_inflight.fetch_add( 1 );
+    if ( prof_active.load() ) {
+        size_t i = prof_next.fetch_add( 1, std::memory_order_relaxed );
+        if ( i < MAX_SAMPLES ) {
+            prof_sample* s = &prof_samples[i];
+            uintptr_t pc, fp, sp;
+            int depth = 0;
+            if ( context_regs( uc, pc, fp, sp ) ) {
+                s->pc[ depth++ ] = pc;
+                // 帧记录为 [fp] = 上一帧的fp，[fp + 8] = 返回地址（x86_64 和 aarch64 相同）
+                // 栈向低地址增长，合法的帧链一定单调递增
+                while ( depth < MAX_DEPTH && fp >= sp && ( fp & ( sizeof( uintptr_t ) - 1 ) ) == 0 ) {
+                    uintptr_t frame[2];
+                    if ( !safe_read( fp, frame, sizeof( frame ) ) || frame[1] == 0 ) {
+                        break;
+                    }
+                    s->pc[ depth++ ] = frame[1];
+                    if ( frame[0] <= fp ) {
+                        break;
+                    }
+                    fp = frame[0];
+                }
+            }
+            s->depth = depth;
+            s->ready.store( 1, std::memory_order_release );
+        } else {
+            prof_dropped.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+    prof_inflight.fetch_sub( 1 );
+    errno = saved_errno;
+}
+
+// 其他线程的CPU时钟：内核里的 MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED)
+static clockid_t thread_cpu_clock( pid_t tid ) {
+    return ( ( ~( clockid_t )tid ) << 3 ) | 6;
+}
+
+// 给进程中除自己以外的每个线程创建一个CPU时间定时器
+static void arm_timers( int hz, std::vector< timer_t >& timers ) {
+    pid_t self = syscall( SYS_gettid );
+    DIR* dir = opendir( "/proc/self/task" );
+    if ( !dir ) {
+        return;
+    }
+    itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000L / hz;
+    its.it_value = its.it_interval;
+    dirent* de;
+    while ( ( de = readdir( dir ) ) != NULL ) {
+        pid_t tid = atoi( de->d_name );
+        if ( tid <= 0 || tid == self ) {
+            continue;
+        }
+        sigevent sev;
+        memset( &sev, 0, sizeof( sev ) );
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = tid;
+        timer_t timer;
+        if ( timer_create( thread_cpu_clock( tid ), &sev, &timer ) != 0 ) {
+            continue;   // 线程可能已经退出
+        }
+        timer_settime( timer, 0, &its, NULL );
+        timers.push_back( timer );
+    }
+    closedir( dir );
+}
+
+// 主程序的符号取自 /proc/self/exe 的 .symtab，这样不需要 -rdynamic；共享库用 dladdr
+struct elf_symbol {
+    uintptr_t addr;
+    size_t size;
+    const char* name;
+    bool operator<( const elf_symbol& other ) const { return addr < other.addr; }
+};
+
+class symbolizer {
+public:
+    symbolizer() : m_image( NULL ), m_image_size( 0 ) {
+        load_exe();
+    }
+    ~symbolizer() {
+        if ( m_image ) {
+            munmap( m_image, m_image_size );
+        }
+    }
+
+    const std::string& lookup( uintptr_t pc ) {
+        std::map< uintptr_t, std::string >::iterator it = m_cache.find( pc );
+        if ( it != m_cache.end() ) {
+            return it->second;
+        }
+        std::string name = resolve( pc );
+        // ';' 是折叠栈的分隔符
+        std::replace( name.begin(), name.end(), ';', ':' );
+        return m_cache[ pc ] = name;
+    }
+
+private:
+    static int first_object( dl_phdr_info* info, size_t, void* data ) {
+        *( uintptr_t* )data = info->dlpi_addr;     // 第一个对象就是主程序，dlpi_addr 是PIE的装载偏移
+        return 1;
+    }
+
+    void load_exe() {
+        int fd = open( "/proc/self/exe", O_RDONLY );
+        if ( fd < 0 ) {
+            return;
+        }
+        struct stat st;
+        if ( fstat( fd, &st ) == 0 && st.st_size > ( off_t )sizeof( ElfW( Ehdr ) ) ) {
+            void* p = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( p != MAP_FAILED ) {
+                m_image = ( char* )p;
+                m_image_size = st.st_size;
+            }
+        }
+        close( fd );
+        if ( !m_image ) {
+            return;
+        }
+        ElfW( Ehdr )* eh = ( ElfW( Ehdr )* )m_image;
+        if ( memcmp( eh->e_ident, ELFMAG, SELFMAG ) != 0 ||
+             eh->e_shoff + ( size_t )eh->e_shnum * sizeof( ElfW( Shdr ) ) > m_image_size ) {
+            return;
+        }
+        uintptr_t bias = 0;
+        dl_iterate_phdr( first_object, &bias );
+        ElfW( Shdr )* sh = ( ElfW( Shdr )* )( m_image + eh->e_shoff );
+        for ( int i = 0; i < eh->e_shnum; ++i ) {
+            if ( sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum ) {
+                continue;
+            }
+            ElfW( Shdr )& strtab = sh[ sh[i].sh_link ];
+            if ( sh[i].sh_offset + sh[i].sh_size > m_image_size || strtab.sh_offset + strtab.sh_size > m_image_size ) {
+                continue;
+            }
+            ElfW( Sym )* syms = ( ElfW( Sym )* )( m_image + sh[i].sh_offset );
+            size_t count = sh[i].sh_size / sizeof( ElfW( Sym ) );
+            for ( size_t j = 0; j < count; ++j ) {
+                if ( ELF64_ST_TYPE( syms[j].st_info ) != STT_FUNC || syms[j].st_value == 0 ||
+                     syms[j].st_name >= strtab.sh_size ) {
+                    continue;
+                }
+                elf_symbol s;
+                s.addr = syms[j].st_value + bias;
+                s.size = syms[j].st_size;
+                s.name = m_image + strtab.sh_offset + syms[j].st_name;
+                m_symbols.push_back( s );
+            }
+        }
+        std::sort( m_symbols.begin(), m_symbols.end() );
+    }
+
+    static std::string demangle( const char* name ) {
+        int status = 0;
+        char* d = abi::__cxa_demangle( name, NULL, NULL, &status );
+        if ( status == 0 && d ) {
+            std::string s( d );
+            free( d );
+            return s;
+        }
+        return name;
+    }
+
+    std::string resolve( uintptr_t pc ) {
+        if ( !m_symbols.empty() ) {
+            elf_symbol key;
+            key.addr = pc;
+            std::vector< elf_symbol >::iterator it = std::upper_bound( m_symbols.begin(), m_symbols.end(), key );
+            if ( it != m_symbols.begin() ) {
+                --it;
+                if ( pc < it->addr + ( it->size ? it->size : 1 ) ) {
+                    return demangle( it->name );
+                }
+            }
+        }
+        Dl_info info;
+        if ( dladdr( ( void* )pc, &info ) ) {
+            if ( info.dli_sname ) {
+                return demangle( info.dli_sname );
+            }
+            if ( info.dli_fname ) {
+                const char* base = strrchr( info.dli_fname, '/' );
+                char buf[ 256 ];
+                snprintf( buf, sizeof( buf ), "%s+0x%lx", base ? base + 1 : info.dli_fname,
+                          ( unsigned long )( pc - ( uintptr_t )info.dli_fbase ) );
+                return buf;
+            }
+        }
+        char buf[ 32 ];
+        snprintf( buf, sizeof( buf ), "0x%lx", ( unsigned long )pc );
+        return buf;
+    }
+
+    char* m_image;
+    size_t m_image_size;
+    std::vector< elf_symbol > m_symbols;
+    std::map< uintptr_t, std::string > m_cache;
+};
+
+// 把样本汇总成折叠栈：根在前，叶子在后，后面是出现次数
+static void fold_samples( size_t count, std::string& out ) {
+    symbolizer sym;
+    std::map< std::string, size_t > stacks;
+    std::string stack;
+    for ( size_t i = 0; i < count; ++i ) {
+        prof_sample& s = prof_samples[i];
+        if ( !s.ready.load( std::memory_order_acquire ) || s.depth == 0 ) {
+            continue;
+        }
+        stack.clear();
+        for ( int d = s.depth - 1; d >= 0; --d ) {
+            // 返回地址指向call的下一条指令，减1才落在调用者的调用点上
+            uintptr_t pc = d == 0 ? s.pc[d] : s.pc[d] - 1;
+            if ( !stack.empty() ) {
+                stack += ';';
+            }
+            stack += sym.lookup( pc );
+        }
+        stacks[ stack ]++;
+    }
+    char buf[ 32 ];
+    for ( std::map< std::string, size_t >::iterator it = stacks.begin(); it != stacks.end(); ++it ) {
+        snprintf( buf, sizeof( buf ), " %zu\n", it->second );
+        out += it->first;
+        out += buf;
+    }
+}
+
+// 查询参数 name=整数，不存在时返回默认值，格式错误返回-1
+static int query_int( const char* url, const char* name, int def ) {
+    const char* q = strchr( url, '?' );
+    size_t len = strlen( name );
+    while ( q ) {
+        ++q;
+        if ( strncmp( q, name, len ) == 0 && q[ len ] == '=' ) {
+            char* end;
+            long v = strtol( q + len + 1, &end, 10 );
+            return ( end == q + len + 1 || ( *end != '\0' && *end != '&' ) ) ? -1 : ( int )v;
+        }
+        q = strchr( q, '&' );
+    }
+    return def;
+}
+
+bool profiler_match( const char* url ) {
+    size_t len = strlen( PROFILE_URL );
+    return strncmp( url, PROFILE_URL, len ) == 0 && ( url[ len ] == '\0' || url[ len ] == '?' );
+}
+
+PROFILE_RESULT profiler_run( const char* url, std::string& out ) {
+    int seconds = query_int( url, "seconds", 10 );
+    int hz = query_int( url, "hz", 99 );
+    if ( seconds < 1 || seconds > MAX_SECONDS || hz < 1 || hz > MAX_HZ ) {
+        return PROFILE_BAD;
+    }
+    bool expected = false;
+    if ( !prof_busy.compare_exchange_strong( expected, true ) ) {
+        return PROFILE_BUSY;
+    }
+
+    prof_samples = new prof_sample[ MAX_SAMPLES ];
+    for ( size_t i = 0; i < MAX_SAMPLES; ++i ) {
+        prof_samples[i].ready.store( 0, std::memory_order_relaxed );
+    }
+    prof_next.store( 0 );
+    prof_dropped.store( 0 );
+
+    struct sigaction sa, old;
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_sigaction = prof_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;     // 被打断的 recv/writev/sem_wait 自动重启
+    sigemptyset( &sa.sa_mask );
+    if ( sigaction( SIGPROF, &sa, &old ) != 0 ) {
+        delete [] prof_samples;
+        prof_samples = NULL;
+        prof_busy.store( false );
+        return PROFILE_FAILED;
+    }
+    prof_active.store( true );
+    std::vector< timer_t > timers;
+    arm_timers( hz, timers );
+
+    timespec left;
+    left.tv_sec = seconds;
+    left.tv_nsec = 0;
+    while ( nanosleep( &left, &left ) != 0 && errno == EINTR ) {
+    }
+
+    for ( size_t i = 0; i < timers.size(); ++i ) {
+        timer_delete( timers[i] );
+    }
+    // 先关闭记录，再等待已经进入处理函数的线程写完，之后才能读取和释放缓冲区
+    prof_active.store( false );
+    while ( prof_inflight.load() != 0 ) {
+        sched_yield();
+    }
+    // 保留处理函数：已经排队的SIGPROF稍后送达时，若恢复成默认动作会终止进程
+
+    size_t count = std::min( prof_next.load(), MAX_SAMPLES );
+    fold_samples( count, out );
+    printf( "profile: %d s at %d Hz, %zu threads, %zu samples, %zu dropped\n", seconds, hz, timers.size(), count,
+            prof_dropped.load() );
+    delete [] prof_samples;
+    prof_samples = NULL;
+    prof_busy.store( false );
+    return PROFILE_OK;
+}
@@ -0,0 +1,24 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+
+/*
+    内置的采样剖析器
+    访问 PROFILE_URL?seconds=10&hz=99 时，给进程里的每个线程创建一个按线程CPU时间计时的定时器，
+    到期时向该线程发送 SIGPROF，信号处理函数沿帧指针回溯调用栈，写入无锁的样本缓冲区。
+    时间到后停止定时器，把样本符号化，输出 flamegraph.pl 可以直接使用的折叠栈：
+        main;http_conn::process;http_conn::process_read 42
+    回溯依赖帧指针，编译时加上 -fno-omit-frame-pointer 栈才完整。
+    处理这个请求的工作线程会阻塞到采样结束，同一时间只允许一次剖析。
+*/
+#define PROFILE_URL "/__profile"
+
+// url 为完整的请求路径（含查询参数）
+bool profiler_match( const char* url );
+
+// 采样并把折叠栈写入out；参数错误返回 PROFILE_BAD，已有剖析在进行时返回 PROFILE_BUSY
+enum PROFILE_RESULT { PROFILE_OK = 0, PROFILE_BAD, PROFILE_BUSY, PROFILE_FAILED };
+PROFILE_RESULT profiler_run( const char* url, std::string& out );
+
+#endif
@@ -0,0 +1,1071 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include "proxy.h"
+#include "metrics.h"
+#include "microcache.h"
+
+std::vector< proxy_route > proxy_routes;
+int proxy_timeout_ms = 30000;
+int proxy_idle_max = 16;
+int proxy_balance = PROXY_ROUND_ROBIN;
+int proxy_max_fails = 2;
+int proxy_eject_ms = 10000;
+
+// 空闲连接在池中最多放这么久，上游一般也会关闭长时间空闲的连接
+static const uint64_t PROXY_IDLE_MS = 15000;
+// 每个线程缓存的空闲管道数
+static const size_t PIPE_CACHE = 64;
+// 每个前缀最多的上游数，一致性哈希环上每个上游的虚拟节点数
+static const size_t MAX_UPSTREAMS = 64;
+static const int RING_POINTS = 160;
+
+static const char* const balance_names[] = { "round_robin", "least_outstanding", "p2c", "hash" };
+
+static std::atomic< uint64_t > proxy_stats[ PROXY_STAT_COUNT ];
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms() {
+    return now_us() / 1000;
+}
+
+// FNV-1a，最后再做一次 murmur3 的 fmix32：只有末尾几个字符不同的键（"/a/1" 和 "/a/2"）高位也能分散开
+static uint32_t fnv1a( const char* p, size_t len ) {
+    uint32_t h = 2166136261u;
+    for ( size_t i = 0; i < len; ++i ) {
+        h = ( h ^ ( unsigned char )p[i] ) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static bool parse_address( const std::string& text, proxy_upstream& up, std::string& err ) {
+    memset( &up.addr, 0, sizeof( up.addr ) );
+    up.name = text;
+    if ( text.compare( 0, 5, "unix:" ) == 0 ) {
+        sockaddr_un* un = ( sockaddr_un* )&up.addr;
+        std::string path = text.substr( 5 );
+        if ( path.empty() || path.size() >= sizeof( un->sun_path ) ) {
+            err = "bad unix socket path in '" + text + "'";
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy( un->sun_path, path.c_str(), path.size() + 1 );
+        up.addr_len = sizeof( sockaddr_un );
+        return true;
+    }
+    // 主机:端口，IPv6 地址写在方括号中
+    size_t colon = text.rfind( ':' );
+    if ( colon == std::string::npos || colon == 0 || colon + 1 == text.size() ) {
+        err = "expected host:port or unix:path, got '" + text + "'";
+        return false;
+    }
+    std::string host = text.substr( 0, colon );
+    std::string port = text.substr( colon + 1 );
+    if ( host.size() > 2 && host[0] == '[' && host[ host.size() - 1 ] == ']' ) {
+        host = host.substr( 1, host.size() - 2 );
+    }
+    addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = NULL;
+    int ret = getaddrinfo( host.c_str(), port.c_str(), &hints, &res );
+    if ( ret != 0 || !res ) {
+        err = "cannot resolve '" + text + "': " + gai_strerror( ret );
+        return false;
+    }
+    memcpy( &up.addr, res->ai_addr, res->ai_addrlen );
+    up.addr_len = res->ai_addrlen;
+    freeaddrinfo( res );
+    return true;
+}
+
+bool proxy_parse( const char* spec, std::vector< proxy_route >& routes, std::string& err ) {
+    routes.clear();
+    int id = 0;
+    std::string s( spec );
+    size_t pos = 0;
+    while ( pos <= s.size() ) {
+        size_t end = s.find( ',', pos );
+        if ( end == std::string::npos ) {
+            end = s.size();
+        }
+        std::string item = s.substr( pos, end - pos );
+        pos = end + 1;
+        if ( item.empty() ) {
+            continue;
+        }
+        size_t eq = item.find( '=' );
+        if ( eq == std::string::npos || item[0] != '/' ) {
+            err = "expected /prefix=address, got '" + item + "'";
+            return false;
+        }
+        proxy_route route;
+        route.prefix = item.substr( 0, eq );
+        route.fastcgi = false;
+        route.max_in_flight = 0;
+        // 地址1|地址2|...
+        std::string list = item.substr( eq + 1 );
+        size_t start = 0;
+        while ( start <= list.size() ) {
+            size_t bar = list.find( '|', start );
+            if ( bar == std::string::npos ) {
+                bar = list.size();
+            }
+            proxy_upstream up;
+            if ( !parse_address( list.substr( start, bar - start ), up, err ) ) {
+                return false;
+            }
+            up.id = id++;
+            up.state = std::make_shared< proxy_upstream_state >();
+            route.upstreams.push_back( up );
+            start = bar + 1;
+        }
+        if ( route.upstreams.size() > MAX_UPSTREAMS ) {
+            err = "too many upstreams for '" + route.prefix + "'";
+            return false;
+        }
+        for ( size_t u = 0; u < route.upstreams.size(); ++u ) {
+            for ( int i = 0; i < RING_POINTS; ++i ) {
+                char point[ 160 ];
+                int n = snprintf( point, sizeof( point ), "%s#%d", route.upstreams[u].name.c_str(), i );
+                route.ring.push_back( std::make_pair( fnv1a( point, n < ( int )sizeof( point ) ? n : sizeof( point ) - 1 ), ( int )u ) );
+            }
+        }
+        std::sort( route.ring.begin(), route.ring.end() );
+        route.next = std::make_shared< std::atomic< unsigned > >( 0 );
+        routes.push_back( route );
+    }
+    return true;
+}
+
+int proxy_balance_parse( const char* name ) {
+    for ( size_t i = 0; i < sizeof( balance_names ) / sizeof( balance_names[0] ); ++i ) {
+        if ( strcmp( name, balance_names[i] ) == 0 ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int proxy_match( const char* url ) {
+    int best = -1;
+    size_t best_len = 0;
+    for ( size_t i = 0; i < proxy_routes.size(); ++i ) {
+        const std::string& p = proxy_routes[i].prefix;
+        if ( strncmp( url, p.c_str(), p.size() ) != 0 ) {
+            continue;
+        }
+        // 整段匹配：前缀以'/'结尾，或者URL在前缀之后结束、是下一段或查询串
+        char next = url[ p.size() ];
+        if ( p[ p.size() - 1 ] != '/' && next != '\0' && next != '/' && next != '?' ) {
+            continue;
+        }
+        if ( best < 0 || p.size() > best_len ) {
+            best = i;
+            best_len = p.size();
+        }
+    }
+    return best;
+}
+
+static bool healthy( const proxy_upstream& up, uint64_t now ) {
+    return up.state->ejected_until.load( std::memory_order_relaxed ) <= now;
+}
+
+static bool has_room( const proxy_route& r, int u ) {
+    return r.max_in_flight <= 0 || r.upstreams[u].state->in_flight.load( std::memory_order_relaxed ) < r.max_in_flight;
+}
+
+// 线程本地的随机数，p2c 使用
+static uint32_t next_random() {
+    static thread_local uint32_t x = 0;
+    if ( x == 0 ) {
+        x = ( uint32_t )now_us() | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+int proxy_pick( int route, const char* url, int exclude ) {
+    const proxy_route& r = proxy_routes[ route ];
+    int n = r.upstreams.size();
+    if ( n == 1 ) {
+        return has_room( r, 0 ) ? 0 : -1;
+    }
+    uint64_t now = now_ms();
+    int healthy_list[ MAX_UPSTREAMS ];
+    int count = 0;
+    unsigned start = r.next->fetch_add( 1, std::memory_order_relaxed );
+    for ( int i = 0; i < n; ++i ) {
+        int u = ( start + i ) % n;
+        if ( u != exclude && healthy( r.upstreams[u], now ) && has_room( r, u ) ) {
+            healthy_list[ count++ ] = u;
+        }
+    }
+    if ( count == 0 ) {
+        // 都被摘除了：选最早恢复的，相当于一次探测；都满了时返回-1
+        int best = -1;
+        for ( int u = 0; u < n; ++u ) {
+            if ( u != exclude && has_room( r, u ) &&
+                 ( best < 0 || r.upstreams[u].state->ejected_until < r.upstreams[ best ].state->ejected_until ) ) {
+                best = u;
+            }
+        }
+        return best;
+    }
+    switch ( proxy_balance ) {
+        case PROXY_LEAST_OUTSTANDING: {
+            // 从轮流的位置开始找，进行中的请求数相同时分散到不同的上游
+            int best = healthy_list[0];
+            for ( int i = 1; i < count; ++i ) {
+                if ( r.upstreams[ healthy_list[i] ].state->in_flight < r.upstreams[ best ].state->in_flight ) {
+                    best = healthy_list[i];
+                }
+            }
+            return best;
+        }
+        case PROXY_P2C: {
+            if ( count == 1 ) {
+                return healthy_list[0];
+            }
+            int a = healthy_list[ next_random() % count ];
+            int b = healthy_list[ next_random() % ( count - 1 ) ];
+            if ( b == a ) {
+                b = healthy_list[ count - 1 ];
+            }
+            const proxy_upstream_state& sa = *r.upstreams[a].state;
+            const proxy_upstream_state& sb = *r.upstreams[b].state;
+            if ( sa.in_flight != sb.in_flight ) {
+                return sa.in_flight < sb.in_flight ? a : b;
+            }
+            return sa.latency_us <= sb.latency_us ? a : b;
+        }
+        case PROXY_HASH: {
+            // 顺时针找第一个可用的上游，摘除的上游的URL分到环上的下一个上游，其他URL不受影响
+            size_t len = strcspn( url, "?" );
+            uint32_t h = fnv1a( url, len );
+            size_t pos = std::lower_bound( r.ring.begin(), r.ring.end(), std::make_pair( h, -1 ) ) - r.ring.begin();
+            for ( size_t i = 0; i < r.ring.size(); ++i ) {
+                int u = r.ring[ ( pos + i ) % r.ring.size() ].second;
+                if ( u != exclude && healthy( r.upstreams[u], now ) && has_room( r, u ) ) {
+                    return u;
+                }
+            }
+            return healthy_list[0];
+        }
+        default:
+            return healthy_list[0];
+    }
+}
+
+uint64_t proxy_begin( int route, int up ) {
+    proxy_upstream_state& st = *proxy_routes[ route ].upstreams[ up ].state;
+    st.in_flight.fetch_add( 1, std::memory_order_relaxed );
+    st.requests.fetch_add( 1, std::memory_order_relaxed );
+    return now_us();
+}
+
+void proxy_answered( int route, int up, uint64_t start ) {
+    proxy_upstream_state& st = *proxy_routes[ route ].upstreams[ up ].state;
+    uint64_t sample = now_us() - start;
+    uint64_t old = st.latency_us.load( std::memory_order_relaxed );
+    // 权重 1/8 的移动平均；并发更新时丢掉一个样本没有关系
+    st.latency_us.store( old == 0 ? sample : old - old / 8 + sample / 8, std::memory_order_relaxed );
+}
+
+void proxy_end( int route, int up, int result ) {
+    proxy_upstream_state& st = *proxy_routes[ route ].upstreams[ up ].state;
+    st.in_flight.fetch_sub( 1, std::memory_order_relaxed );
+    if ( result == PROXY_RESULT_OK ) {
+        st.fails.store( 0, std::memory_order_relaxed );
+    } else if ( result == PROXY_RESULT_DOWN ) {
+        st.failures.fetch_add( 1, std::memory_order_relaxed );
+        if ( st.fails.fetch_add( 1, std::memory_order_relaxed ) + 1 >= proxy_max_fails ) {
+            st.fails.store( 0, std::memory_order_relaxed );
+            st.ejected_until.store( now_ms() + proxy_eject_ms, std::memory_order_relaxed );
+            st.ejections.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+}
+
+// 线程本地的空闲连接和管道，线程退出时关闭
+struct idle_conn {
+    int fd;
+    uint64_t since;
+};
+
+struct proxy_thread_cache {
+    std::vector< std::vector< idle_conn > > idle;   // 按上游的 id
+    std::vector< int > pipes;                       // 成对存放
+    ~proxy_thread_cache() {
+        for ( size_t r = 0; r < idle.size(); ++r ) {
+            for ( size_t i = 0; i < idle[r].size(); ++i ) {
+                close( idle[r][i].fd );
+            }
+        }
+        for ( size_t i = 0; i < pipes.size(); ++i ) {
+            close( pipes[i] );
+        }
+    }
+};
+
+static thread_local proxy_thread_cache cache;
+
+int proxy_take( int route, int up ) {
+    size_t id = proxy_routes[ route ].upstreams[ up ].id;
+    if ( cache.idle.size() <= id ) {
+        return -1;
+    }
+    std::vector< idle_conn >& pool = cache.idle[ id ];
+    uint64_t now = now_ms();
+    while ( !pool.empty() ) {
+        // 后放回的先取，最近用过的连接最不可能被上游关闭
+        idle_conn c = pool.back();
+        pool.pop_back();
+        if ( now - c.since > PROXY_IDLE_MS ) {
+            close( c.fd );
+            continue;
+        }
+        // 空闲时收到数据或者EOF都说明连接不能再用了
+        char b;
+        ssize_t n = recv( c.fd, &b, 1, MSG_PEEK | MSG_DONTWAIT );
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            proxy_count( PROXY_REUSED );
+            return c.fd;
+        }
+        close( c.fd );
+    }
+    return -1;
+}
+
+int proxy_dial( int route, int index ) {
+    const proxy_upstream& up = proxy_routes[ route ].upstreams[ index ];
+    int fd = socket( up.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    if ( up.addr.ss_family != AF_UNIX ) {
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    }
+    proxy_count( PROXY_DIALS );
+    if ( connect( fd, ( const sockaddr* )&up.addr, up.addr_len ) != 0 && errno != EINPROGRESS ) {
+        int saved = errno;
+        close( fd );
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int proxy_connected( int fd ) {
+    int error = 0;
+    socklen_t len = sizeof( error );
+    if ( getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &len ) != 0 ) {
+        return -errno;
+    }
+    return -error;
+}
+
+void proxy_put( int route, int up, int fd, bool reusable ) {
+    if ( !reusable || proxy_idle_max <= 0 ) {
+        close( fd );
+        return;
+    }
+    size_t id = proxy_routes[ route ].upstreams[ up ].id;
+    if ( cache.idle.size() <= id ) {
+        cache.idle.resize( id + 1 );
+    }
+    std::vector< idle_conn >& pool = cache.idle[ id ];
+    if ( pool.size() >= ( size_t )proxy_idle_max ) {
+        close( fd );
+        return;
+    }
+    idle_conn c = { fd, now_ms() };
+    pool.push_back( c );
+}
+
+bool proxy_failover( int route, const char* url, int& up, uint64_t& start, int attempt ) {
+    proxy_end( route, up, PROXY_RESULT_DOWN );
+    // 连不上时换一个上游重试一次，其他上游都满了时不重试
+    int next = attempt == 0 && proxy_routes[ route ].upstreams.size() > 1 ? proxy_pick( route, url, up ) : -1;
+    if ( next < 0 ) {
+        return false;
+    }
+    proxy_count( PROXY_RETRIES );
+    up = next;
+    start = proxy_begin( route, up );
+    return true;
+}
+
+bool proxy_hop_by_hop( const char* name, size_t len ) {
+    static const char* const names[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade" };
+    for ( size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); ++i ) {
+        if ( strlen( names[i] ) == len && strncasecmp( name, names[i], len ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Connection 头中列出的头部也是逐跳的，例如 Connection: close, X-Session
+static bool listed_in( const std::string& connection, const char* name, size_t len ) {
+    size_t pos = 0;
+    while ( pos < connection.size() ) {
+        pos = connection.find_first_not_of( " \t,", pos );
+        if ( pos == std::string::npos ) {
+            break;
+        }
+        size_t end = connection.find_first_of( " \t,", pos );
+        if ( end == std::string::npos ) {
+            end = connection.size();
+        }
+        if ( end - pos == len && strncasecmp( connection.c_str() + pos, name, len ) == 0 ) {
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+void proxy_request_head( std::string& out, const char* method, const char* url, const std::vector< const char* >& headers,
+                         const sockaddr_in& client, bool& expect_continue ) {
+    std::string connection;
+    std::string forwarded;
+    expect_continue = false;
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        if ( strncasecmp( headers[i], "Connection:", 11 ) == 0 ) {
+            connection += headers[i] + 11;
+            connection += ',';
+        }
+    }
+    out.clear();
+    out.append( method ).append( " " ).append( url ).append( " HTTP/1.1\r\n" );
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        const char* h = headers[i];
+        const char* colon = strchr( h, ':' );
+        if ( !colon ) {
+            continue;
+        }
+        size_t len = colon - h;
+        const char* value = colon + 1 + strspn( colon + 1, " \t" );
+        if ( proxy_hop_by_hop( h, len ) || listed_in( connection, h, len ) ) {
+            continue;
+        }
+        if ( len == 6 && strncasecmp( h, "Expect", 6 ) == 0 ) {
+            // 100 Continue 由代理直接回复，上游收到的是完整的请求
+            expect_continue = strcasecmp( value, "100-continue" ) == 0;
+            continue;
+        }
+        if ( len == 15 && strncasecmp( h, "X-Forwarded-For", 15 ) == 0 ) {
+            forwarded = value;
+            continue;
+        }
+        out.append( h ).append( "\r\n" );
+    }
+    char ip[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &client.sin_addr, ip, sizeof( ip ) );
+    if ( !forwarded.empty() ) {
+        forwarded += ", ";
+    }
+    forwarded += ip;
+    out.append( "X-Forwarded-For: " ).append( forwarded ).append( "\r\nConnection: keep-alive\r\n\r\n" );
+}
+
+// 在 [p, end) 中找下一行，返回行尾（'\r'的位置）
+static const char* line_end( const char* p, const char* end ) {
+    const char* cr = ( const char* )memmem( p, end - p, "\r\n", 2 );
+    return cr ? cr : end;
+}
+
+static bool header_is( const char* line, size_t len, const char* name, const char*& value, size_t& value_len ) {
+    size_t n = strlen( name );
+    if ( len <= n || line[n] != ':' || strncasecmp( line, name, n ) != 0 ) {
+        return false;
+    }
+    value = line + n + 1;
+    value_len = len - n - 1;
+    while ( value_len > 0 && ( *value == ' ' || *value == '\t' ) ) {
+        ++value;
+        --value_len;
+    }
+    return true;
+}
+
+static bool has_token( const char* value, size_t len, const char* token ) {
+    size_t n = strlen( token );
+    for ( size_t i = 0; i + n <= len; ++i ) {
+        if ( strncasecmp( value + i, token, n ) == 0 &&
+             ( i == 0 || strchr( " \t,", value[ i - 1 ] ) ) && ( i + n == len || strchr( " \t,;", value[ i + n ] ) ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int proxy_parse_response( const char* buf, size_t len, bool head_request, proxy_response& r ) {
+    const char* head_end = ( const char* )memmem( buf, len, "\r\n\r\n", 4 );
+    if ( !head_end ) {
+        return len >= PROXY_BUFFER_SIZE ? -1 : 0;
+    }
+    r.head_len = head_end + 4 - buf;
+    // HTTP/1.1 200 OK
+    if ( r.head_len < 14 || strncmp( buf, "HTTP/1.", 7 ) != 0 || buf[8] != ' ' ) {
+        return -1;
+    }
+    r.status = atoi( buf + 9 );
+    if ( r.status < 100 || r.status > 999 ) {
+        return -1;
+    }
+    r.upstream_close = buf[7] == '0';
+    bool has_length = false;
+    bool chunked = false;
+    r.content_length = 0;
+    const char* p = line_end( buf, head_end ) + 2;
+    while ( p < head_end ) {
+        const char* e = line_end( p, head_end );
+        const char* v;
+        size_t vlen;
+        if ( header_is( p, e - p, "Content-Length", v, vlen ) ) {
+            char* stop;
+            unsigned long long n = strtoull( v, &stop, 10 );
+            if ( stop == v || ( has_length && n != r.content_length ) ) {
+                return -1;
+            }
+            r.content_length = n;
+            has_length = true;
+        } else if ( header_is( p, e - p, "Transfer-Encoding", v, vlen ) ) {
+            chunked = has_token( v, vlen, "chunked" );
+        } else if ( header_is( p, e - p, "Connection", v, vlen ) ) {
+            if ( has_token( v, vlen, "close" ) ) {
+                r.upstream_close = true;
+            } else if ( has_token( v, vlen, "keep-alive" ) ) {
+                r.upstream_close = false;
+            }
+        }
+        p = e + 2;
+    }
+    if ( head_request || r.status < 200 || r.status == 204 || r.status == 304 ) {
+        r.body = PROXY_BODY_NONE;
+    } else if ( chunked ) {
+        r.body = PROXY_BODY_CHUNKED;
+    } else if ( has_length ) {
+        r.body = r.content_length > 0 ? PROXY_BODY_LENGTH : PROXY_BODY_NONE;
+    } else {
+        r.body = PROXY_BODY_EOF;
+    }
+    return 1;
+}
+
+void proxy_response_head( std::string& out, const char* buf, const proxy_response& r, bool& keep_alive ) {
+    const char* head_end = buf + r.head_len - 2;
+    std::string connection;
+    const char* p = line_end( buf, head_end ) + 2;
+    while ( p < head_end ) {
+        const char* e = line_end( p, head_end );
+        const char* v;
+        size_t vlen;
+        if ( header_is( p, e - p, "Connection", v, vlen ) ) {
+            connection.append( v, vlen ).append( "," );
+        }
+        p = e + 2;
+    }
+    if ( r.body == PROXY_BODY_EOF ) {
+        keep_alive = false;
+    }
+    // 状态行统一为 HTTP/1.1
+    const char* status_end = line_end( buf, head_end );
+    out.assign( "HTTP/1.1" ).append( buf + 8, status_end - buf - 8 ).append( "\r\n" );
+    p = status_end + 2;
+    while ( p < head_end ) {
+        const char* e = line_end( p, head_end );
+        const char* colon = ( const char* )memchr( p, ':', e - p );
+        if ( colon && !proxy_hop_by_hop( p, colon - p ) && !listed_in( connection, p, colon - p ) ) {
+            out.append( p, e - p ).append( "\r\n" );
+        }
+        p = e + 2;
+    }
+    out.append( keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n" );
+}
+
+size_t chunk_scanner::scan( const char* p, size_t n ) {
+    size_t i = 0;
+    while ( i < n && state != DONE && state != FAILED ) {
+        char c = p[i];
+        switch ( state ) {
+            case SIZE:
+                if ( isxdigit( ( unsigned char )c ) ) {
+                    int d = c <= '9' ? c - '0' : ( c | 0x20 ) - 'a' + 10;
+                    if ( remaining >> 59 ) {
+                        state = FAILED;
+                        break;
+                    }
+                    remaining = remaining * 16 + d;
+                    digits = true;
+                } else if ( !digits ) {
+                    state = FAILED;
+                } else if ( c == '\r' ) {
+                    state = SIZE_LF;
+                } else {
+                    state = EXT;    // 分块扩展 ;name=value
+                }
+                ++i;
+                break;
+            case EXT:
+                if ( c == '\r' ) {
+                    state = SIZE_LF;
+                }
+                ++i;
+                break;
+            case SIZE_LF:
+                if ( c != '\n' ) {
+                    state = FAILED;
+                } else {
+                    state = remaining > 0 ? DATA : TRAILER_START;
+                }
+                ++i;
+                break;
+            case DATA: {
+                size_t take = n - i < remaining ? n - i : ( size_t )remaining;
+                i += take;
+                remaining -= take;
+                if ( remaining == 0 ) {
+                    state = DATA_CR;
+                }
+                break;
+            }
+            case DATA_CR:
+                state = c == '\r' ? DATA_LF : FAILED;
+                ++i;
+                break;
+            case DATA_LF:
+                if ( c == '\n' ) {
+                    state = SIZE;
+                    digits = false;
+                } else {
+                    state = FAILED;
+                }
+                ++i;
+                break;
+            case TRAILER_START:
+                // 最后一个分块之后是零到多行的 trailer，空行结束
+                state = c == '\r' ? END_LF : TRAILER;
+                ++i;
+                break;
+            case TRAILER:
+                if ( c == '\r' ) {
+                    state = TRAILER_LF;
+                }
+                ++i;
+                break;
+            case TRAILER_LF:
+                state = c == '\n' ? TRAILER_START : FAILED;
+                ++i;
+                break;
+            case END_LF:
+                state = c == '\n' ? DONE : FAILED;
+                ++i;
+                break;
+        }
+    }
+    return i;
+}
+
+char* proxy_buffer() {
+    static thread_local char buffer[ PROXY_BUFFER_SIZE ];
+    return buffer;
+}
+
+bool proxy_pipe_take( int pipefd[2] ) {
+    if ( cache.pipes.size() >= 2 ) {
+        pipefd[1] = cache.pipes.back();
+        cache.pipes.pop_back();
+        pipefd[0] = cache.pipes.back();
+        cache.pipes.pop_back();
+        return true;
+    }
+    return pipe2( pipefd, O_NONBLOCK | O_CLOEXEC ) == 0;
+}
+
+void proxy_pipe_put( int pipefd[2], bool clean ) {
+    if ( clean && cache.pipes.size() < PIPE_CACHE * 2 ) {
+        cache.pipes.push_back( pipefd[0] );
+        cache.pipes.push_back( pipefd[1] );
+    } else {
+        close( pipefd[0] );
+        close( pipefd[1] );
+    }
+}
+
+int proxy_wait( int fd, short events ) {
+    pollfd pfd = { fd, events, 0 };
+    while ( true ) {
+        int n = poll( &pfd, 1, proxy_timeout_ms );
+        if ( n > 0 ) {
+            return 0;
+        }
+        if ( n == 0 ) {
+            return -ETIMEDOUT;
+        }
+        if ( errno != EINTR ) {
+            return -errno;
+        }
+    }
+}
+
+int proxy_connect( int route, const char* url, int& up, uint64_t& start, bool& reused ) {
+    for ( int attempt = 0; ; ++attempt ) {
+        int fd = proxy_take( route, up );
+        reused = fd >= 0;
+        if ( reused ) {
+            return fd;
+        }
+        fd = proxy_dial( route, up );
+        int ret = fd < 0 ? -errno : proxy_wait( fd, POLLOUT );
+        if ( ret == 0 ) {
+            ret = proxy_connected( fd );
+        }
+        if ( ret == 0 ) {
+            return fd;
+        }
+        if ( fd >= 0 ) {
+            close( fd );
+        }
+        if ( !proxy_failover( route, url, up, start, attempt ) ) {
+            return ret;
+        }
+    }
+}
+
+ssize_t proxy_send_all( int fd, const char* buf, size_t len, int flags ) {
+    size_t done = 0;
+    while ( done < len ) {
+        ssize_t n = send( fd, buf + done, len - done, flags | MSG_NOSIGNAL );
+        if ( n > 0 ) {
+            done += n;
+            continue;
+        }
+        if ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+            return -errno;
+        }
+        int ret = proxy_wait( fd, POLLOUT );
+        if ( ret < 0 ) {
+            return ret;
+        }
+    }
+    return done;
+}
+
+ssize_t proxy_recv( int fd, char* buf, size_t len ) {
+    while ( true ) {
+        ssize_t n = recv( fd, buf, len, 0 );
+        if ( n >= 0 ) {
+            return n;
+        }
+        if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+            return -errno;
+        }
+        int ret = proxy_wait( fd, POLLIN );
+        if ( ret < 0 ) {
+            return ret;
+        }
+    }
+}
+
+ssize_t proxy_splice( int from, int to, uint64_t len ) {
+    int p[2];
+    if ( !proxy_pipe_take( p ) ) {
+        return -errno;
+    }
+    uint64_t moved = 0;
+    ssize_t ret = 0;
+    size_t in_pipe = 0;
+    while ( moved < len ) {
+        // 先把 from 中的数据放进管道，再把管道中的全部数据写到 to
+        uint64_t want = len - moved < 65536 ? len - moved : 65536;
+        ssize_t n = splice( from, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( n == 0 ) {
+            // from 关闭：读到结束为止时正常结束，否则数据不完整
+            ret = len == UINT64_MAX ? 0 : -EPIPE;
+            break;
+        }
+        if ( n < 0 ) {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                ret = -errno;
+                break;
+            }
+            ret = proxy_wait( from, POLLIN );
+            if ( ret < 0 ) {
+                break;
+            }
+            continue;
+        }
+        in_pipe = n;
+        while ( in_pipe > 0 ) {
+            ssize_t m = splice( p[0], NULL, to, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            if ( m > 0 ) {
+                in_pipe -= m;
+                moved += m;
+                continue;
+            }
+            if ( m < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                ret = -errno;
+                break;
+            }
+            ret = proxy_wait( to, POLLOUT );
+            if ( ret < 0 ) {
+                break;
+            }
+        }
+        if ( ret < 0 ) {
+            break;
+        }
+    }
+    proxy_pipe_put( p, in_pipe == 0 );
+    return ret < 0 ? ret : ( ssize_t )moved;
+}
+
+ssize_t proxy_copy( int from, int to, uint64_t len, microcache_capture* copy ) {
+    char* buf = proxy_buffer();
+    uint64_t moved = 0;
+    while ( moved < len ) {
+        ssize_t n = proxy_recv( from, buf, len - moved < PROXY_BUFFER_SIZE ? len - moved : PROXY_BUFFER_SIZE );
+        if ( n <= 0 ) {
+            return n == 0 && len == UINT64_MAX ? moved : ( n == 0 ? -EPIPE : n );
+        }
+        copy->add( buf, n );
+        ssize_t ret = proxy_send_all( to, buf, n, moved + n < len ? MSG_MORE : 0 );
+        if ( ret < 0 ) {
+            return ret;
+        }
+        moved += n;
+    }
+    return moved;
+}
+
+ssize_t proxy_relay_chunked( int from, int to, const char* pre, size_t pre_len, microcache_capture* copy ) {
+    chunk_scanner scanner;
+    const char* data = pre;
+    size_t len = pre_len;
+    char* buf = proxy_buffer();
+    while ( true ) {
+        size_t body = scanner.scan( data, len );
+        if ( scanner.failed() ) {
+            return -EPROTO;
+        }
+        if ( body > 0 ) {
+            if ( copy ) {
+                copy->add( data, body );
+            }
+            ssize_t ret = proxy_send_all( to, data, body, scanner.done() ? 0 : MSG_MORE );
+            if ( ret < 0 ) {
+                return ret;
+            }
+        }
+        if ( scanner.done() ) {
+            return len - body;
+        }
+        ssize_t n = proxy_recv( from, buf, PROXY_BUFFER_SIZE );
+        if ( n <= 0 ) {
+            return n == 0 ? -EPIPE : n;
+        }
+        data = buf;
+        len = n;
+    }
+}
+
+proxy_exchange::proxy_exchange( int route, const http_request& req, char* buf, bool keep_alive,
+                                microcache_capture* capture )
+    : route( route ), req( req ), buf( buf ), capture( capture ), has_body( req.chunked || req.content_length > 0 ),
+      pre_len( 0 ), remaining( 0 ), expect_continue( false ), continue_sent( false ), body_streamed( false ),
+      keep_alive( keep_alive ), up( -1 ), start( 0 ), attempt( 0 ), len( 0 ), answered( false ), extra( NULL ),
+      extra_len( 0 ), first( 0 ), reusable( false ) {
+    memset( &r, 0, sizeof( r ) );
+}
+
+int proxy_exchange::begin( const std::vector< const char* >& headers, const sockaddr_in& client, size_t pre_bytes ) {
+    proxy_count( PROXY_REQUESTS );
+    proxy_request_head( head, req.method_name, req.url, headers, client, expect_continue );
+    pre_len = pre_bytes;
+    if ( !req.chunked ) {
+        pre_len = pre_bytes < ( size_t )req.content_length ? pre_bytes : req.content_length;
+        remaining = req.content_length - pre_len;
+    }
+    up = proxy_pick( route, req.url );
+    if ( up < 0 ) {
+        // 所有上游都满了，请求体还留在连接上
+        keep_alive = keep_alive && !has_body;
+        return 503;
+    }
+    start = proxy_begin( route, up );
+    return 0;
+}
+
+bool proxy_exchange::need_continue() {
+    if ( !expect_continue || continue_sent || remaining == 0 ) {
+        return false;
+    }
+    continue_sent = true;
+    return true;
+}
+
+int proxy_exchange::connect_failed( ssize_t err ) {
+    proxy_count( err == -ETIMEDOUT ? PROXY_ERR_TIMEOUT : PROXY_ERR_CONNECT );
+    keep_alive = keep_alive && !has_body;
+    return err == -ETIMEDOUT ? 504 : 502;
+}
+
+int proxy_exchange::read_head() {
+    while ( len > 0 ) {
+        int parsed = proxy_parse_response( buf, len, req.method == http_request::HEAD, r );
+        if ( parsed < 0 || ( parsed > 0 && r.status == 101 ) ) {
+            return -EPROTO;
+        }
+        if ( parsed == 0 ) {
+            break;
+        }
+        if ( r.status >= 200 ) {
+            proxy_answered( route, up, start );
+            return 1;
+        }
+        // 1xx 的临时响应不转发，后面可能紧接着最终的响应
+        memmove( buf, buf + r.head_len, len - r.head_len );
+        len -= r.head_len;
+    }
+    return 0;
+}
+
+bool proxy_exchange::retry( ssize_t err, bool reused ) {
+    if ( !reused || attempt > 0 || answered || body_streamed || err == -ETIMEDOUT ) {
+        return false;
+    }
+    proxy_count( PROXY_RETRIES );
+    ++attempt;
+    len = 0;
+    return true;
+}
+
+int proxy_exchange::failed( ssize_t err ) {
+    proxy_end( route, up, err == -ETIMEDOUT ? PROXY_RESULT_DOWN : PROXY_RESULT_ERROR );
+    proxy_count( err == -ETIMEDOUT ? PROXY_ERR_TIMEOUT : PROXY_ERR_UPSTREAM );
+    // 请求体可能还有一部分留在连接上，无法再解析下一个请求，回复错误后关闭
+    if ( has_body ) {
+        keep_alive = false;
+    }
+    return err == -ETIMEDOUT ? 504 : 502;
+}
+
+void proxy_exchange::forward( bool closing ) {
+    // 响应头去掉逐跳的头部，响应体原样转发
+    keep_alive = keep_alive && !closing;
+    proxy_response_head( head, buf, r, keep_alive );
+    extra = buf + r.head_len;
+    extra_len = len - r.head_len;
+    reusable = !r.upstream_close;
+    first = extra_len;
+    if ( r.body == PROXY_BODY_NONE ) {
+        first = 0;
+        reusable = reusable && extra_len == 0;
+    } else if ( r.body == PROXY_BODY_LENGTH ) {
+        first = extra_len < r.content_length ? extra_len : r.content_length;
+        reusable = reusable && extra_len <= r.content_length;
+    } else if ( r.body == PROXY_BODY_EOF ) {
+        // 没有长度，上游关闭连接时结束
+        reusable = false;
+    }
+    if ( capture ) {
+        capture->add( head.data(), head.size() );
+        if ( r.body != PROXY_BODY_CHUNKED ) {
+            capture->add( extra, first );
+        }
+    }
+}
+
+void proxy_exchange::abort( ssize_t err ) {
+    proxy_count( err == -ETIMEDOUT ? PROXY_ERR_TIMEOUT : PROXY_ERR_UPSTREAM );
+    proxy_end( route, up, err == -ETIMEDOUT ? PROXY_RESULT_DOWN : PROXY_RESULT_ERROR );
+    keep_alive = false;
+}
+
+void proxy_exchange::finish( int fd ) {
+    proxy_end( route, up, PROXY_RESULT_OK );
+    proxy_put( route, up, fd, reusable );
+    if ( capture ) {
+        capture->complete = true;
+    }
+}
+
+void proxy_count( int stat ) {
+    proxy_stats[ stat ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+void proxy_metrics( std::string& out ) {
+    if ( proxy_routes.empty() ) {
+        return;
+    }
+    metrics_header( out, "webserver_proxy_requests_total", "counter", "Requests forwarded to an upstream." );
+    metrics_counter( out, "webserver_proxy_requests_total", NULL, proxy_stats[ PROXY_REQUESTS ].load() );
+    metrics_header( out, "webserver_proxy_connections_total", "counter", "Upstream connections by origin." );
+    metrics_counter( out, "webserver_proxy_connections_total", "origin=\"dial\"", proxy_stats[ PROXY_DIALS ].load() );
+    metrics_counter( out, "webserver_proxy_connections_total", "origin=\"pool\"", proxy_stats[ PROXY_REUSED ].load() );
+    metrics_header( out, "webserver_proxy_retries_total", "counter", "Requests retried on a new connection or another upstream." );
+    metrics_counter( out, "webserver_proxy_retries_total", NULL, proxy_stats[ PROXY_RETRIES ].load() );
+    metrics_header( out, "webserver_proxy_errors_total", "counter", "Proxied requests that failed, by cause." );
+    metrics_counter( out, "webserver_proxy_errors_total", "cause=\"connect\"", proxy_stats[ PROXY_ERR_CONNECT ].load() );
+    metrics_counter( out, "webserver_proxy_errors_total", "cause=\"timeout\"", proxy_stats[ PROXY_ERR_TIMEOUT ].load() );
+    metrics_counter( out, "webserver_proxy_errors_total", "cause=\"upstream\"", proxy_stats[ PROXY_ERR_UPSTREAM ].load() );
+
+    // 每个上游的状态
+    static const char* const names[] = { "webserver_proxy_upstream_in_flight", "webserver_proxy_upstream_requests_total",
+                                         "webserver_proxy_upstream_failures_total", "webserver_proxy_upstream_ejections_total",
+                                         "webserver_proxy_upstream_latency_seconds", "webserver_proxy_upstream_healthy" };
+    static const char* const types[] = { "gauge", "counter", "counter", "counter", "gauge", "gauge" };
+    static const char* const helps[] = { "Requests in progress on the upstream.", "Requests sent to the upstream.",
+                                         "Connect failures and timeouts.", "Times the upstream was ejected by the passive health check.",
+                                         "Moving average of the time to the response head.", "1 unless the upstream is ejected." };
+    uint64_t now = now_ms();
+    for ( int m = 0; m < 6; ++m ) {
+        metrics_header( out, names[m], types[m], helps[m] );
+        for ( size_t r = 0; r < proxy_routes.size(); ++r ) {
+            for ( size_t u = 0; u < proxy_routes[r].upstreams.size(); ++u ) {
+                const proxy_upstream& up = proxy_routes[r].upstreams[u];
+                const proxy_upstream_state& st = *up.state;
+                std::string labels = "route=\"" + proxy_routes[r].prefix + "\",upstream=\"" + up.name + "\"";
+                switch ( m ) {
+                    case 0: metrics_gauge( out, names[m], labels.c_str(), st.in_flight.load() ); break;
+                    case 1: metrics_counter( out, names[m], labels.c_str(), st.requests.load() ); break;
+                    case 2: metrics_counter( out, names[m], labels.c_str(), st.failures.load() ); break;
+                    case 3: metrics_counter( out, names[m], labels.c_str(), st.ejections.load() ); break;
+                    case 4: metrics_gauge( out, names[m], labels.c_str(), st.latency_us.load() / 1e6 ); break;
+                    default: metrics_gauge( out, names[m], labels.c_str(), healthy( up, now ) ? 1 : 0 ); break;
+                }
+            }
+        }
+    }
+}
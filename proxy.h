@@ -0,0 +1,238 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "http_request.h"
+
+/*
+    反向代理：URL 以某个前缀开头的请求原样转发给上游，例如
+        proxy = /api=127.0.0.1:8081,/internal=unix:/run/app.sock
+    前缀按整段匹配（/api 匹配 /api、/api/users、/api?x=1，不匹配 /apix），多个前缀都匹配时取最长的。
+    转发时URL不变，去掉逐跳的请求头，加上 X-Forwarded-For；代理的路径允许 GET 以外的方法。
+
+    到上游的连接是 keep-alive 的，用完放回连接池。连接池是线程本地的：线程池模式下每个工作线程一份，
+    协程模式下每个反应堆一份，取用和归还都不加锁。取出时先用 MSG_PEEK 确认上游没有关闭，
+    复用的连接在收到任何响应之前就断开时，换一个新连接重试一次（请求体还没有从客户端读走时）。
+
+    请求体和响应体中已知长度的部分用 splice() 经过管道在两个套接字之间搬运，不复制到用户空间；
+    chunked 的响应体需要找到结束位置，经过缓冲区转发（不改变分块）。
+    上游连不上回复502，超过 proxy_timeout_ms 没有进展回复504；已经开始发送响应之后出错只能关闭连接。
+
+    一个前缀可以有多个上游，用'|'分隔，例如 /api=127.0.0.1:8081|127.0.0.1:8082，按 proxy_balance 选择：
+        round_robin         轮流
+        least_outstanding   进行中的请求最少的
+        p2c                 随机取两个，选进行中的请求少的（相同时选延迟低的）
+        hash                按URL（不含查询串）一致性哈希，同一个URL总是到同一个上游，便于上游缓存
+    被动健康检查：连接失败或者超时连续 proxy_max_fails 次，这个上游在 proxy_eject_ms 内不再被选择；
+    所有上游都被摘除时选最早恢复的那个试一试。连接失败时换一个上游重试一次。
+
+    FastCGI 的路由（见 fastcgi.h）也放在 proxy_routes 中，共用前缀匹配、负载均衡、健康检查和连接池。
+*/
+
+// 上游的运行状态，选择上游和指标使用
+struct proxy_upstream_state {
+    std::atomic< int > in_flight;           // 进行中的请求
+    std::atomic< int > fails;               // 连续失败次数
+    std::atomic< uint64_t > requests;
+    std::atomic< uint64_t > failures;       // 连接失败或超时
+    std::atomic< uint64_t > ejections;
+    std::atomic< uint64_t > ejected_until;  // 毫秒，之前不被选择
+    std::atomic< uint64_t > latency_us;     // 收到响应头的时间，指数移动平均
+    proxy_upstream_state() : in_flight( 0 ), fails( 0 ), requests( 0 ), failures( 0 ), ejections( 0 ), ejected_until( 0 ),
+                             latency_us( 0 ) {}
+};
+
+struct proxy_upstream {
+    std::string name;           // 配置中的写法，用于日志和指标
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    int id;                     // 在所有路由的上游中的序号，连接池按它区分
+    std::shared_ptr< proxy_upstream_state > state;
+};
+
+struct proxy_route {
+    std::string prefix;
+    std::vector< proxy_upstream > upstreams;
+    std::vector< std::pair< uint32_t, int > > ring;     // 一致性哈希环：(哈希, 上游下标)，按哈希排序
+    std::shared_ptr< std::atomic< unsigned > > next;    // 轮流的位置
+    bool fastcgi;                                       // 上游是 FastCGI 应用服务器，见 fastcgi.h
+    int max_in_flight;                                  // 每个上游同时进行的请求数上限，0 表示不限
+};
+
+enum PROXY_BALANCE { PROXY_ROUND_ROBIN = 0, PROXY_LEAST_OUTSTANDING, PROXY_P2C, PROXY_HASH };
+
+extern std::vector< proxy_route > proxy_routes;
+extern int proxy_timeout_ms;    // 连接、读、写上游（以及代理时写客户端）的超时
+extern int proxy_idle_max;      // 每个线程、每个上游最多保留的空闲连接数，0 表示不复用
+extern int proxy_balance;       // PROXY_BALANCE
+extern int proxy_max_fails;
+extern int proxy_eject_ms;
+
+// 解析 "前缀=地址|地址,前缀=地址"，地址为 主机:端口 或 unix:路径；出错时返回false并在err中给出原因
+bool proxy_parse( const char* spec, std::vector< proxy_route >& routes, std::string& err );
+// 解析 proxy_balance 的取值，不认识时返回-1
+int proxy_balance_parse( const char* name );
+// 返回匹配的路由下标，没有时返回-1
+int proxy_match( const char* url );
+
+// 为请求选择上游，返回 upstreams 的下标；exclude 是刚刚失败、重试时不再选择的上游。
+// 所有上游都达到 max_in_flight 时返回-1（检查和 proxy_begin 之间不加锁，并发时可能略微超出）
+int proxy_pick( int route, const char* url, int exclude = -1 );
+// 请求开始转发到上游，返回开始时间（微秒）
+uint64_t proxy_begin( int route, int up );
+// 收到了响应头，记录延迟
+void proxy_answered( int route, int up, uint64_t start );
+// 请求结束。result 为 PROXY_RESULT，PROXY_RESULT_DOWN 计入被动健康检查
+enum PROXY_RESULT { PROXY_RESULT_OK = 0, PROXY_RESULT_DOWN, PROXY_RESULT_ERROR };
+void proxy_end( int route, int up, int result );
+
+// 连接池：取一个到 upstreams[ up ] 的空闲连接，没有时返回-1
+int proxy_take( int route, int up );
+// 新建到上游的非阻塞连接，connect 已经发起（可能还在进行中）；失败返回-1
+int proxy_dial( int route, int up );
+// 检查非阻塞 connect 的结果，返回0或者-errno
+int proxy_connected( int fd );
+// 响应完整收到、上游没有要求关闭时放回连接池，否则关闭
+void proxy_put( int route, int up, int fd, bool reusable );
+// 连不上 upstreams[ up ]（attempt 为这个请求第几次连接，从0开始）：记入被动健康检查，
+// 第一次失败时换一个上游，返回true表示用新的 up 和 start 再连一次
+bool proxy_failover( int route, const char* url, int& up, uint64_t& start, int attempt );
+
+// 逐跳的头部（Connection、Keep-Alive 等）只对一个连接有意义，不转发
+bool proxy_hop_by_hop( const char* name, size_t len );
+// 生成转发给上游的请求头。headers 是客户端的请求头，每项是一行 "Name: value"（不含换行）；
+// expect_continue 返回客户端是否在等待 100 Continue
+void proxy_request_head( std::string& out, const char* method, const char* url, const std::vector< const char* >& headers,
+                         const sockaddr_in& client, bool& expect_continue );
+
+// 上游响应体的长度方式
+enum PROXY_BODY { PROXY_BODY_NONE = 0, PROXY_BODY_LENGTH, PROXY_BODY_CHUNKED, PROXY_BODY_EOF };
+
+struct proxy_response {
+    int status;
+    int body;                   // PROXY_BODY
+    uint64_t content_length;
+    bool upstream_close;        // 上游要求关闭连接，或者是 HTTP/1.0
+    size_t head_len;            // 响应头的长度（含空行）
+};
+
+// 解析 [buf, buf + len) 中的响应头：返回1表示完整，0表示还需要数据，-1表示格式错误
+int proxy_parse_response( const char* buf, size_t len, bool head_request, proxy_response& r );
+// 生成发给客户端的响应头：去掉逐跳的头部，按 keep_alive 加 Connection；
+// 响应体以关闭连接结束时 keep_alive 改为false
+void proxy_response_head( std::string& out, const char* buf, const proxy_response& r, bool& keep_alive );
+
+// 找 chunked 响应体的结束位置，不解码
+struct chunk_scanner {
+    chunk_scanner() : state( 0 ), remaining( 0 ), digits( false ) {}
+    // 扫描接下来的 n 个字节，返回属于响应体的字节数；小于 n 或 done() 时响应体已经结束
+    size_t scan( const char* p, size_t n );
+    bool done() const { return state == DONE; }
+    bool failed() const { return state == FAILED; }
+
+    enum { SIZE = 0, EXT, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER_START, TRAILER, TRAILER_LF, END_LF, DONE, FAILED };
+    int state;
+    uint64_t remaining;
+    bool digits;
+};
+
+// 每个线程的缓冲区，存放上游的响应头和 chunked 响应体
+char* proxy_buffer();
+static const size_t PROXY_BUFFER_SIZE = 16384;
+
+// 搬运数据用的管道：用完后如果管道里没有残留数据就放回，否则关闭
+bool proxy_pipe_take( int pipefd[2] );
+void proxy_pipe_put( int pipefd[2], bool clean );
+
+struct microcache_capture;
+
+static const char PROXY_CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+// 一次代理请求中不读写套接字的部分：生成请求头、选择上游、解析响应头、出错时是否重试以及回复什么、
+// 统计和被动健康检查。线程池模式（http_conn::do_proxy，阻塞）和协程模式（coro.cpp，co_await）
+// 都按它的决定进行，自己只负责 I/O，顺序是
+//     begin；连接上游，失败时 connect_failed；发送 head 和请求体；read_head 为0时读到 buf + len；
+//     出错时关闭上游连接，retry 为true时重来，否则回复 failed 的状态码；
+//     成功时 forward，发送 head（这时是给客户端的响应头）和响应体，最后 finish（出错时 abort）
+struct proxy_exchange {
+    // buf 存放上游的响应头（PROXY_BUFFER_SIZE）；keep_alive 为客户端是否要求保持连接；
+    // capture 不为 NULL 时记下发给客户端的响应（见 microcache.h），响应体由驱动方记入
+    proxy_exchange( int route, const http_request& req, char* buf, bool keep_alive, microcache_capture* capture );
+    // 生成发给上游的请求头并选择上游。pre_bytes 是读缓冲区中请求头之后已经读到的字节数。
+    // 返回0，或者应该回复客户端的状态码（上游都满了时为503）
+    int begin( const std::vector< const char* >& headers, const sockaddr_in& client, size_t pre_bytes );
+    // 客户端在等 100 Continue 才发送剩下的请求体，只返回一次true
+    bool need_continue();
+    // 连不上上游（err 为 -errno），返回502或504
+    int connect_failed( ssize_t err );
+    // 解析 buf 中已经读到的 len 字节，跳过 1xx 的临时响应：返回1表示响应头完整，0表示需要再读，-EPROTO 表示响应不正确
+    int read_head();
+    void received( size_t n ) { len += n; answered = true; }
+    // 转发或读响应头出错，到上游的连接已经关闭：复用的连接可能恰好被上游关闭，还没有收到响应、
+    // 请求体也还没有从客户端读走时返回true，用新连接重来一次
+    bool retry( ssize_t err, bool reused );
+    // 不再重试，返回502或504
+    int failed( ssize_t err );
+    // 响应头完整之后：head 换成发给客户端的响应头，算出 buf 中响应头之后属于响应体的部分；closing 为服务器正在退出
+    void forward( bool closing );
+    // 响应已经开始发送之后出错，只能关闭两边的连接
+    void abort( ssize_t err );
+    // 响应转发完，到上游的连接 fd 放回连接池或者关闭
+    void finish( int fd );
+
+    int route;
+    const http_request& req;
+    char* buf;
+    microcache_capture* capture;
+    std::string head;           // 发给上游的请求头；forward 之后为发给客户端的响应头
+    bool has_body;
+    size_t pre_len;             // 读缓冲区中属于请求体的字节数（chunked 时为全部，由 chunk_scanner 找结束位置）
+    uint64_t remaining;         // Content-Length 的请求体中还要从客户端读的字节数
+    bool expect_continue;
+    bool continue_sent;
+    bool body_streamed;         // 已经从客户端读走了请求体，不能再重试
+    bool keep_alive;            // 之后客户端连接是否保持
+    int up;                     // 选中的上游（upstreams 的下标）和开始时间，连不上换上游时随之改变
+    uint64_t start;
+    int attempt;                // 第几次连接，retry 时加一
+    proxy_response r;
+    size_t len;                 // buf 中读到的字节数
+    bool answered;              // 这次连接上收到过上游的数据
+    const char* extra;          // forward 之后：buf 中响应头之后的数据
+    size_t extra_len;
+    size_t first;               // 其中属于响应体的字节数（chunked 时由 chunk_scanner 决定）
+    bool reusable;              // 到上游的连接能否放回连接池，chunked 的响应体转发完之后驱动方再检查
+};
+
+// 以下是线程池模式的工作线程使用的阻塞式操作：套接字是非阻塞的，EAGAIN 时用 poll 等待 proxy_timeout_ms，
+// 返回值小于0时为 -errno，超时为 -ETIMEDOUT
+int proxy_wait( int fd, short events );
+// 取一个到 upstreams[ up ] 的连接：先从连接池取（reused 为true），没有时新建并等待连接完成。
+// 连不上时记入被动健康检查，换一个上游重试一次，up 和 start（proxy_begin 的返回值）随之改变；
+// 返回套接字，失败时返回 -errno
+int proxy_connect( int route, const char* url, int& up, uint64_t& start, bool& reused );
+ssize_t proxy_send_all( int fd, const char* buf, size_t len, int flags = 0 );
+ssize_t proxy_recv( int fd, char* buf, size_t len );
+// 从 from 向 to 搬运 len 字节，len 为 UINT64_MAX 时直到 from 关闭；返回搬运的字节数
+ssize_t proxy_splice( int from, int to, uint64_t len );
+// 与 proxy_splice 相同，但经过 proxy_buffer 复制，转发的数据同时记入 copy（微缓存填充时，见 microcache.h）
+ssize_t proxy_copy( int from, int to, uint64_t len, microcache_capture* copy );
+// 从 from 向 to 转发 chunked 消息体，pre 是已经读到的部分；返回消息体之后多读的字节数，
+// 分块格式错误时返回 -EPROTO。copy 不为 NULL 时转发的数据同时记入 copy
+ssize_t proxy_relay_chunked( int from, int to, const char* pre, size_t pre_len, microcache_capture* copy = NULL );
+
+// 代理的统计
+enum PROXY_STAT { PROXY_REQUESTS = 0, PROXY_DIALS, PROXY_REUSED, PROXY_RETRIES, PROXY_ERR_CONNECT, PROXY_ERR_TIMEOUT,
+                  PROXY_ERR_UPSTREAM, PROXY_STAT_COUNT };
+void proxy_count( int stat );
+void proxy_metrics( std::string& out );
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include "ratelimit.h"
+#include "metrics.h"
+
+static const int SHARD_BITS = 6;                // 64 个分片
+static const int PROBE_LIMIT = 8;               // 每次最多探测的槽数，16字节一个槽，正好两条缓存行
+static const size_t MAX_PREFIXES = 255;
+
+/*
+    槽的 word：最低位为1表示已占用，1..32位是IP，33..40位是种类（0 为IP本身，i 为第 i 个前缀），
+    41位以上是连接数。连接数和键在同一个字里，占用空闲槽时用 CAS 就能确认它确实没有连接。
+    槽被占用后不会再变回0，只会被别的键替换，所以一个键一定在探测路径上第一个空槽之前。
+*/
+static const int CONN_SHIFT = 41;
+static const uint64_t KEY_MASK = ( 1ull << CONN_SHIFT ) - 1;
+static const uint64_t CONN_ONE = 1ull << CONN_SHIFT;
+
+struct rl_slot {
+    std::atomic< uint64_t > word;
+    std::atomic< uint64_t > tat;                // GCRA 的理论到达时间（微秒），不大于当前时间表示桶是满的
+};
+
+struct rl_bucket {
+    uint64_t interval;                          // 两个请求之间的间隔（微秒）
+    uint64_t tolerance;                         // (突发 - 1) * 间隔
+};
+
+enum { STAT_RATE = 0, STAT_PREFIX, STAT_CONN, STAT_FULL, STAT_RECLAIM, STAT_COUNT };
+
+static rl_slot* table = NULL;
+static size_t shard_size = 0;
+static rl_bucket ip_bucket = { 0, 0 };
+static uint64_t conn_max = 0;
+static std::vector< ratelimit_prefix > prefix_list;
+static std::vector< rl_bucket > prefix_buckets;
+static std::atomic< uint64_t > stats[ STAT_COUNT ];
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t make_key( uint32_t ip, int kind ) {
+    return ( uint64_t )kind << 33 | ( uint64_t )ip << 1 | 1;
+}
+
+// murmur3 的 fmix64，高位选分片，低位选分片内的槽
+static uint64_t mix( uint64_t k ) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+static rl_bucket make_bucket( int rate, int burst ) {
+    rl_bucket b;
+    b.interval = 1000000 / ( uint64_t )rate;
+    b.tolerance = ( uint64_t )( burst - 1 ) * b.interval;
+    return b;
+}
+
+// 找到键所在的槽，没有时占用一个空槽或空闲的槽；探测范围内都在用时返回NULL
+static rl_slot* find( uint64_t key, uint64_t now ) {
+    uint64_t h = mix( key );
+    rl_slot* shard = table + ( size_t )( h >> ( 64 - SHARD_BITS ) ) * shard_size;
+    size_t mask = shard_size - 1;
+    for ( int attempt = 0; attempt < 2; ++attempt ) {
+        rl_slot* idle = NULL;
+        uint64_t idle_word = 0;
+        size_t i = ( size_t )h & mask;
+        for ( int n = 0; n < PROBE_LIMIT; ++n, i = ( i + 1 ) & mask ) {
+            rl_slot* s = shard + i;
+            uint64_t w = s->word.load( std::memory_order_acquire );
+            if ( w == 0 ) {
+                // 后面不会再有这个键；前面有空闲的槽时用它，让探测路径保持短
+                if ( idle ) {
+                    break;
+                }
+                if ( s->word.compare_exchange_strong( w, key ) ) {
+                    return s;
+                }
+            }
+            if ( ( w & KEY_MASK ) == key ) {
+                return s;
+            }
+            if ( !idle && ( w >> CONN_SHIFT ) == 0 && s->tat.load( std::memory_order_relaxed ) <= now ) {
+                idle = s;
+                idle_word = w;
+            }
+        }
+        if ( !idle ) {
+            break;
+        }
+        // 空闲的槽的桶已经满了，换成新键不会丢失状态；被别的线程抢先时重新探测一次
+        if ( idle->word.compare_exchange_strong( idle_word, key ) ) {
+            stats[ STAT_RECLAIM ].fetch_add( 1, std::memory_order_relaxed );
+            return idle;
+        }
+    }
+    stats[ STAT_FULL ].fetch_add( 1, std::memory_order_relaxed );
+    return NULL;
+}
+
+// 从桶中取一个请求：放行时返回0，否则返回需要等待的秒数
+static int take( rl_slot* s, const rl_bucket& b, uint64_t now ) {
+    uint64_t tat = s->tat.load( std::memory_order_relaxed );
+    while ( true ) {
+        uint64_t base = tat > now ? tat : now;
+        if ( base - now > b.tolerance ) {
+            uint64_t wait = base - now - b.tolerance;
+            return ( int )( ( wait + 999999 ) / 1000000 );
+        }
+        if ( s->tat.compare_exchange_weak( tat, base + b.interval, std::memory_order_relaxed ) ) {
+            return 0;
+        }
+    }
+}
+
+// 整段匹配，规则和 proxy_match 相同，取最长的前缀
+static int match( const char* url, size_t len ) {
+    int best = -1;
+    size_t best_len = 0;
+    for ( size_t i = 0; i < prefix_list.size(); ++i ) {
+        const std::string& p = prefix_list[i].prefix;
+        if ( p.size() > len || memcmp( url, p.data(), p.size() ) != 0 ) {
+            continue;
+        }
+        char next = p.size() < len ? url[ p.size() ] : '\0';
+        if ( p[ p.size() - 1 ] != '/' && next != '\0' && next != '/' && next != '?' ) {
+            continue;
+        }
+        if ( best < 0 || p.size() > best_len ) {
+            best = i;
+            best_len = p.size();
+        }
+    }
+    return best;
+}
+
+static bool parse_positive( const std::string& s, int& out ) {
+    char* tail;
+    long v = strtol( s.c_str(), &tail, 10 );
+    if ( s.empty() || *tail != '\0' || v < 1 || v > 1000000 ) {
+        return false;
+    }
+    out = ( int )v;
+    return true;
+}
+
+bool ratelimit_parse( const char* spec, std::vector< ratelimit_prefix >& prefixes, std::string& err ) {
+    prefixes.clear();
+    std::string s( spec );
+    size_t pos = 0;
+    while ( pos <= s.size() ) {
+        size_t end = s.find( ',', pos );
+        if ( end == std::string::npos ) {
+            end = s.size();
+        }
+        std::string item = s.substr( pos, end - pos );
+        pos = end + 1;
+        if ( item.empty() ) {
+            continue;
+        }
+        size_t eq = item.find( '=' );
+        if ( eq == std::string::npos || eq < 1 || item[0] != '/' ) {
+            err = "expected /prefix=rate[:burst], got '" + item + "'";
+            return false;
+        }
+        ratelimit_prefix p;
+        p.prefix = item.substr( 0, eq );
+        std::string value = item.substr( eq + 1 );
+        size_t colon = value.find( ':' );
+        // 没有给出突发时允许一秒的量
+        if ( !parse_positive( value.substr( 0, colon ), p.rate ) ||
+             ( colon != std::string::npos && !parse_positive( value.substr( colon + 1 ), p.burst ) ) ) {
+            err = "rate and burst must be between 1 and 1000000 in '" + item + "'";
+            return false;
+        }
+        if ( colon == std::string::npos ) {
+            p.burst = p.rate;
+        }
+        prefixes.push_back( p );
+    }
+    if ( prefixes.size() > MAX_PREFIXES ) {
+        err = "too many prefixes";
+        return false;
+    }
+    return true;
+}
+
+void ratelimit_init( int rate, int burst, int conn_limit, int slots, const std::vector< ratelimit_prefix >& prefixes ) {
+    if ( rate == 0 && conn_limit == 0 && prefixes.empty() ) {
+        return;
+    }
+    if ( rate > 0 ) {
+        ip_bucket = make_bucket( rate, burst );
+    }
+    conn_max = conn_limit;
+    prefix_list = prefixes;
+    for ( size_t i = 0; i < prefixes.size(); ++i ) {
+        prefix_buckets.push_back( make_bucket( prefixes[i].rate, prefixes[i].burst ) );
+    }
+    // 每个分片的槽数取2的幂，方便取模
+    shard_size = PROBE_LIMIT;
+    while ( shard_size < ( size_t )slots >> SHARD_BITS ) {
+        shard_size <<= 1;
+    }
+    table = new rl_slot[ shard_size << SHARD_BITS ]();
+}
+
+bool ratelimit_enabled() {
+    return table != NULL;
+}
+
+bool ratelimit_connect( uint32_t ip, bool& counted ) {
+    counted = false;
+    if ( conn_max == 0 ) {
+        return true;
+    }
+    uint64_t key = make_key( ip, 0 );
+    uint64_t now = now_us();
+    for ( int attempt = 0; attempt < 2; ++attempt ) {
+        rl_slot* s = find( key, now );
+        if ( !s ) {
+            return true;
+        }
+        uint64_t w = s->word.load( std::memory_order_acquire );
+        while ( ( w & KEY_MASK ) == key ) {
+            if ( ( w >> CONN_SHIFT ) >= conn_max ) {
+                stats[ STAT_CONN ].fetch_add( 1, std::memory_order_relaxed );
+                return false;
+            }
+            if ( s->word.compare_exchange_weak( w, w + CONN_ONE ) ) {
+                counted = true;
+                return true;
+            }
+        }
+        // 找到之后槽被换成了别的键，重新找
+    }
+    return true;
+}
+
+void ratelimit_disconnect( uint32_t ip ) {
+    // 有连接的槽不会被替换，一定在探测范围内
+    uint64_t key = make_key( ip, 0 );
+    uint64_t h = mix( key );
+    rl_slot* shard = table + ( size_t )( h >> ( 64 - SHARD_BITS ) ) * shard_size;
+    size_t i = ( size_t )h & ( shard_size - 1 );
+    for ( int n = 0; n < PROBE_LIMIT; ++n, i = ( i + 1 ) & ( shard_size - 1 ) ) {
+        uint64_t w = shard[i].word.load( std::memory_order_acquire );
+        if ( ( w & KEY_MASK ) == key && ( w >> CONN_SHIFT ) > 0 ) {
+            shard[i].word.fetch_sub( CONN_ONE );
+            return;
+        }
+    }
+}
+
+int ratelimit_request( uint32_t ip, const char* url, size_t len ) {
+    if ( !table ) {
+        return 0;
+    }
+    uint64_t now = now_us();
+    if ( ip_bucket.interval > 0 ) {
+        rl_slot* s = find( make_key( ip, 0 ), now );
+        int wait = s ? take( s, ip_bucket, now ) : 0;
+        if ( wait > 0 ) {
+            stats[ STAT_RATE ].fetch_add( 1, std::memory_order_relaxed );
+            return wait;
+        }
+    }
+    int p = prefix_list.empty() ? -1 : match( url, len );
+    if ( p >= 0 ) {
+        rl_slot* s = find( make_key( ip, p + 1 ), now );
+        int wait = s ? take( s, prefix_buckets[p], now ) : 0;
+        if ( wait > 0 ) {
+            stats[ STAT_PREFIX ].fetch_add( 1, std::memory_order_relaxed );
+            return wait;
+        }
+    }
+    return 0;
+}
+
+void ratelimit_metrics( std::string& out ) {
+    if ( !table ) {
+        return;
+    }
+    metrics_header( out, "webserver_ratelimit_rejected_total", "counter",
+                    "Requests and connections rejected by the per-client limits." );
+    metrics_counter( out, "webserver_ratelimit_rejected_total", "reason=\"rate\"", stats[ STAT_RATE ].load() );
+    metrics_counter( out, "webserver_ratelimit_rejected_total", "reason=\"prefix\"", stats[ STAT_PREFIX ].load() );
+    metrics_counter( out, "webserver_ratelimit_rejected_total", "reason=\"connections\"", stats[ STAT_CONN ].load() );
+    metrics_header( out, "webserver_ratelimit_table_full_total", "counter",
+                    "Lookups that found no free slot and were let through; raise rate_limit_slots if this grows." );
+    metrics_counter( out, "webserver_ratelimit_table_full_total", NULL, stats[ STAT_FULL ].load() );
+    metrics_header( out, "webserver_ratelimit_reclaimed_total", "counter", "Idle slots taken over by another client." );
+    metrics_counter( out, "webserver_ratelimit_reclaimed_total", NULL, stats[ STAT_RECLAIM ].load() );
+    metrics_header( out, "webserver_ratelimit_slots", "gauge", "Size of the rate limit table." );
+    metrics_gauge( out, "webserver_ratelimit_slots", NULL, ( double )( shard_size << SHARD_BITS ) );
+}
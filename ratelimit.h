@@ -0,0 +1,46 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+    按客户端IP限速和限制连接数，在请求进入线程池之前（协程模式为处理请求之前）检查，
+    防止少数客户端占满线程池的请求队列。
+        rate_limit          每个IP每秒的请求数，0 表示不限
+        rate_limit_burst    允许的突发请求数
+        rate_limit_prefixes 按URL前缀另外限速 "前缀=每秒请求数[:突发],..."，例如 /login=5:10,/api=200，
+                            前缀按整段匹配，取最长的；每个IP在每个前缀上单独计数，同时也计入 rate_limit
+        conn_limit          每个IP同时打开的连接数，0 表示不限，超过时新连接直接关闭
+    超过速率时回复 429 和 Retry-After，然后关闭连接。
+
+    计数用 GCRA（和令牌桶等价）：每个IP（或IP加前缀）只需要一个"理论到达时间" tat，
+    请求到达时若 tat - now 不超过 (突发-1) * 间隔 就放行，并把 tat 推后一个间隔；用 CAS 更新，不加锁。
+    这些状态放在启动时分配的开放寻址哈希表中（rate_limit_slots 个槽），按哈希分成若干分片，
+    在分片内线性探测，最多探测 PROBE_LIMIT 个槽，所以每个请求的开销是常数，和IP的总数无关。
+    槽不主动清理：tat 已过去（桶已满）且没有连接的槽视为空闲，插入时直接占用。
+    探测范围内没有可用的槽时放行并计数（webserver_ratelimit_table_full_total），应调大 rate_limit_slots。
+*/
+
+// 一个前缀的速率
+struct ratelimit_prefix {
+    std::string prefix;
+    int rate;
+    int burst;
+};
+
+// 解析 rate_limit_prefixes，格式不对时返回false
+bool ratelimit_parse( const char* spec, std::vector< ratelimit_prefix >& prefixes, std::string& err );
+// 启动时调用，rate、conn_limit 都为0且没有前缀时不分配哈希表
+void ratelimit_init( int rate, int burst, int conn_limit, int slots, const std::vector< ratelimit_prefix >& prefixes );
+bool ratelimit_enabled();
+// 新连接：超过 conn_limit 时返回false，调用者关闭连接；counted 为true的连接关闭时要调用 ratelimit_disconnect
+bool ratelimit_connect( uint32_t ip, bool& counted );
+void ratelimit_disconnect( uint32_t ip );
+// 一个请求，url 不必以 '\0' 结尾：放行时返回0，否则返回建议客户端等待的秒数（Retry-After）
+int ratelimit_request( uint32_t ip, const char* url, size_t len );
+void ratelimit_metrics( std::string& out );
+
+#endif
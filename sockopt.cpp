@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "sockopt.h"
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+socket_profile sockopt_profile = { false, false, 0, 0, 0, 0, 0 };
+
+// 带数值的选项
+struct sockopt_field {
+    const char* name;
+    int socket_profile::*value;
+};
+
+static const sockopt_field int_fields[] = {
+    { "fastopen", &socket_profile::fastopen },
+    { "sndbuf", &socket_profile::sndbuf },
+    { "rcvbuf", &socket_profile::rcvbuf },
+    { "notsent_lowat", &socket_profile::notsent_lowat },
+    { "busy_poll", &socket_profile::busy_poll },
+};
+static const int INT_FIELD_COUNT = sizeof( int_fields ) / sizeof( int_fields[0] );
+
+bool sockopt_parse( const char* spec, socket_profile& profile, std::string& err ) {
+    memset( &profile, 0, sizeof( profile ) );
+    std::string s( spec );
+    size_t pos = 0;
+    while ( pos <= s.size() ) {
+        size_t end = s.find( ',', pos );
+        if ( end == std::string::npos ) {
+            end = s.size();
+        }
+        std::string item = s.substr( pos, end - pos );
+        pos = end + 1;
+        if ( item.empty() ) {
+            continue;
+        }
+        size_t eq = item.find( '=' );
+        std::string name = item.substr( 0, eq );
+        if ( eq == std::string::npos ) {
+            if ( name == "nodelay" ) {
+                profile.nodelay = true;
+            } else if ( name == "cork" ) {
+                profile.cork = true;
+            } else {
+                err = "unknown socket option '" + name + "'";
+                return false;
+            }
+            continue;
+        }
+        int i = 0;
+        for ( ; i < INT_FIELD_COUNT; ++i ) {
+            if ( name == int_fields[i].name ) {
+                break;
+            }
+        }
+        const char* text = item.c_str() + eq + 1;
+        char* tail;
+        long v = strtol( text, &tail, 10 );
+        if ( i == INT_FIELD_COUNT ) {
+            err = "unknown socket option '" + name + "'";
+            return false;
+        }
+        if ( tail == text || *tail != '\0' || v < 0 || v > 0x7fffffff ) {
+            err = "bad value for socket option '" + name + "'";
+            return false;
+        }
+        profile.*( int_fields[i].value ) = ( int )v;
+    }
+    return true;
+}
+
+std::string sockopt_describe( const socket_profile& profile ) {
+    std::string out;
+    if ( profile.nodelay ) {
+        out += "nodelay,";
+    }
+    if ( profile.cork ) {
+        out += "cork,";
+    }
+    for ( int i = 0; i < INT_FIELD_COUNT; ++i ) {
+        int v = profile.*( int_fields[i].value );
+        if ( v > 0 ) {
+            char buf[ 64 ];
+            snprintf( buf, sizeof( buf ), "%s=%d,", int_fields[i].name, v );
+            out += buf;
+        }
+    }
+    if ( out.empty() ) {
+        return "default";
+    }
+    out.erase( out.size() - 1 );
+    return out;
+}
+
+static void set_int( int fd, int level, int name, int value, const char* what, bool report ) {
+    if ( setsockopt( fd, level, name, &value, sizeof( value ) ) < 0 && report ) {
+        printf( "setsockopt %s=%d failed: %s\n", what, value, strerror( errno ) );
+    }
+}
+
+void sockopt_listen( int fd ) {
+    const socket_profile& p = sockopt_profile;
+    // 缓冲区大小要在listen之前设置，接受的连接才能继承，窗口扩大因子也在握手时就确定了
+    if ( p.sndbuf > 0 ) {
+        set_int( fd, SOL_SOCKET, SO_SNDBUF, p.sndbuf, "SO_SNDBUF", true );
+    }
+    if ( p.rcvbuf > 0 ) {
+        set_int( fd, SOL_SOCKET, SO_RCVBUF, p.rcvbuf, "SO_RCVBUF", true );
+    }
+    if ( p.fastopen > 0 ) {
+        set_int( fd, IPPROTO_TCP, TCP_FASTOPEN, p.fastopen, "TCP_FASTOPEN", true );
+    }
+    // 下面几个选项对监听套接字没有意义，这里只是提前检查一次，失败时在启动日志里给出原因
+    if ( p.notsent_lowat > 0 ) {
+        set_int( fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p.notsent_lowat, "TCP_NOTSENT_LOWAT", true );
+    }
+    if ( p.busy_poll > 0 ) {
+        set_int( fd, SOL_SOCKET, SO_BUSY_POLL, p.busy_poll, "SO_BUSY_POLL", true );
+    }
+}
+
+void sockopt_accept( int fd ) {
+    const socket_profile& p = sockopt_profile;
+    if ( p.nodelay ) {
+        set_int( fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", false );
+    }
+    if ( p.notsent_lowat > 0 ) {
+        set_int( fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p.notsent_lowat, "TCP_NOTSENT_LOWAT", false );
+    }
+    if ( p.busy_poll > 0 ) {
+        set_int( fd, SOL_SOCKET, SO_BUSY_POLL, p.busy_poll, "SO_BUSY_POLL", false );
+    }
+}
+
+void sockopt_cork( int fd, bool on ) {
+    if ( sockopt_profile.cork ) {
+        set_int( fd, IPPROTO_TCP, TCP_CORK, on ? 1 : 0, "TCP_CORK", false );
+    }
+}
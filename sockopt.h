@@ -0,0 +1,41 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <string>
+
+/*
+    套接字选项配置，用逗号分隔的字符串描述，例如
+        nodelay,cork,fastopen=256,sndbuf=262144,rcvbuf=131072,notsent_lowat=16384,busy_poll=50
+    nodelay          : TCP_NODELAY，关闭Nagle算法
+    cork             : 发送响应期间设置TCP_CORK，响应头和正文合并成尽量满的报文段，发送完再拔掉塞子
+    fastopen=N       : 监听套接字的TCP_FASTOPEN，N为等待中的TFO请求队列长度
+    sndbuf/rcvbuf=N  : SO_SNDBUF/SO_RCVBUF，设置在监听套接字上，由接受的连接继承
+    notsent_lowat=N  : TCP_NOTSENT_LOWAT，发送缓冲区中未发送的数据低于N字节才报告可写，
+                       大文件不会一次塞满内核缓冲区
+    busy_poll=N      : SO_BUSY_POLL，阻塞读取前忙等N微秒，低延迟模式，需要网卡驱动支持
+    数值为0或不出现表示不设置，保持内核默认值
+*/
+struct socket_profile {
+    bool nodelay;
+    bool cork;
+    int fastopen;
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    int busy_poll;
+};
+
+extern socket_profile sockopt_profile;
+
+// 解析配置字符串，出错时返回false并在err中给出原因
+bool sockopt_parse( const char* spec, socket_profile& profile, std::string& err );
+// 把配置还原成字符串，用于启动日志
+std::string sockopt_describe( const socket_profile& profile );
+// 在 listen() 之前对监听套接字设置
+void sockopt_listen( int fd );
+// 对每个接受的连接设置，不支持的选项（比如 socketpair）直接忽略
+void sockopt_accept( int fd );
+// 开始/结束发送一个响应，开启cork时塞住/拔掉TCP_CORK
+void sockopt_cork( int fd, bool on );
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * backend: 测试反向代理用的上游服务器（见 proxy.h）
+ *
+ * 每个连接一个线程，阻塞读写，支持 HTTP/1.1 keep-alive。按URL给出不同形式的响应，
+ * 覆盖代理需要处理的几种响应体（URL 中任意一段，例如 /api/chunked）：
+ *   /chunked       分块的响应体
+ *   /close         没有 Content-Length，发完关闭连接
+ *   /big?n=字节数   指定大小的响应体
+ *   /slow?ms=毫秒   等一段时间再回复，用来测试 proxy_timeout_ms
+ *   其他 GET/HEAD   一行文本，包含方法、URL、X-Forwarded-For 和这个连接上处理过的请求数
+ *   POST/PUT/PATCH 原样返回请求体（Content-Length 或 chunked）
+ * 响应头 X-Backend-Conn 是连接的序号，用来确认代理复用了上游连接；X-Backend-Requests 是处理过的请求总数，
+ * 用来确认微缓存（microcache.h）合并了请求。查询参数 max_age=秒 加上 Cache-Control: max-age，
+ * 再加 swr=秒 时带 stale-while-revalidate，vary=1 时加上 Vary: X-Variant。
+ *
+ * 用法： backend 端口         监听 127.0.0.1:端口
+ *        backend unix:路径    监听 unix 域套接字
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+
+#define BUFFER_SIZE 65536
+
+static int conn_seq = 0;
+static int request_seq = 0;
+
+static bool send_all( int fd, const char* buf, size_t len ) {
+    while ( len > 0 ) {
+        ssize_t n = send( fd, buf, len, MSG_NOSIGNAL );
+        if ( n <= 0 ) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 连接上的接收缓冲区
+struct reader {
+    int fd;
+    std::string data;
+
+    bool fill() {
+        char buf[ BUFFER_SIZE ];
+        ssize_t n = recv( fd, buf, sizeof( buf ), 0 );
+        if ( n <= 0 ) {
+            return false;
+        }
+        data.append( buf, n );
+        return true;
+    }
+    // 读一行（不含 \r\n）
+    bool line( std::string& out ) {
+        size_t pos;
+        while ( ( pos = data.find( "\r\n" ) ) == std::string::npos ) {
+            if ( !fill() ) {
+                return false;
+            }
+        }
+        out = data.substr( 0, pos );
+        data.erase( 0, pos + 2 );
+        return true;
+    }
+    bool bytes( size_t n, std::string& out ) {
+        while ( data.size() < n ) {
+            if ( !fill() ) {
+                return false;
+            }
+        }
+        out.append( data, 0, n );
+        data.erase( 0, n );
+        return true;
+    }
+};
+
+static long query_arg( const std::string& url, const char* name, long def ) {
+    size_t q = url.find( '?' );
+    if ( q == std::string::npos ) {
+        return def;
+    }
+    std::string key = std::string( name ) + "=";
+    size_t pos = url.find( key, q );
+    return pos == std::string::npos ? def : atol( url.c_str() + pos + key.size() );
+}
+
+static void* serve( void* arg ) {
+    int fd = ( int )( long )arg;
+    int id = __sync_add_and_fetch( &conn_seq, 1 );
+    reader in = { fd, "" };
+    int served = 0;
+    std::string line;
+    while ( in.line( line ) ) {
+        // 请求行和请求头
+        std::string method = line.substr( 0, line.find( ' ' ) );
+        size_t u = line.find( ' ' ) + 1;
+        std::string url = line.substr( u, line.find( ' ', u ) - u );
+        long length = 0;
+        bool chunked = false;
+        bool close_conn = false;
+        std::string forwarded;
+        while ( in.line( line ) && !line.empty() ) {
+            if ( strncasecmp( line.c_str(), "Content-Length:", 15 ) == 0 ) {
+                length = atol( line.c_str() + 15 );
+            } else if ( strncasecmp( line.c_str(), "Transfer-Encoding:", 18 ) == 0 ) {
+                chunked = strstr( line.c_str(), "chunked" ) != NULL;
+            } else if ( strncasecmp( line.c_str(), "Connection:", 11 ) == 0 ) {
+                close_conn = strcasestr( line.c_str(), "close" ) != NULL;
+            } else if ( strncasecmp( line.c_str(), "X-Forwarded-For:", 16 ) == 0 ) {
+                forwarded = line.substr( 16 + strspn( line.c_str() + 16, " " ) );
+            }
+        }
+        std::string body;
+        bool ok = true;
+        if ( chunked ) {
+            // 解码分块的请求体
+            std::string size_line;
+            while ( ( ok = in.line( size_line ) ) ) {
+                long n = strtol( size_line.c_str(), NULL, 16 );
+                std::string crlf;
+                if ( n == 0 ) {
+                    while ( ( ok = in.line( crlf ) ) && !crlf.empty() ) {
+                    }
+                    break;
+                }
+                if ( !( ok = in.bytes( n, body ) && in.line( crlf ) ) ) {
+                    break;
+                }
+            }
+        } else if ( length > 0 ) {
+            ok = in.bytes( length, body );
+        }
+        if ( !ok ) {
+            break;
+        }
+        ++served;
+
+        char head[ 512 ];
+        std::string out;
+        bool head_only = method == "HEAD";
+        // 各种响应共用的头部
+        std::string common;
+        snprintf( head, sizeof( head ), "X-Backend-Conn: %d\r\nX-Backend-Requests: %d\r\n", id,
+                  __sync_add_and_fetch( &request_seq, 1 ) );
+        common = head;
+        if ( query_arg( url, "max_age", -1 ) >= 0 ) {
+            snprintf( head, sizeof( head ), "Cache-Control: max-age=%ld", query_arg( url, "max_age", -1 ) );
+            common += head;
+            if ( query_arg( url, "swr", 0 ) > 0 ) {
+                snprintf( head, sizeof( head ), ", stale-while-revalidate=%ld", query_arg( url, "swr", 0 ) );
+                common += head;
+            }
+            common += "\r\n";
+        }
+        if ( query_arg( url, "vary", 0 ) ) {
+            common += "Vary: X-Variant\r\n";
+        }
+        if ( url.find( "/chunked" ) != std::string::npos ) {
+            snprintf( head, sizeof( head ), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n%s"
+                      "Transfer-Encoding: chunked\r\n\r\n", common.c_str() );
+            out = head;
+            if ( !head_only ) {
+                for ( int i = 0; i < 5; ++i ) {
+                    char part[ 64 ];
+                    int n = snprintf( part, sizeof( part ), "chunk %d\n", i );
+                    snprintf( head, sizeof( head ), "%x;ext=%d\r\n", n, i );
+                    out += head;
+                    out.append( part, n ).append( "\r\n" );
+                }
+                out += "0\r\nX-Trailer: done\r\n\r\n";
+            }
+        } else if ( url.find( "/close" ) != std::string::npos ) {
+            // 以关闭连接结束响应体
+            snprintf( head, sizeof( head ), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n"
+                      "%s\r\nuntil close\n", common.c_str() );
+            send_all( fd, head, strlen( head ) );
+            break;
+        } else {
+            if ( url.find( "/slow" ) != std::string::npos ) {
+                usleep( query_arg( url, "ms", 1000 ) * 1000 );
+            }
+            std::string text;
+            if ( url.find( "/big" ) != std::string::npos ) {
+                text.assign( query_arg( url, "n", 1 << 20 ), 'x' );
+            } else if ( method == "POST" || method == "PUT" || method == "PATCH" ) {
+                text = body;
+            } else {
+                snprintf( head, sizeof( head ), "%s %s xff=%s n=%d\n", method.c_str(), url.c_str(), forwarded.c_str(),
+                          served );
+                text = head;
+            }
+            snprintf( head, sizeof( head ), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                      "%s%s\r\n", text.size(), common.c_str(), close_conn ? "Connection: close\r\n" : "" );
+            out = head;
+            if ( !head_only ) {
+                out += text;
+            }
+        }
+        if ( !send_all( fd, out.data(), out.size() ) || close_conn ) {
+            break;
+        }
+    }
+    close( fd );
+    return NULL;
+}
+
+int main( int argc, char* argv[] ) {
+    if ( argc != 2 ) {
+        printf( "usage: %s port | unix:path\n", argv[0] );
+        return 1;
+    }
+    signal( SIGPIPE, SIG_IGN );
+    int listenfd;
+    if ( strncmp( argv[1], "unix:", 5 ) == 0 ) {
+        sockaddr_un addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sun_family = AF_UNIX;
+        strncpy( addr.sun_path, argv[1] + 5, sizeof( addr.sun_path ) - 1 );
+        unlink( addr.sun_path );
+        listenfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if ( bind( listenfd, ( sockaddr* )&addr, sizeof( addr ) ) != 0 ) {
+            perror( "bind" );
+            return 1;
+        }
+    } else {
+        sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        addr.sin_port = htons( atoi( argv[1] ) );
+        listenfd = socket( AF_INET, SOCK_STREAM, 0 );
+        int one = 1;
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+        if ( bind( listenfd, ( sockaddr* )&addr, sizeof( addr ) ) != 0 ) {
+            perror( "bind" );
+            return 1;
+        }
+    }
+    listen( listenfd, 1024 );
+    printf( "backend listening on %s\n", argv[1] );
+    fflush( stdout );
+    while ( true ) {
+        int fd = accept( listenfd, NULL, NULL );
+        if ( fd < 0 ) {
+            continue;
+        }
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+        pthread_t tid;
+        if ( pthread_create( &tid, NULL, serve, ( void* )( long )fd ) != 0 ) {
+            close( fd );
+            continue;
+        }
+        pthread_detach( tid );
+    }
+}
@@ -0,0 +1,81 @@
+#!/bin/sh
+# 微缓存合并请求的检查（见 microcache.h）：服务器把 /api 代理到 backend，同时发出同一个URL的几个慢请求
+#   可以缓存的响应（max_age）：上游只处理一次，所有请求差不多同时完成
+#   不能缓存的响应：第一次等填充的请求知道了不能缓存之后各自去上游（最多两倍的耗时），
+#   之后的一段时间内直接转发，都应该差不多同时完成，而不是一个接一个地排队
+# 任何一项不满足时返回非0
+#
+# 用法： ./microcache_collapse.sh <服务器程序> [端口] [后端端口]
+#   SERVER_ARGS 环境变量传给服务器的额外参数，例如 SERVER_ARGS=--coroutines=on
+#   N 为并发的请求数（默认 4），MS 为后端每个请求的耗时（默认 500 毫秒）
+
+SERVER=${1:?usage: $0 <server-binary> [port] [backend-port]}
+PORT=${2:-9100}
+BACKEND_PORT=${3:-18090}
+BACKEND=${BACKEND:-./backend}
+N=${N:-4}
+MS=${MS:-500}
+ROOT=$(cd "$(dirname "$0")/../../resources" && pwd)
+
+if [ ! -x "$BACKEND" ]; then
+    echo "build backend first (make)" >&2
+    exit 1
+fi
+
+"$BACKEND" "$BACKEND_PORT" > /dev/null 2>&1 &
+backend=$!
+"$SERVER" $SERVER_ARGS --doc_root="$ROOT" --microcache_mb=16 --proxy=/api=127.0.0.1:"$BACKEND_PORT" "$PORT" > /dev/null 2>&1 &
+server=$!
+sleep 0.5
+if ! kill -0 $server 2>/dev/null; then
+    echo "server failed to start" >&2
+    kill $backend
+    exit 1
+fi
+
+out=/tmp/microcache_collapse.$$
+failed=0
+
+# $1 为名称，$2 为查询参数；输出最慢的请求的耗时和后端处理的请求数
+run() {
+    i=0
+    pids=
+    while [ $i -lt "$N" ]; do
+        curl -s -o /dev/null -D "$out.$i" -w "%{time_total}\n" "http://127.0.0.1:$PORT/api/slow?ms=$MS&$2" > "$out.t$i" &
+        pids="$pids $!"
+        i=$(( i + 1 ))
+    done
+    wait $pids
+    slowest=$(cat "$out".t* | sort -n | tail -1)
+    upstream=$(cat "$out".[0-9]* | tr -d '\r' | sed -n 's/^X-Backend-Requests: //p' | sort -u | wc -l)
+    rm -f "$out".*
+    printf "%-12s %d requests  slowest %ss  upstream %d\n" "$1" "$N" "$slowest" "$upstream"
+}
+
+# 最慢的请求超过后端耗时的 $1 倍，说明有请求在排队
+too_slow() {
+    awk -v t="$slowest" -v ms="$MS" -v k="$1" 'BEGIN { exit !( t > ms * k / 1000 ) }'
+}
+
+# 可以缓存：只去一次上游
+run cacheable "max_age=5&k=$$"
+if [ "$upstream" -ne 1 ] || too_slow 1.8; then
+    echo "FAIL cacheable requests were not collapsed"
+    failed=1
+fi
+
+# 不能缓存：每个请求都去上游，等待填充的请求醒来后不再排队
+run uncacheable "k=$$"
+if [ "$upstream" -ne "$N" ] || too_slow 2.5; then
+    echo "FAIL uncacheable requests were serialized"
+    failed=1
+fi
+# 已经知道不能缓存：不再合并
+run uncacheable "k=$$"
+if [ "$upstream" -ne "$N" ] || too_slow 1.8; then
+    echo "FAIL uncacheable requests were collapsed again"
+    failed=1
+fi
+
+kill $server $backend
+exit $failed
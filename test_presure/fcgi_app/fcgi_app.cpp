@@ -0,0 +1,253 @@
+/*
+ * fcgi_app: 测试 FastCGI 用的应用服务器（见 fastcgi.h），代替 php-fpm
+ *
+ * 每个连接一个线程，按 FCGI_KEEP_CONN 保持连接，一个连接上依次处理多个请求。按 SCRIPT_NAME/REQUEST_URI
+ * 给出不同形式的输出（URL 中任意一段，例如 /app/length）：
+ *   /length        带 Content-Length 的输出
+ *   /status        Status: 404 Not Found
+ *   /stderr        先写一条 FCGI_STDERR 再输出
+ *   /big?n=字节数   指定大小的输出，分成多个 FCGI_STDOUT 记录
+ *   /slow?ms=毫秒   等一段时间再输出，用来测试超时和背压
+ *   /params        列出收到的所有参数
+ *   其他            一行文本，包含方法、URI、SCRIPT_FILENAME、请求体长度和这个连接上处理过的请求数，
+ *                  没有 Content-Length（服务器用 chunked 转发）
+ * 响应头 X-App-Conn 是连接的序号，用来确认服务器复用了连接；查询参数 max_age=秒 时加上 Cache-Control: max-age。
+ * 同时处理的请求超过 max 个时回复 FCGI_OVERLOADED。
+ *
+ * 用法： fcgi_app 端口 [max]        监听 127.0.0.1:端口
+ *        fcgi_app unix:路径 [max]   监听 unix 域套接字
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <map>
+
+enum { BEGIN_REQUEST = 1, END_REQUEST = 3, PARAMS = 4, STDIN = 5, STDOUT = 6, STDERR = 7 };
+
+static int conn_seq = 0;
+static int active = 0;
+static int max_active = 0;
+
+static bool read_all( int fd, void* buf, size_t len ) {
+    char* p = ( char* )buf;
+    while ( len > 0 ) {
+        ssize_t n = recv( fd, p, len, 0 );
+        if ( n <= 0 ) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_all( int fd, const char* buf, size_t len ) {
+    while ( len > 0 ) {
+        ssize_t n = send( fd, buf, len, MSG_NOSIGNAL );
+        if ( n <= 0 ) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void record( std::string& out, int type, int id, const char* data, size_t len ) {
+    do {
+        size_t n = len < 65535 ? len : 65535;
+        unsigned char h[8] = { 1, ( unsigned char )type, ( unsigned char )( id >> 8 ), ( unsigned char )id,
+                               ( unsigned char )( n >> 8 ), ( unsigned char )n, 0, 0 };
+        out.append( ( char* )h, 8 );
+        out.append( data, n );
+        data += n;
+        len -= n;
+    } while ( len > 0 );
+}
+
+static void end_request( std::string& out, int id, int status ) {
+    unsigned char body[8] = { 0, 0, 0, 0, ( unsigned char )status, 0, 0, 0 };
+    unsigned char h[8] = { 1, END_REQUEST, ( unsigned char )( id >> 8 ), ( unsigned char )id, 0, 8, 0, 0 };
+    out.append( ( char* )h, 8 );
+    out.append( ( char* )body, 8 );
+}
+
+static size_t get_length( const unsigned char*& p ) {
+    if ( *p < 128 ) {
+        return *p++;
+    }
+    size_t len = ( ( p[0] & 0x7f ) << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+    p += 4;
+    return len;
+}
+
+static long query_arg( const std::string& url, const char* name, long def ) {
+    size_t q = url.find( '?' );
+    if ( q == std::string::npos ) {
+        return def;
+    }
+    std::string key = std::string( name ) + "=";
+    size_t pos = url.find( key, q );
+    return pos == std::string::npos ? def : atol( url.c_str() + pos + key.size() );
+}
+
+static void* serve( void* arg ) {
+    int fd = ( int )( long )arg;
+    int conn = __sync_add_and_fetch( &conn_seq, 1 );
+    int served = 0;
+    bool keep = true;
+    while ( keep ) {
+        // 一个请求：BEGIN_REQUEST、PARAMS...、空 PARAMS、STDIN...、空 STDIN
+        std::map< std::string, std::string > params;
+        std::string raw_params, body;
+        int id = 0;
+        bool params_done = false, stdin_done = false;
+        while ( !( params_done && stdin_done ) ) {
+            unsigned char h[8];
+            if ( !read_all( fd, h, 8 ) ) {
+                close( fd );
+                return NULL;
+            }
+            size_t len = h[4] << 8 | h[5];
+            std::string content( len + h[6], '\0' );
+            if ( !read_all( fd, &content[0], content.size() ) ) {
+                close( fd );
+                return NULL;
+            }
+            content.resize( len );
+            id = h[2] << 8 | h[3];
+            if ( h[1] == BEGIN_REQUEST ) {
+                keep = ( content[2] & 1 ) != 0;
+            } else if ( h[1] == PARAMS ) {
+                params_done = len == 0;
+                raw_params += content;
+            } else if ( h[1] == STDIN ) {
+                stdin_done = len == 0;
+                body += content;
+            }
+        }
+        const unsigned char* p = ( const unsigned char* )raw_params.data();
+        const unsigned char* end = p + raw_params.size();
+        while ( p < end ) {
+            size_t nl = get_length( p );
+            size_t vl = get_length( p );
+            params[ std::string( ( const char* )p, nl ) ] = std::string( ( const char* )p + nl, vl );
+            p += nl + vl;
+        }
+        ++served;
+
+        std::string out;
+        if ( __sync_add_and_fetch( &active, 1 ) > max_active && max_active > 0 ) {
+            end_request( out, id, 2 );      // FCGI_OVERLOADED
+        } else {
+            std::string uri = params[ "REQUEST_URI" ];
+            char head[ 512 ];
+            if ( uri.find( "/slow" ) != std::string::npos ) {
+                usleep( query_arg( uri, "ms", 1000 ) * 1000 );
+            }
+            if ( uri.find( "/stderr" ) != std::string::npos ) {
+                const char* msg = "fcgi_app: something went wrong\n";
+                record( out, STDERR, id, msg, strlen( msg ) );
+            }
+            std::string text;
+            std::string extra;
+            if ( uri.find( "/big" ) != std::string::npos ) {
+                text.assign( query_arg( uri, "n", 1 << 20 ), 'x' );
+            } else if ( uri.find( "/params" ) != std::string::npos ) {
+                for ( std::map< std::string, std::string >::iterator it = params.begin(); it != params.end(); ++it ) {
+                    text += it->first + "=" + it->second + "\n";
+                }
+            } else if ( !body.empty() ) {
+                text = body;
+            } else {
+                snprintf( head, sizeof( head ), "%s %s script=%s body=%zu n=%d\n", params[ "REQUEST_METHOD" ].c_str(),
+                          uri.c_str(), params[ "SCRIPT_FILENAME" ].c_str(), body.size(), served );
+                text = head;
+            }
+            if ( uri.find( "/status" ) != std::string::npos ) {
+                extra += "Status: 404 Not Found\r\n";
+            }
+            if ( query_arg( uri, "max_age", -1 ) >= 0 ) {
+                snprintf( head, sizeof( head ), "Cache-Control: max-age=%ld\r\n", query_arg( uri, "max_age", -1 ) );
+                extra += head;
+            }
+            if ( uri.find( "/length" ) != std::string::npos ) {
+                snprintf( head, sizeof( head ), "Content-Length: %zu\r\n", text.size() );
+                extra += head;
+            }
+            snprintf( head, sizeof( head ), "Content-Type: text/plain\r\nX-App-Conn: %d\r\n%s\r\n", conn, extra.c_str() );
+            record( out, STDOUT, id, head, strlen( head ) );
+            // 输出分成多个记录，每个最多 8KB
+            for ( size_t off = 0; off < text.size(); off += 8192 ) {
+                record( out, STDOUT, id, text.data() + off, text.size() - off < 8192 ? text.size() - off : 8192 );
+            }
+            record( out, STDOUT, id, NULL, 0 );
+            end_request( out, id, 0 );
+        }
+        __sync_sub_and_fetch( &active, 1 );
+        if ( !send_all( fd, out.data(), out.size() ) ) {
+            break;
+        }
+    }
+    close( fd );
+    return NULL;
+}
+
+int main( int argc, char* argv[] ) {
+    if ( argc < 2 ) {
+        printf( "usage: %s port | unix:path [max]\n", argv[0] );
+        return 1;
+    }
+    max_active = argc > 2 ? atoi( argv[2] ) : 0;
+    signal( SIGPIPE, SIG_IGN );
+    int listenfd;
+    if ( strncmp( argv[1], "unix:", 5 ) == 0 ) {
+        sockaddr_un addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sun_family = AF_UNIX;
+        strncpy( addr.sun_path, argv[1] + 5, sizeof( addr.sun_path ) - 1 );
+        unlink( addr.sun_path );
+        listenfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if ( bind( listenfd, ( sockaddr* )&addr, sizeof( addr ) ) != 0 ) {
+            perror( "bind" );
+            return 1;
+        }
+    } else {
+        sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        addr.sin_port = htons( atoi( argv[1] ) );
+        listenfd = socket( AF_INET, SOCK_STREAM, 0 );
+        int one = 1;
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+        if ( bind( listenfd, ( sockaddr* )&addr, sizeof( addr ) ) != 0 ) {
+            perror( "bind" );
+            return 1;
+        }
+    }
+    listen( listenfd, 1024 );
+    printf( "fcgi_app listening on %s\n", argv[1] );
+    fflush( stdout );
+    while ( true ) {
+        int fd = accept( listenfd, NULL, NULL );
+        if ( fd < 0 ) {
+            continue;
+        }
+        pthread_t tid;
+        if ( pthread_create( &tid, NULL, serve, ( void* )( long )fd ) != 0 ) {
+            close( fd );
+            continue;
+        }
+        pthread_detach( tid );
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef LOADGEN_HISTOGRAM_H
+#define LOADGEN_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// 对数-线性分桶的延迟直方图（与 HdrHistogram 思路相同）
+// 小于 128 的值每个值一个桶，之后每翻一倍划分 64 个子桶，相对误差小于 1.6%
+// 每个线程各持有一个，结束时合并，记录时不需要加锁
+class histogram {
+public:
+    static const int SUB_BITS = 7;
+    static const int HALF = 1 << ( SUB_BITS - 1 );          // 64
+    static const int BUCKETS = ( 64 - SUB_BITS + 2 ) * HALF; // 覆盖全部 64 位取值
+
+    histogram() { reset(); }
+
+    void reset() {
+        memset( m_counts, 0, sizeof( m_counts ) );
+        m_total = 0;
+        m_sum = 0;
+        m_min = UINT64_MAX;
+        m_max = 0;
+    }
+
+    void record( uint64_t value ) {
+        m_counts[ index_of( value ) ]++;
+        m_total++;
+        m_sum += value;
+        if ( value < m_min ) {
+            m_min = value;
+        }
+        if ( value > m_max ) {
+            m_max = value;
+        }
+    }
+
+    void merge( const histogram& other ) {
+        for ( int i = 0; i < BUCKETS; ++i ) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+        if ( other.m_min < m_min ) {
+            m_min = other.m_min;
+        }
+        if ( other.m_max > m_max ) {
+            m_max = other.m_max;
+        }
+    }
+
+    // 返回第 q 分位（0 < q <= 100）所在桶的代表值
+    uint64_t percentile( double q ) const {
+        if ( m_total == 0 ) {
+            return 0;
+        }
+        uint64_t rank = ( uint64_t )( q / 100.0 * m_total + 0.5 );
+        if ( rank == 0 ) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for ( int i = 0; i < BUCKETS; ++i ) {
+            seen += m_counts[i];
+            if ( seen >= rank ) {
+                uint64_t v = value_of( i );
+                return v > m_max ? m_max : v;
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t count() const { return m_total; }
+    uint64_t min() const { return m_total ? m_min : 0; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_total ? ( double )m_sum / m_total : 0.0; }
+
+private:
+    static int index_of( uint64_t v ) {
+        if ( v < ( uint64_t )( 2 * HALF ) ) {
+            return ( int )v;
+        }
+        int msb = 63 - __builtin_clzll( v );
+        int shift = msb - ( SUB_BITS - 1 );
+        // v >> shift 落在 [64, 127]
+        return ( ( shift + 1 ) * HALF ) + ( int )( ( v >> shift ) - HALF );
+    }
+
+    // 桶的中点，作为该桶的代表值
+    static uint64_t value_of( int idx ) {
+        if ( idx < 2 * HALF ) {
+            return idx;
+        }
+        int shift = idx / HALF - 1;
+        uint64_t low = ( uint64_t )( idx % HALF + HALF ) << shift;
+        return low + ( ( ( uint64_t )1 << shift ) >> 1 );
+    }
+
+private:
+    uint64_t m_counts[ BUCKETS ];
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+};
+
+#endif
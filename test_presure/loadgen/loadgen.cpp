@@ -0,0 +1,1041 @@
+/*
+ * loadgen: 多线程 epoll 压测客户端，用来代替 webbench
+ *
+ * webbench 每个客户端 fork 一个进程、每个请求新建一个 TCP 连接，默认还是 HTTP/1.0，
+ * 而服务器的 parse_request_line 只接受 HTTP/1.1。loadgen 用少量事件循环线程，
+ * 每个线程管理成千上万个非阻塞连接：
+ *   - HTTP/1.1 keep-alive，以及可配置的流水线深度
+ *   - 从场景文件读入加权URL混合
+ *   - 输出 p50/p90/p99/p99.9 延迟分位数和错误分类，结果为JSON
+ *
+ * 默认是闭环模式（和 webbench 的 benchcore 一样，收到响应才发下一个请求）。
+ * 闭环模式下服务器一卡顿客户端就停止发送，尾延迟被掩盖了（coordinated omission）。
+ * -R 打开开环模式（wrk2 的做法）：每个连接按固定间隔安排请求，延迟从"计划发送时间"
+ * 开始计算，服务器卡住期间本该发出的请求也会被计入；--sweep 依次扫描多个请求速率，
+ * 输出延迟-吞吐曲线，用来找线程池/反应堆配置的饱和拐点。
+ *
+ * --soak-pid 打开浸泡测试：场景中可以混入中断下载、慢速读取和错误请求，
+ * 同时定期采样服务器进程的 /proc/<pid>（RSS、fd 数量、maps 行数），
+ * 预热后资源持续增长超过阈值则以退出码 1 失败。
+ *
+ * 用法： loadgen [选项] http://host:port/path
+ */
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include "histogram.h"
+#include "scenario.h"
+#include "soak.h"
+
+#define MAX_PIPELINE 64         // 每个连接最多同时在途的请求数
+#define IN_BUFFER_SIZE 16384    // 每个连接的接收缓冲区
+#define SLOW_CHUNK 1024         // 慢速读取：每次最多读取的字节数
+#define SLOW_PAUSE_NS 20000000ull   // 慢速读取：两次读取之间的间隔
+#define SLOW_RCVBUF 4096        // 慢速读取：接收缓冲区大小，让服务器的发送缓冲区更快写满
+#define RETRY_PAUSE_NS 10000000ull  // socket() 或 connect() 立即失败（如 -k 0 时本地端口用完）后，隔多久重新连接
+
+// 错误分类
+enum ERROR_KIND { ERR_CONNECT = 0, ERR_READ, ERR_WRITE, ERR_TIMEOUT, ERR_PARSE, ERR_CLOSED, ERR_COUNT };
+static const char* error_names[ ERR_COUNT ] = { "connect", "read", "write", "timeout", "parse", "closed" };
+
+// 命令行参数
+struct options {
+    int threads;
+    int connections;
+    int duration;           // 秒
+    int pipeline;           // 流水线深度
+    bool keepalive;
+    int timeout_ms;         // 单个请求的超时时间
+    const char* scenario_file;
+    const char* json_file;  // 为空则输出到标准输出
+    std::string url;
+    double rate;            // 开环模式的总请求速率（请求/秒），0 表示闭环模式
+    double sweep_start;     // 速率扫描： 起始:结束:步长
+    double sweep_end;
+    double sweep_step;
+    pid_t soak_pid;         // 浸泡测试：被采样的服务器进程
+    int soak_interval;      // 采样间隔（秒）
+    int soak_warmup;        // 预热时间（秒），之前的样本不参与判定
+    double soak_tolerance;  // RSS 允许的相对增长
+    long soak_slack;        // fd 和 maps 允许的绝对增长
+    const char* soak_log;   // 样本的 CSV 输出文件
+};
+
+// 每个线程自己的统计，结束后合并，运行中不需要任何同步
+struct thread_stats {
+    histogram latency;      // 单位：纳秒；开环模式下从计划发送时间算起
+    histogram service;      // 从实际发送时间算起，和 latency 对比可以看出被掩盖的排队时间
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t bytes_read;
+    uint64_t unsent;        // 开环模式下到结束时仍积压、没能发出的请求数
+    uint64_t aborted;       // 主动中断的下载
+    uint64_t expected_closes;   // oversize 请求被服务器按预期关闭
+    uint64_t status[6];     // 下标为状态码的百位，0 表示无法识别
+    uint64_t errors[ ERR_COUNT ];
+    std::vector< uint64_t > per_entry;
+
+    thread_stats() : requests( 0 ), responses( 0 ), bytes_read( 0 ), unsent( 0 ), aborted( 0 ), expected_closes( 0 ) {
+        memset( status, 0, sizeof( status ) );
+        memset( errors, 0, sizeof( errors ) );
+    }
+};
+
+// 一个客户端连接
+struct connection {
+    int fd;
+    unsigned gen;                   // 每次重新连接加一，用来识别事件是否属于旧连接
+    bool connected;
+    bool want_out;                  // 是否注册了 EPOLLOUT
+
+    std::string out;                // 待发送的数据
+    size_t out_off;
+
+    uint64_t sent_at[ MAX_PIPELINE ];   // 在途请求的发送时间（环形队列），开环模式下为计划发送时间
+    uint64_t real_sent_at[ MAX_PIPELINE ];  // 实际写入socket的时间
+    int entry[ MAX_PIPELINE ];          // 在途请求对应的场景条目
+    int head;
+    int inflight;
+
+    char in[ IN_BUFFER_SIZE ];
+    int in_len;
+    bool in_body;                   // 当前是否在读取响应体
+    long body_left;                 // 响应体剩余字节
+    int status;                     // 当前响应的状态码
+    bool close_after;               // 当前响应带有 Connection: close
+
+    // 开环模式的发送计划，重连时不重置
+    uint64_t next_intended;         // 下一个请求的计划发送时间
+    uint64_t interval;              // 该连接的请求间隔
+    bool queued;                    // 是否已经在定时堆中
+
+    // 慢速读取
+    bool paused;                    // 暂停读取，不监听 EPOLLIN
+    uint64_t resume_at;
+
+    uint64_t retry_at;              // 连接立即失败时重新连接的时间，0 表示没有等待重连
+};
+
+// 定时堆中的条目：按计划发送时间排序的小顶堆
+typedef std::pair< uint64_t, connection* > schedule_item;
+typedef std::priority_queue< schedule_item, std::vector< schedule_item >, std::greater< schedule_item > > schedule_heap;
+
+struct worker {
+    int id;
+    int epfd;
+    std::vector< connection* > conns;
+    thread_stats stats;
+    uint64_t rng;
+    uint64_t deadline;
+    pthread_t tid;
+    schedule_heap timers;   // 开环模式下各连接的下一次发送时间
+};
+
+static options opts;
+static scenario scn;
+static sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+static std::string host_header;
+static int depth;                   // 实际使用的流水线深度
+static std::vector< proc_sample > soak_samples;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_rand( uint64_t& s ) {
+    // xorshift64*
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s * 2685821657736338717ull;
+}
+
+static void setnonblocking( int fd ) {
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+}
+
+static void conn_update( worker* w, connection* c ) {
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLRDHUP | ( c->paused ? 0u : ( uint32_t )EPOLLIN ) | ( c->want_out ? ( uint32_t )EPOLLOUT : 0u );
+    epoll_ctl( w->epfd, EPOLL_CTL_MOD, c->fd, &ev );
+}
+
+static void conn_arm( worker* w, connection* c, bool want_out ) {
+    if ( c->want_out == want_out ) {
+        return;
+    }
+    c->want_out = want_out;
+    conn_update( w, c );
+}
+
+static void conn_reset( connection* c ) {
+    c->fd = -1;
+    c->connected = false;
+    c->want_out = false;
+    c->out.clear();
+    c->out_off = 0;
+    c->head = 0;
+    c->inflight = 0;
+    c->in_len = 0;
+    c->in_body = false;
+    c->body_left = 0;
+    c->status = 0;
+    c->close_after = false;
+    c->paused = false;
+    c->resume_at = 0;
+    c->retry_at = 0;
+}
+
+// 连接没能发起：过一会儿由定时堆重新连接，否则这个连接在剩下的时间里一直空着，实际并发低于 -c
+static void conn_retry( worker* w, connection* c ) {
+    w->stats.errors[ ERR_CONNECT ]++;
+    c->retry_at = now_ns() + RETRY_PAUSE_NS;
+    w->timers.push( schedule_item( c->retry_at, c ) );
+}
+
+static void conn_open( worker* w, connection* c ) {
+    conn_reset( c );
+    c->gen++;
+    c->fd = socket( server_addr.ss_family, SOCK_STREAM, 0 );
+    if ( c->fd < 0 ) {
+        conn_retry( w, c );
+        return;
+    }
+    setnonblocking( c->fd );
+    int one = 1;
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    if ( scn.has_kind( KIND_SLOW ) ) {
+        int rcvbuf = SLOW_RCVBUF;
+        setsockopt( c->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof( rcvbuf ) );
+    }
+    if ( connect( c->fd, ( sockaddr* )&server_addr, server_addrlen ) < 0 && errno != EINPROGRESS ) {
+        close( c->fd );
+        c->fd = -1;
+        conn_retry( w, c );
+        return;
+    }
+    // 连接建立完成时会触发 EPOLLOUT
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    epoll_ctl( w->epfd, EPOLL_CTL_ADD, c->fd, &ev );
+    c->want_out = true;
+}
+
+static void conn_close( worker* w, connection* c ) {
+    if ( c->fd >= 0 ) {
+        epoll_ctl( w->epfd, EPOLL_CTL_DEL, c->fd, 0 );
+        close( c->fd );
+    }
+    c->fd = -1;
+}
+
+// 出错：记录错误，丢弃在途请求，重新建立连接
+static void conn_fail( worker* w, connection* c, ERROR_KIND kind ) {
+    w->stats.errors[ kind ]++;
+    conn_close( w, c );
+    if ( now_ns() < w->deadline ) {
+        conn_open( w, c );
+    }
+}
+
+// 闭环模式：把流水线填满
+// 开环模式：按计划发出所有已经到期的请求（不超过流水线深度），
+// 流水线满的时候到期的请求积压下来，等响应回来后立即补发，计划时间不变
+static void conn_fill( worker* w, connection* c ) {
+    uint64_t now = now_ns();
+    while ( c->inflight < depth ) {
+        uint64_t intended = now;
+        if ( opts.rate > 0 ) {
+            if ( c->next_intended > now ) {
+                break;
+            }
+            intended = c->next_intended;
+            c->next_intended += c->interval;
+        }
+        int e = scn.pick( next_rand( w->rng ) );
+        int slot = ( c->head + c->inflight ) % MAX_PIPELINE;
+        c->sent_at[ slot ] = intended;
+        c->real_sent_at[ slot ] = now;
+        c->entry[ slot ] = e;
+        c->inflight++;
+        c->out += scn.entry( e ).request;
+        w->stats.requests++;
+        w->stats.per_entry[ e ]++;
+    }
+    // 下一个请求还没到时间，放入定时堆等待
+    if ( opts.rate > 0 && !c->queued && c->next_intended > now ) {
+        w->timers.push( schedule_item( c->next_intended, c ) );
+        c->queued = true;
+    }
+}
+
+static void conn_flush( worker* w, connection* c ) {
+    while ( c->out_off < c->out.size() ) {
+        ssize_t n = send( c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                conn_arm( w, c, true );
+                return;
+            }
+            conn_fail( w, c, ERR_WRITE );
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    conn_arm( w, c, false );
+}
+
+// 解析响应头，返回头部长度；头部不完整返回0，格式错误返回-1
+static int parse_head( connection* c ) {
+    char* end = ( char* )memmem( c->in, c->in_len, "\r\n\r\n", 4 );
+    if ( !end ) {
+        return c->in_len >= IN_BUFFER_SIZE ? -1 : 0;
+    }
+    end += 4;
+    if ( end - c->in < 12 || strncmp( c->in, "HTTP/1.", 7 ) != 0 ) {
+        return -1;
+    }
+    c->status = atoi( c->in + 9 );
+    c->body_left = 0;
+    c->close_after = false;
+    // 逐行检查感兴趣的头部字段，大小写不敏感
+    char* line = ( char* )memmem( c->in, end - c->in, "\r\n", 2 ) + 2;
+    while ( line < end - 2 ) {
+        char* eol = ( char* )memmem( line, end - line, "\r\n", 2 );
+        if ( strncasecmp( line, "Content-Length:", 15 ) == 0 ) {
+            c->body_left = atol( line + 15 );
+        } else if ( strncasecmp( line, "Connection:", 11 ) == 0 ) {
+            const char* v = line + 11;
+            v += strspn( v, " \t" );
+            if ( strncasecmp( v, "close", 5 ) == 0 ) {
+                c->close_after = true;
+            }
+        }
+        line = eol + 2;
+    }
+    return ( int )( end - c->in );
+}
+
+// 一个响应接收完毕
+static void conn_complete( worker* w, connection* c ) {
+    uint64_t now = now_ns();
+    int slot = c->head;
+    w->stats.latency.record( now - c->sent_at[ slot ] );
+    w->stats.service.record( now - c->real_sent_at[ slot ] );
+    w->stats.responses++;
+    int cls = c->status / 100;
+    w->stats.status[ ( cls >= 1 && cls <= 5 ) ? cls : 0 ]++;
+    c->head = ( c->head + 1 ) % MAX_PIPELINE;
+    c->inflight--;
+    c->in_body = false;
+}
+
+// 用 RST 立即断开，服务器在 write() 中会收到 ECONNRESET/EPIPE
+static void conn_abort( worker* w, connection* c ) {
+    linger lg;
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt( c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof( lg ) );
+    w->stats.aborted++;
+    conn_close( w, c );
+    if ( now_ns() < w->deadline ) {
+        conn_open( w, c );
+    }
+}
+
+// 慢速读取：暂停一段时间再继续读
+static void conn_pause( worker* w, connection* c ) {
+    c->paused = true;
+    c->resume_at = now_ns() + SLOW_PAUSE_NS;
+    conn_update( w, c );
+    w->timers.push( schedule_item( c->resume_at, c ) );
+}
+
+static void conn_read( worker* w, connection* c ) {
+    while ( true ) {
+        REQUEST_KIND kind = c->inflight > 0 ? scn.entry( c->entry[ c->head ] ).kind : KIND_NORMAL;
+        int room = IN_BUFFER_SIZE - c->in_len;
+        if ( kind == KIND_SLOW && room > SLOW_CHUNK ) {
+            room = SLOW_CHUNK;
+        }
+        ssize_t n = recv( c->fd, c->in + c->in_len, room, 0 );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                break;
+            }
+            if ( kind == KIND_OVERSIZE && errno == ECONNRESET ) {
+                // 服务器没读完请求就关闭，内核会发送 RST
+                w->stats.expected_closes++;
+                conn_close( w, c );
+                if ( now_ns() < w->deadline ) {
+                    conn_open( w, c );
+                }
+                return;
+            }
+            conn_fail( w, c, ERR_READ );
+            return;
+        }
+        if ( n > 0 && kind == KIND_ABORT ) {
+            // 中断的下载：响应刚开始就断开
+            conn_abort( w, c );
+            return;
+        }
+        if ( n == 0 ) {
+            // 对端关闭：如果还有请求没有收到响应就算一次错误
+            if ( c->inflight > 0 && kind == KIND_OVERSIZE ) {
+                w->stats.expected_closes++;
+                conn_close( w, c );
+                if ( now_ns() < w->deadline ) {
+                    conn_open( w, c );
+                }
+            } else if ( c->inflight > 0 ) {
+                conn_fail( w, c, ERR_CLOSED );
+            } else {
+                conn_close( w, c );
+                if ( now_ns() < w->deadline ) {
+                    conn_open( w, c );
+                }
+            }
+            return;
+        }
+        w->stats.bytes_read += n;
+        c->in_len += n;
+
+        // 处理缓冲区中所有完整的响应
+        int pos = 0;
+        bool closing = false;
+        while ( pos < c->in_len ) {
+            if ( !c->in_body ) {
+                if ( c->inflight == 0 ) {
+                    conn_fail( w, c, ERR_PARSE ); // 收到了没有请求过的数据
+                    return;
+                }
+                memmove( c->in, c->in + pos, c->in_len - pos );
+                c->in_len -= pos;
+                pos = 0;
+                int head_len = parse_head( c );
+                if ( head_len < 0 ) {
+                    conn_fail( w, c, ERR_PARSE );
+                    return;
+                }
+                if ( head_len == 0 ) {
+                    break;
+                }
+                pos = head_len;
+                c->in_body = true;
+            }
+            long take = c->in_len - pos;
+            if ( take > c->body_left ) {
+                take = c->body_left;
+            }
+            c->body_left -= take;
+            pos += take;
+            if ( c->body_left > 0 ) {
+                break;
+            }
+            conn_complete( w, c );
+            if ( c->close_after ) {
+                closing = true;
+                break;
+            }
+        }
+        // 丢弃已经处理的数据
+        memmove( c->in, c->in + pos, c->in_len - pos );
+        c->in_len -= pos;
+
+        if ( closing ) {
+            conn_close( w, c );
+            if ( now_ns() < w->deadline ) {
+                conn_open( w, c );
+            }
+            return;
+        }
+        if ( kind == KIND_SLOW && c->inflight > 0 ) {
+            conn_pause( w, c );
+            return;
+        }
+    }
+    if ( c->inflight < depth && c->connected && now_ns() < w->deadline ) {
+        conn_fill( w, c );
+        conn_flush( w, c );
+    }
+}
+
+static void on_event( worker* w, connection* c, uint32_t events ) {
+    if ( !c->connected ) {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &len );
+        if ( err != 0 || ( events & ( EPOLLERR | EPOLLHUP ) ) ) {
+            conn_fail( w, c, ERR_CONNECT );
+            return;
+        }
+        c->connected = true;
+        conn_fill( w, c );
+        conn_flush( w, c );
+        return;
+    }
+    if ( ( events & EPOLLIN ) || ( c->paused && ( events & EPOLLRDHUP ) ) ) {
+        unsigned gen = c->gen;
+        conn_read( w, c );
+        if ( c->fd < 0 || c->gen != gen ) {
+            // 连接已经关闭或被替换，剩下的事件属于旧连接
+            return;
+        }
+    }
+    if ( events & ( EPOLLERR | EPOLLHUP ) ) {
+        conn_fail( w, c, c->inflight > 0 ? ERR_CLOSED : ERR_READ );
+        return;
+    }
+    if ( ( events & EPOLLOUT ) && c->fd >= 0 ) {
+        conn_flush( w, c );
+    }
+}
+
+// 检查超时的请求
+static void check_timeouts( worker* w, uint64_t now ) {
+    uint64_t limit = ( uint64_t )opts.timeout_ms * 1000000ull;
+    for ( size_t i = 0; i < w->conns.size(); ++i ) {
+        connection* c = w->conns[i];
+        if ( c->fd >= 0 && c->inflight > 0 && now - c->sent_at[ c->head ] > limit ) {
+            conn_fail( w, c, ERR_TIMEOUT );
+        }
+    }
+}
+
+static void* worker_run( void* arg ) {
+    worker* w = ( worker* )arg;
+    for ( size_t i = 0; i < w->conns.size(); ++i ) {
+        conn_open( w, w->conns[i] );
+    }
+    epoll_event events[ 1024 ];
+    uint64_t last_check = now_ns();
+    while ( true ) {
+        uint64_t now = now_ns();
+        if ( now >= w->deadline ) {
+            break;
+        }
+        // 开环模式下睡到最近一个计划发送时间。epoll_wait 精度为毫秒，向上取整而不是忙等，
+        // 晚发出的时间会计入延迟（延迟从计划时间算起），不会掩盖
+        int wait_ms = 10;
+        if ( !w->timers.empty() ) {
+            uint64_t due = w->timers.top().first;
+            wait_ms = due <= now ? 0 : ( int )( ( due - now + 999999ull ) / 1000000ull );
+            if ( wait_ms > 10 ) {
+                wait_ms = 10;
+            }
+        }
+        int n = epoll_wait( w->epfd, events, 1024, wait_ms );
+        for ( int i = 0; i < n; ++i ) {
+            on_event( w, ( connection* )events[i].data.ptr, events[i].events );
+        }
+        now = now_ns();
+        while ( !w->timers.empty() && w->timers.top().first <= now ) {
+            connection* c = w->timers.top().second;
+            w->timers.pop();
+            c->queued = false;
+            if ( c->fd < 0 ) {
+                if ( c->retry_at && now >= c->retry_at ) {
+                    conn_open( w, c );
+                }
+                continue;
+            }
+            if ( c->paused ) {
+                if ( now >= c->resume_at ) {
+                    c->paused = false;
+                    conn_update( w, c );
+                    conn_read( w, c );
+                }
+                continue;
+            }
+            // 未连接的连接在连接建立后会补发积压的请求
+            if ( c->connected ) {
+                conn_fill( w, c );
+                conn_flush( w, c );
+            }
+        }
+        if ( now - last_check >= 10000000ull ) {
+            check_timeouts( w, now );
+            last_check = now;
+        }
+    }
+    for ( size_t i = 0; i < w->conns.size(); ++i ) {
+        connection* c = w->conns[i];
+        if ( opts.rate > 0 && c->next_intended < w->deadline ) {
+            w->stats.unsent += ( w->deadline - c->next_intended ) / c->interval + 1;
+        }
+        conn_close( w, c );
+    }
+    return NULL;
+}
+
+// 解析 http://host[:port]/path
+static bool resolve_target( const std::string& url, std::string& path ) {
+    std::string rest = url;
+    if ( strncasecmp( rest.c_str(), "http://", 7 ) == 0 ) {
+        rest = rest.substr( 7 );
+    }
+    size_t slash = rest.find( '/' );
+    std::string hostport = slash == std::string::npos ? rest : rest.substr( 0, slash );
+    path = slash == std::string::npos ? "/" : rest.substr( slash );
+    std::string host = hostport, port = "80";
+    size_t colon = hostport.rfind( ':' );
+    if ( colon != std::string::npos ) {
+        host = hostport.substr( 0, colon );
+        port = hostport.substr( colon + 1 );
+    }
+    addrinfo hints, *res = NULL;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( getaddrinfo( host.c_str(), port.c_str(), &hints, &res ) != 0 || !res ) {
+        fprintf( stderr, "cannot resolve %s\n", hostport.c_str() );
+        return false;
+    }
+    memcpy( &server_addr, res->ai_addr, res->ai_addrlen );
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo( res );
+    host_header = hostport;
+    return true;
+}
+
+static void raise_fd_limit() {
+    rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur < rl.rlim_max ) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &rl );
+    }
+}
+
+static bool print_soak( FILE* fp );
+
+// 返回 false 表示浸泡测试判定失败
+static bool print_json( FILE* fp, const thread_stats& total, double elapsed ) {
+    const histogram& h = total.latency;
+    fprintf( fp, "{\n" );
+    fprintf( fp, "  \"target\": \"%s\",\n", opts.url.c_str() );
+    fprintf( fp, "  \"threads\": %d,\n", opts.threads );
+    fprintf( fp, "  \"connections\": %d,\n", opts.connections );
+    fprintf( fp, "  \"pipeline\": %d,\n", opts.pipeline );
+    fprintf( fp, "  \"keepalive\": %s,\n", opts.keepalive ? "true" : "false" );
+    fprintf( fp, "  \"mode\": \"%s\",\n", opts.rate > 0 ? "open-loop" : "closed-loop" );
+    if ( opts.rate > 0 ) {
+        fprintf( fp, "  \"target_rps\": %.1f,\n", opts.rate );
+        fprintf( fp, "  \"unsent\": %llu,\n", ( unsigned long long )total.unsent );
+    }
+    fprintf( fp, "  \"duration_s\": %.3f,\n", elapsed );
+    fprintf( fp, "  \"requests\": %llu,\n", ( unsigned long long )total.requests );
+    fprintf( fp, "  \"responses\": %llu,\n", ( unsigned long long )total.responses );
+    fprintf( fp, "  \"bytes_read\": %llu,\n", ( unsigned long long )total.bytes_read );
+    fprintf( fp, "  \"rps\": %.1f,\n", total.responses / elapsed );
+    fprintf( fp, "  \"bytes_per_s\": %.1f,\n", total.bytes_read / elapsed );
+    fprintf( fp, "  \"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+                 "\"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f},\n",
+             h.min() / 1e3, h.mean() / 1e3, h.percentile( 50 ) / 1e3, h.percentile( 90 ) / 1e3,
+             h.percentile( 99 ) / 1e3, h.percentile( 99.9 ) / 1e3, h.max() / 1e3 );
+    if ( opts.rate > 0 ) {
+        const histogram& sv = total.service;
+        fprintf( fp, "  \"service_latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f},\n",
+                 sv.percentile( 50 ) / 1e3, sv.percentile( 90 ) / 1e3, sv.percentile( 99 ) / 1e3,
+                 sv.percentile( 99.9 ) / 1e3, sv.max() / 1e3 );
+    }
+    fprintf( fp, "  \"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu},\n",
+             ( unsigned long long )total.status[1], ( unsigned long long )total.status[2],
+             ( unsigned long long )total.status[3], ( unsigned long long )total.status[4],
+             ( unsigned long long )total.status[5], ( unsigned long long )total.status[0] );
+    if ( scn.has_special() ) {
+        fprintf( fp, "  \"aborted\": %llu,\n", ( unsigned long long )total.aborted );
+        fprintf( fp, "  \"expected_closes\": %llu,\n", ( unsigned long long )total.expected_closes );
+    }
+    fprintf( fp, "  \"errors\": {" );
+    for ( int i = 0; i < ERR_COUNT; ++i ) {
+        fprintf( fp, "%s\"%s\": %llu", i ? ", " : "", error_names[i], ( unsigned long long )total.errors[i] );
+    }
+    fprintf( fp, "},\n" );
+    bool pass = true;
+    if ( opts.soak_pid > 0 ) {
+        pass = print_soak( fp );
+    }
+    fprintf( fp, "  \"urls\": [" );
+    for ( int i = 0; i < scn.size(); ++i ) {
+        fprintf( fp, "%s\n    {\"path\": \"%s\", \"kind\": \"%s\", \"weight\": %u, \"requests\": %llu}", i ? "," : "",
+                 scn.entry( i ).path.c_str(), kind_names[ scn.entry( i ).kind ], scn.entry( i ).weight,
+                 ( unsigned long long )total.per_entry[i] );
+    }
+    fprintf( fp, "\n  ]\n}\n" );
+    return pass;
+}
+
+// 压测期间在主线程中定期采样服务器进程，服务器退出时提前结束采样
+static void soak_monitor( uint64_t start, uint64_t deadline ) {
+    FILE* log = NULL;
+    if ( opts.soak_log ) {
+        log = fopen( opts.soak_log, "w" );
+        if ( log ) {
+            fprintf( log, "seconds,rss_kb,fds,maps\n" );
+        }
+    }
+    uint64_t next = start;
+    while ( true ) {
+        uint64_t now = now_ns();
+        if ( now >= deadline ) {
+            break;
+        }
+        if ( now < next ) {
+            uint64_t left = ( next < deadline ? next : deadline ) - now;
+            usleep( left / 1000 );
+            continue;
+        }
+        next += ( uint64_t )opts.soak_interval * 1000000000ull;
+        proc_sample ps;
+        if ( !sample_proc( opts.soak_pid, ( now - start ) / 1e9, ps ) ) {
+            fprintf( stderr, "loadgen: cannot sample pid %d, server exited?\n", ( int )opts.soak_pid );
+            ps.rss_kb = -1;
+            soak_samples.push_back( ps );
+            break;
+        }
+        soak_samples.push_back( ps );
+        if ( log ) {
+            fprintf( log, "%.1f,%ld,%ld,%ld\n", ps.t, ps.rss_kb, ps.fds, ps.maps );
+            fflush( log );
+        }
+    }
+    if ( log ) {
+        fclose( log );
+    }
+}
+
+// 输出浸泡测试的判定结果，返回是否通过
+static bool print_soak( FILE* fp ) {
+    bool alive = !soak_samples.empty() && soak_samples.back().rss_kb >= 0;
+    std::vector< proc_sample > valid;
+    for ( size_t i = 0; i < soak_samples.size(); ++i ) {
+        if ( soak_samples[i].rss_kb >= 0 ) {
+            valid.push_back( soak_samples[i] );
+        }
+    }
+    soak_verdict v[3];
+    v[0] = judge_metric( "rss_kb", valid, &proc_sample::rss_kb, opts.soak_warmup, opts.soak_tolerance, 4096 );
+    v[1] = judge_metric( "fds", valid, &proc_sample::fds, opts.soak_warmup, 0, opts.soak_slack );
+    v[2] = judge_metric( "maps", valid, &proc_sample::maps, opts.soak_warmup, 0, opts.soak_slack );
+    bool pass = alive;
+    fprintf( fp, "  \"soak\": {\"pid\": %d, \"samples\": %zu, \"server_alive\": %s,",
+             ( int )opts.soak_pid, soak_samples.size(), alive ? "true" : "false" );
+    for ( int i = 0; i < 3; ++i ) {
+        fprintf( fp, "\n    \"%s\": {\"baseline\": %.0f, \"final\": %.0f, \"peak\": %.0f, "
+                     "\"slope_per_hour\": %.1f, \"limit\": %.0f, \"judged\": %s, \"pass\": %s},",
+                 v[i].name, v[i].baseline, v[i].final, v[i].peak, v[i].slope_per_hour, v[i].limit,
+                 v[i].judged ? "true" : "false", v[i].pass ? "true" : "false" );
+        if ( !v[i].pass ) {
+            fprintf( stderr, "loadgen: soak failed, %s grew from %.0f to %.0f (limit %.0f)\n",
+                     v[i].name, v[i].baseline, v[i].final, v[i].limit );
+        }
+        pass = pass && v[i].pass;
+    }
+    fprintf( fp, "\n    \"pass\": %s},\n", pass ? "true" : "false" );
+    return pass;
+}
+
+// 运行一轮压测，返回合并后的统计和实际耗时（秒）
+static double run_once( thread_stats& total ) {
+    uint64_t start = now_ns();
+    std::vector< worker* > workers;
+    for ( int i = 0; i < opts.threads; ++i ) {
+        worker* w = new worker;
+        w->id = i;
+        w->epfd = epoll_create1( 0 );
+        w->rng = 0x9E3779B97F4A7C15ull * ( i + 1 ) ^ start;
+        w->deadline = start + ( uint64_t )opts.duration * 1000000000ull;
+        w->stats.per_entry.assign( scn.size(), 0 );
+        int n = opts.connections / opts.threads + ( i < opts.connections % opts.threads ? 1 : 0 );
+        for ( int j = 0; j < n; ++j ) {
+            connection* c = new connection;
+            conn_reset( c );
+            c->gen = 0;
+            c->queued = false;
+            c->interval = 0;
+            c->next_intended = start;
+            if ( opts.rate > 0 ) {
+                // 总速率平均分给每个连接，初始相位随机，避免所有连接同时发送
+                c->interval = ( uint64_t )( 1e9 * opts.connections / opts.rate );
+                if ( c->interval == 0 ) {
+                    c->interval = 1;
+                }
+                c->next_intended = start + next_rand( w->rng ) % c->interval;
+            }
+            w->conns.push_back( c );
+        }
+        workers.push_back( w );
+    }
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        if ( pthread_create( &workers[i]->tid, NULL, worker_run, workers[i] ) != 0 ) {
+            fprintf( stderr, "pthread_create failed\n" );
+            exit( 3 );
+        }
+    }
+    if ( opts.soak_pid > 0 ) {
+        soak_monitor( start, start + ( uint64_t )opts.duration * 1000000000ull );
+    }
+
+    total = thread_stats();
+    total.per_entry.assign( scn.size(), 0 );
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        worker* w = workers[i];
+        pthread_join( w->tid, NULL );
+        total.latency.merge( w->stats.latency );
+        total.service.merge( w->stats.service );
+        total.requests += w->stats.requests;
+        total.responses += w->stats.responses;
+        total.bytes_read += w->stats.bytes_read;
+        total.unsent += w->stats.unsent;
+        total.aborted += w->stats.aborted;
+        total.expected_closes += w->stats.expected_closes;
+        for ( int k = 0; k < 6; ++k ) {
+            total.status[k] += w->stats.status[k];
+        }
+        for ( int k = 0; k < ERR_COUNT; ++k ) {
+            total.errors[k] += w->stats.errors[k];
+        }
+        for ( int k = 0; k < scn.size(); ++k ) {
+            total.per_entry[k] += w->stats.per_entry[k];
+        }
+        for ( size_t j = 0; j < w->conns.size(); ++j ) {
+            delete w->conns[j];
+        }
+        close( w->epfd );
+        delete w;
+    }
+    return ( now_ns() - start ) / 1e9;
+}
+
+// 速率扫描：每个速率跑一轮，输出延迟-吞吐曲线
+// 拐点取第一个满足下列任一条件的速率：实际吞吐低于目标的95%，或 p99 超过最低速率时的10倍
+static int run_sweep( FILE* fp ) {
+    fprintf( fp, "{\n" );
+    fprintf( fp, "  \"target\": \"%s\",\n", opts.url.c_str() );
+    fprintf( fp, "  \"mode\": \"open-loop-sweep\",\n" );
+    fprintf( fp, "  \"threads\": %d,\n", opts.threads );
+    fprintf( fp, "  \"connections\": %d,\n", opts.connections );
+    fprintf( fp, "  \"pipeline\": %d,\n", opts.pipeline );
+    fprintf( fp, "  \"step_duration_s\": %d,\n", opts.duration );
+    fprintf( fp, "  \"curve\": [" );
+    double knee = 0;
+    uint64_t base_p99 = 0;
+    bool first = true;
+    for ( double rate = opts.sweep_start; rate <= opts.sweep_end + 1e-9; rate += opts.sweep_step ) {
+        opts.rate = rate;
+        thread_stats total;
+        double elapsed = run_once( total );
+        const histogram& h = total.latency;
+        double achieved = total.responses / elapsed;
+        uint64_t errors = 0;
+        for ( int k = 0; k < ERR_COUNT; ++k ) {
+            errors += total.errors[k];
+        }
+        if ( first ) {
+            base_p99 = h.percentile( 99 );
+        }
+        if ( knee == 0 && ( achieved < rate * 0.95 || ( base_p99 > 0 && h.percentile( 99 ) > base_p99 * 10 ) ) ) {
+            knee = rate;
+        }
+        fprintf( stderr, "loadgen: rate %.0f -> %.0f rps, p99 %.1f us\n", rate, achieved, h.percentile( 99 ) / 1e3 );
+        fprintf( fp, "%s\n    {\"target_rps\": %.1f, \"achieved_rps\": %.1f, \"errors\": %llu, \"unsent\": %llu, "
+                     "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p99_9_us\": %.1f, \"max_us\": %.1f, "
+                     "\"service_p99_us\": %.1f}",
+                 first ? "" : ",", rate, achieved, ( unsigned long long )errors, ( unsigned long long )total.unsent,
+                 h.percentile( 50 ) / 1e3, h.percentile( 90 ) / 1e3, h.percentile( 99 ) / 1e3,
+                 h.percentile( 99.9 ) / 1e3, h.max() / 1e3, total.service.percentile( 99 ) / 1e3 );
+        first = false;
+    }
+    fprintf( fp, "\n  ],\n" );
+    if ( knee > 0 ) {
+        fprintf( fp, "  \"knee_rps\": %.1f\n}\n", knee );
+    } else {
+        fprintf( fp, "  \"knee_rps\": null\n}\n" );
+    }
+    return 0;
+}
+
+static void usage() {
+    fprintf( stderr,
+        "loadgen [option]... http://host:port/path\n"
+        "  -t|--threads <n>       Event-loop threads. Default 2.\n"
+        "  -c|--connections <n>   Total connections, split across threads. Default 100.\n"
+        "  -d|--duration <sec>    Run for <sec> seconds (per step when sweeping). Default 10.\n"
+        "  -p|--pipeline <n>      Requests in flight per connection (max %d). Default 1.\n"
+        "  -k|--keepalive <0|1>   Use HTTP/1.1 keep-alive. Default 1.\n"
+        "  -T|--timeout <ms>      Per-request timeout. Default 2000.\n"
+        "  -s|--scenario <file>   Weighted URL mix, one '<weight> /path' per line.\n"
+        "  -R|--rate <rps>        Open-loop mode: constant total arrival rate, latency\n"
+        "                         measured from the intended send time.\n"
+        "  --sweep <a:b:step>     Open-loop sweep from a to b rps, prints a latency curve.\n"
+        "  -o|--output <file>     Write JSON result to <file> instead of stdout.\n"
+        "  --soak-pid <pid>       Soak mode: sample /proc/<pid> while running and fail\n"
+        "                         (exit 1) if RSS, fd count or mappings keep growing.\n"
+        "  --soak-interval <sec>  Sampling interval. Default 5.\n"
+        "  --soak-warmup <sec>    Samples before this are ignored. Default 60.\n"
+        "  --soak-tolerance <pct> Allowed RSS growth after warmup. Default 10.\n"
+        "  --soak-slack <n>       Allowed fd/mapping growth after warmup. Default 64.\n"
+        "  --soak-log <file>      Write every sample to <file> as CSV.\n"
+        "  -h|--help              This information.\n"
+        "Scenario kinds (third column): normal, abort, slow, bad, oversize.\n", MAX_PIPELINE );
+}
+
+int main( int argc, char* argv[] ) {
+    opts.threads = 2;
+    opts.connections = 100;
+    opts.duration = 10;
+    opts.pipeline = 1;
+    opts.keepalive = true;
+    opts.timeout_ms = 2000;
+    opts.scenario_file = NULL;
+    opts.json_file = NULL;
+    opts.rate = 0;
+    opts.sweep_start = opts.sweep_end = opts.sweep_step = 0;
+    opts.soak_pid = 0;
+    opts.soak_interval = 5;
+    opts.soak_warmup = 60;
+    opts.soak_tolerance = 0.10;
+    opts.soak_slack = 64;
+    opts.soak_log = NULL;
+
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "connections", required_argument, NULL, 'c' },
+        { "duration", required_argument, NULL, 'd' },
+        { "pipeline", required_argument, NULL, 'p' },
+        { "keepalive", required_argument, NULL, 'k' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "scenario", required_argument, NULL, 's' },
+        { "rate", required_argument, NULL, 'R' },
+        { "sweep", required_argument, NULL, 'W' },
+        { "output", required_argument, NULL, 'o' },
+        { "soak-pid", required_argument, NULL, 1 },
+        { "soak-interval", required_argument, NULL, 2 },
+        { "soak-warmup", required_argument, NULL, 3 },
+        { "soak-tolerance", required_argument, NULL, 4 },
+        { "soak-slack", required_argument, NULL, 5 },
+        { "soak-log", required_argument, NULL, 6 },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ( ( opt = getopt_long( argc, argv, "t:c:d:p:k:T:s:R:o:h", long_options, NULL ) ) != -1 ) {
+        switch ( opt ) {
+            case 't': opts.threads = atoi( optarg ); break;
+            case 'c': opts.connections = atoi( optarg ); break;
+            case 'd': opts.duration = atoi( optarg ); break;
+            case 'p': opts.pipeline = atoi( optarg ); break;
+            case 'k': opts.keepalive = atoi( optarg ) != 0; break;
+            case 'T': opts.timeout_ms = atoi( optarg ); break;
+            case 's': opts.scenario_file = optarg; break;
+            case 'R': opts.rate = atof( optarg ); break;
+            case 'W':
+                if ( sscanf( optarg, "%lf:%lf:%lf", &opts.sweep_start, &opts.sweep_end, &opts.sweep_step ) != 3
+                    || opts.sweep_start <= 0 || opts.sweep_step <= 0 || opts.sweep_end < opts.sweep_start ) {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'o': opts.json_file = optarg; break;
+            case 1: opts.soak_pid = atoi( optarg ); break;
+            case 2: opts.soak_interval = atoi( optarg ); break;
+            case 3: opts.soak_warmup = atoi( optarg ); break;
+            case 4: opts.soak_tolerance = atof( optarg ) / 100.0; break;
+            case 5: opts.soak_slack = atol( optarg ); break;
+            case 6: opts.soak_log = optarg; break;
+            default: usage(); return 2;
+        }
+    }
+    if ( optind >= argc ) {
+        usage();
+        return 2;
+    }
+    opts.url = argv[ optind ];
+    if ( opts.threads <= 0 || opts.connections <= 0 || opts.duration <= 0 || opts.timeout_ms <= 0
+        || opts.pipeline <= 0 || opts.pipeline > MAX_PIPELINE || opts.rate < 0
+        || opts.soak_interval <= 0 || opts.soak_warmup < 0 || opts.soak_tolerance < 0 || opts.soak_slack < 0
+        || ( opts.soak_pid > 0 && opts.sweep_step > 0 ) ) {
+        usage();
+        return 2;
+    }
+    if ( opts.threads > opts.connections ) {
+        opts.threads = opts.connections;
+    }
+
+    std::string path;
+    if ( !resolve_target( opts.url, path ) ) {
+        return 1;
+    }
+    if ( opts.scenario_file ) {
+        std::string err;
+        if ( !scn.load( opts.scenario_file, err ) ) {
+            fprintf( stderr, "%s\n", err.c_str() );
+            return 2;
+        }
+    } else {
+        scn.add( path.c_str(), 1 );
+    }
+    scn.build_requests( host_header, opts.keepalive );
+    // 异常路径的请求会断开连接，和流水线混用时无法区分错误，只用深度1
+    depth = opts.keepalive ? opts.pipeline : 1;
+    if ( scn.has_special() ) {
+        depth = 1;
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+    raise_fd_limit();
+
+    FILE* fp = stdout;
+    if ( opts.json_file ) {
+        fp = fopen( opts.json_file, "w" );
+        if ( !fp ) {
+            fprintf( stderr, "cannot open %s\n", opts.json_file );
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    if ( opts.sweep_step > 0 ) {
+        fprintf( stderr, "loadgen: %s, %d threads, %d connections, sweep %.0f..%.0f rps, %ds per step\n",
+                 opts.url.c_str(), opts.threads, opts.connections, opts.sweep_start, opts.sweep_end, opts.duration );
+        ret = run_sweep( fp );
+    } else {
+        fprintf( stderr, "loadgen: %s, %d threads, %d connections, pipeline %d, %ds%s\n",
+                 opts.url.c_str(), opts.threads, opts.connections, opts.pipeline, opts.duration,
+                 opts.rate > 0 ? ", open-loop" : "" );
+        thread_stats total;
+        double elapsed = run_once( total );
+        bool pass = print_json( fp, total, elapsed );
+        ret = ( total.responses > 0 && pass ) ? 0 : 1;
+    }
+    if ( fp != stdout ) {
+        fclose( fp );
+    }
+    return ret;
+}
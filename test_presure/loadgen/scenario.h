@@ -0,0 +1,155 @@
+#ifndef LOADGEN_SCENARIO_H
+#define LOADGEN_SCENARIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// 请求类型，用于浸泡测试中覆盖各种异常路径
+//   normal   : 普通请求
+//   abort    : 收到响应的第一批数据后用 RST 断开，模拟中断的下载
+//   slow     : 慢速读取响应，让服务器的 write() 遇到 EAGAIN
+//   bad      : 语法错误的请求，走 400 错误路径
+//   oversize : 超过服务器读缓冲区的请求头，服务器直接关闭连接
+enum REQUEST_KIND { KIND_NORMAL = 0, KIND_ABORT, KIND_SLOW, KIND_BAD, KIND_OVERSIZE, KIND_COUNT };
+static const char* kind_names[ KIND_COUNT ] = { "normal", "abort", "slow", "bad", "oversize" };
+
+// 场景中的一条请求：按权重随机选中，请求报文在启动时就拼好，发送时只做拷贝
+struct scenario_entry {
+    std::string path;
+    unsigned weight;
+    REQUEST_KIND kind;
+    uint64_t cumulative;    // 前缀权重和，用于二分查找
+    std::string request;    // 预先生成的完整请求报文
+};
+
+// 加权URL混合
+// 场景文件每行一条： <权重> <路径> [类型]，'#' 开头为注释，例如
+//     90 /index.html
+//     10 /images/image1.jpg
+//      1 /images/image1.jpg abort
+class scenario {
+public:
+    scenario() : m_total( 0 ) {}
+
+    bool load( const char* file, std::string& err ) {
+        FILE* fp = fopen( file, "r" );
+        if ( !fp ) {
+            err = std::string( "cannot open scenario file " ) + file;
+            return false;
+        }
+        char line[ 4096 ];
+        int lineno = 0;
+        while ( fgets( line, sizeof( line ), fp ) ) {
+            ++lineno;
+            char* text = line + strspn( line, " \t" );
+            if ( text[0] == '#' || text[0] == '\n' || text[0] == '\0' ) {
+                continue;
+            }
+            char path[ 2048 ];
+            char kind[ 32 ] = "normal";
+            unsigned weight = 0;
+            int k = KIND_COUNT;
+            if ( sscanf( text, "%u %2047s %31s", &weight, path, kind ) >= 2 && weight > 0 && path[0] == '/' ) {
+                for ( k = 0; k < KIND_COUNT; ++k ) {
+                    if ( strcmp( kind, kind_names[k] ) == 0 ) {
+                        break;
+                    }
+                }
+            }
+            if ( k == KIND_COUNT ) {
+                char msg[ 128 ];
+                snprintf( msg, sizeof( msg ), "%s:%d: expected '<weight> /path [kind]'", file, lineno );
+                err = msg;
+                fclose( fp );
+                return false;
+            }
+            add( path, weight, ( REQUEST_KIND )k );
+        }
+        fclose( fp );
+        if ( m_entries.empty() ) {
+            err = std::string( "scenario file has no entries: " ) + file;
+            return false;
+        }
+        return true;
+    }
+
+    void add( const char* path, unsigned weight, REQUEST_KIND kind = KIND_NORMAL ) {
+        scenario_entry e;
+        e.path = path;
+        e.weight = weight;
+        e.kind = kind;
+        m_total += weight;
+        e.cumulative = m_total;
+        m_entries.push_back( e );
+    }
+
+    // 生成请求报文。这个服务器只接受 HTTP/1.1，并且只有显式带上 keep-alive 才会保持连接
+    void build_requests( const std::string& host, bool keepalive ) {
+        for ( size_t i = 0; i < m_entries.size(); ++i ) {
+            std::string& r = m_entries[i].request;
+            REQUEST_KIND kind = m_entries[i].kind;
+            if ( kind == KIND_BAD ) {
+                r = "BREW " + m_entries[i].path + " HTTP/1.0\r\n";
+            } else {
+                r = "GET " + m_entries[i].path + " HTTP/1.1\r\n";
+            }
+            r += "Host: " + host + "\r\n";
+            r += "User-Agent: loadgen\r\n";
+            if ( kind == KIND_OVERSIZE ) {
+                r += "X-Padding: " + std::string( 4096, 'x' ) + "\r\n";
+            }
+            r += keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+            r += "\r\n";
+        }
+    }
+
+    // 是否包含异常路径的请求：这类请求会断开连接，不能和流水线混用
+    bool has_special() const {
+        for ( size_t i = 0; i < m_entries.size(); ++i ) {
+            if ( m_entries[i].kind != KIND_NORMAL ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool has_kind( REQUEST_KIND kind ) const {
+        for ( size_t i = 0; i < m_entries.size(); ++i ) {
+            if ( m_entries[i].kind == kind ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // r 为均匀分布的随机数，返回选中的条目下标
+    int pick( uint64_t r ) const {
+        if ( m_entries.size() == 1 ) {
+            return 0;
+        }
+        uint64_t x = r % m_total;
+        int lo = 0, hi = ( int )m_entries.size() - 1;
+        while ( lo < hi ) {
+            int mid = ( lo + hi ) / 2;
+            if ( x < m_entries[ mid ].cumulative ) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        return lo;
+    }
+
+    const scenario_entry& entry( int i ) const { return m_entries[i]; }
+    int size() const { return ( int )m_entries.size(); }
+
+private:
+    std::vector< scenario_entry > m_entries;
+    uint64_t m_total;
+};
+
+#endif
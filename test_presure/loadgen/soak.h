@@ -0,0 +1,139 @@
+#ifndef LOADGEN_SOAK_H
+#define LOADGEN_SOAK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <vector>
+
+// 浸泡测试：长时间施压的同时定期采样服务器进程的资源占用，
+// 内存、文件描述符或内存映射区域数量持续增长则判定为泄漏
+
+// 一次采样
+struct proc_sample {
+    double t;       // 距开始的秒数
+    long rss_kb;    // /proc/<pid>/status 中的 VmRSS
+    long fds;       // /proc/<pid>/fd 中的条目数
+    long maps;      // /proc/<pid>/maps 的行数
+};
+
+// 单个指标的判定结果
+struct soak_verdict {
+    const char* name;
+    double baseline;        // 预热结束后前几个样本的中位数
+    double final;           // 最后几个样本的中位数
+    double peak;
+    double slope_per_hour;  // 预热之后的最小二乘斜率
+    double limit;           // final 允许的上限
+    bool judged;            // 预热后的样本是否足够做出判定
+    bool pass;
+};
+
+static bool sample_proc( pid_t pid, double t, proc_sample& s ) {
+    char path[ 64 ];
+    char line[ 512 ];
+    s.t = t;
+    s.rss_kb = s.fds = s.maps = -1;
+
+    snprintf( path, sizeof( path ), "/proc/%d/status", ( int )pid );
+    FILE* fp = fopen( path, "r" );
+    if ( !fp ) {
+        return false;
+    }
+    while ( fgets( line, sizeof( line ), fp ) ) {
+        if ( strncmp( line, "VmRSS:", 6 ) == 0 ) {
+            s.rss_kb = atol( line + 6 );
+            break;
+        }
+    }
+    fclose( fp );
+
+    snprintf( path, sizeof( path ), "/proc/%d/fd", ( int )pid );
+    DIR* dir = opendir( path );
+    if ( !dir ) {
+        return false;
+    }
+    s.fds = 0;
+    dirent* de;
+    while ( ( de = readdir( dir ) ) != NULL ) {
+        if ( de->d_name[0] != '.' ) {
+            s.fds++;
+        }
+    }
+    closedir( dir );
+
+    snprintf( path, sizeof( path ), "/proc/%d/maps", ( int )pid );
+    fp = fopen( path, "r" );
+    if ( !fp ) {
+        return false;
+    }
+    s.maps = 0;
+    int c;
+    while ( ( c = fgetc( fp ) ) != EOF ) {
+        if ( c == '\n' ) {
+            s.maps++;
+        }
+    }
+    fclose( fp );
+    return s.rss_kb >= 0;
+}
+
+static double median_of( std::vector< double > v ) {
+    if ( v.empty() ) {
+        return 0;
+    }
+    std::sort( v.begin(), v.end() );
+    return v[ v.size() / 2 ];
+}
+
+// 用预热之后的样本判定一个指标
+// 通过条件： final <= baseline * ( 1 + tolerance ) + slack
+// 取首尾窗口的中位数，避免连接数的瞬时波动造成误判
+static soak_verdict judge_metric( const char* name, const std::vector< proc_sample >& samples,
+                                  long proc_sample::*field, double warmup, double tolerance, double slack ) {
+    const int WINDOW = 5;
+    soak_verdict v;
+    memset( &v, 0, sizeof( v ) );
+    v.name = name;
+    v.pass = true;
+    std::vector< const proc_sample* > steady;
+    for ( size_t i = 0; i < samples.size(); ++i ) {
+        if ( samples[i].t >= warmup ) {
+            steady.push_back( &samples[i] );
+        }
+    }
+    if ( steady.size() < ( size_t )( 2 * WINDOW ) ) {
+        // 样本太少无法判断，不判失败
+        return v;
+    }
+    std::vector< double > head, tail;
+    for ( int i = 0; i < WINDOW; ++i ) {
+        head.push_back( steady[i]->*field );
+        tail.push_back( steady[ steady.size() - WINDOW + i ]->*field );
+    }
+    v.baseline = median_of( head );
+    v.final = median_of( tail );
+
+    double n = steady.size(), sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for ( size_t i = 0; i < steady.size(); ++i ) {
+        double x = steady[i]->t, y = steady[i]->*field;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        if ( y > v.peak ) {
+            v.peak = y;
+        }
+    }
+    double denom = n * sxx - sx * sx;
+    v.slope_per_hour = denom > 0 ? ( n * sxy - sx * sy ) / denom * 3600.0 : 0;
+    v.limit = v.baseline * ( 1.0 + tolerance ) + slack;
+    v.judged = true;
+    v.pass = v.final <= v.limit;
+    return v;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#!/bin/sh
+# 套接字选项对比：依次用不同的 --socket_options 启动服务器，用 loadgen 在回环上施压，
+# 输出每种配置下小文件和大文件的吞吐量和延迟
+#
+# 用法： ./sockopt_sweep.sh <服务器程序> [端口] [每项秒数]
+#   PROFILES 环境变量可以替换要比较的配置，配置之间用空格分隔，default 表示不设置任何选项
+
+SERVER=${1:?usage: $0 <server-binary> [port] [seconds]}
+PORT=${2:-9100}
+SECONDS_PER_RUN=${3:-5}
+LOADGEN=${LOADGEN:-./loadgen}
+PATHS=${PATHS:-"/index.html /images/image1.jpg"}
+PROFILES=${PROFILES:-"default nodelay cork nodelay,cork fastopen=256 sndbuf=262144,rcvbuf=262144 notsent_lowat=16384 busy_poll=50"}
+
+if [ ! -x "$LOADGEN" ]; then
+    echo "build loadgen first (make)" >&2
+    exit 1
+fi
+
+printf "%-32s %-20s %10s %9s %9s %7s\n" profile path req/s "p50 us" "p99 us" errors
+for profile in $PROFILES; do
+    opt=$profile
+    [ "$opt" = default ] && opt=
+    "$SERVER" --socket_options="$opt" "$PORT" > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    if ! kill -0 $pid 2>/dev/null; then
+        printf "%-32s server failed to start\n" "$profile"
+        continue
+    fi
+    for path in $PATHS; do
+        out=$("$LOADGEN" -c 16 -d "$SECONDS_PER_RUN" "http://127.0.0.1:$PORT$path" 2>/dev/null)
+        rps=$(echo "$out" | sed -n 's/.*"rps": \([0-9.]*\).*/\1/p' | head -1)
+        p50=$(echo "$out" | sed -n 's/.*"latency_us": {[^}]*"p50": \([0-9.]*\).*/\1/p' | head -1)
+        p99=$(echo "$out" | sed -n 's/.*"latency_us": {[^}]*"p99": \([0-9.]*\).*/\1/p' | head -1)
+        errors=$(echo "$out" | sed -n 's/.*"errors": {\(.*\)}.*/\1/p' | head -1 | tr -cd '0-9,' | tr ',' '\n' | awk '{s+=$1} END {print s+0}')
+        printf "%-32s %-20s %10s %9s %9s %7s\n" "$profile" "$path" "${rps:--}" "${p50:--}" "${p99:--}" "$errors"
+    done
+    kill $pid
+    wait $pid 2>/dev/null
+    # 等待端口上的连接进入TIME_WAIT之后再启动下一轮（监听套接字设置了SO_REUSEADDR）
+    sleep 0.5
+done
@@ -0,0 +1,56 @@
+#!/bin/sh
+# 不停机升级演练：启动服务器，用 loadgen 持续施压，中途向旧进程发 SIGUSR2 启动新进程，
+# 再发 SIGQUIT 让旧进程排空退出，最后输出整个过程中的吞吐量、延迟和错误数。
+# 升级过程中不应出现连接被拒绝或被重置的错误。
+#
+# 用法： ./upgrade_under_load.sh <服务器程序> [端口] [秒数]
+#   SERVER_ARGS 环境变量传给服务器的额外参数，例如 SERVER_ARGS=--coroutines=on
+#   KEEPALIVE=0 时每个请求新建连接（检验监听套接字的交接），默认 1（检验长连接的排空）
+
+SERVER=${1:?usage: $0 <server-binary> [port] [seconds]}
+PORT=${2:-9100}
+DURATION=${3:-6}
+LOADGEN=${LOADGEN:-./loadgen}
+URL_PATH=${URL_PATH:-/index.html}
+KEEPALIVE=${KEEPALIVE:-1}
+LOG=${LOG:-/tmp/upgrade_under_load.log}
+
+if [ ! -x "$LOADGEN" ]; then
+    echo "build loadgen first (make)" >&2
+    exit 1
+fi
+
+"$SERVER" $SERVER_ARGS "$PORT" > "$LOG" 2>&1 &
+old=$!
+sleep 0.5
+if ! kill -0 $old 2>/dev/null; then
+    echo "server failed to start, see $LOG" >&2
+    exit 1
+fi
+
+out=/tmp/upgrade_under_load.$$
+"$LOADGEN" -c 16 -k "$KEEPALIVE" -d "$DURATION" "http://127.0.0.1:$PORT$URL_PATH" > "$out" 2>/dev/null &
+load=$!
+
+# 施压到三分之一时升级，新进程启动后再让旧进程退出
+sleep $(( DURATION / 3 ))
+kill -USR2 $old
+sleep 1
+new=$(sed -n 's/^upgrade: started pid \([0-9]*\).*/\1/p' "$LOG" | tail -1)
+if [ -z "$new" ] || ! kill -0 "$new" 2>/dev/null; then
+    echo "new server did not start, see $LOG" >&2
+    kill $old $load 2>/dev/null
+    exit 1
+fi
+kill -QUIT $old
+wait $old
+echo "old pid $old exited with status $?, new pid $new"
+
+wait $load
+rps=$(sed -n 's/.*"rps": \([0-9.]*\).*/\1/p' "$out" | head -1)
+p99=$(sed -n 's/.*"latency_us": {[^}]*"p99": \([0-9.]*\).*/\1/p' "$out" | head -1)
+errors=$(sed -n 's/.*"errors": {\(.*\)}.*/\1/p' "$out" | head -1)
+printf "req/s %s  p99 us %s  errors {%s}\n" "${rps:--}" "${p99:--}" "$errors"
+rm -f "$out"
+
+kill -QUIT "$new"
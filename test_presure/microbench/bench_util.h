@@ -0,0 +1,92 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// 微基准测试共用的计时和内存分配计数工具
+// 只能被每个基准程序的主文件包含一次：这里替换了 malloc 系列函数
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static inline uint64_t now_ns() {
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// x86 上读 TSC（按标称频率计数的周期），其他平台退化为纳秒
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+// 每纳秒对应的周期数，用来把周期换算成时间
+static inline double cycles_per_ns() {
+    uint64_t t0 = now_ns(), c0 = read_cycles();
+    usleep( 100000 );
+    uint64_t t1 = now_ns(), c1 = read_cycles();
+    return ( double )( c1 - c0 ) / ( t1 - t0 );
+}
+
+// 内存分配计数：直接转发到 glibc 的实现，operator new 也会经过这里
+static std::atomic< uint64_t > g_alloc_count( 0 );
+
+extern "C" {
+void* __libc_malloc( size_t size );
+void* __libc_calloc( size_t n, size_t size );
+void* __libc_realloc( void* p, size_t size );
+void* __libc_memalign( size_t align, size_t size );
+void __libc_free( void* p );
+
+void* malloc( size_t size ) {
+    g_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_malloc( size );
+}
+
+void* calloc( size_t n, size_t size ) {
+    g_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_calloc( n, size );
+}
+
+void* realloc( void* p, size_t size ) {
+    g_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_realloc( p, size );
+}
+
+void* memalign( size_t align, size_t size ) {
+    g_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_memalign( align, size );
+}
+
+int posix_memalign( void** out, size_t align, size_t size ) {
+    g_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    void* p = __libc_memalign( align, size );
+    if ( !p ) {
+        return 12; // ENOMEM
+    }
+    *out = p;
+    return 0;
+}
+
+void* aligned_alloc( size_t align, size_t size ) {
+    g_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_memalign( align, size );
+}
+
+void free( void* p ) {
+    __libc_free( p );
+}
+}
+
+static inline uint64_t alloc_count() {
+    return g_alloc_count.load( std::memory_order_relaxed );
+}
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * loopback_bench: 进程内回环驱动，端到端测量 http_conn 的 read -> process -> write
+ *
+ * 传输层换成 socketpair(AF_UNIX)：服务器一端交给 http_conn::init，和真实连接一样
+ * 注册到 epoll，走 EPOLLONESHOT、modfd 重新武装、线程池这一整套流程；
+ * 客户端一端由驱动循环按样本文件的顺序回放请求。不经过TCP协议栈，
+ * 网络开销不会淹没服务器自身的开销，适合配合 perf 计数器做剖析和回归对比。
+ *
+ *   -i  内联模式：process() 直接在反应堆线程中执行，不经过线程池，
+ *       单线程、顺序确定，多次运行的响应摘要（digest）完全相同
+ *   -P  开启 perf 计数器，结束时输出各阶段的指标（同 METRICS_URL）
+ *
+ * 用法： loopback_bench [-c 连接数] [-n 请求数] [-w 工作线程数] [-i] [-P] [样本文件]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <string>
+#include <vector>
+#include "../../http_conn.h"
+#include "../../threadpool.h"
+#include "../../metrics.h"
+#include "../../perf_counter.h"
+#include "../loadgen/histogram.h"
+#include "bench_util.h"
+
+#define MAX_FD 65536
+#define MAX_EVENT_NUMBER 10000
+
+extern int setnonblocking( int fd );
+
+// 客户端一端的状态
+struct client {
+    int fd;                 // socketpair 中客户端的一端，-1 表示需要重新建立
+    int next;               // 下一个要发送的样本
+    uint64_t sent_at;
+    bool waiting;           // 已发送请求，等待响应
+    std::string in;         // 已收到但尚未解析完的响应数据
+    long body_left;
+    bool in_body;
+    bool close_after;       // 响应带有 Connection: close
+};
+
+static std::vector< std::string > requests;
+static http_conn* users = NULL;
+static threadpool< http_conn >* pool = NULL;
+static bool inline_mode = false;
+static int client_epfd = -1;
+
+// 统计
+static histogram latency;
+static uint64_t done = 0;
+static uint64_t reconnects = 0;
+static uint64_t status_class[6];
+static uint64_t digest = 1469598103934665603ull;   // FNV-1a，覆盖所有响应字节
+
+static void digest_update( const char* p, size_t n ) {
+    for ( size_t i = 0; i < n; ++i ) {
+        digest ^= ( unsigned char )p[i];
+        digest *= 1099511628211ull;
+    }
+}
+
+// 与 main.cpp 的事件循环保持一致，只是 inline 模式下直接调用 process()
+static void server_dispatch( epoll_event* events, int number ) {
+    perf_scope dispatch_scope( PERF_STAGE_DISPATCH, number > 0 ? number : 0 );
+    for ( int i = 0; i < number; ++i ) {
+        int sockfd = events[i].data.fd;
+        if ( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+            users[sockfd].close_conn();
+        } else if ( events[i].events & EPOLLIN ) {
+            if ( users[sockfd].read() ) {
+                if ( inline_mode ) {
+                    users[sockfd].process();
+                } else {
+                    int cost;
+                    int level = users[sockfd].sched_level( cost );
+                    pool->append( users + sockfd, level, users[sockfd].client_key(), cost );
+                }
+            } else {
+                users[sockfd].close_conn();
+            }
+        } else if ( events[i].events & EPOLLOUT ) {
+            if ( !users[sockfd].write() ) {
+                users[sockfd].close_conn();
+            }
+        }
+    }
+}
+
+// 建立一对套接字，服务器一端交给 http_conn，客户端一端注册到驱动自己的 epoll
+static bool client_open( client* c ) {
+    int fds[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 ) {
+        return false;
+    }
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = htons( ( unsigned short )( 10000 + fds[1] ) );
+    users[ fds[0] ].init( fds[0], addr );
+
+    c->fd = fds[1];
+    setnonblocking( c->fd );
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    epoll_ctl( client_epfd, EPOLL_CTL_ADD, c->fd, &ev );
+    c->waiting = false;
+    c->in.clear();
+    c->in_body = false;
+    c->body_left = 0;
+    c->close_after = false;
+    return true;
+}
+
+static void client_close( client* c ) {
+    epoll_ctl( client_epfd, EPOLL_CTL_DEL, c->fd, 0 );
+    close( c->fd );
+    c->fd = -1;
+}
+
+static void client_send( client* c ) {
+    const std::string& req = requests[ c->next ];
+    c->next = ( c->next + 1 ) % ( int )requests.size();
+    c->sent_at = now_ns();
+    c->waiting = true;
+    // 请求都很小，一次就能写进 socketpair 的缓冲区
+    if ( send( c->fd, req.data(), req.size(), MSG_NOSIGNAL ) != ( ssize_t )req.size() ) {
+        client_close( c );
+    }
+}
+
+// 解析缓冲区中的响应，完成一个返回 true
+static bool client_parse( client* c ) {
+    if ( !c->in_body ) {
+        size_t end = c->in.find( "\r\n\r\n" );
+        if ( end == std::string::npos ) {
+            return false;
+        }
+        int status = c->in.size() > 12 ? atoi( c->in.c_str() + 9 ) : 0;
+        int cls = status / 100;
+        status_class[ ( cls >= 1 && cls <= 5 ) ? cls : 0 ]++;
+        c->body_left = 0;
+        c->close_after = false;
+        size_t pos = c->in.find( "\r\n" ) + 2;
+        while ( pos < end ) {
+            size_t eol = c->in.find( "\r\n", pos );
+            const char* line = c->in.c_str() + pos;
+            if ( strncasecmp( line, "Content-Length:", 15 ) == 0 ) {
+                c->body_left = atol( line + 15 );
+            } else if ( strncasecmp( line, "Connection:", 11 ) == 0 && strstr( line, "close" ) ) {
+                c->close_after = true;
+            }
+            pos = eol + 2;
+        }
+        c->in.erase( 0, end + 4 );
+        c->in_body = true;
+    }
+    long take = ( long )c->in.size() < c->body_left ? ( long )c->in.size() : c->body_left;
+    c->in.erase( 0, take );
+    c->body_left -= take;
+    if ( c->body_left > 0 ) {
+        return false;
+    }
+    c->in_body = false;
+    return true;
+}
+
+// 客户端可读：收响应，完成后发送下一个请求
+static void client_event( client* c, uint32_t events, uint64_t total ) {
+    char buf[ 65536 ];
+    bool eof = false;
+    while ( true ) {
+        ssize_t n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if ( n > 0 ) {
+            digest_update( buf, n );
+            c->in.append( buf, n );
+            continue;
+        }
+        if ( n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) {
+            eof = true;
+        }
+        break;
+    }
+    while ( c->waiting && client_parse( c ) ) {
+        latency.record( now_ns() - c->sent_at );
+        c->waiting = false;
+        done++;
+        if ( c->close_after ) {
+            eof = true;
+            break;
+        }
+        if ( done < total ) {
+            client_send( c );
+        }
+    }
+    if ( eof || ( events & ( EPOLLHUP | EPOLLERR ) ) ) {
+        // 服务器关闭了连接（非keep-alive请求或错误路径），换一对新的套接字继续
+        if ( c->waiting ) {
+            // 没有等到响应，算作一次完成，避免驱动卡住
+            c->waiting = false;
+            done++;
+        }
+        client_close( c );
+        if ( done < total && client_open( c ) ) {
+            reconnects++;
+            client_send( c );
+        }
+    }
+}
+
+static bool load_corpus( const char* file ) {
+    FILE* fp = fopen( file, "r" );
+    if ( !fp ) {
+        fprintf( stderr, "cannot open corpus %s\n", file );
+        return false;
+    }
+    char line[ 4096 ];
+    std::string cur;
+    bool in_sample = false;
+    while ( fgets( line, sizeof( line ), fp ) ) {
+        if ( strncmp( line, "### ", 4 ) == 0 ) {
+            if ( in_sample && !cur.empty() ) {
+                requests.push_back( cur );
+            }
+            cur.clear();
+            in_sample = true;
+            continue;
+        }
+        if ( !in_sample ) {
+            continue;
+        }
+        size_t len = strcspn( line, "\r\n" );
+        if ( len == 0 && !cur.empty() && cur.size() >= 4 && cur.compare( cur.size() - 4, 4, "\r\n\r\n" ) == 0 ) {
+            continue;   // 样本之间多余的空行
+        }
+        cur.append( line, len );
+        cur += "\r\n";
+    }
+    if ( in_sample && !cur.empty() ) {
+        requests.push_back( cur );
+    }
+    fclose( fp );
+    return !requests.empty();
+}
+
+int main( int argc, char* argv[] ) {
+    int connections = 64;
+    uint64_t total = 100000;
+    int workers = 8;
+    const char* corpus = "corpus.txt";
+    bool perf = false;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "c:n:w:iPh" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'c': connections = atoi( optarg ); break;
+            case 'n': total = strtoull( optarg, NULL, 10 ); break;
+            case 'w': workers = atoi( optarg ); break;
+            case 'i': inline_mode = true; break;
+            case 'P': perf = true; break;
+            default:
+                fprintf( stderr, "usage: %s [-c connections] [-n requests] [-w workers] [-i] [-P] [corpus]\n", argv[0] );
+                return 2;
+        }
+    }
+    if ( optind < argc ) {
+        corpus = argv[ optind ];
+    }
+    if ( connections <= 0 || total == 0 || workers <= 0 || !load_corpus( corpus ) ) {
+        return 2;
+    }
+
+    // 服务器打印的解析日志丢掉，结果写到原来的标准输出
+    FILE* report = fdopen( dup( STDOUT_FILENO ), "w" );
+    if ( !freopen( "/dev/null", "w", stdout ) ) {
+        return 1;
+    }
+    signal( SIGPIPE, SIG_IGN );
+    if ( perf && !perf_counter_enable() ) {
+        fprintf( report, "perf counters unavailable\n" );
+    }
+
+    if ( !inline_mode ) {
+        try {
+            pool = new threadpool< http_conn >( workers );
+        } catch ( ... ) {
+            return 1;
+        }
+    }
+    users = new http_conn[ MAX_FD ];
+    int epollfd = epoll_create( 5 );
+    http_conn::m_epollfd = epollfd;
+    client_epfd = epoll_create( 5 );
+
+    std::vector< client > clients( connections );
+    for ( int i = 0; i < connections; ++i ) {
+        clients[i].next = i % ( int )requests.size();
+        if ( !client_open( &clients[i] ) ) {
+            fprintf( stderr, "socketpair failed: %s\n", strerror( errno ) );
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    uint64_t a0 = alloc_count();
+    uint64_t sent = 0;
+    for ( int i = 0; i < connections && sent < total; ++i, ++sent ) {
+        client_send( &clients[i] );
+    }
+
+    epoll_event events[ MAX_EVENT_NUMBER ];
+    epoll_event cevents[ 1024 ];
+    while ( done < total ) {
+        // 先处理服务器一侧，再处理客户端一侧；inline 模式下两边都在这一个线程里
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, 0 );
+        if ( number < 0 && errno != EINTR ) {
+            fprintf( stderr, "epoll failure\n" );
+            return 1;
+        }
+        server_dispatch( events, number );
+        int cn = epoll_wait( client_epfd, cevents, 1024, number > 0 || inline_mode ? 0 : 1 );
+        for ( int i = 0; i < cn; ++i ) {
+            client_event( ( client* )cevents[i].data.ptr, cevents[i].events, total );
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint64_t allocs = alloc_count() - a0;
+
+    fprintf( report, "mode: %s, connections: %d, requests: %llu, corpus samples: %zu\n",
+             inline_mode ? "inline" : "threadpool", connections, ( unsigned long long )done, requests.size() );
+    fprintf( report, "elapsed: %.3f s, %.0f req/s, %.0f ns/req, %.2f allocs/req\n", elapsed / 1e9,
+             done / ( elapsed / 1e9 ), ( double )elapsed / done, ( double )allocs / done );
+    fprintf( report, "latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+             latency.percentile( 50 ) / 1e3, latency.percentile( 90 ) / 1e3, latency.percentile( 99 ) / 1e3,
+             latency.percentile( 99.9 ) / 1e3, latency.max() / 1e3 );
+    fprintf( report, "status: 2xx %llu, 4xx %llu, 5xx %llu, other %llu, reconnects %llu\n",
+             ( unsigned long long )status_class[2], ( unsigned long long )status_class[4],
+             ( unsigned long long )status_class[5], ( unsigned long long )( status_class[0] + status_class[1] + status_class[3] ),
+             ( unsigned long long )reconnects );
+    fprintf( report, "digest: %016llx\n", ( unsigned long long )digest );
+    if ( perf_counter_on ) {
+        std::string out;
+        metrics_render( out );
+        fprintf( report, "\n%s", out.c_str() );
+    }
+    fclose( report );
+    return 0;
+}
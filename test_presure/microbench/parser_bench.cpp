@@ -0,0 +1,212 @@
+/*
+ * parser_bench: HTTP解析器和响应头组装的微基准测试
+ *
+ * 不经过socket：把请求样本直接拷贝进 http_conn 的读缓冲区（内存传输），
+ * 分别测量 process_read（parse_line / parse_request_line / parse_headers）
+ * 和 process_write（响应头组装）。每项输出 ns/请求、周期/请求、字节/周期、分配次数/请求。
+ *
+ * 用法： parser_bench [-n 迭代次数] [样本文件]
+ * 注意：解析器会向标准输出打印每一行，这里把标准输出重定向到 /dev/null，
+ *      打印本身的开销计入结果，结果写到原来的标准输出。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../../http_conn.h"
+#include "bench_util.h"
+
+// http_conn 的友元，直接操作内部缓冲区
+class http_conn_bench {
+public:
+    // 相当于一次 read()：复位连接状态，再把请求放进读缓冲区
+    static bool load( http_conn& c, const std::string& req ) {
+        c.alloc_buffers();
+        c.init();
+        if ( req.size() > ( size_t )http_conn::m_read_buffer_size ) {
+            return false;
+        }
+        memcpy( c.m_read_buf, req.data(), req.size() );
+        c.m_read_idx = ( int )req.size();
+        return true;
+    }
+
+    static http_conn::HTTP_CODE parse( http_conn& c ) {
+        return c.process_read();
+    }
+
+    // 准备组装响应：清空写缓冲区，文件请求使用一个假的映射地址
+    static void prepare_write( http_conn& c, off_t file_size, bool linger ) {
+        static char dummy_file[1];
+        c.m_write_idx = 0;
+        c.m_linger = linger;
+        c.m_file_stat.st_size = file_size;
+        c.m_file_address = dummy_file;
+    }
+
+    static bool respond( http_conn& c, http_conn::HTTP_CODE code ) {
+        return c.process_write( code );
+    }
+
+    static int written( const http_conn& c ) {
+        return c.m_write_idx;
+    }
+};
+
+struct sample {
+    std::string name;
+    std::string request;
+};
+
+// 读取样本文件，换行统一转换为 \r\n
+static bool load_corpus( const char* file, std::vector< sample >& out ) {
+    FILE* fp = fopen( file, "r" );
+    if ( !fp ) {
+        fprintf( stderr, "cannot open corpus %s\n", file );
+        return false;
+    }
+    char line[ 4096 ];
+    sample* cur = NULL;
+    while ( fgets( line, sizeof( line ), fp ) ) {
+        if ( strncmp( line, "### ", 4 ) == 0 ) {
+            sample s;
+            s.name = line + 4;
+            s.name.erase( s.name.find_last_not_of( "\r\n" ) + 1 );
+            out.push_back( s );
+            cur = &out.back();
+            continue;
+        }
+        if ( !cur ) {
+            continue; // 第一个样本之前的注释
+        }
+        size_t len = strcspn( line, "\r\n" );
+        cur->request.append( line, len );
+        cur->request += "\r\n";
+    }
+    fclose( fp );
+    // 每个样本只保留到第一个空行（含），去掉样本之间多余的空行
+    for ( size_t i = 0; i < out.size(); ++i ) {
+        size_t end = out[i].request.find( "\r\n\r\n" );
+        if ( end != std::string::npos ) {
+            out[i].request.erase( end + 4 );
+        }
+    }
+    return !out.empty();
+}
+
+static const char* code_name( http_conn::HTTP_CODE code ) {
+    switch ( code ) {
+        case http_conn::NO_REQUEST: return "NO_REQUEST";
+        case http_conn::GET_REQUEST: return "GET_REQUEST";
+        case http_conn::BAD_REQUEST: return "BAD_REQUEST";
+        case http_conn::NO_RESOURCE: return "NO_RESOURCE";
+        case http_conn::FORBIDDEN_REQUEST: return "FORBIDDEN_REQUEST";
+        case http_conn::FILE_REQUEST: return "FILE_REQUEST";
+        case http_conn::DYNAMIC_REQUEST: return "DYNAMIC_REQUEST";
+        case http_conn::BUNDLE_REQUEST: return "BUNDLE_REQUEST";
+        case http_conn::NOT_MODIFIED: return "NOT_MODIFIED";
+        case http_conn::PROXY_DONE: return "PROXY_DONE";
+        case http_conn::BAD_GATEWAY: return "BAD_GATEWAY";
+        case http_conn::GATEWAY_TIMEOUT: return "GATEWAY_TIMEOUT";
+        case http_conn::SERVICE_UNAVAILABLE: return "SERVICE_UNAVAILABLE";
+        case http_conn::CACHE_HIT: return "CACHE_HIT";
+        case http_conn::TOO_MANY_REQUESTS: return "TOO_MANY_REQUESTS";
+        case http_conn::WEBSOCKET_UPGRADE: return "WEBSOCKET_UPGRADE";
+        case http_conn::INTERNAL_ERROR: return "INTERNAL_ERROR";
+        case http_conn::CLOSED_CONNECTION: return "CLOSED_CONNECTION";
+    }
+    return "?";
+}
+
+static FILE* report = NULL;
+static double cpn = 1.0;
+
+static void print_row( const char* name, int bytes, uint64_t cycles, uint64_t allocs, int iters, const char* result ) {
+    double cyc = ( double )cycles / iters;
+    fprintf( report, "%-24s %7d %10.1f %12.1f %12.3f %11.2f  %s\n", name, bytes, cyc / cpn, cyc,
+             cyc > 0 ? bytes / cyc : 0.0, ( double )allocs / iters, result );
+}
+
+int main( int argc, char* argv[] ) {
+    int iters = 200000;
+    const char* corpus = "corpus.txt";
+    int opt;
+    while ( ( opt = getopt( argc, argv, "n:h" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'n': iters = atoi( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-n iterations] [corpus]\n", argv[0] );
+                return 2;
+        }
+    }
+    if ( optind < argc ) {
+        corpus = argv[ optind ];
+    }
+    if ( iters <= 0 ) {
+        return 2;
+    }
+    std::vector< sample > samples;
+    if ( !load_corpus( corpus, samples ) ) {
+        return 1;
+    }
+
+    // 结果写到原来的标准输出，解析器自己的打印丢掉
+    report = fdopen( dup( STDOUT_FILENO ), "w" );
+    if ( !freopen( "/dev/null", "w", stdout ) ) {
+        return 1;
+    }
+    cpn = cycles_per_ns();
+
+    static http_conn conn;
+    fprintf( report, "iterations: %d, cycles/ns: %.3f\n\n", iters, cpn );
+    fprintf( report, "%-24s %7s %10s %12s %12s %11s  %s\n", "parse (process_read)", "bytes", "ns/req",
+             "cycles/req", "bytes/cycle", "allocs/req", "result" );
+    for ( size_t i = 0; i < samples.size(); ++i ) {
+        const sample& s = samples[i];
+        uint64_t cycles = 0;
+        http_conn::HTTP_CODE ret = http_conn::NO_REQUEST;
+        uint64_t a0 = alloc_count();
+        for ( int k = 0; k < iters; ++k ) {
+            if ( !http_conn_bench::load( conn, s.request ) ) {
+                break;
+            }
+            uint64_t c0 = read_cycles();
+            ret = http_conn_bench::parse( conn );
+            cycles += read_cycles() - c0;
+        }
+        print_row( s.name.c_str(), ( int )s.request.size(), cycles, alloc_count() - a0, iters, code_name( ret ) );
+    }
+
+    // 响应头组装：文件响应分别取首页和图片的大小，外加各种错误页
+    struct response_case {
+        const char* name;
+        http_conn::HTTP_CODE code;
+        off_t size;
+    } cases[] = {
+        { "200 index.html", http_conn::FILE_REQUEST, 437 },
+        { "200 image1.jpg", http_conn::FILE_REQUEST, 67313 },
+        { "400 bad request", http_conn::BAD_REQUEST, 0 },
+        { "403 forbidden", http_conn::FORBIDDEN_REQUEST, 0 },
+        { "404 not found", http_conn::NO_RESOURCE, 0 },
+        { "500 internal error", http_conn::INTERNAL_ERROR, 0 },
+    };
+    fprintf( report, "\n%-24s %7s %10s %12s %12s %11s  %s\n", "response (process_write)", "bytes", "ns/req",
+             "cycles/req", "bytes/cycle", "allocs/req", "result" );
+    for ( size_t i = 0; i < sizeof( cases ) / sizeof( cases[0] ); ++i ) {
+        uint64_t cycles = 0;
+        bool ok = false;
+        uint64_t a0 = alloc_count();
+        for ( int k = 0; k < iters; ++k ) {
+            http_conn_bench::prepare_write( conn, cases[i].size, true );
+            uint64_t c0 = read_cycles();
+            ok = http_conn_bench::respond( conn, cases[i].code );
+            cycles += read_cycles() - c0;
+        }
+        print_row( cases[i].name, http_conn_bench::written( conn ), cycles, alloc_count() - a0, iters,
+                   ok ? "ok" : "failed" );
+    }
+    fclose( report );
+    return 0;
+}
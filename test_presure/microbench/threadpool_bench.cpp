@@ -0,0 +1,266 @@
+/*
+ * threadpool_bench: 线程池调度的微基准测试
+ *
+ * 用若干生产者线程向 threadpool<T> 投递代价可配置的合成任务，测量：
+ *   - 吞吐量（任务/秒）
+ *   - 唤醒延迟分布：append() 入队到工作线程开始执行 process() 的时间
+ *   - 每个任务的上下文切换次数（getrusage）
+ * 修改队列或唤醒机制（目前是互斥锁+信号量）之后，用同样的参数对比前后结果。
+ *
+ * 每组参数在一个 fork 出来的子进程里运行，互不影响各自的直方图和 rusage。
+ * -m 指定线程数上限时线程池按排队时间伸缩（-w 为常驻线程数），threads 列为结束时的线程数。
+ * -H 指定重任务的百分比时，重任务的代价是普通任务的 50 倍（至少 50us），成批出现（每 400 个任务
+ * 中连续的 4*H 个），按最贵的级别入队，普通任务按最便宜的级别入队，每个生产者当作一个客户端；
+ * 延迟只统计普通任务，用来观察分级调度（见 fair_queue.h）对小请求尾延迟的保护，
+ * -F 0 关闭分级，全部先进先出。-r 限制投递速率（任务/秒），不限速时队列总是满的，
+ * 排队时间只取决于队列上限。
+ *
+ * 用法： threadpool_bench [-w 1,2,4,8] [-P 1,2,4] [-n 任务数] [-c 任务代价ns] [-q 队列上限]
+ *                        [-m 线程数上限] [-s 新建线程的排队时间us] [-H 重任务百分比] [-F 0|1] [-r 速率]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <vector>
+#include "../../threadpool.h"
+#include "../loadgen/histogram.h"
+#include "bench_util.h"
+
+// 合成任务：记录唤醒延迟，然后空转指定的时间
+class bench_task {
+public:
+    void process();
+
+    uint64_t enqueued_at;
+    uint64_t cost_ns;
+    bool heavy;
+};
+
+static std::atomic< uint64_t > g_done( 0 );
+static locker g_hist_lock;
+static std::vector< histogram* > g_hists;   // 每个工作线程一个直方图
+static __thread histogram* t_hist = NULL;
+
+void bench_task::process() {
+    uint64_t start = now_ns();
+    if ( !t_hist ) {
+        t_hist = new histogram;
+        g_hist_lock.lock();
+        g_hists.push_back( t_hist );
+        g_hist_lock.unlock();
+    }
+    if ( !heavy ) {
+        t_hist->record( start - enqueued_at );
+    }
+    while ( now_ns() - start < cost_ns ) {
+        // 模拟任务的计算量
+    }
+    g_done.fetch_add( 1, std::memory_order_release );
+}
+
+struct producer_arg {
+    threadpool< bench_task >* pool;
+    unsigned key;       // 公平调度的客户端，0 表示不分级
+    uint64_t interval_ns;   // 两次投递的间隔，0 表示不限速
+    bench_task* tasks;
+    int count;
+    uint64_t rejected;  // 队列满被拒绝的次数
+};
+
+static void* producer( void* arg ) {
+    producer_arg* p = ( producer_arg* )arg;
+    uint64_t next = now_ns();
+    for ( int i = 0; i < p->count; ++i ) {
+        bench_task* t = p->tasks + i;
+        if ( p->interval_ns ) {
+            while ( now_ns() < next ) {
+                // 按固定间隔投递
+            }
+            next += p->interval_ns;
+        }
+        t->enqueued_at = now_ns();
+        int level = 0, cost = 1;
+        if ( p->key && t->heavy ) {
+            level = fair_queue< bench_task >::LEVELS - 1;
+            cost = fair_queue< bench_task >::QUANTUM;
+        }
+        while ( !p->pool->append( t, level, p->key, cost ) ) {
+            p->rejected++;
+            sched_yield();
+            t->enqueued_at = now_ns();
+        }
+    }
+    return NULL;
+}
+
+// 一组参数的结果，由子进程通过管道传回
+struct result {
+    double throughput;
+    double p50, p90, p99, p999, max;   // 微秒
+    double csw_per_task;
+    uint64_t rejected;
+    int threads;        // 结束时的线程数
+    bool ok;
+};
+
+static result run_case( int workers, int producers, int tasks, uint64_t cost_ns, int max_requests, int max_workers,
+                        int spawn_us, int heavy_pct, bool fair, int rate ) {
+    result r;
+    memset( &r, 0, sizeof( r ) );
+    threadpool< bench_task >* pool = NULL;
+    try {
+        pool = new threadpool< bench_task >( workers, max_requests, NULL, NULL, max_workers, spawn_us );
+    } catch ( ... ) {
+        return r;
+    }
+    std::vector< bench_task > all( tasks );
+    uint64_t heavy_ns = cost_ns * 50 > 50000 ? cost_ns * 50 : 50000;
+    for ( int i = 0; i < tasks; ++i ) {
+        // 重任务成批出现，每次运行的分布相同
+        all[i].heavy = i % 400 < 4 * heavy_pct;
+        all[i].cost_ns = all[i].heavy ? heavy_ns : cost_ns;
+    }
+    std::vector< producer_arg > args( producers );
+    std::vector< pthread_t > tids( producers );
+
+    rusage ru0, ru1;
+    getrusage( RUSAGE_SELF, &ru0 );
+    uint64_t start = now_ns();
+    int offset = 0;
+    for ( int i = 0; i < producers; ++i ) {
+        args[i].pool = pool;
+        args[i].key = fair ? i + 1 : 0;
+        args[i].interval_ns = rate > 0 ? ( uint64_t )1e9 * producers / rate : 0;
+        args[i].tasks = &all[ offset ];
+        args[i].count = tasks / producers + ( i < tasks % producers ? 1 : 0 );
+        args[i].rejected = 0;
+        offset += args[i].count;
+        pthread_create( &tids[i], NULL, producer, &args[i] );
+    }
+    for ( int i = 0; i < producers; ++i ) {
+        pthread_join( tids[i], NULL );
+        r.rejected += args[i].rejected;
+    }
+    while ( g_done.load( std::memory_order_acquire ) < ( uint64_t )tasks ) {
+        usleep( 100 );
+    }
+    uint64_t elapsed = now_ns() - start;
+    getrusage( RUSAGE_SELF, &ru1 );
+
+    histogram total;
+    g_hist_lock.lock();
+    for ( size_t i = 0; i < g_hists.size(); ++i ) {
+        total.merge( *g_hists[i] );
+    }
+    g_hist_lock.unlock();
+    r.throughput = tasks / ( elapsed / 1e9 );
+    r.p50 = total.percentile( 50 ) / 1e3;
+    r.p90 = total.percentile( 90 ) / 1e3;
+    r.p99 = total.percentile( 99 ) / 1e3;
+    r.p999 = total.percentile( 99.9 ) / 1e3;
+    r.max = total.max() / 1e3;
+    long csw = ( ru1.ru_nvcsw - ru0.ru_nvcsw ) + ( ru1.ru_nivcsw - ru0.ru_nivcsw );
+    r.csw_per_task = ( double )csw / tasks;
+    r.threads = pool->threads();
+    r.ok = true;
+    delete pool;
+    return r;
+}
+
+static std::vector< int > parse_list( const char* s ) {
+    std::vector< int > v;
+    while ( *s ) {
+        int n = atoi( s );
+        if ( n > 0 ) {
+            v.push_back( n );
+        }
+        s += strcspn( s, "," );
+        if ( *s == ',' ) {
+            ++s;
+        }
+    }
+    return v;
+}
+
+int main( int argc, char* argv[] ) {
+    std::vector< int > worker_counts = parse_list( "1,2,4,8" );
+    std::vector< int > producer_counts = parse_list( "1,2,4" );
+    int tasks = 200000;
+    uint64_t cost_ns = 0;
+    int max_requests = 10000;
+    int max_workers = 0;
+    int spawn_us = 1000;
+    int heavy_pct = 0;
+    bool fair = true;
+    int rate = 0;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "w:P:n:c:q:m:s:H:F:r:h" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'w': worker_counts = parse_list( optarg ); break;
+            case 'P': producer_counts = parse_list( optarg ); break;
+            case 'n': tasks = atoi( optarg ); break;
+            case 'c': cost_ns = strtoull( optarg, NULL, 10 ); break;
+            case 'q': max_requests = atoi( optarg ); break;
+            case 'm': max_workers = atoi( optarg ); break;
+            case 's': spawn_us = atoi( optarg ); break;
+            case 'H': heavy_pct = atoi( optarg ); break;
+            case 'F': fair = atoi( optarg ) != 0; break;
+            case 'r': rate = atoi( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-w workers,...] [-P producers,...] [-n tasks] [-c cost_ns] [-q max_requests] "
+                         "[-m max_workers] [-s spawn_us] [-H heavy_percent] [-F 0|1] [-r tasks_per_sec]\n",
+                         argv[0] );
+                return 2;
+        }
+    }
+    if ( tasks <= 0 || worker_counts.empty() || producer_counts.empty() ) {
+        return 2;
+    }
+
+    printf( "tasks: %d, task cost: %llu ns, queue limit: %d, heavy tasks: %d%%, fair: %s, rate: %d/s\n\n", tasks,
+            ( unsigned long long )cost_ns, max_requests, heavy_pct, fair ? "on" : "off", rate );
+    printf( "%7s %9s %13s %9s %9s %9s %9s %10s %9s %9s %7s\n", "workers", "producers", "tasks/s",
+            "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "csw/task", "rejected", "threads" );
+    fflush( stdout );
+    for ( size_t i = 0; i < worker_counts.size(); ++i ) {
+        for ( size_t j = 0; j < producer_counts.size(); ++j ) {
+            int fds[2];
+            if ( pipe( fds ) != 0 ) {
+                return 1;
+            }
+            pid_t pid = fork();
+            if ( pid == 0 ) {
+                close( fds[0] );
+                // 线程池创建线程时会打印，丢掉
+                if ( !freopen( "/dev/null", "w", stdout ) ) {
+                    _exit( 1 );
+                }
+                result r = run_case( worker_counts[i], producer_counts[j], tasks, cost_ns, max_requests, max_workers,
+                                    spawn_us, heavy_pct, fair, rate );
+                ssize_t n = write( fds[1], &r, sizeof( r ) );
+                _exit( n == sizeof( r ) ? 0 : 1 );
+            }
+            close( fds[1] );
+            result r;
+            memset( &r, 0, sizeof( r ) );
+            ssize_t n = read( fds[0], &r, sizeof( r ) );
+            close( fds[0] );
+            waitpid( pid, NULL, 0 );
+            if ( n != sizeof( r ) || !r.ok ) {
+                printf( "%7d %9d  failed\n", worker_counts[i], producer_counts[j] );
+                continue;
+            }
+            printf( "%7d %9d %13.0f %9.1f %9.1f %9.1f %9.1f %10.1f %9.3f %9llu %7d\n", worker_counts[i],
+                    producer_counts[j], r.throughput, r.p50, r.p90, r.p99, r.p999, r.max, r.csw_per_task,
+                    ( unsigned long long )r.rejected, r.threads );
+            fflush( stdout );
+        }
+    }
+    return 0;
+}
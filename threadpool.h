@@ -3,40 +3,74 @@
 
 #include <pthread.h>
 #include <list>
+#include <vector>
 #include <exception>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
 #include "locker.h"
+#include "fair_queue.h"
 // 线程池类，定义成模板类是为了代码的复用，
 // 模板参数T是任务类
 template<typename T>
 class threadpool {
 public:
     // 初始化函数，默认指定线程池中线程的数量8。
-    // 线程池中线程的数量是服务器启动之初就创建好的
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    // thread_number 个线程在服务器启动之初就创建好，一直常驻
+    // thread_init 在每个工作线程开始取任务之前调用，参数为线程序号和 init_arg，用来绑定CPU等
+    // max_threads 大于 thread_number 时线程池可以伸缩：队首的请求等待超过 spawn_delay_us 微秒
+    // 并且没有空闲线程时新建一个线程（每 spawn_delay_us 最多一个）；
+    // 多出来的线程空闲 idle_ms 毫秒后退出，线程数不少于 thread_number
+    threadpool(int thread_number = 8, int max_requests = 10000,
+               void (*thread_init)(int index, void* arg) = NULL, void* init_arg = NULL,
+               int max_threads = 0, int spawn_delay_us = 1000, int idle_ms = 30000);
+    // 等待队列中的请求处理完，所有线程退出后返回，调用时不能再有 append
     ~threadpool();
-    bool append(T* request);
+    // level 为预计代价的级别（0 最便宜），key 为客户端，cost 为请求的相对代价，排队规则见 fair_queue.h
+    bool append(T* request, int level = 0, unsigned key = 0, int cost = 1);
+
+    // 运行状态，用于输出指标
+    int threads();
+    int idle() const { return m_idle.load( std::memory_order_relaxed ); }
+    size_t queued();
+    size_t queued(int level);
+    unsigned long spawned() const { return m_spawned.load( std::memory_order_relaxed ); }
+    unsigned long retired() const { return m_retired.load( std::memory_order_relaxed ); }
 
 private:
     // 子线程运行逻辑代码;注意要加上static
     static void * worker (void * arg);
     // 线程池运行
     void run();
+    // 新建一个线程，调用时不持有 m_queuelocker：pthread_create 要 clone 和映射栈，不能挡住取请求的线程。
+    // 调用前在锁内把 m_spawning 加一，创建后再加锁记下线程
+    bool spawn();
+    // 通知所有线程退出并 join
+    void shutdown();
+    static uint64_t now_ns();
 private:
-    // 线程的数量
+    // 常驻线程的数量
     int m_thread_number;
+    // 线程数的上限，等于 m_thread_number 时线程池不伸缩
+    int m_max_threads;
+    int m_spawn_delay_us;
+    int m_idle_ms;
 
-    // 线程池数组，大小为m_thread_number
-    // 动态创建
-    pthread_t * m_threads;
+    // 正在运行的线程；空闲退出的线程移到 m_exited，等待 join
+    std::list<pthread_t> m_threads;
+    std::vector<pthread_t> m_exited;
+    // 已经决定新建、还没有记到 m_threads 中的线程数，也算在线程数上限内
+    int m_spawning;
 
     // 请求队列中最多允许的，等待处理的请求数量
     int m_max_requests;
 
-    // 请求队列，待处理的任务
-    std::list<T*> m_workqueue;
+    // 请求队列，待处理的任务和入队时间（线程池不伸缩时不取时间，为0）
+    typedef typename fair_queue<T>::entry entry;
+    fair_queue<T> m_workqueue;
 
-    // 互斥锁
+    // 互斥锁，同时保护 m_threads、m_exited、m_spawning 和 m_stop
     locker m_queuelocker;
 
     // 信号量用来判断是否有任务需要处理
@@ -45,33 +79,42 @@ private:
     // 是否结束线程
     bool m_stop;
 
+    // 工作线程的初始化回调
+    void (*m_thread_init)(int index, void* arg);
+    void* m_init_arg;
+    std::atomic< int > m_started;
+
+    // 上一次新建线程的时间，上一次取出请求的时间和那个请求的排队时间
+    uint64_t m_last_spawn_ns;
+    uint64_t m_last_dequeue_ns;
+    uint64_t m_last_sojourn_ns;
+    // 等待任务的线程数
+    std::atomic< int > m_idle;
+    std::atomic< unsigned long > m_spawned;
+    std::atomic< unsigned long > m_retired;
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) :
-    m_thread_number(thread_number), m_max_requests(max_requests),
-    m_stop(false), m_threads(NULL) {
+threadpool<T>::threadpool(int thread_number, int max_requests,
+                          void (*thread_init)(int index, void* arg), void* init_arg,
+                          int max_threads, int spawn_delay_us, int idle_ms) :
+    m_thread_number(thread_number), m_max_threads(max_threads > thread_number ? max_threads : thread_number),
+    m_spawn_delay_us(spawn_delay_us), m_idle_ms(idle_ms), m_spawning(0), m_max_requests(max_requests),
+    m_stop(false), m_thread_init(thread_init), m_init_arg(init_arg), m_started(0),
+    m_last_spawn_ns(0), m_last_dequeue_ns(0), m_last_sojourn_ns(0), m_idle(0), m_spawned(0), m_retired(0) {
 
-        if((thread_number) <= 0 || (max_requests <= 0)) {
+        if((thread_number) <= 0 || (max_requests <= 0) || (idle_ms <= 0) || (spawn_delay_us < 0)) {
             throw std::exception();
         }
 
-        m_threads = new pthread_t[m_thread_number]; // 动态创建线程池
-        if(!m_threads) {
-            throw std::exception();
-        }
-        // 创建thread_number个线程，并将它们设置为线程脱离
+        // 创建thread_number个常驻线程，线程是可join的，析构时等待它们退出
+        m_spawning = thread_number;
         for (int i = 0; i < thread_number; ++i) {
             printf("create the %dth thread\n", i);
 
             // worker为静态函数，不可直接访问动态资源，通过参数this来使用动态资源
-            if(pthread_create(m_threads + i, NULL , worker, this) != 0) {
-                delete [] m_threads;
-                throw std::exception();
-            }
-            
-            if(pthread_detach(m_threads[i])) {
-                delete[] m_threads;
+            if (!spawn()) {
+                shutdown();
                 throw std::exception();
             }
         }
@@ -79,57 +122,184 @@ threadpool<T>::threadpool(int thread_number, int max_requests) :
 
 template<typename T>
 threadpool<T>::~threadpool() {
-    // 析构 释放线程池，结束主线程
-    delete[] m_threads;
+    // 析构 通知所有线程退出，每个线程处理完队列中剩余的请求后退出
+    shutdown();
+}
+
+template<typename T>
+void threadpool<T>::shutdown() {
+    m_queuelocker.lock();
     m_stop = true;
+    size_t running = m_threads.size();
+    m_queuelocker.unlock();
+    for (size_t i = 0; i < running; ++i) {
+        m_queuestat.post();
+    }
+    // 停止之后线程不会再移动到 m_exited，两个列表都不会再变
+    for (typename std::list<pthread_t>::iterator it = m_threads.begin(); it != m_threads.end(); ++it) {
+        pthread_join(*it, NULL);
+    }
+    for (size_t i = 0; i < m_exited.size(); ++i) {
+        pthread_join(m_exited[i], NULL);
+    }
+    m_threads.clear();
+    m_exited.clear();
 }
 
 template<typename T>
-bool threadpool<T>::append(T * request) {
+uint64_t threadpool<T>::now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+template<typename T>
+bool threadpool<T>::spawn() {
+    pthread_t tid;
+    bool created = pthread_create(&tid, NULL, worker, this) == 0;
+    m_queuelocker.lock();
+    if (created) {
+        m_threads.push_back(tid);
+    }
+    m_spawning--;
+    m_queuelocker.unlock();
+    if (created) {
+        m_spawned++;
+    }
+    return created;
+}
+
+template<typename T>
+bool threadpool<T>::append(T * request, int level, unsigned key, int cost) {
     // 在请求队列中追加事件
+    entry e = { request, m_max_threads > m_thread_number ? now_ns() : 0, cost };
 
     // 首先，对请求队列上锁
     m_queuelocker.lock();
     // 若请求队列中请求的大小超出设置的最大请求数量，解锁并返回，不能加入到工作队列中，直接舍弃
-    if (m_workqueue.size() >= m_max_requests) {
+    if (m_workqueue.size() >= (size_t)m_max_requests) {
         m_queuelocker.unlock();
         return false;
     }
 
     // 工作队列未满，可将请求加入工作队列中
-    m_workqueue.push_back(request);
+    m_workqueue.push(e, level, key);
+
+    // 刚取出的请求排队太久，或者队列里有请求却很久没有线程来取，说明现有线程都阻塞在处理中
+    // （例如冷文件的缺页），再开一个线程
+    // 在锁内决定，解锁后再创建线程
+    uint64_t delay = (uint64_t)m_spawn_delay_us * 1000;
+    bool grow = false;
+    if (e.enqueued_ns && (int)m_threads.size() + m_spawning < m_max_threads && m_idle.load() == 0 &&
+        (m_last_sojourn_ns >= delay || e.enqueued_ns - m_last_dequeue_ns >= delay) &&
+        e.enqueued_ns - m_last_spawn_ns >= delay) {
+        m_last_spawn_ns = e.enqueued_ns;
+        m_spawning++;
+        grow = true;
+    }
+    // 回收空闲退出的线程
+    std::vector<pthread_t> exited;
+    if (!m_exited.empty()) {
+        exited.swap(m_exited);
+    }
     m_queuelocker.unlock();
     m_queuestat.post(); // 请求+1，信号量增加，待处理的线程增多，线程取数据的时候，根据信号量判断线程是阻塞还是继续执行，信号量用于同步
+    if (grow) {
+        spawn();
+    }
+    for (size_t i = 0; i < exited.size(); ++i) {
+        pthread_join(exited[i], NULL);
+    }
     return true;
 }
 
+template<typename T>
+int threadpool<T>::threads() {
+    m_queuelocker.lock();
+    int n = (int)m_threads.size();
+    m_queuelocker.unlock();
+    return n;
+}
+
+template<typename T>
+size_t threadpool<T>::queued() {
+    m_queuelocker.lock();
+    size_t n = m_workqueue.size();
+    m_queuelocker.unlock();
+    return n;
+}
+
+template<typename T>
+size_t threadpool<T>::queued(int level) {
+    m_queuelocker.lock();
+    size_t n = m_workqueue.size(level);
+    m_queuelocker.unlock();
+    return n;
+}
+
 template<typename T>
 void * threadpool<T>::worker(void * arg) {
     // 工作线程调用函数
     threadpool * pool = (threadpool *) arg;
+    int index = pool->m_started.fetch_add( 1 );
+    if ( pool->m_thread_init ) {
+        pool->m_thread_init( index, pool->m_init_arg );
+    }
     pool->run();
     return pool;
 }
 
 template<typename T>
 void threadpool<T>::run() {
-    while(!m_stop) {
+    bool elastic = m_max_threads > m_thread_number;
+    while (true) {
          // 有数据/资源处理的时候，线程才不会阻塞
-         // 否则线程阻塞在wait处
-         m_queuestat.wait();
-        // 继续执行，代表有资源待处理
+         // 否则线程阻塞在wait处；可伸缩的线程池最多等待 m_idle_ms
+         m_idle++;
+         bool woken = elastic ? m_queuestat.timedwait(m_idle_ms) : m_queuestat.wait();
+         m_idle--;
         // 上锁
         m_queuelocker.lock();
+        if (!woken) {
+            // 空闲超时，线程数多于常驻线程数时退出，由 append 或析构函数 join。
+            // 刚创建、还没有被 spawn 记下的线程不退出，等下一次超时
+            if (!m_stop && (int)m_threads.size() > m_thread_number) {
+                pthread_t self = pthread_self();
+                for (typename std::list<pthread_t>::iterator it = m_threads.begin(); it != m_threads.end(); ++it) {
+                    if (pthread_equal(*it, self)) {
+                        m_threads.erase(it);
+                        m_exited.push_back(self);
+                        m_retired++;
+                        m_queuelocker.unlock();
+                        return;
+                    }
+                }
+            }
+            m_queuelocker.unlock();
+            continue;
+        }
         // 信号量不是随着请求资源的增加而增加嘛？？为什么信号量非空时，请求队列为空呢？？
+        // 析构时额外 post 的信号量用来唤醒线程退出，队列处理完后才退出
         if (m_workqueue.empty()) {
+            bool stop = m_stop;
             m_queuelocker.unlock();
+            if (stop) {
+                return;
+            }
             continue;
         }
 
-        // 有请求
-        T * request = m_workqueue.front();
-        m_workqueue.pop_front();
-        
+        // 有请求，按级别和客户端轮流取
+        entry e;
+        m_workqueue.pop(e);
+        T * request = e.request;
+        if (e.enqueued_ns) {
+            m_last_dequeue_ns = now_ns();
+            m_last_sojourn_ns = m_last_dequeue_ns - e.enqueued_ns;
+        }
+        // 取出任务后立即解锁，否则其他工作线程和append都会被阻塞
+        m_queuelocker.unlock();
+
         if (!request) {
             continue;
         }
@@ -137,4 +307,4 @@ void threadpool<T>::run() {
         request->process();
     }
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,361 @@
+#include "tls.h"
+
+#ifndef WEBSERVER_TLS
+
+bool tls_available() {
+    return false;
+}
+
+bool tls_init( const char*, const char*, const char*, int, int, std::string& err ) {
+    err = "TLS support is not compiled in (build with -DWEBSERVER_TLS -lssl -lcrypto)";
+    return false;
+}
+
+tls_conn* tls_new( int ) {
+    return NULL;
+}
+
+void tls_free( tls_conn* ) {}
+
+int tls_handshake( tls_conn*, uint32_t& ) {
+    return -1;
+}
+
+bool tls_ktls_send( const tls_conn* ) {
+    return false;
+}
+
+bool tls_ktls_recv( const tls_conn* ) {
+    return false;
+}
+
+ssize_t tls_read( tls_conn*, void*, size_t ) {
+    return -1;
+}
+
+ssize_t tls_writev( tls_conn*, const struct iovec*, int ) {
+    return -1;
+}
+
+ssize_t tls_sendfile( tls_conn*, int, off_t, size_t ) {
+    return -1;
+}
+
+void tls_metrics( std::string& ) {}
+
+#else
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <atomic>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include "metrics.h"
+
+struct tls_conn {
+    SSL* ssl;
+    int fd;
+    bool ready;             // 握手已经完成
+    bool failed;            // 出过致命错误，不能再发送 close_notify
+    bool ktls_send;
+    bool ktls_recv;
+};
+
+// 票据密钥文件的格式（nginx 的 ssl_session_ticket_key）：密钥名、HMAC 密钥、AES 密钥
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char hmac[32];
+    unsigned char aes[32];
+};
+
+enum { STAT_FULL = 0, STAT_RESUMED, STAT_ERROR, STAT_KTLS_SEND, STAT_KTLS_RECV, STAT_COUNT };
+
+static SSL_CTX* ctx = NULL;
+static bool ticket_key_set = false;
+static ticket_key ticket;
+static std::atomic< uint64_t > stats[ STAT_COUNT ];
+
+bool tls_available() {
+    return true;
+}
+
+// 用配置的密钥加密和校验票据。返回1表示可以使用，0表示不是我们的密钥（退回完整握手），-1表示出错
+static int ticket_key_cb( SSL*, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac,
+                          int enc ) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY, ticket.hmac, sizeof( ticket.hmac ) ),
+        OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, ( char* )"SHA256", 0 ),
+        OSSL_PARAM_construct_end()
+    };
+    if ( enc ) {
+        memcpy( name, ticket.name, sizeof( ticket.name ) );
+        if ( RAND_bytes( iv, EVP_CIPHER_get_iv_length( EVP_aes_256_cbc() ) ) <= 0 ||
+             !EVP_EncryptInit_ex( cipher, EVP_aes_256_cbc(), NULL, ticket.aes, iv ) ||
+             !EVP_MAC_CTX_set_params( mac, params ) ) {
+            return -1;
+        }
+        return 1;
+    }
+    if ( memcmp( name, ticket.name, sizeof( ticket.name ) ) != 0 ) {
+        return 0;
+    }
+    if ( !EVP_MAC_CTX_set_params( mac, params ) || !EVP_DecryptInit_ex( cipher, EVP_aes_256_cbc(), NULL, ticket.aes, iv ) ) {
+        return -1;
+    }
+    return 1;
+}
+
+static std::string ssl_error( const char* what ) {
+    char buf[ 256 ];
+    ERR_error_string_n( ERR_get_error(), buf, sizeof( buf ) );
+    return std::string( what ) + ": " + buf;
+}
+
+static bool load_ticket_key( const char* file, std::string& err ) {
+    FILE* fp = fopen( file, "rb" );
+    if ( !fp ) {
+        err = std::string( "cannot open tls_ticket_key " ) + file;
+        return false;
+    }
+    char extra;
+    size_t n = fread( &ticket, 1, sizeof( ticket ), fp );
+    bool exact = n == sizeof( ticket ) && fread( &extra, 1, 1, fp ) == 0;
+    fclose( fp );
+    if ( !exact ) {
+        err = std::string( "tls_ticket_key " ) + file + " must be exactly 80 bytes";
+        return false;
+    }
+    ticket_key_set = true;
+    return true;
+}
+
+bool tls_init( const char* cert, const char* key, const char* ticket_key, int cache_size, int timeout, std::string& err ) {
+    ctx = SSL_CTX_new( TLS_server_method() );
+    if ( !ctx ) {
+        err = ssl_error( "SSL_CTX_new" );
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( ctx, TLS1_2_VERSION );
+    // 客户端不发 close_notify 就关闭连接很常见，当作正常关闭
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options( ctx, options );
+    // 非阻塞的写：每个记录写完就返回，重试时缓冲区的地址可以不同（调用者会移动 iovec），
+    // 空闲的长连接释放读写缓冲区
+    SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+    // AES-GCM 在前：内核的 kTLS 支持它
+    SSL_CTX_set_cipher_list( ctx, "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:!aNULL" );
+    SSL_CTX_set_ciphersuites( ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256" );
+    if ( SSL_CTX_use_certificate_chain_file( ctx, cert ) != 1 ) {
+        err = ssl_error( ( std::string( "tls_cert " ) + cert ).c_str() );
+        return false;
+    }
+    if ( SSL_CTX_use_PrivateKey_file( ctx, key, SSL_FILETYPE_PEM ) != 1 || SSL_CTX_check_private_key( ctx ) != 1 ) {
+        err = ssl_error( ( std::string( "tls_key " ) + key ).c_str() );
+        return false;
+    }
+    // 会话缓存：TLS 1.2 按会话ID复用；票据（TLS 1.2 和 1.3）不占缓存，密钥见 ticket_key_cb
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context( ctx, sid_ctx, sizeof( sid_ctx ) - 1 );
+    SSL_CTX_set_session_cache_mode( ctx, cache_size > 0 ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF );
+    SSL_CTX_sess_set_cache_size( ctx, cache_size );
+    SSL_CTX_set_timeout( ctx, timeout );
+    // TLS 1.3 默认在握手后发两张票据，一张就够了，少做一次加密
+    SSL_CTX_set_num_tickets( ctx, 1 );
+    if ( ticket_key && *ticket_key ) {
+        if ( !load_ticket_key( ticket_key, err ) ) {
+            return false;
+        }
+        SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx, ticket_key_cb );
+    }
+    return true;
+}
+
+tls_conn* tls_new( int fd ) {
+    SSL* ssl = SSL_new( ctx );
+    if ( !ssl ) {
+        return NULL;
+    }
+    if ( SSL_set_fd( ssl, fd ) != 1 ) {
+        SSL_free( ssl );
+        return NULL;
+    }
+    SSL_set_accept_state( ssl );
+    tls_conn* c = new tls_conn;
+    c->ssl = ssl;
+    c->fd = fd;
+    c->ready = false;
+    c->failed = false;
+    c->ktls_send = false;
+    c->ktls_recv = false;
+    return c;
+}
+
+void tls_free( tls_conn* c ) {
+    if ( !c ) {
+        return;
+    }
+    // 只发一次 close_notify，不等对端的回复；出过错的连接不能再调用 SSL_shutdown
+    if ( c->ready && !c->failed ) {
+        ERR_clear_error();
+        SSL_shutdown( c->ssl );
+    }
+    SSL_free( c->ssl );
+    delete c;
+}
+
+int tls_handshake( tls_conn* c, uint32_t& events ) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake( c->ssl );
+    if ( ret == 1 ) {
+        c->ready = true;
+#ifndef OPENSSL_NO_KTLS
+        c->ktls_send = BIO_get_ktls_send( SSL_get_wbio( c->ssl ) ) > 0;
+        c->ktls_recv = BIO_get_ktls_recv( SSL_get_rbio( c->ssl ) ) > 0;
+#endif
+        stats[ SSL_session_reused( c->ssl ) ? STAT_RESUMED : STAT_FULL ].fetch_add( 1, std::memory_order_relaxed );
+        if ( c->ktls_send ) {
+            stats[ STAT_KTLS_SEND ].fetch_add( 1, std::memory_order_relaxed );
+        }
+        if ( c->ktls_recv ) {
+            stats[ STAT_KTLS_RECV ].fetch_add( 1, std::memory_order_relaxed );
+        }
+        return 1;
+    }
+    int e = SSL_get_error( c->ssl, ret );
+    if ( e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE ) {
+        events = e == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+        return 0;
+    }
+    c->failed = true;
+    stats[ STAT_ERROR ].fetch_add( 1, std::memory_order_relaxed );
+    return -1;
+}
+
+bool tls_ktls_send( const tls_conn* c ) {
+    return c->ktls_send;
+}
+
+bool tls_ktls_recv( const tls_conn* c ) {
+    return c->ktls_recv;
+}
+
+// SSL_read/SSL_write 失败：需要等待时 errno 为 EAGAIN 返回-1，对端正常关闭时返回0
+static ssize_t ssl_failure( tls_conn* c, int ret ) {
+    int e = SSL_get_error( c->ssl, ret );
+    if ( e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE ) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if ( e == SSL_ERROR_ZERO_RETURN ) {
+        return 0;
+    }
+    c->failed = true;
+    if ( e != SSL_ERROR_SYSCALL || errno == 0 || errno == EAGAIN ) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+ssize_t tls_read( tls_conn* c, void* buf, size_t len ) {
+    // kTLS 的接收方向也经过 SSL_read：它用 recvmsg 读出记录类型，能处理对端的告警和 TLS 1.3 的握后消息
+    size_t n = 0;
+    ERR_clear_error();
+    int ret = SSL_read_ex( c->ssl, buf, len, &n );
+    if ( ret == 1 ) {
+        return n;
+    }
+    return ssl_failure( c, ret );
+}
+
+ssize_t tls_writev( tls_conn* c, const struct iovec* iov, int count ) {
+    if ( c->ktls_send ) {
+        return writev( c->fd, iov, count );
+    }
+    // 每次 SSL_write 写一个记录。写了一部分之后遇到 EAGAIN 时返回已写的字节数，
+    // 调用者下次从未写的位置开始，正好是 OpenSSL 要求重试的那一段
+    ssize_t total = 0;
+    for ( int i = 0; i < count; ++i ) {
+        const char* p = ( const char* )iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while ( left > 0 ) {
+            size_t n = 0;
+            ERR_clear_error();
+            int ret = SSL_write_ex( c->ssl, p, left, &n );
+            if ( ret != 1 ) {
+                if ( total > 0 ) {
+                    return total;
+                }
+                if ( ssl_failure( c, ret ) == 0 ) {
+                    errno = EPIPE;
+                }
+                return -1;
+            }
+            p += n;
+            left -= n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+ssize_t tls_sendfile( tls_conn* c, int file_fd, off_t offset, size_t count ) {
+    if ( c->ktls_send ) {
+        return sendfile( c->fd, file_fd, &offset, count );
+    }
+    // 退回用户空间加密：每次读一个记录大小的内容。重试时从同一个位置重新读，内容相同，
+    // 所以这个缓冲区可以在同一线程的连接之间共用
+    static thread_local char chunk[ 16384 ];
+    ssize_t total = 0;
+    while ( ( size_t )total < count ) {
+        size_t want = count - total < sizeof( chunk ) ? count - total : sizeof( chunk );
+        ssize_t got = pread( file_fd, chunk, want, offset + total );
+        if ( got <= 0 ) {
+            return total > 0 || got == 0 ? total : -1;
+        }
+        size_t n = 0;
+        ERR_clear_error();
+        int ret = SSL_write_ex( c->ssl, chunk, got, &n );
+        if ( ret != 1 ) {
+            if ( total > 0 ) {
+                return total;
+            }
+            if ( ssl_failure( c, ret ) == 0 ) {
+                errno = EPIPE;
+            }
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+void tls_metrics( std::string& out ) {
+    if ( !ctx ) {
+        return;
+    }
+    metrics_header( out, "webserver_tls_handshakes_total", "counter", "Completed TLS handshakes." );
+    metrics_counter( out, "webserver_tls_handshakes_total", "resumed=\"no\"", stats[ STAT_FULL ].load() );
+    metrics_counter( out, "webserver_tls_handshakes_total", "resumed=\"yes\"", stats[ STAT_RESUMED ].load() );
+    metrics_header( out, "webserver_tls_handshake_errors_total", "counter", "TLS handshakes that failed." );
+    metrics_counter( out, "webserver_tls_handshake_errors_total", NULL, stats[ STAT_ERROR ].load() );
+    metrics_header( out, "webserver_tls_ktls_total", "counter",
+                    "Handshakes after which the record layer moved into the kernel, by direction." );
+    metrics_counter( out, "webserver_tls_ktls_total", "direction=\"send\"", stats[ STAT_KTLS_SEND ].load() );
+    metrics_counter( out, "webserver_tls_ktls_total", "direction=\"recv\"", stats[ STAT_KTLS_RECV ].load() );
+    metrics_header( out, "webserver_tls_session_cache_entries", "gauge", "Sessions in the server-side session cache." );
+    metrics_gauge( out, "webserver_tls_session_cache_entries", NULL, ( double )SSL_CTX_sess_number( ctx ) );
+    metrics_header( out, "webserver_tls_ticket_key", "gauge", "1 if session tickets use the key from tls_ticket_key." );
+    metrics_gauge( out, "webserver_tls_ticket_key", NULL, ticket_key_set ? 1 : 0 );
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+
+/*
+    HTTPS：在 tls_port 上另开一个监听套接字，连接先做 TLS 握手（OpenSSL），之后的请求和明文端口完全一样。
+    握手完成后 OpenSSL 尝试把记录层交给内核（kTLS，需要内核的 tls 模块和 AES-GCM 等内核支持的加密套件）：
+        发送方向在内核中：响应直接 writev/sendfile 到套接字，由内核加密，mmap 的文件和 sendfile 都不经过用户空间，
+                          和明文连接一样是零拷贝的
+        接收方向在内核中：recv 直接得到明文
+    内核不支持时退回 SSL_read/SSL_write：文件内容按 16KB 读到线程本地的缓冲区后加密发送。
+    是否用上了 kTLS 看运行时指标 webserver_tls_ktls_total。
+
+    会话复用：服务器端的会话缓存（tls_session_cache 个条目，超时 tls_session_timeout 秒）和会话票据。
+    票据的密钥默认在启动时随机生成，重启或升级后旧票据失效；tls_ticket_key 指定一个80字节的密钥文件
+    （前16字节为密钥名，之后32字节 HMAC-SHA256 的密钥，32字节 AES-256-CBC 的密钥，和 nginx 的格式相同），
+    多个实例、升级前后的进程用同一个文件时，客户端的票据在它们之间都能用。
+
+    HTTPS 连接上不协商 HTTP/2（没有 ALPN），h2c 只在明文端口上。反向代理和 FastCGI 的路由直接在套接字上
+    搬运数据（splice），只有 kTLS 两个方向都生效时才能转发，否则回复502。
+
+    需要 OpenSSL，定义 WEBSERVER_TLS 编译时才启用，例如
+        g++ -DWEBSERVER_TLS -O2 *.cpp -pthread -lssl -lcrypto -o server
+    否则 tls_available() 返回false，配置 tls_port 会在启动时报错。
+    测试时可以用自签名的证书：
+        openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -days 30 -keyout key.pem -out cert.pem
+*/
+
+struct tls_conn;
+
+// 是否编译了 TLS 支持
+bool tls_available();
+// 启动时调用：加载证书和私钥，设置会话缓存和票据密钥（ticket_key 为空时随机生成）；失败时返回false
+bool tls_init( const char* cert, const char* key, const char* ticket_key, int cache_size, int timeout, std::string& err );
+// 新的连接（非阻塞的套接字），tls_free 释放，不关闭套接字
+tls_conn* tls_new( int fd );
+void tls_free( tls_conn* c );
+// 握手：完成返回1；需要等待时返回0，events 为要等待的 EPOLLIN 或 EPOLLOUT；失败返回-1
+int tls_handshake( tls_conn* c, uint32_t& events );
+// 握手之后记录层是否在内核中
+bool tls_ktls_send( const tls_conn* c );
+bool tls_ktls_recv( const tls_conn* c );
+// 和 recv/writev/sendfile 的返回值相同：出错返回-1并设置 errno，需要等待时为 EAGAIN，对端关闭时读返回0
+ssize_t tls_read( tls_conn* c, void* buf, size_t len );
+ssize_t tls_writev( tls_conn* c, const struct iovec* iov, int count );
+ssize_t tls_sendfile( tls_conn* c, int file_fd, off_t offset, size_t count );
+void tls_metrics( std::string& out );
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * packer: 把网站根目录打成服务器可以直接 mmap 的资源包，格式见 bundle.h
+ *
+ * 根目录下有成千上万个小文件时，冷启动的服务器对每个文件都要 stat/open/mmap 一次。
+ * 打包之后服务器启动时只 mmap 一个文件，查找是一次二分查找：
+ *   - 路径按字节序排好，URL 就是相对根目录的路径（以 '/' 开头）
+ *   - 每个文件的内容从页边界开始
+ *   - Content-Type 按扩展名、ETag 按内容的哈希在打包时算好
+ *   - 文本类文件压缩后不超过原来的 90% 时再存一份 gzip 的版本
+ * 和服务器一样跳过其他用户不可读的文件。先写临时文件再改名，服务器可以一直使用旧包。
+ *
+ * 用法： packer [-n] [-l 压缩级别] <根目录> <输出文件>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../../bundle.h"
+
+struct file_item {
+    std::string path;           // URL 路径，例如 /images/image1.jpg
+    std::string type;
+    std::string etag;
+    std::string gzip_etag;
+    std::string content;
+    std::string gzip;           // 为空表示不存gzip版本
+};
+
+// 扩展名对应的 Content-Type，compress 表示值得预先压缩
+struct mime_type {
+    const char* ext;
+    const char* type;
+    bool compress;
+};
+
+static const mime_type mime_types[] = {
+    { "html", "text/html; charset=utf-8", true },
+    { "htm", "text/html; charset=utf-8", true },
+    { "css", "text/css; charset=utf-8", true },
+    { "js", "application/javascript; charset=utf-8", true },
+    { "mjs", "application/javascript; charset=utf-8", true },
+    { "json", "application/json", true },
+    { "xml", "application/xml", true },
+    { "txt", "text/plain; charset=utf-8", true },
+    { "csv", "text/csv; charset=utf-8", true },
+    { "svg", "image/svg+xml", true },
+    { "ico", "image/x-icon", true },
+    { "wasm", "application/wasm", true },
+    { "jpg", "image/jpeg", false },
+    { "jpeg", "image/jpeg", false },
+    { "png", "image/png", false },
+    { "gif", "image/gif", false },
+    { "webp", "image/webp", false },
+    { "avif", "image/avif", false },
+    { "woff", "font/woff", false },
+    { "woff2", "font/woff2", false },
+    { "mp4", "video/mp4", false },
+    { "webm", "video/webm", false },
+    { "mp3", "audio/mpeg", false },
+    { "pdf", "application/pdf", false },
+    { "zip", "application/zip", false },
+    { "gz", "application/gzip", false },
+};
+
+static const mime_type* lookup_type( const std::string& path ) {
+    static const mime_type fallback = { "", "application/octet-stream", false };
+    size_t slash = path.rfind( '/' );
+    size_t dot = path.rfind( '.' );
+    if ( dot == std::string::npos || ( slash != std::string::npos && dot < slash ) ) {
+        return &fallback;
+    }
+    const char* ext = path.c_str() + dot + 1;
+    for ( size_t i = 0; i < sizeof( mime_types ) / sizeof( mime_types[0] ); ++i ) {
+        if ( strcasecmp( ext, mime_types[i].ext ) == 0 ) {
+            return &mime_types[i];
+        }
+    }
+    return &fallback;
+}
+
+// 64 位 FNV-1a，内容相同的文件 ETag 相同，重新打包不会让客户端的缓存失效
+static uint64_t content_hash( const std::string& data ) {
+    uint64_t h = 14695981039346656037ull;
+    for ( size_t i = 0; i < data.size(); ++i ) {
+        h ^= ( unsigned char )data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static bool read_file( const std::string& file, std::string& out ) {
+    FILE* f = fopen( file.c_str(), "rb" );
+    if ( !f ) {
+        return false;
+    }
+    char buf[ 65536 ];
+    size_t n;
+    out.clear();
+    while ( ( n = fread( buf, 1, sizeof( buf ), f ) ) > 0 ) {
+        out.append( buf, n );
+    }
+    bool ok = !ferror( f );
+    fclose( f );
+    return ok;
+}
+
+static bool gzip_compress( const std::string& in, std::string& out, int level ) {
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    // windowBits 加 16 输出 gzip 格式
+    if ( deflateInit2( &zs, level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        return false;
+    }
+    out.resize( deflateBound( &zs, in.size() ) + 32 );
+    zs.next_in = ( Bytef* )in.data();
+    zs.avail_in = in.size();
+    zs.next_out = ( Bytef* )&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate( &zs, Z_FINISH );
+    out.resize( zs.total_out );
+    deflateEnd( &zs );
+    return ret == Z_STREAM_END;
+}
+
+// 递归收集目录下的普通文件
+static bool collect( const std::string& root, const std::string& rel, std::vector< file_item >& items, bool gzip, int level ) {
+    std::string dir = root + rel;
+    DIR* d = opendir( dir.c_str() );
+    if ( !d ) {
+        fprintf( stderr, "cannot open %s: %s\n", dir.c_str(), strerror( errno ) );
+        return false;
+    }
+    bool ok = true;
+    struct dirent* ent;
+    while ( ok && ( ent = readdir( d ) ) != NULL ) {
+        if ( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 ) {
+            continue;
+        }
+        std::string path = rel + "/" + ent->d_name;
+        std::string file = root + path;
+        struct stat st;
+        if ( stat( file.c_str(), &st ) < 0 ) {
+            fprintf( stderr, "skip %s: %s\n", file.c_str(), strerror( errno ) );
+            continue;
+        }
+        if ( S_ISDIR( st.st_mode ) ) {
+            ok = collect( root, path, items, gzip, level );
+            continue;
+        }
+        if ( !S_ISREG( st.st_mode ) ) {
+            continue;
+        }
+        if ( !( st.st_mode & S_IROTH ) ) {
+            // 服务器对这类文件返回403，不放进包里
+            fprintf( stderr, "skip %s: not readable by others\n", file.c_str() );
+            continue;
+        }
+        if ( path.size() >= 4096 ) {
+            fprintf( stderr, "skip %s: path too long\n", file.c_str() );
+            continue;
+        }
+        file_item item;
+        item.path = path;
+        if ( !read_file( file, item.content ) ) {
+            fprintf( stderr, "cannot read %s: %s\n", file.c_str(), strerror( errno ) );
+            ok = false;
+            break;
+        }
+        const mime_type* mt = lookup_type( path );
+        item.type = mt->type;
+        char etag[ 32 ];
+        uint64_t h = content_hash( item.content );
+        snprintf( etag, sizeof( etag ), "\"%016llx\"", ( unsigned long long )h );
+        item.etag = etag;
+        if ( gzip && mt->compress && item.content.size() >= 256 ) {
+            std::string z;
+            if ( gzip_compress( item.content, z, level ) && z.size() * 10 <= item.content.size() * 9 ) {
+                item.gzip.swap( z );
+                snprintf( etag, sizeof( etag ), "\"%016llx-gz\"", ( unsigned long long )h );
+                item.gzip_etag = etag;
+            }
+        }
+        items.push_back( item );
+    }
+    closedir( d );
+    return ok;
+}
+
+static bool path_less( const file_item& a, const file_item& b ) {
+    // 和 bundle_find 的比较方式一致：按字节比较，前缀较短的在前
+    return a.path < b.path;
+}
+
+static uint64_t align_up( uint64_t v ) {
+    return ( v + BUNDLE_ALIGN - 1 ) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+}
+
+static uint32_t add_string( std::string& strings, const std::string& s ) {
+    uint32_t off = strings.size();
+    strings.append( s );
+    strings.push_back( '\0' );
+    return off;
+}
+
+static bool write_bundle( const char* out, std::vector< file_item >& items ) {
+    std::sort( items.begin(), items.end(), path_less );
+
+    bundle_header header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, BUNDLE_MAGIC, 8 );
+    header.version = BUNDLE_VERSION;
+    header.count = items.size();
+
+    std::vector< bundle_entry > entries( items.size() );
+    std::string strings;
+    for ( size_t i = 0; i < items.size(); ++i ) {
+        bundle_entry& e = entries[i];
+        memset( &e, 0, sizeof( e ) );
+        e.path = add_string( strings, items[i].path );
+        e.path_len = items[i].path.size();
+        e.type = add_string( strings, items[i].type );
+        e.etag = add_string( strings, items[i].etag );
+        if ( !items[i].gzip.empty() ) {
+            e.gzip_etag = add_string( strings, items[i].gzip_etag );
+        }
+    }
+    header.strings_offset = sizeof( header ) + entries.size() * sizeof( bundle_entry );
+    header.strings_size = strings.size();
+
+    // 内容区从索引之后的第一个页边界开始，每个文件占整数个页
+    uint64_t pos = align_up( header.strings_offset + header.strings_size );
+    for ( size_t i = 0; i < items.size(); ++i ) {
+        entries[i].offset = pos;
+        entries[i].size = items[i].content.size();
+        pos = align_up( pos + entries[i].size );
+        if ( !items[i].gzip.empty() ) {
+            entries[i].gzip_offset = pos;
+            entries[i].gzip_size = items[i].gzip.size();
+            pos = align_up( pos + entries[i].gzip_size );
+        }
+    }
+    header.file_size = pos;
+
+    std::string tmp = std::string( out ) + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if ( !f ) {
+        fprintf( stderr, "cannot create %s: %s\n", tmp.c_str(), strerror( errno ) );
+        return false;
+    }
+    static const char zeros[ BUNDLE_ALIGN ] = { 0 };
+    uint64_t written = 0;
+    bool ok = fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+              ( entries.empty() || fwrite( &entries[0], sizeof( bundle_entry ), entries.size(), f ) == entries.size() ) &&
+              fwrite( strings.data(), 1, strings.size(), f ) == strings.size();
+    written = header.strings_offset + header.strings_size;
+    for ( size_t i = 0; ok && i < items.size(); ++i ) {
+        const std::string* parts[2] = { &items[i].content, &items[i].gzip };
+        uint64_t offsets[2] = { entries[i].offset, entries[i].gzip_offset };
+        for ( int k = 0; ok && k < 2; ++k ) {
+            if ( k == 1 && parts[k]->empty() ) {
+                break;
+            }
+            ok = fwrite( zeros, 1, offsets[k] - written, f ) == offsets[k] - written &&
+                 fwrite( parts[k]->data(), 1, parts[k]->size(), f ) == parts[k]->size();
+            written = offsets[k] + parts[k]->size();
+        }
+    }
+    ok = ok && fwrite( zeros, 1, header.file_size - written, f ) == header.file_size - written;
+    ok = ( fclose( f ) == 0 ) && ok;
+    if ( !ok || rename( tmp.c_str(), out ) != 0 ) {
+        fprintf( stderr, "cannot write %s: %s\n", out, strerror( errno ) );
+        unlink( tmp.c_str() );
+        return false;
+    }
+    return true;
+}
+
+static void usage() {
+    fprintf( stderr,
+             "usage: packer [-n] [-l level] <doc_root> <bundle>\n"
+             "  -n        do not store gzip variants\n"
+             "  -l level  gzip level 1-9 (default 9)\n" );
+}
+
+int main( int argc, char* argv[] ) {
+    bool gzip = true;
+    int level = 9;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "nl:h" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'n': gzip = false; break;
+            case 'l': level = atoi( optarg ); break;
+            default: usage(); return 2;
+        }
+    }
+    if ( argc - optind != 2 || level < 1 || level > 9 ) {
+        usage();
+        return 2;
+    }
+    std::string root = argv[ optind ];
+    while ( root.size() > 1 && root[ root.size() - 1 ] == '/' ) {
+        root.erase( root.size() - 1 );
+    }
+    std::vector< file_item > items;
+    if ( !collect( root, "", items, gzip, level ) ) {
+        return 1;
+    }
+    if ( !write_bundle( argv[ optind + 1 ], items ) ) {
+        return 1;
+    }
+    uint64_t raw = 0, packed = 0;
+    size_t compressed = 0;
+    for ( size_t i = 0; i < items.size(); ++i ) {
+        raw += items[i].content.size();
+        if ( !items[i].gzip.empty() ) {
+            packed += items[i].gzip.size();
+            compressed++;
+        }
+    }
+    printf( "%zu files, %llu bytes, %zu gzip variants (%llu bytes) -> %s\n", items.size(),
+            ( unsigned long long )raw, compressed, ( unsigned long long )packed, argv[ optind + 1 ] );
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+#include "upgrade.h"
+
+extern char** environ;
+
+static int signal_pipe[2] = { -1, -1 };
+
+int upgrade_inherited_listener( const char* env ) {
+    const char* value = getenv( env );
+    if ( !value ) {
+        return -1;
+    }
+    char* end;
+    long fd = strtol( value, &end, 10 );
+    // 只用一次，之后再升级时重新设置
+    unsetenv( env );
+    if ( *value == '\0' || *end != '\0' || fd < 0 || fd > 65535 ) {
+        printf( "ignoring %s=%s\n", env, value );
+        return -1;
+    }
+    int listening = 0;
+    socklen_t len = sizeof( listening );
+    if ( getsockopt( ( int )fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len ) != 0 || !listening ) {
+        printf( "inherited fd %ld is not a listening socket\n", fd );
+        return -1;
+    }
+    fcntl( ( int )fd, F_SETFD, FD_CLOEXEC );
+    return ( int )fd;
+}
+
+static void signal_handler( int sig ) {
+    int saved = errno;
+    char c = ( char )sig;
+    ssize_t n = write( signal_pipe[1], &c, 1 );
+    ( void )n;
+    errno = saved;
+}
+
+static const int handled_signals[] = { SIGUSR2, SIGTERM, SIGQUIT, SIGCHLD };
+static const int HANDLED_COUNT = sizeof( handled_signals ) / sizeof( handled_signals[0] );
+
+int upgrade_signal_init() {
+    if ( pipe2( signal_pipe, O_NONBLOCK | O_CLOEXEC ) != 0 ) {
+        return -1;
+    }
+    struct sigaction sa;
+    memset( &sa, '\0', sizeof( sa ) );
+    sa.sa_handler = signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigfillset( &sa.sa_mask );
+    for ( int i = 0; i < HANDLED_COUNT; ++i ) {
+        sigaction( handled_signals[i], &sa, NULL );
+    }
+    return signal_pipe[0];
+}
+
+int upgrade_signal_take() {
+    int events = UPGRADE_NONE;
+    char buf[ 64 ];
+    ssize_t n;
+    while ( ( n = read( signal_pipe[0], buf, sizeof( buf ) ) ) > 0 ) {
+        for ( ssize_t i = 0; i < n; ++i ) {
+            if ( buf[i] == SIGUSR2 ) {
+                events |= UPGRADE_REEXEC;
+            } else if ( buf[i] == SIGTERM || buf[i] == SIGQUIT ) {
+                events |= UPGRADE_STOP;
+            }
+        }
+    }
+    // 新程序启动失败时在这里回收，旧进程继续服务
+    int status;
+    pid_t pid;
+    while ( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ) {
+        if ( WIFEXITED( status ) ) {
+            printf( "upgrade: pid %d exited with status %d\n", ( int )pid, WEXITSTATUS( status ) );
+        } else if ( WIFSIGNALED( status ) ) {
+            printf( "upgrade: pid %d killed by signal %d\n", ( int )pid, WTERMSIG( status ) );
+        }
+    }
+    return events;
+}
+
+void upgrade_block_signals() {
+    sigset_t set;
+    sigemptyset( &set );
+    for ( int i = 0; i < HANDLED_COUNT; ++i ) {
+        sigaddset( &set, handled_signals[i] );
+    }
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+}
+
+// 环境变量 e 是不是 name=...
+static bool env_is( const char* e, const char* name ) {
+    size_t len = strlen( name );
+    return strncmp( e, name, len ) == 0 && e[ len ] == '=';
+}
+
+pid_t upgrade_spawn( int listenfd, int tls_listenfd, char* argv[] ) {
+    // 子进程的环境变量在 fork 之前准备好：多线程程序 fork 之后到 exec 之前不能调用 malloc
+    char listen_env[ 64 ];
+    char tls_listen_env[ 64 ];
+    snprintf( listen_env, sizeof( listen_env ), "%s=%d", UPGRADE_LISTEN_ENV, listenfd );
+    snprintf( tls_listen_env, sizeof( tls_listen_env ), "%s=%d", UPGRADE_TLS_LISTEN_ENV, tls_listenfd );
+    std::vector< char* > envp;
+    for ( char** e = environ; *e; ++e ) {
+        if ( !env_is( *e, UPGRADE_LISTEN_ENV ) && !env_is( *e, UPGRADE_TLS_LISTEN_ENV ) ) {
+            envp.push_back( *e );
+        }
+    }
+    envp.push_back( listen_env );
+    if ( tls_listenfd >= 0 ) {
+        envp.push_back( tls_listen_env );
+    }
+    envp.push_back( NULL );
+    struct rlimit rl;
+    int max_fd = getrlimit( RLIMIT_NOFILE, &rl ) == 0 ? ( int )rl.rlim_cur : 65536;
+
+    fflush( stdout );
+    pid_t pid = fork();
+    if ( pid != 0 ) {
+        if ( pid < 0 ) {
+            printf( "upgrade: fork failed: %s\n", strerror( errno ) );
+        } else {
+            printf( "upgrade: started pid %d\n", ( int )pid );
+        }
+        // 日志可能重定向到文件，立即写出，方便部署脚本取新进程的pid
+        fflush( stdout );
+        return pid;
+    }
+    // 子进程：只保留标准输入输出和监听套接字，恢复默认的信号处理和屏蔽字
+    for ( int fd = 3; fd < max_fd; ++fd ) {
+        if ( fd != listenfd && fd != tls_listenfd ) {
+            close( fd );
+        }
+    }
+    fcntl( listenfd, F_SETFD, 0 );
+    if ( tls_listenfd >= 0 ) {
+        fcntl( tls_listenfd, F_SETFD, 0 );
+    }
+    for ( int i = 0; i < HANDLED_COUNT; ++i ) {
+        signal( handled_signals[i], SIG_DFL );
+    }
+    sigset_t none;
+    sigemptyset( &none );
+    sigprocmask( SIG_SETMASK, &none, NULL );
+
+    // 按原来的路径执行，部署时替换的新程序生效
+    execvpe( argv[0], argv, &envp[0] );
+    const char msg[] = "upgrade: exec failed\n";
+    ssize_t n = write( STDERR_FILENO, msg, sizeof( msg ) - 1 );
+    ( void )n;
+    _exit( 127 );
+}
+
+uint64_t upgrade_clock_ms() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
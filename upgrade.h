@@ -0,0 +1,44 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+    不停机升级和优雅退出
+    SIGUSR2：fork 并 exec 新的程序（argv[0]，参数不变），监听套接字通过环境变量
+             WEBSERVER_LISTEN_FD 传给新进程，新进程不再 bind，直接在同一个套接字上 accept。
+             两个进程同时接收连接，确认新进程正常后再向旧进程发 SIGQUIT。
+             开启了 HTTPS（见 tls.h）时它的监听套接字通过 WEBSERVER_TLS_LISTEN_FD 同样传过去。
+    SIGTERM / SIGQUIT：停止 accept，之后的响应都带 Connection: close，发完即关闭连接，客户端改连新进程。
+             负载下每个长连接很快会有下一个请求，这样关闭不会丢请求；UPGRADE_IDLE_GRACE_MS 之后
+             仍然空闲的长连接再关闭读方向。所有连接关闭或超过 drain_timeout_ms 后退出。
+    信号处理函数只往自管道里写一个字节，主循环把管道的读端和其他描述符一起等待。
+
+    升级的步骤：
+        kill -USR2 <旧进程>      # 新进程启动，日志中打印 "upgrade: started pid N"
+        kill -QUIT <旧进程>      # 旧进程处理完手上的请求后退出
+*/
+
+#define UPGRADE_LISTEN_ENV "WEBSERVER_LISTEN_FD"
+#define UPGRADE_TLS_LISTEN_ENV "WEBSERVER_TLS_LISTEN_FD"
+// 开始排空后多久关闭空闲的长连接（毫秒）
+#define UPGRADE_IDLE_GRACE_MS 1000
+
+// upgrade_signal_take 返回的事件
+enum UPGRADE_EVENT { UPGRADE_NONE = 0, UPGRADE_REEXEC = 1, UPGRADE_STOP = 2 };
+
+// 从环境变量 env 取继承的监听套接字，没有或不是监听套接字时返回-1
+int upgrade_inherited_listener( const char* env = UPGRADE_LISTEN_ENV );
+// 安装 SIGUSR2/SIGTERM/SIGQUIT/SIGCHLD 的处理函数，返回自管道的读端
+int upgrade_signal_init();
+// 自管道可读时调用，读空管道，回收退出的子进程，返回收到的事件（UPGRADE_EVENT 的组合）
+int upgrade_signal_take();
+// 在工作线程中调用，屏蔽上面这些信号，只由主线程处理，系统调用不会被打断
+void upgrade_block_signals();
+// 启动新程序并把监听套接字交给它（tls_listenfd 为-1表示没有 HTTPS），返回子进程的pid，失败返回-1
+pid_t upgrade_spawn( int listenfd, int tls_listenfd, char* argv[] );
+// 单调时钟的毫秒数，用来计算排空的截止时间
+uint64_t upgrade_clock_ms();
+
+#endif
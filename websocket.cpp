@@ -0,0 +1,736 @@
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <unordered_map>
+#include "websocket.h"
+#include "locker.h"
+#include "metrics.h"
+#include "tls.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_IOV_MAX 64
+
+static std::vector< std::string > ws_prefixes;
+static int ws_publish_policy = WS_PUBLISH_LOCAL;
+static size_t ws_queue_limit = 256 * 1024;
+static size_t ws_max_message = 64 * 1024;
+
+enum { STAT_UPGRADES, STAT_PUBLISHED, STAT_DELIVERED, STAT_POSTED, STAT_DISCARDED, STAT_SLOW, STAT_PROTOCOL, STAT_COUNT };
+static std::atomic< uint64_t > stats[ STAT_COUNT ];
+static std::atomic< int > ws_connections( 0 );
+
+// 一个反应堆的订阅表和收件箱
+struct ws_reactor {
+    int id;
+    int wakefd;
+    locker lock;                                                        // 保护 inbox
+    std::vector< std::pair< std::string, ws_frame > > inbox;            // 其他线程发布、还没投递的帧
+    std::unordered_map< std::string, std::vector< ws_conn* > > subs;    // 频道的订阅者，只在反应堆线程上访问
+};
+
+// 反应堆在启动阶段注册，之后不再变化
+static std::vector< ws_reactor* > reactors;
+// 频道 -> 各反应堆上是否有订阅者，发布时据此决定投递给哪些反应堆。只在反应堆上第一个订阅者加入、
+// 最后一个离开时修改，所以锁的竞争和订阅者的数量无关
+static locker hub_lock;
+static std::unordered_map< std::string, std::vector< char > > channels;
+static thread_local ws_reactor* local_reactor = NULL;
+
+// 16 字节的向量，GCC 按目标平台生成 SIMD 指令（x86-64 的 SSE2、ARM 的 NEON）
+typedef unsigned char ws_vec __attribute__(( vector_size( 16 ) ));
+
+// dst[i] = src[i] ^ key[ ( phase + i ) % 4 ]，phase 为 src 在帧的负载中的偏移
+static void ws_unmask( unsigned char* dst, const unsigned char* src, size_t len, const unsigned char* key, uint64_t phase ) {
+    unsigned char k[ 4 ];
+    for ( int i = 0; i < 4; ++i ) {
+        k[i] = key[ ( phase + i ) & 3 ];
+    }
+    size_t i = 0;
+    if ( len >= 16 ) {
+        ws_vec m;
+        for ( int j = 0; j < 16; ++j ) {
+            m[j] = k[ j & 3 ];
+        }
+        // memcpy 不要求对齐，编译成非对齐的向量读写
+        for ( ; i + 64 <= len; i += 64 ) {
+            ws_vec a, b, c, d;
+            memcpy( &a, src + i, 16 );
+            memcpy( &b, src + i + 16, 16 );
+            memcpy( &c, src + i + 32, 16 );
+            memcpy( &d, src + i + 48, 16 );
+            a ^= m;
+            b ^= m;
+            c ^= m;
+            d ^= m;
+            memcpy( dst + i, &a, 16 );
+            memcpy( dst + i + 16, &b, 16 );
+            memcpy( dst + i + 32, &c, 16 );
+            memcpy( dst + i + 48, &d, 16 );
+        }
+        for ( ; i + 16 <= len; i += 16 ) {
+            ws_vec a;
+            memcpy( &a, src + i, 16 );
+            a ^= m;
+            memcpy( dst + i, &a, 16 );
+        }
+    }
+    for ( ; i < len; ++i ) {
+        dst[i] = src[i] ^ k[ i & 3 ];
+    }
+}
+
+// 文本消息必须是合法的 UTF-8：没有超长编码、代理对和超过 U+10FFFF 的码点
+static bool utf8_valid( const unsigned char* s, size_t len ) {
+    size_t i = 0;
+    while ( i < len ) {
+        // ASCII 每次跳过8字节
+        if ( i + 8 <= len ) {
+            uint64_t w;
+            memcpy( &w, s + i, 8 );
+            if ( !( w & 0x8080808080808080ULL ) ) {
+                i += 8;
+                continue;
+            }
+        }
+        unsigned char c = s[i];
+        if ( c < 0x80 ) {
+            ++i;
+            continue;
+        }
+        size_t n;
+        uint32_t cp;
+        uint32_t min;
+        if ( ( c & 0xe0 ) == 0xc0 ) {
+            n = 1;
+            cp = c & 0x1f;
+            min = 0x80;
+        } else if ( ( c & 0xf0 ) == 0xe0 ) {
+            n = 2;
+            cp = c & 0x0f;
+            min = 0x800;
+        } else if ( ( c & 0xf8 ) == 0xf0 ) {
+            n = 3;
+            cp = c & 0x07;
+            min = 0x10000;
+        } else {
+            return false;
+        }
+        if ( len - i <= n ) {
+            return false;
+        }
+        for ( size_t k = 1; k <= n; ++k ) {
+            if ( ( s[ i + k ] & 0xc0 ) != 0x80 ) {
+                return false;
+            }
+            cp = ( cp << 6 ) | ( s[ i + k ] & 0x3f );
+        }
+        if ( cp < min || cp > 0x10ffff || ( cp >= 0xd800 && cp <= 0xdfff ) ) {
+            return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+// 握手
+
+static uint32_t rol( uint32_t x, int n ) {
+    return ( x << n ) | ( x >> ( 32 - n ) );
+}
+
+// Sec-WebSocket-Accept 要用 SHA-1；不依赖 OpenSSL（它只在 WEBSERVER_TLS 时链接）
+static void sha1( const std::string& in, unsigned char out[ 20 ] ) {
+    uint32_t h[ 5 ] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    std::string msg = in;
+    msg += ( char )0x80;
+    while ( msg.size() % 64 != 56 ) {
+        msg += '\0';
+    }
+    uint64_t bits = ( uint64_t )in.size() * 8;
+    for ( int i = 7; i >= 0; --i ) {
+        msg += ( char )( bits >> ( i * 8 ) );
+    }
+    for ( size_t off = 0; off < msg.size(); off += 64 ) {
+        const unsigned char* p = ( const unsigned char* )msg.data() + off;
+        uint32_t w[ 80 ];
+        for ( int i = 0; i < 16; ++i ) {
+            w[i] = ( ( uint32_t )p[ 4 * i ] << 24 ) | ( ( uint32_t )p[ 4 * i + 1 ] << 16 ) | ( ( uint32_t )p[ 4 * i + 2 ] << 8 ) | p[ 4 * i + 3 ];
+        }
+        for ( int i = 16; i < 80; ++i ) {
+            w[i] = rol( w[ i - 3 ] ^ w[ i - 8 ] ^ w[ i - 14 ] ^ w[ i - 16 ], 1 );
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for ( int i = 0; i < 80; ++i ) {
+            uint32_t f, k;
+            if ( i < 20 ) {
+                f = ( b & c ) | ( ~b & d );
+                k = 0x5a827999;
+            } else if ( i < 40 ) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if ( i < 60 ) {
+                f = ( b & c ) | ( b & d ) | ( c & d );
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rol( a, 5 ) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol( b, 30 );
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for ( int i = 0; i < 5; ++i ) {
+        out[ 4 * i ] = h[i] >> 24;
+        out[ 4 * i + 1 ] = h[i] >> 16;
+        out[ 4 * i + 2 ] = h[i] >> 8;
+        out[ 4 * i + 3 ] = h[i];
+    }
+}
+
+static std::string base64( const unsigned char* p, size_t len ) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for ( size_t i = 0; i < len; i += 3 ) {
+        uint32_t v = p[i] << 16;
+        if ( i + 1 < len ) {
+            v |= p[ i + 1 ] << 8;
+        }
+        if ( i + 2 < len ) {
+            v |= p[ i + 2 ];
+        }
+        out += table[ ( v >> 18 ) & 63 ];
+        out += table[ ( v >> 12 ) & 63 ];
+        out += i + 1 < len ? table[ ( v >> 6 ) & 63 ] : '=';
+        out += i + 2 < len ? table[ v & 63 ] : '=';
+    }
+    return out;
+}
+
+std::string ws_accept( const std::string& key ) {
+    unsigned char digest[ 20 ];
+    sha1( key + WS_GUID, digest );
+    return base64( digest, sizeof( digest ) );
+}
+
+// 在 "Name: value" 中取 value，line 以 \r 或 '\0' 结束
+static bool header_value( const char* line, const char* name, const char*& value, size_t& len ) {
+    size_t n = strlen( name );
+    if ( strncasecmp( line, name, n ) != 0 || line[n] != ':' ) {
+        return false;
+    }
+    value = line + n + 1;
+    value += strspn( value, " \t" );
+    len = strcspn( value, "\r\n" );
+    while ( len > 0 && ( value[ len - 1 ] == ' ' || value[ len - 1 ] == '\t' ) ) {
+        --len;
+    }
+    return true;
+}
+
+// 逗号分隔的列表中有 token（不分大小写），例如 Connection: keep-alive, Upgrade
+static bool has_token( const char* v, size_t len, const char* token ) {
+    size_t n = strlen( token );
+    size_t i = 0;
+    while ( i < len ) {
+        i += strspn( v + i, " \t," );
+        size_t end = i;
+        while ( end < len && v[ end ] != ',' ) {
+            ++end;
+        }
+        size_t e = end;
+        while ( e > i && ( v[ e - 1 ] == ' ' || v[ e - 1 ] == '\t' ) ) {
+            --e;
+        }
+        if ( e - i == n && strncasecmp( v + i, token, n ) == 0 ) {
+            return true;
+        }
+        i = end + 1;
+    }
+    return false;
+}
+
+bool ws_upgrade_requested( const std::vector< const char* >& headers, std::string& key ) {
+    bool upgrade = false;
+    bool connection = false;
+    bool version = false;
+    key.clear();
+    for ( size_t i = 0; i < headers.size(); ++i ) {
+        const char* v;
+        size_t len;
+        if ( header_value( headers[i], "Upgrade", v, len ) ) {
+            upgrade = len == 9 && strncasecmp( v, "websocket", 9 ) == 0;
+        } else if ( header_value( headers[i], "Connection", v, len ) ) {
+            connection = connection || has_token( v, len, "upgrade" );
+        } else if ( header_value( headers[i], "Sec-WebSocket-Version", v, len ) ) {
+            version = len == 2 && strncmp( v, "13", 2 ) == 0;
+        } else if ( header_value( headers[i], "Sec-WebSocket-Key", v, len ) ) {
+            // 16 字节随机数的 base64
+            key.assign( v, len );
+        }
+    }
+    return upgrade && connection && version && key.size() == 24;
+}
+
+// 设置
+
+bool ws_parse( const char* spec, std::vector< std::string >& prefixes, std::string& err ) {
+    prefixes.clear();
+    std::string s( spec );
+    size_t pos = 0;
+    while ( pos <= s.size() ) {
+        size_t end = s.find( ',', pos );
+        if ( end == std::string::npos ) {
+            end = s.size();
+        }
+        std::string item = s.substr( pos, end - pos );
+        pos = end + 1;
+        if ( item.empty() ) {
+            continue;
+        }
+        if ( item[0] != '/' || item.find_first_of( " \t?" ) != std::string::npos ) {
+            err = "expected a URL prefix such as /ws, got '" + item + "'";
+            return false;
+        }
+        prefixes.push_back( item );
+    }
+    return true;
+}
+
+int ws_publish_parse( const char* name ) {
+    if ( strcmp( name, "local" ) == 0 ) {
+        return WS_PUBLISH_LOCAL;
+    }
+    if ( strcmp( name, "all" ) == 0 ) {
+        return WS_PUBLISH_ALL;
+    }
+    return -1;
+}
+
+void ws_init( const std::vector< std::string >& prefixes, int publish, size_t queue_limit, size_t max_message ) {
+    ws_prefixes = prefixes;
+    ws_publish_policy = publish;
+    ws_queue_limit = queue_limit;
+    ws_max_message = max_message;
+}
+
+bool ws_enabled() {
+    return !ws_prefixes.empty();
+}
+
+bool ws_match( const char* url ) {
+    for ( size_t i = 0; i < ws_prefixes.size(); ++i ) {
+        const std::string& p = ws_prefixes[i];
+        if ( strncmp( url, p.c_str(), p.size() ) != 0 ) {
+            continue;
+        }
+        // 整段匹配，和 proxy_match 相同
+        char next = url[ p.size() ];
+        if ( p[ p.size() - 1 ] == '/' || next == '\0' || next == '/' || next == '?' ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 广播
+
+// 服务器发出的帧不加掩码；消息不分片，一帧发完
+static ws_frame ws_encode( int opcode, const char* data, size_t len ) {
+    std::string* f = new std::string;
+    f->reserve( len + 10 );
+    *f += ( char )( 0x80 | opcode );
+    if ( len < 126 ) {
+        *f += ( char )len;
+    } else if ( len < 65536 ) {
+        *f += ( char )126;
+        *f += ( char )( len >> 8 );
+        *f += ( char )len;
+    } else {
+        *f += ( char )127;
+        for ( int i = 7; i >= 0; --i ) {
+            *f += ( char )( ( uint64_t )len >> ( i * 8 ) );
+        }
+    }
+    f->append( data, len );
+    return ws_frame( f );
+}
+
+ws_reactor* ws_reactor_new( int wakefd ) {
+    ws_reactor* r = new ws_reactor;
+    r->id = reactors.size();
+    r->wakefd = wakefd;
+    reactors.push_back( r );
+    return r;
+}
+
+void ws_reactor_bind( ws_reactor* r ) {
+    local_reactor = r;
+}
+
+// 在反应堆线程上：帧的指针放进频道每个订阅者的队列
+static void deliver( ws_reactor* r, const std::string& channel, const ws_frame& frame ) {
+    std::unordered_map< std::string, std::vector< ws_conn* > >::iterator it = r->subs.find( channel );
+    if ( it == r->subs.end() ) {
+        return;
+    }
+    // push 不会退订（太慢的连接只关闭套接字，由它的协程或主线程在之后释放），遍历期间表不变
+    std::vector< ws_conn* >& subs = it->second;
+    for ( size_t i = 0; i < subs.size(); ++i ) {
+        subs[i]->push( frame );
+    }
+    stats[ STAT_DELIVERED ].fetch_add( subs.size(), std::memory_order_relaxed );
+}
+
+void ws_reactor_wake( ws_reactor* r ) {
+    std::vector< std::pair< std::string, ws_frame > > fresh;
+    r->lock.lock();
+    fresh.swap( r->inbox );
+    r->lock.unlock();
+    for ( size_t i = 0; i < fresh.size(); ++i ) {
+        deliver( r, fresh[i].first, fresh[i].second );
+    }
+}
+
+void ws_publish( const std::string& channel, int opcode, const char* data, size_t len ) {
+    ws_frame frame = ws_encode( opcode, data, len );
+    stats[ STAT_PUBLISHED ].fetch_add( 1, std::memory_order_relaxed );
+    static thread_local std::vector< ws_reactor* > targets;
+    targets.clear();
+    hub_lock.lock();
+    std::unordered_map< std::string, std::vector< char > >::iterator it = channels.find( channel );
+    if ( it != channels.end() ) {
+        for ( size_t i = 0; i < it->second.size(); ++i ) {
+            if ( it->second[i] ) {
+                targets.push_back( reactors[i] );
+            }
+        }
+    }
+    hub_lock.unlock();
+    for ( size_t i = 0; i < targets.size(); ++i ) {
+        ws_reactor* r = targets[i];
+        if ( r == local_reactor ) {
+            deliver( r, channel, frame );
+            continue;
+        }
+        r->lock.lock();
+        bool wake = r->inbox.empty();
+        r->inbox.push_back( std::make_pair( channel, frame ) );
+        r->lock.unlock();
+        if ( wake && r->wakefd >= 0 ) {
+            uint64_t one = 1;
+            ssize_t n = ::write( r->wakefd, &one, sizeof( one ) );
+            ( void )n;
+        }
+        stats[ STAT_POSTED ].fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+// 连接
+
+ws_conn::ws_conn( const char* url, uint32_t ip )
+    : m_channel( url, strcspn( url, "?" ) ), m_fd( -1 ), m_tls( NULL ), m_blocked( NULL ), m_blocked_arg( NULL ),
+      m_reactor( NULL ), m_index( 0 ), m_head_len( 0 ), m_in_frame( false ), m_opcode( 0 ), m_fin( false ), m_left( 0 ),
+      m_pos( 0 ), m_msg_opcode( 0 ), m_msg_len( 0 ), m_sent( 0 ), m_queued( 0 ), m_closing( false ), m_dead( false ) {
+    m_publisher = ws_publish_policy == WS_PUBLISH_ALL || ( ntohl( ip ) >> 24 ) == 127;
+}
+
+ws_conn::~ws_conn() {
+    if ( !m_reactor ) {
+        return;
+    }
+    std::unordered_map< std::string, std::vector< ws_conn* > >::iterator it = m_reactor->subs.find( m_channel );
+    std::vector< ws_conn* >& subs = it->second;
+    subs[ m_index ] = subs.back();
+    subs[ m_index ]->m_index = m_index;
+    subs.pop_back();
+    if ( subs.empty() ) {
+        m_reactor->subs.erase( it );
+        hub_lock.lock();
+        std::unordered_map< std::string, std::vector< char > >::iterator c = channels.find( m_channel );
+        c->second[ m_reactor->id ] = 0;
+        size_t i = 0;
+        while ( i < c->second.size() && !c->second[i] ) {
+            ++i;
+        }
+        if ( i == c->second.size() ) {
+            channels.erase( c );
+        }
+        hub_lock.unlock();
+    }
+    ws_connections--;
+}
+
+void ws_conn::attach( int fd, tls_conn* tls, void ( *blocked )( void* ), void* arg ) {
+    m_fd = fd;
+    m_tls = tls;
+    m_blocked = blocked;
+    m_blocked_arg = arg;
+    m_reactor = local_reactor;
+    if ( !m_reactor ) {
+        return;
+    }
+    std::vector< ws_conn* >& subs = m_reactor->subs[ m_channel ];
+    m_index = subs.size();
+    subs.push_back( this );
+    if ( subs.size() == 1 ) {
+        hub_lock.lock();
+        std::vector< char >& on = channels[ m_channel ];
+        on.resize( reactors.size(), 0 );
+        on[ m_reactor->id ] = 1;
+        hub_lock.unlock();
+    }
+    ws_connections++;
+    stats[ STAT_UPGRADES ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+void ws_conn::feed( const char* data, size_t len ) {
+    const unsigned char* p = ( const unsigned char* )data;
+    while ( len > 0 && !m_closing ) {
+        if ( !m_in_frame ) {
+            // 帧头：2字节，之后是扩展的长度（0、2或8字节）和掩码（4字节）
+            if ( m_head_len < 2 ) {
+                m_head[ m_head_len++ ] = *p++;
+                --len;
+                continue;
+            }
+            if ( !( m_head[1] & 0x80 ) ) {
+                // 客户端的帧必须加掩码
+                fail( 1002 );
+                return;
+            }
+            int len7 = m_head[1] & 0x7f;
+            size_t need = 2 + ( len7 == 126 ? 2 : ( len7 == 127 ? 8 : 0 ) ) + 4;
+            size_t n = need - m_head_len < len ? need - m_head_len : len;
+            memcpy( m_head + m_head_len, p, n );
+            m_head_len += n;
+            p += n;
+            len -= n;
+            if ( m_head_len == need ) {
+                start_frame();
+            }
+            continue;
+        }
+        size_t n = m_left < len ? m_left : len;
+        // 控制帧的负载总是保存；不能发布的连接的消息不保存，也就不用解掩码
+        std::string* to = m_opcode >= WS_CLOSE ? &m_control : ( m_publisher ? &m_message : NULL );
+        if ( to ) {
+            size_t old = to->size();
+            to->resize( old + n );
+            ws_unmask( ( unsigned char* )&( *to )[ old ], p, n, m_key, m_pos );
+        }
+        p += n;
+        len -= n;
+        m_pos += n;
+        m_left -= n;
+        if ( m_left == 0 ) {
+            frame_done();
+        }
+    }
+}
+
+void ws_conn::start_frame() {
+    m_head_len = 0;
+    m_fin = m_head[0] & 0x80;
+    m_opcode = m_head[0] & 0x0f;
+    uint64_t len = m_head[1] & 0x7f;
+    size_t off = 2;
+    if ( len == 126 ) {
+        len = ( m_head[2] << 8 ) | m_head[3];
+        off = 4;
+    } else if ( len == 127 ) {
+        len = 0;
+        for ( int i = 0; i < 8; ++i ) {
+            len = ( len << 8 ) | m_head[ 2 + i ];
+        }
+        off = 10;
+    }
+    memcpy( m_key, m_head + off, 4 );
+    // 没有协商扩展，RSV 必须为0
+    if ( ( m_head[0] & 0x70 ) || ( len >> 63 ) ) {
+        fail( 1002 );
+        return;
+    }
+    if ( m_opcode >= WS_CLOSE ) {
+        // 控制帧不能分片，负载不超过125字节，可以插在分片消息的中间
+        if ( m_opcode > WS_PONG || !m_fin || len > 125 ) {
+            fail( 1002 );
+            return;
+        }
+        m_control.clear();
+    } else {
+        if ( m_opcode == WS_CONTINUATION ? m_msg_opcode == 0 : ( m_opcode > WS_BINARY || m_msg_opcode != 0 ) ) {
+            fail( 1002 );
+            return;
+        }
+        if ( len > ws_max_message - m_msg_len ) {
+            fail( 1009 );
+            return;
+        }
+        if ( m_opcode != WS_CONTINUATION ) {
+            m_msg_opcode = m_opcode;
+        }
+        m_msg_len += len;
+    }
+    m_in_frame = true;
+    m_left = len;
+    m_pos = 0;
+    if ( len == 0 ) {
+        frame_done();
+    }
+}
+
+void ws_conn::frame_done() {
+    m_in_frame = false;
+    if ( m_opcode == WS_PING ) {
+        enqueue( ws_encode( WS_PONG, m_control.data(), m_control.size() ) );
+    } else if ( m_opcode == WS_CLOSE ) {
+        // 回复客户端的状态码，没有状态码时回复空的 close
+        if ( m_control.size() == 1 ) {
+            fail( 1002 );
+            return;
+        }
+        close( m_control.size() >= 2 ? ( ( unsigned char )m_control[0] << 8 ) | ( unsigned char )m_control[1] : 0 );
+    } else if ( m_opcode < WS_CLOSE && m_fin ) {
+        // 消息完整
+        if ( !m_publisher ) {
+            stats[ STAT_DISCARDED ].fetch_add( 1, std::memory_order_relaxed );
+        } else if ( m_msg_opcode == WS_TEXT && !utf8_valid( ( const unsigned char* )m_message.data(), m_message.size() ) ) {
+            fail( 1007 );
+            return;
+        } else {
+            ws_publish( m_channel, m_msg_opcode, m_message.data(), m_message.size() );
+        }
+        m_message.clear();
+        m_msg_opcode = 0;
+        m_msg_len = 0;
+    }
+}
+
+void ws_conn::enqueue( const ws_frame& frame ) {
+    m_queue.push_back( frame );
+    m_queued += frame->size();
+}
+
+void ws_conn::close( int code ) {
+    if ( m_closing ) {
+        return;
+    }
+    m_closing = true;
+    char payload[ 2 ] = { ( char )( code >> 8 ), ( char )code };
+    enqueue( ws_encode( WS_CLOSE, payload, code ? 2 : 0 ) );
+}
+
+void ws_conn::fail( int code ) {
+    stats[ STAT_PROTOCOL ].fetch_add( 1, std::memory_order_relaxed );
+    close( code );
+}
+
+// 关闭套接字的两个方向，连接的协程或主线程随后收到 EPOLLHUP，在那里释放连接
+void ws_conn::disconnect() {
+    m_dead = true;
+    m_queue.clear();
+    m_queued = 0;
+    shutdown( m_fd, SHUT_RDWR );
+}
+
+void ws_conn::push( const ws_frame& frame ) {
+    if ( m_closing || m_dead ) {
+        return;
+    }
+    // 队列为空时总能放进一帧，所以比 websocket_queue_kb 大的消息也能发给跟得上的订阅者
+    if ( m_queued > 0 && m_queued + frame->size() > ws_queue_limit ) {
+        stats[ STAT_SLOW ].fetch_add( 1, std::memory_order_relaxed );
+        disconnect();
+        return;
+    }
+    bool idle = m_queue.empty();
+    enqueue( frame );
+    if ( !idle ) {
+        // 前面的还没发完，已经在等可写
+        return;
+    }
+    int ret = flush();
+    if ( ret == 0 && m_blocked ) {
+        m_blocked( m_blocked_arg );
+    } else if ( ret < 0 && !m_dead ) {
+        disconnect();
+    }
+}
+
+int ws_conn::flush() {
+    if ( m_dead ) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    while ( !m_queue.empty() ) {
+        struct iovec iov[ WS_IOV_MAX ];
+        int n = 0;
+        for ( std::deque< ws_frame >::iterator it = m_queue.begin(); it != m_queue.end() && n < WS_IOV_MAX; ++it, ++n ) {
+            size_t skip = n == 0 ? m_sent : 0;
+            iov[n].iov_base = ( void* )( ( *it )->data() + skip );
+            iov[n].iov_len = ( *it )->size() - skip;
+        }
+        ssize_t w = m_tls ? tls_writev( m_tls, iov, n ) : writev( m_fd, iov, n );
+        if ( w < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        size_t left = w;
+        m_queued -= left;
+        while ( left > 0 ) {
+            size_t rest = m_queue.front()->size() - m_sent;
+            if ( left < rest ) {
+                m_sent += left;
+                break;
+            }
+            left -= rest;
+            m_queue.pop_front();
+            m_sent = 0;
+        }
+    }
+    return 1;
+}
+
+void websocket_metrics( std::string& out ) {
+    if ( !ws_enabled() ) {
+        return;
+    }
+    hub_lock.lock();
+    size_t channel_count = channels.size();
+    hub_lock.unlock();
+    metrics_header( out, "webserver_websocket_connections", "gauge", "WebSocket connections subscribed to a channel." );
+    metrics_gauge( out, "webserver_websocket_connections", NULL, ws_connections.load() );
+    metrics_header( out, "webserver_websocket_channels", "gauge", "Channels with at least one subscriber." );
+    metrics_gauge( out, "webserver_websocket_channels", NULL, channel_count );
+    metrics_header( out, "webserver_websocket_upgrades_total", "counter", "Connections upgraded to WebSocket." );
+    metrics_counter( out, "webserver_websocket_upgrades_total", NULL, stats[ STAT_UPGRADES ].load() );
+    metrics_header( out, "webserver_websocket_published_total", "counter", "Messages published, each encoded once." );
+    metrics_counter( out, "webserver_websocket_published_total", NULL, stats[ STAT_PUBLISHED ].load() );
+    metrics_header( out, "webserver_websocket_delivered_total", "counter", "Messages queued to subscribers." );
+    metrics_counter( out, "webserver_websocket_delivered_total", NULL, stats[ STAT_DELIVERED ].load() );
+    metrics_header( out, "webserver_websocket_cross_reactor_total", "counter",
+                    "Published messages handed to another reactor's inbox." );
+    metrics_counter( out, "webserver_websocket_cross_reactor_total", NULL, stats[ STAT_POSTED ].load() );
+    metrics_header( out, "webserver_websocket_discarded_total", "counter",
+                    "Messages from clients not allowed to publish (websocket_publish)." );
+    metrics_counter( out, "webserver_websocket_discarded_total", NULL, stats[ STAT_DISCARDED ].load() );
+    metrics_header( out, "webserver_websocket_disconnects_total", "counter", "WebSocket connections closed by the server." );
+    metrics_counter( out, "webserver_websocket_disconnects_total", "reason=\"slow_consumer\"", stats[ STAT_SLOW ].load() );
+    metrics_counter( out, "webserver_websocket_disconnects_total", "reason=\"protocol_error\"", stats[ STAT_PROTOCOL ].load() );
+}
@@ -0,0 +1,130 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+
+/*
+    WebSocket（RFC 6455）和按频道的广播，用来向大量客户端推送消息。
+    websocket 设置中的URL前缀是 WebSocket 的端点（整段匹配，和 proxy 相同），例如 /ws：
+    GET /ws/news 带 Upgrade: websocket、Connection: Upgrade、Sec-WebSocket-Version: 13 和 Sec-WebSocket-Key，
+    回复 101 后连接订阅频道 "/ws/news"（URL去掉查询串），不是升级请求时回复400。
+    线程池模式在 parse_headers 中识别，101 发完后连接交给主线程；协程模式在 serve 中识别，连接留在它的反应堆上。
+
+    发布：客户端发来的文本和二进制消息发布到它所在的频道，频道的每个订阅者（包括发布者自己）都收到一份。
+    websocket_publish = local 时只有本机（127.0.0.0/8）的客户端能发布，例如和服务器在同一台机器上的后端，
+    其他客户端的消息被丢弃；all 时所有客户端都能发布。
+
+    扇出：一条消息只编码一次，成为一个服务器到客户端的帧（不加掩码），放在 shared_ptr 管理的缓冲区中。
+    每个反应堆（线程池模式是主线程，协程模式是每个反应堆线程）有自己的订阅表，只有这个线程访问，
+    发布时把帧投递给有订阅者的反应堆：本线程的直接投递，其他反应堆的放进它的收件箱，再用 eventfd 唤醒。
+    投递是把帧的指针放进每个订阅者的发送队列，各连接的队列共用这一个缓冲区，队列原来为空时立即 writev。
+    慢的订阅者：队列中没发出的字节超过 websocket_queue_kb 时断开这个连接（不影响其他订阅者），
+    见指标 webserver_websocket_disconnects_total{reason="slow_consumer"}。
+
+    收到的帧：客户端的帧必须加掩码，解掩码用 16 字节的向量异或（GCC 的向量扩展，x86-64 上是 SSE2，ARM 上是 NEON），
+    每次处理 64 字节，剩下的按字节处理。分片的消息拼接后再发布，超过 websocket_max_message_kb 时以1009关闭；
+    文本消息检查 UTF-8，不合法时以1007关闭；ping 回复 pong，close 回复 close 后关闭连接。
+    服务器退出时发送 1001（going away）。
+*/
+
+// 帧的类型
+enum { WS_CONTINUATION = 0, WS_TEXT = 1, WS_BINARY = 2, WS_CLOSE = 8, WS_PING = 9, WS_PONG = 10 };
+// 谁能发布，见 websocket_publish
+enum WS_PUBLISH { WS_PUBLISH_LOCAL = 0, WS_PUBLISH_ALL };
+
+// 编码好的一帧，各订阅者的发送队列共用
+typedef std::shared_ptr< const std::string > ws_frame;
+
+// 解析 websocket 设置（逗号分隔的URL前缀），格式不对时返回false
+bool ws_parse( const char* spec, std::vector< std::string >& prefixes, std::string& err );
+// 解析 websocket_publish 的取值，不认识时返回-1
+int ws_publish_parse( const char* name );
+// 启动时调用，queue_limit 和 max_message 为字节数
+void ws_init( const std::vector< std::string >& prefixes, int publish, size_t queue_limit, size_t max_message );
+bool ws_enabled();
+// url 是否是 WebSocket 的端点
+bool ws_match( const char* url );
+// HTTP/1.1 的请求头（每项一行 "Name: value"）是 WebSocket 的升级请求，key 为 Sec-WebSocket-Key 的值
+bool ws_upgrade_requested( const std::vector< const char* >& headers, std::string& key );
+// 101 响应中 Sec-WebSocket-Accept 的值
+std::string ws_accept( const std::string& key );
+// 把消息编码成一帧，发布到频道
+void ws_publish( const std::string& channel, int opcode, const char* data, size_t len );
+void websocket_metrics( std::string& out );
+
+// 反应堆：启动阶段在主线程中用 ws_reactor_new 创建（wakefd 为它的 eventfd），在反应堆线程中 ws_reactor_bind 一次；
+// wakefd 可读时（读出计数之后）调用 ws_reactor_wake，投递其他线程发布的消息
+struct ws_reactor;
+ws_reactor* ws_reactor_new( int wakefd );
+void ws_reactor_bind( ws_reactor* r );
+void ws_reactor_wake( ws_reactor* r );
+
+struct tls_conn;
+
+// 一个 WebSocket 连接：只处理协议和发送队列，读由调用者完成后交给 feed，写由 flush 完成
+class ws_conn {
+public:
+    // url 决定频道，ip 为客户端地址（决定能否发布）
+    ws_conn( const char* url, uint32_t ip );
+    // 订阅过时退订
+    ~ws_conn();
+
+    // 在反应堆线程上订阅频道，之后这个连接只能在这个线程上使用。投递的帧没能一次发完时调用 blocked( arg )，
+    // 调用者等可写后调用 flush；一直关注 EPOLLOUT 的调用者可以传 NULL
+    void attach( int fd, tls_conn* tls, void ( *blocked )( void* ), void* arg );
+    bool attached() const { return m_reactor != NULL; }
+    // 放入收到的数据，完整的消息在这里发布
+    void feed( const char* data, size_t len );
+    // 把队列写到套接字：全部写完返回1，发送缓冲区满返回0，出错（或连接因为太慢被断开）返回-1
+    int flush();
+    // 发送 close 帧，之后不再接收消息，发完后 finished() 为true
+    void close( int code );
+    bool closing() const { return m_closing; }
+    bool finished() const { return m_closing && m_queue.empty(); }
+    // 反应堆投递频道的一帧
+    void push( const ws_frame& frame );
+
+private:
+    void start_frame();
+    void frame_done();
+    void enqueue( const ws_frame& frame );
+    void fail( int code );
+    void disconnect();
+
+    std::string m_channel;
+    bool m_publisher;                   // 收到的消息可以发布
+    int m_fd;
+    tls_conn* m_tls;
+    void ( *m_blocked )( void* );
+    void* m_blocked_arg;
+    ws_reactor* m_reactor;              // 订阅所在的反应堆，没有订阅时为NULL
+    size_t m_index;                     // 在反应堆的订阅表中的位置
+
+    // 接收
+    unsigned char m_head[ 14 ];         // 不完整的帧头
+    size_t m_head_len;
+    bool m_in_frame;                    // 帧头已经完整，正在接收负载
+    int m_opcode;
+    bool m_fin;
+    unsigned char m_key[ 4 ];
+    uint64_t m_left;                    // 这一帧还没收到的负载
+    uint64_t m_pos;                     // 这一帧已经收到的负载，决定从掩码的哪个字节开始
+    int m_msg_opcode;                   // 正在接收的（分片）消息的类型，0 表示没有
+    uint64_t m_msg_len;
+    std::string m_message;              // 消息的负载（只有能发布时才保存）
+    std::string m_control;              // 控制帧的负载
+
+    // 发送
+    std::deque< ws_frame > m_queue;
+    size_t m_sent;                      // 队首的帧已经发送的字节数
+    size_t m_queued;                    // 队列中还没发送的字节数
+    bool m_closing;
+    bool m_dead;                        // 连接出错或者太慢，已经关闭了套接字的两个方向
+};
+
+#endif